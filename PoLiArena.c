@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PoLiLog.h"
+#include "PoLiArena.h"
+
+static int add_chunk (struct poli_arena *arena);
+
+int poli_arena_init (struct poli_arena *arena, size_t record_size, unsigned long chunk_records, size_t memory_limit)
+{
+    memset(arena, 0, sizeof(struct poli_arena));
+    arena->record_size = record_size;
+    arena->chunk_records = (chunk_records > 0) ? chunk_records : 1;
+    arena->memory_limit = memory_limit;
+
+    if (add_chunk(arena) != 0)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to allocate %lu records of %lu bytes", __FUNCTION__, arena->chunk_records, (unsigned long) record_size);
+        return 1;
+    }
+    return 0;
+}
+
+static int add_chunk (struct poli_arena *arena)
+{
+    if (arena->num_chunks == arena->max_chunks)
+    {
+        //only the list of chunks is moved, never the chunks themselves
+        unsigned long max_chunks = (arena->max_chunks > 0) ? 2 * arena->max_chunks : 16;
+        char **chunks = realloc(arena->chunks, max_chunks * sizeof(char *));
+        if (chunks == NULL)
+            return 1;
+        arena->chunks = chunks;
+        arena->max_chunks = max_chunks;
+    }
+
+    char *chunk = calloc(arena->chunk_records, arena->record_size);
+    if (chunk == NULL)
+        return 1;
+    arena->chunks[arena->num_chunks++] = chunk;
+    return 0;
+}
+
+void *poli_arena_append (struct poli_arena *arena)
+{
+    if (arena->num_records == arena->num_chunks * arena->chunk_records)
+    {
+        size_t chunk_size = arena->chunk_records * arena->record_size;
+        if ((arena->memory_limit > 0 && (arena->num_chunks + 1) * chunk_size > arena->memory_limit)
+            || add_chunk(arena) != 0)
+        {
+            arena->dropped++;
+            return NULL;
+        }
+    }
+
+    return poli_arena_get(arena, arena->num_records++);
+}
+
+void poli_arena_destroy (struct poli_arena *arena)
+{
+    unsigned long chunk;
+    for (chunk = 0; chunk < arena->num_chunks; chunk++)
+        free(arena->chunks[chunk]);
+    if (arena->chunks)
+        free(arena->chunks);
+    memset(arena, 0, sizeof(struct poli_arena));
+}
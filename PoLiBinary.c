@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "PoLiLog.h"
+#include "PoLiBinary.h"
+
+static uint64_t to_little_endian (uint64_t value);
+static void put_u32 (char *buf, size_t offset, uint32_t value);
+static void put_u64 (char *buf, size_t offset, uint64_t value);
+static int write_at (struct bin_writer *writer, const void *buf, size_t len, uint64_t offset);
+static int copy_at (struct bin_writer *writer, const void *buf, size_t len, uint64_t offset);
+static int flush_column (struct bin_writer *writer, int column);
+
+int poli_bin_open (struct bin_writer *writer, char *path)
+{
+    memset(writer, 0, sizeof(struct bin_writer));
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd < 0)
+    {
+        poli_log(ERROR, NULL, "Failed to open file %s: %s", path, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+int poli_bin_open_memory (struct bin_writer *writer)
+{
+    memset(writer, 0, sizeof(struct bin_writer));
+    writer->fd = -1;
+    return 0;
+}
+
+int poli_bin_add_column (struct bin_writer *writer, bin_table_t table, bin_type_t type, char *name)
+{
+    if (writer->laid_out)
+    {
+        poli_log(ERROR, NULL, "%s: Column %s was added after the columns were laid out", __FUNCTION__, name);
+        return -1;
+    }
+    if (writer->num_columns == writer->max_columns)
+    {
+        int max_columns = (writer->max_columns > 0) ? 2 * writer->max_columns : 64;
+        struct bin_column *columns = realloc(writer->columns, max_columns * sizeof(struct bin_column));
+        if (columns == NULL)
+        {
+            poli_log(ERROR, NULL, "%s: Failed to allocate memory for column %s", __FUNCTION__, name);
+            writer->error = 1;
+            return -1;
+        }
+        writer->columns = columns;
+        writer->max_columns = max_columns;
+    }
+
+    struct bin_column *column = &writer->columns[writer->num_columns];
+    memset(column, 0, sizeof(struct bin_column));
+    strncpy(column->name, name, BIN_NAME_LEN - 1);
+    column->type = type;
+    column->table = table;
+    return writer->num_columns++;
+}
+
+void poli_bin_set_rows (struct bin_writer *writer, bin_table_t table, uint64_t num_rows)
+{
+    if (!writer->laid_out)
+        writer->num_rows[table] = num_rows;
+}
+
+int poli_bin_layout (struct bin_writer *writer)
+{
+    writer->buffers = malloc((size_t) (writer->num_columns > 0 ? writer->num_columns : 1) * BIN_BUFFER_ROWS * sizeof(uint64_t));
+    if (writer->buffers == NULL)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to allocate memory for %d columns", __FUNCTION__, writer->num_columns);
+        writer->error = 1;
+        return 1;
+    }
+
+    uint64_t offset = BIN_HEADER_SIZE + (uint64_t) writer->num_columns * BIN_COLUMN_SIZE;
+    int i;
+    for (i = 0; i < writer->num_columns; i++)
+    {
+        writer->columns[i].offset = offset;
+        offset += writer->num_rows[writer->columns[i].table] * sizeof(uint64_t);
+    }
+    writer->data_end = offset;
+    writer->laid_out = 1;
+    return 0;
+}
+
+int poli_bin_append (struct bin_writer *writer, int column, const void *values, size_t count)
+{
+    if (column < 0 || column >= writer->num_columns || !writer->laid_out)
+        return 1;
+
+    struct bin_column *col = &writer->columns[column];
+    uint64_t *buffer = &writer->buffers[(size_t) column * BIN_BUFFER_ROWS];
+    const char *src = values;
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        if (col->num_written + col->num_buffered == writer->num_rows[col->table])
+            return 1;
+        uint64_t value;
+        memcpy(&value, src + i * sizeof(uint64_t), sizeof(uint64_t));
+        buffer[col->num_buffered++] = to_little_endian(value);
+        if (col->num_buffered == BIN_BUFFER_ROWS && flush_column(writer, column) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+int poli_bin_append_double (struct bin_writer *writer, int column, double value)
+{
+    return poli_bin_append(writer, column, &value, 1);
+}
+
+int poli_bin_append_int (struct bin_writer *writer, int column, int64_t value)
+{
+    return poli_bin_append(writer, column, &value, 1);
+}
+
+int64_t poli_bin_add_string (struct bin_writer *writer, char *string)
+{
+    size_t len = strlen(string) + 1;
+    if (writer->strings_size + len > writer->max_strings)
+    {
+        size_t max_strings = (writer->max_strings > 0) ? 2 * writer->max_strings : 4096;
+        while (writer->strings_size + len > max_strings)
+            max_strings *= 2;
+        char *strings = realloc(writer->strings, max_strings);
+        if (strings == NULL)
+        {
+            poli_log(ERROR, NULL, "%s: Failed to allocate memory for string %s", __FUNCTION__, string);
+            writer->error = 1;
+            return -1;
+        }
+        writer->strings = strings;
+        writer->max_strings = max_strings;
+    }
+    int64_t offset = writer->strings_size;
+    memcpy(writer->strings + writer->strings_size, string, len);
+    writer->strings_size += len;
+    return offset;
+}
+
+int poli_bin_close (struct bin_writer *writer, double start_time, char *node, char *jobid)
+{
+    int i;
+    if (!writer->laid_out)
+        poli_bin_layout(writer);
+
+    for (i = 0; i < writer->num_columns && writer->laid_out; i++)
+    {
+        struct bin_column *col = &writer->columns[i];
+        flush_column(writer, i);
+        if (col->num_written < writer->num_rows[col->table])
+        {
+            poli_log(ERROR, NULL, "%s: Column %s is missing %lu of its %lu rows", __FUNCTION__, col->name,
+                (unsigned long) (writer->num_rows[col->table] - col->num_written), (unsigned long) writer->num_rows[col->table]);
+            writer->error = 1;
+        }
+    }
+
+    char descriptor[BIN_COLUMN_SIZE];
+    for (i = 0; i < writer->num_columns; i++)
+    {
+        struct bin_column *col = &writer->columns[i];
+        memset(descriptor, 0, sizeof(descriptor));
+        memcpy(descriptor, col->name, BIN_NAME_LEN);
+        strcpy(descriptor + 56, (col->type == BIN_FLOAT64) ? "<f8" : "<i8");
+        put_u32(descriptor, 64, col->table);
+        put_u32(descriptor, 68, col->type == BIN_STRING);
+        put_u64(descriptor, 72, col->offset);
+        write_at(writer, descriptor, sizeof(descriptor), BIN_HEADER_SIZE + (uint64_t) i * BIN_COLUMN_SIZE);
+    }
+
+    if (writer->strings_size > 0)
+        write_at(writer, writer->strings, writer->strings_size, writer->data_end);
+
+    char header[BIN_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, BIN_MAGIC, sizeof(BIN_MAGIC));
+    put_u32(header, 8, BIN_VERSION);
+    put_u32(header, 12, writer->num_columns);
+    put_u64(header, 16, BIN_HEADER_SIZE);
+    put_u64(header, 24, writer->data_end);
+    put_u64(header, 32, writer->strings_size);
+    for (i = 0; i < BIN_NUM_TABLES; i++)
+        put_u64(header, 40 + 8 * i, writer->num_rows[i]);
+    uint64_t start_bits;
+    memcpy(&start_bits, &start_time, sizeof(start_bits));
+    put_u64(header, 72, start_bits);
+    put_u32(header, 80, BIN_NUM_TABLES);
+    strncpy(header + 88, node, 63);
+    strncpy(header + 152, jobid, 63);
+    write_at(writer, header, sizeof(header), 0);
+
+    if (writer->fd >= 0 && close(writer->fd) != 0)
+        writer->error = 1;
+    free(writer->columns);
+    free(writer->buffers);
+    free(writer->strings);
+    return writer->error;
+}
+
+void poli_bin_job_header (char *buf, uint32_t num_nodes, char *jobid)
+{
+    memset(buf, 0, BIN_JOB_HEADER_SIZE);
+    memcpy(buf, BIN_JOB_MAGIC, sizeof(BIN_JOB_MAGIC));
+    put_u32(buf, 8, BIN_JOB_VERSION);
+    put_u32(buf, 12, num_nodes);
+    put_u64(buf, 16, BIN_JOB_HEADER_SIZE);
+    put_u64(buf, 24, BIN_JOB_HEADER_SIZE + (uint64_t) num_nodes * BIN_JOB_ENTRY_SIZE);
+    strncpy(buf + 32, jobid, 63);
+}
+
+void poli_bin_job_entry (char *buf, char *node, uint64_t offset, uint64_t size, uint32_t rank, int complete)
+{
+    memset(buf, 0, BIN_JOB_ENTRY_SIZE);
+    strncpy(buf, node, 63);
+    put_u64(buf, 64, offset);
+    put_u64(buf, 72, size);
+    put_u32(buf, 80, rank);
+    put_u32(buf, 84, complete != 0);
+}
+
+static int flush_column (struct bin_writer *writer, int column)
+{
+    struct bin_column *col = &writer->columns[column];
+    if (col->num_buffered == 0)
+        return 0;
+    int ret = write_at(writer, &writer->buffers[(size_t) column * BIN_BUFFER_ROWS], col->num_buffered * sizeof(uint64_t),
+        col->offset + col->num_written * sizeof(uint64_t));
+    col->num_written += col->num_buffered;
+    col->num_buffered = 0;
+    return ret;
+}
+
+static int write_at (struct bin_writer *writer, const void *buf, size_t len, uint64_t offset)
+{
+    if (writer->fd < 0)
+        return copy_at(writer, buf, len, offset);
+
+    const char *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = pwrite(writer->fd, p, len, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (!writer->error)
+                poli_log(ERROR, NULL, "%s: Failed to write the binary output: %s", __FUNCTION__, strerror(errno));
+            writer->error = 1;
+            return 1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int copy_at (struct bin_writer *writer, const void *buf, size_t len, uint64_t offset)
+{
+    if (offset + len > writer->image_capacity)
+    {
+        size_t capacity = (writer->image_capacity > 0) ? 2 * writer->image_capacity : 65536;
+        while (offset + len > capacity)
+            capacity *= 2;
+        char *image = realloc(writer->image, capacity);
+        if (image == NULL)
+        {
+            if (!writer->error)
+                poli_log(ERROR, NULL, "%s: Failed to allocate memory for %lu bytes of binary output", __FUNCTION__, (unsigned long) capacity);
+            writer->error = 1;
+            return 1;
+        }
+        //columns are not filled in order, the gaps between them are written later
+        memset(image + writer->image_capacity, 0, capacity - writer->image_capacity);
+        writer->image = image;
+        writer->image_capacity = capacity;
+    }
+    memcpy(writer->image + offset, buf, len);
+    if (offset + len > writer->image_size)
+        writer->image_size = offset + len;
+    return 0;
+}
+
+static uint64_t to_little_endian (uint64_t value)
+{
+    const uint16_t one = 1;
+    if (*(const char *) &one == 1)
+        return value;
+    uint64_t swapped = 0;
+    int i;
+    for (i = 0; i < 8; i++)
+        swapped |= ((value >> (8 * i)) & 0xff) << (8 * (7 - i));
+    return swapped;
+}
+
+static void put_u32 (char *buf, size_t offset, uint32_t value)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+        buf[offset + i] = (char) ((value >> (8 * i)) & 0xff);
+}
+
+static void put_u64 (char *buf, size_t offset, uint64_t value)
+{
+    int i;
+    for (i = 0; i < 8; i++)
+        buf[offset + i] = (char) ((value >> (8 * i)) & 0xff);
+}
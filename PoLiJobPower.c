@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PoLiMEr.h"
+#include "PoLiLog.h"
+#include "PoLiJobPower.h"
+
+#if !defined(_NOMPI) && MPI_VERSION >= 3
+/* start_round - starts the reduction of the next point, with the node's power or without a value if power is negative*/
+static void start_round (struct job_power_timeline *timeline, double power);
+
+/* complete_rounds - stores the points whose reduction completed, oldest first
+   input: the timeline, 1 to wait for all rounds in flight, 0 to only take those that are done*/
+static void complete_rounds (struct job_power_timeline *timeline, int wait);
+#endif
+
+int poli_job_power_init (struct job_power_timeline *timeline, struct monitor_t *monitor, int requested, double interval, int max_points)
+{
+    memset(timeline, 0, sizeof(struct job_power_timeline));
+    timeline->interval = interval;
+#if !defined(_NOMPI) && MPI_VERSION >= 3
+    timeline->comm = MPI_COMM_NULL;
+    int provided;
+    MPI_Query_thread(&provided);
+    int usable = (provided == MPI_THREAD_MULTIPLE);
+    if (requested && !usable)
+        poli_log(WARNING, monitor, "The job power timeline needs MPI_THREAD_MULTIPLE, it is disabled");
+
+    //either all monitors take part or none of them
+    int enabled = (requested && usable);
+    MPI_Allreduce(MPI_IN_PLACE, &enabled, 1, MPI_INT, MPI_MIN, monitor->monitors_comm);
+    if (!enabled)
+        return 0;
+
+    MPI_Comm_rank(monitor->monitors_comm, &timeline->monitor_rank);
+    int error = 0;
+    if (timeline->monitor_rank == 0)
+    {
+        timeline->points = malloc(max_points * sizeof(struct job_power_point));
+        if (timeline->points == NULL)
+        {
+            poli_log(ERROR, monitor, "%s: Failed to allocate memory for %d points", __FUNCTION__, max_points);
+            error = 1;
+        }
+        timeline->max_points = max_points;
+        pthread_mutex_init(&timeline->lock, NULL);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &error, 1, MPI_INT, MPI_MAX, monitor->monitors_comm);
+    if (error)
+    {
+        poli_job_power_destroy(timeline);
+        return 1;
+    }
+
+    //a communicator of its own keeps the timeline's reductions apart from any other collective of the monitors
+    MPI_Comm_dup(monitor->monitors_comm, &timeline->comm);
+    timeline->monitors_comm = monitor->monitors_comm;
+    poli_node_stats_mpi_create(&timeline->type, &timeline->op);
+    timeline->enabled = 1;
+    return 0;
+#else
+    (void) max_points;
+    if (requested)
+        poli_log(WARNING, monitor, "The job power timeline needs MPI-3, it is disabled");
+    return 0;
+#endif
+}
+
+void poli_job_power_update (struct job_power_timeline *timeline, double time, double power)
+{
+#if !defined(_NOMPI) && MPI_VERSION >= 3
+    if (!timeline->enabled)
+        return;
+    complete_rounds(timeline, 0);
+    //points that are due are never skipped, a monitor that fell behind catches up with its latest power
+    while (timeline->next_point * timeline->interval <= time && timeline->num_rounds < JOB_POWER_WINDOW)
+        start_round(timeline, power);
+#else
+    (void) timeline;
+    (void) time;
+    (void) power;
+#endif
+}
+
+int poli_job_power_finish (struct job_power_timeline *timeline)
+{
+#if !defined(_NOMPI) && MPI_VERSION >= 3
+    if (!timeline->enabled)
+        return 0;
+    //the monitors stopped after different numbers of rounds, so they agree on the last one outside of the rounds'
+    //communicator, before waiting for any round
+    long num_points = timeline->next_point;
+    MPI_Allreduce(&timeline->next_point, &num_points, 1, MPI_LONG, MPI_MAX, timeline->monitors_comm);
+
+    //a monitor only waits for a round once it started all rounds before it, and so did every other monitor
+    //that waits for a later round, so the oldest round in flight on any monitor can always complete
+    while (timeline->next_point < num_points)
+    {
+        if (timeline->num_rounds == JOB_POWER_WINDOW)
+            complete_rounds(timeline, 1);
+        start_round(timeline, -1.0);
+    }
+    complete_rounds(timeline, 1);
+    timeline->enabled = 0;
+#else
+    (void) timeline;
+#endif
+    return 0;
+}
+
+int poli_job_power_get (struct job_power_timeline *timeline, struct job_power_point *points, int max_points, int *num_points)
+{
+    *num_points = 0;
+    if (timeline->points == NULL)
+        return 1;
+
+    pthread_mutex_lock(&timeline->lock);
+    long first = timeline->num_points - max_points;
+    if (first < timeline->num_points - timeline->max_points)
+        first = timeline->num_points - timeline->max_points;
+    if (first < 0)
+        first = 0;
+    long point;
+    for (point = first; point < timeline->num_points; point++)
+        points[(*num_points)++] = timeline->points[point % timeline->max_points];
+    pthread_mutex_unlock(&timeline->lock);
+    return 0;
+}
+
+void poli_job_power_destroy (struct job_power_timeline *timeline)
+{
+#if !defined(_NOMPI) && MPI_VERSION >= 3
+    if (timeline->comm != MPI_COMM_NULL)
+    {
+        MPI_Op_free(&timeline->op);
+        MPI_Type_free(&timeline->type);
+        MPI_Comm_free(&timeline->comm);
+    }
+#endif
+    if (timeline->points)
+    {
+        pthread_mutex_destroy(&timeline->lock);
+        free(timeline->points);
+        timeline->points = 0;
+    }
+    timeline->enabled = 0;
+}
+
+#if !defined(_NOMPI) && MPI_VERSION >= 3
+static void start_round (struct job_power_timeline *timeline, double power)
+{
+    struct job_power_round *round = &timeline->rounds[(timeline->first_round + timeline->num_rounds) % JOB_POWER_WINDOW];
+    round->point = timeline->next_point++;
+    poli_node_stats_init(&round->send);
+    if (power >= 0)
+        poli_node_stats_set(&round->send, power, timeline->monitor_rank);
+    MPI_Ireduce(&round->send, &round->recv, 1, timeline->type, timeline->op, 0, timeline->comm, &round->request);
+    timeline->num_rounds++;
+}
+
+static void complete_rounds (struct job_power_timeline *timeline, int wait)
+{
+    while (timeline->num_rounds > 0)
+    {
+        struct job_power_round *round = &timeline->rounds[timeline->first_round];
+        int done = 1;
+        if (wait)
+            MPI_Wait(&round->request, MPI_STATUS_IGNORE);
+        else
+            MPI_Test(&round->request, &done, MPI_STATUS_IGNORE);
+        if (!done)
+            break;
+
+        if (timeline->points)
+        {
+            pthread_mutex_lock(&timeline->lock);
+            struct job_power_point *point = &timeline->points[timeline->num_points % timeline->max_points];
+            point->time = round->point * timeline->interval;
+            point->power = round->recv;
+            timeline->num_points++;
+            pthread_mutex_unlock(&timeline->lock);
+        }
+        timeline->first_round = (timeline->first_round + 1) % JOB_POWER_WINDOW;
+        timeline->num_rounds--;
+    }
+}
+#endif
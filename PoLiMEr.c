@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +9,8 @@
 #include <signal.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 
 #ifndef _NOMPI
 #include <mpi.h>
@@ -24,6 +27,12 @@
 #include "PoLiLog.h"
 
 #include "msr-handler.h"
+#include "PoLiTagEvents.h"
+#include "PoLiThreadTags.h"
+#include "PoLiBinary.h"
+#include "PoLiText.h"
+#include "PoLiJobPower.h"
+#include "PoLiPowerBudget.h"
 
 #ifdef _CRAY
 #include "cray_pm-handler.h"
@@ -41,7 +50,7 @@ struct system_info_t *system_info = 0;
 
 /* THIS IS ONLY FOR KNL! */
 //we need to know what the power capping zones are
-char *zone_names[3] = {"PACKAGE", "CORE", "DRAM"};
+char *zone_names[NUM_PCAP_ZONES] = {"PACKAGE", "CORE", "DRAM"};
 //for easier string manipulation
 int zone_names_len[3] = {7,4,4};
 
@@ -58,29 +67,169 @@ static int get_comm_split_color_hostname (struct monitor_t * monitor);
 static void init_power_interfaces (struct system_info_t * system_info);
 static void finalize_power_interfaces (struct system_info_t * system_info);
 
-static struct poli_tag *get_poli_tag_for_end_time_counter(int counter);
-static int start_poli_tag_no_sync (char *tag_name);
-static int end_poli_tag_no_sync (char *tag_name);
-static struct poli_tag *find_poli_tag_for_name (char *tag_name);
-static struct poli_tag *get_poli_tag_for_start_time_counter(int counter);
+//tag names interned by this process, on every rank
+static struct tag_registry tag_registry = { .free_aggregated = -1 };
+//boundaries of TAG_SYNC_FIRST_LAST tags logged by the ranks of the node
+static struct tag_event_log tag_events = {0};
+//converts the time of tag events to get_time()
+static double tag_events_offset = 0.0;
+//power of the whole job while it runs, on the monitors
+static struct job_power_timeline job_power = {0};
+//package power caps of the nodes, redistributed within a budget while the job runs, on the monitors
+static struct power_budget power_budget = {0};
+
+/* find_tag_handle - looks up a tag name in the registry
+   input: tag name, where to store the hash table slot the name is in or would go in (may be NULL)
+   returns: the handle of the name, -1 if it isn't registered*/
+static int find_tag_handle (char *tag_name, int *slot);
+
+/* register_tag, lookup_tag - register or look up a tag name, threads inside a parallel region take turns
+   returns: the handle of the name, -1 if error or if it isn't registered*/
+static int register_tag (char *tag_name);
+static int lookup_tag (char *tag_name);
+
+/* in_parallel_region - returns 1 if called inside an OpenMP parallel region, where every thread logs its own tags*/
+static int in_parallel_region (void);
+
+/* record_thread_tag - logs a tag boundary of the calling thread in a parallel region, without synchronizing
+   returns: 0 if no errors, 1 otherwise*/
+static int record_thread_tag (int handle, tag_event_kind_t kind);
+static int grow_tag_registry (void);
+static void free_tag_registry (void);
+
+/* get_poli_tag - returns the poli tag with this id*/
+static inline struct poli_tag *get_poli_tag (int id)
+{
+    return poli_arena_get(&system_info->poli_tags, id);
+}
+
+/* get_app_summary - returns the application_summary tag, which is the first one, NULL if it couldn't be recorded*/
+static inline struct poli_tag *get_app_summary (void)
+{
+    if (system_info->poli_tags.num_records == 0)
+        return NULL;
+    struct poli_tag *tag = get_poli_tag(0);
+    return (tag->tag_name != NULL && strcmp(tag->tag_name, "application_summary") == 0) ? tag : NULL;
+}
+
+/* start_tag, end_tag - start or end a tag with the synchronization selected for it
+   input: handle of the tag, -1 if it is invalid (the ranks are still synchronized)
+   returns: 0 if no errors, 1 otherwise*/
+static int start_tag (int handle);
+static int end_tag (int handle);
+static int start_poli_tag_no_sync (int handle);
+static int end_poli_tag_no_sync (int handle);
 static int end_existing_poli_tag (struct poli_tag *this_poli_tag);
 
-static int init_pcap_tag (char *zone, double watts_long, double watts_short, double seconds_long, double seconds_short, pcap_flag_t pcap_flag);
-static struct pcap_tag *get_pcap_for_time_counter(int counter);
+/* start_aggregated_tag, end_aggregated_tag - open and close an instance of an aggregated tag,
+   which is only added to the tag's summary and not recorded
+   returns: 0 if no errors, 1 otherwise*/
+static int start_aggregated_tag (int handle);
+static int end_aggregated_tag (int index);
+
+/* update_tag_summary - adds a closed instance of an aggregated tag to its summary
+   returns: 0 if no errors, 1 otherwise*/
+static int update_tag_summary (struct poli_tag *tag);
+
+/* append_tag_id - appends a tag id to a growable list of ids
+   input: the list, its length and capacity, the id
+   returns: 0 if no errors, 1 otherwise*/
+static int append_tag_id (int **ids, int *num_ids, int *max_ids, int id);
+
+static int init_pcap_tag (char *zone, int package, double watts_long, double watts_short, double seconds_long, double seconds_short, pcap_flag_t pcap_flag);
 
 /* get_system_power_cap_for_zone - returns power cap (watts_long) after executing a system call for the specified zone
    input: name of zone requested
    returns: the power in watts*/
-static int get_system_power_cap_for_zone (int zone_index);
+static int get_system_power_cap_for_zone (int socket, int zone_index);
 static int get_system_power_caps (void);
 
+/* set_power_cap - sets a power cap on one package or, with ALL_PACKAGES, on all of them, and records it
+   returns: 0 if no errors, 1 otherwise*/
+static int set_power_cap (int package, char *zone_name, double watts_long, double watts_short, double seconds_long, double seconds_short);
+
+/* reset_power_caps - does the work of poli_reset_system, with pcap_lock held
+   returns: 0 if no errors, 1 otherwise*/
+static int reset_power_caps (void);
+
+/* apply_power_cap - does the work of set_power_cap, with pcap_lock held
+   input: as set_power_cap, who set the power cap*/
+static int apply_power_cap (int package, char *zone_name, double watts_long, double watts_short, double seconds_long, double seconds_short,
+    pcap_flag_t pcap_flag);
+
+/* get_current_pcap - returns the power cap last recorded for a zone of a socket*/
+static struct pcap_info *get_current_pcap (int socket, int zone_index);
+
+/* record_pcap_event - appends a power cap event if the power cap of a zone changed since its last event
+   returns: 0 if no errors, 1 otherwise*/
+static int record_pcap_event (int socket, int zone_index);
+
 #ifndef _TIMER_OFF
+/* resolve_tag_events - turns the boundaries of first/last tags logged by the ranks of the node into tags,
+   their energy is interpolated between the samples taken around their boundaries
+   returns: 0 if no errors, 1 otherwise*/
+static int resolve_tag_events (void);
+
+/* resolve_tag_intervals - turns intervals timed with poli_tag_events_clock() into tags
+   input: the intervals and their number
+   returns: 0 if no errors, 1 otherwise*/
+static int resolve_tag_intervals (struct tag_interval *intervals, int num_intervals);
+
+/* resolve_thread_tags - turns the tags logged by threads into one tag per thread and one for the union of threads
+   returns: 0 if no errors, 1 otherwise*/
+static int resolve_thread_tags (void);
+static int compare_tag_boundaries (const void *a, const void *b);
+
+/* interpolate_tag_boundaries - reads the samples back and interpolates the energy counters at every boundary
+   input: the boundaries, sorted by time, and their number*/
+static void interpolate_tag_boundaries (struct tag_boundary *boundaries, int num_boundaries);
+
+/* init_sample_store - sets up the poll ring holding the samples
+   returns: 0 if no errors, 1 otherwise*/
+static int init_sample_store (void);
 static int setup_timer (void);
 static int stop_timer (void);
-static void timer_handler (int signum);
+
+/* get_env_double - reads a number from an environment variable, a value that isn't a finite number is ignored with a warning
+   input: name of the variable, pointer to the value (left as it is unless the variable holds a valid number), unit for the warning
+   returns: 1 if the variable holds a valid number, 0 otherwise*/
+static int get_env_double (char *name, double *value, char *unit);
+static void *poller_thread (void *arg);
+static void timer_handler (void);
+static void adapt_poll_interval (struct system_poll_info *info);
+
+/* get_sample_power - returns the power of the node in a sample: package power on Intel systems, node power on XC40
+   and card power on BG/Q*/
+static double get_sample_power (struct system_poll_info *info);
+
+/* init_job_power - sets up the job power timeline if PoLi_JOB_POWER=1, collective over the monitors*/
+static void init_job_power (void);
+
+/* init_power_budget - starts redistributing the package power caps of the nodes within PoLi_JOB_POWER_BUDGET watts,
+   collective over the monitors*/
+static void init_power_budget (void);
+
+/* update_power_budget - takes part in the redistribution of the job power budget and applies the node's new power cap
+   input: the sample just taken*/
+static void update_power_budget (struct system_poll_info *info);
+
+#ifndef _NOMPI
+/* job_power_to_file - completes the job power timeline and writes it from the first monitor, collective over the monitors
+   returns: 0 if no errors, 1 otherwise*/
+static int job_power_to_file (void);
 #endif
+#endif
+static int get_timer_count (void);
+static void timespec_add_seconds (struct timespec *ts, double seconds);
+
+/* start_wrap_guard - starts a thread that reads energy whenever no reads happened for a wrap guard period,
+   so that no RAPL counter can wrap twice between two reads, even without polling or when tags are far apart
+   returns: 0 if no errors, 1 otherwise*/
+static int start_wrap_guard (void);
+static int stop_wrap_guard (void);
+static void *wrap_guard_thread (void *arg);
 
-static int compute_current_power(struct system_poll_info * info, double time, struct system_info_t * system_info);
+static int compute_current_power(struct system_poll_info * info, double time);
 static int get_current_frequency (struct system_poll_info * info);
 static int read_cpufreq (double *freq);
 
@@ -88,11 +237,28 @@ static void poli_sync (void);
 static void poli_sync_node (void);
 static double get_time (void);
 static struct energy_reading read_current_energy (struct system_info_t * system_info);
-static void get_timestamp(double time_from_start, char *time_str_buffer, size_t buff_len);
-static FILE * open_file (char *filename);
+
+/* get_timestamp - returns the wall-clock second of a time since the start of the application, in seconds since the epoch*/
+static time_t get_timestamp (double time_from_start);
+
+/* open_file - creates a text output file
+   input: base name of the file, its writer
+   returns: 0 if no errors, 1 otherwise*/
+static int open_file (char *filename, struct text_writer *out);
+
+/* get_output_path - builds the path of an output file from PoLi_PREFIX, the node and the job id
+   input: base name of the file, its extension, where to store the path and its size*/
+static void get_output_path (char *filename, char *extension, char *path, size_t len);
 int coordsToInt (int *coords, int dim);
 
-static void init_energy_reading (struct energy_reading *reading);
+/* get_num_sockets - returns the number of packages reported separately, at most MAX_SOCKETS*/
+static int get_num_sockets (void);
+
+/* compute_rapl_totals - computes the RAPL energy used between two readings and the average power over time,
+   for the node and each socket
+   input: energy and power results, end and start readings, time in seconds*/
+static void compute_rapl_totals (struct energy_reading *total_energy, struct energy_reading *total_power,
+    struct energy_reading *end, struct energy_reading *start, double time);
 
 /* get_zone_index - returns the index in zone_names[] of a zone
    input: the zone name
@@ -101,9 +267,289 @@ static int get_zone_index (char *zone_name);
 
 static int file_handler (void);
 static int poli_tags_to_file (void);
+
+/* get_tag_times - returns the start and end of a tag relative to the start of the application and its duration,
+   and computes the tag's total energy and average power*/
+static void get_tag_times (struct poli_tag *tag, double *start_offset, double *end_offset, double *total_time);
+
+/* write_tag_row - writes the row of a tag to the energy tags file
+   input: the file, name of the tag, start and end relative to the start of the application, duration,
+          energy used and average power*/
+static void write_tag_row (struct text_writer *out, char *tag_name, double start_offset, double end_offset, double total_time,
+    struct energy_reading *energy, struct energy_reading *power);
+
+/* get_summary_totals - returns the energy used by all instances of an aggregated tag, and the average power over their total time*/
+static void get_summary_totals (struct tag_summary *summary, struct energy_reading *total_energy, struct energy_reading *total_power);
+
+/* tag_stats_to_file - writes the statistics of every aggregated tag, one row per tag and quantity
+   returns: 0 if no errors, 1 otherwise*/
+static int tag_stats_to_file (void);
+
+/* write_stats_row - writes the row of one quantity of an aggregated tag to the tag statistics file
+   input: the file, name of the tag, name of the quantity, its statistics*/
+static void write_stats_row (struct text_writer *out, char *tag_name, char *quantity, struct running_stats *stats);
 static int pcap_tags_to_file (void);
 static int polling_info_to_file (void);
 
+/* binary_output_to_file - writes the samples, tags, tag statistics and power cap tags into one columnar binary file
+   returns: 0 if no errors, 1 otherwise*/
+static int binary_output_to_file (void);
+
+#ifndef _NOMPI
+/* shared_output_to_file - writes the binary file of this node into the job file, together with the other monitors
+   returns: 0 if no errors, 1 otherwise*/
+static int shared_output_to_file (void);
+#endif
+
+#ifndef _NOMPI
+/* job_summary_to_file - reduces the totals of every tag over all nodes and writes them into one file from the first monitor
+   returns: 0 if no errors, 1 otherwise*/
+static int job_summary_to_file (void);
+
+/* get_node_tag_totals - sums the time and energy of all instances of every tag on this node
+   input: by handle: total time, energies (JOB_SUMMARY_ENERGIES per handle, -1 if not measured), number of instances
+   returns: 0 if no errors, 1 otherwise*/
+static void get_node_tag_totals (double *time, double *energy, int *num_instances);
+
+/* get_job_tag_names - agrees with the other monitors on the names of all tags measured on any node
+   input: the names measured on this node (null-terminated, one after the other), their total length,
+          pointer to all names (allocated, in the same form), pointer to their number
+   returns: 0 if no errors, 1 otherwise*/
+static int get_job_tag_names (char *names, int names_len, char **job_names, int *num_job_names);
+
+/* get_job_energies - picks the energies of the job summary out of a reading
+   input: the reading, JOB_SUMMARY_ENERGIES values (-1 if not measured)*/
+static void get_job_energies (struct energy_reading *reading, double *values);
+
+/* compare_tag_names - orders tag names alphabetically, application_summary first*/
+static int compare_tag_names (const void *a, const void *b);
+#endif
+
+/* write_binary_output - fills an open binary file and closes it
+   input: its writer
+   returns: 0 if no errors, 1 otherwise*/
+static int write_binary_output (struct bin_writer *writer);
+
+#ifndef _TIMER_OFF
+/* build_poll_markers - collects the boundaries of all closed poli tags and all power cap tags, sorted by sample
+   input: pointer to the number of markers
+   returns: the markers (to be freed by the caller), NULL if there are none or on error*/
+static struct poll_marker *build_poll_markers (int *num_markers);
+static int compare_poll_markers (const void *a, const void *b);
+static void write_poll_marker (struct text_writer *out, struct poll_marker *marker);
+
+/* replay_pcap_events - applies the power cap changes recorded up to a sample
+   input: counter of the sample, index of the next power cap event, power caps in effect by socket and zone*/
+static void replay_pcap_events (int counter, int *next_event, double pcap_long[MAX_SOCKETS][NUM_ZONES], double pcap_short[MAX_SOCKETS][NUM_ZONES]);
+
+static int resolve_tag_events (void)
+{
+    struct tag_interval *intervals;
+    int num_intervals;
+    if (poli_tag_events_collect(&tag_events, &intervals, &num_intervals) != 0)
+        return 1;
+    int ret = resolve_tag_intervals(intervals, num_intervals);
+    free(intervals);
+    return ret;
+}
+
+static int resolve_thread_tags (void)
+{
+    struct thread_tag_interval *thread_intervals;
+    int num_thread_intervals;
+    if (poli_thread_tags_collect(&thread_intervals, &num_thread_intervals) != 0)
+        return 1;
+    if (num_thread_intervals == 0)
+        return 0;
+
+    struct tag_interval *intervals = malloc(num_thread_intervals * sizeof(struct tag_interval));
+    if (intervals == NULL)
+    {
+        poli_log(ERROR, monitor, "%s: Failed to allocate memory for %d tags", __FUNCTION__, num_thread_intervals);
+        free(thread_intervals);
+        return 1;
+    }
+
+    int i, num_intervals = 0, num_invalid = 0;
+    for (i = 0; i < num_thread_intervals; i++)
+    {
+        struct thread_tag_interval *ti = &thread_intervals[i];
+        if (ti->handle >= tag_registry.num_names)
+        {
+            num_invalid++;
+            continue;
+        }
+
+        //the tag of each thread is named after the thread and aggregated like the tag itself
+        int handle = ti->handle;
+        if (ti->thread_num != -1)
+        {
+            char thread_tag_name[strlen(tag_registry.names[ti->handle]) + 32];
+            snprintf(thread_tag_name, sizeof(thread_tag_name), "%s [thread %d]", tag_registry.names[ti->handle], ti->thread_num);
+            handle = poli_tag_register(thread_tag_name);
+            if (handle == -1)
+                continue;
+            tag_registry.aggregated[handle] = tag_registry.aggregated[ti->handle];
+        }
+        intervals[num_intervals].name = tag_registry.names[handle];
+        intervals[num_intervals].start = ti->start;
+        intervals[num_intervals].end = ti->end;
+        num_intervals++;
+    }
+    free(thread_intervals);
+    if (num_invalid > 0)
+        poli_log(WARNING, monitor, "%d tags started by threads had an invalid handle and were omitted, tags must be registered with poli_tag_register", num_invalid);
+
+    int ret = resolve_tag_intervals(intervals, num_intervals);
+    free(intervals);
+    return ret;
+}
+
+static int resolve_tag_intervals (struct tag_interval *intervals, int num_intervals)
+{
+    if (num_intervals == 0)
+        return 0;
+    //the tags are bounded by the application summary
+    struct poli_tag *app_summary = get_app_summary();
+    if (app_summary == NULL)
+    {
+        poli_log(ERROR, monitor, "%s: %d tags can't be recorded without the application summary", __FUNCTION__, num_intervals);
+        return 1;
+    }
+
+    struct poli_tag *tags = calloc(num_intervals, sizeof(struct poli_tag));
+    struct tag_boundary *boundaries = malloc(2 * num_intervals * sizeof(struct tag_boundary));
+    if (tags == NULL || boundaries == NULL)
+    {
+        poli_log(ERROR, monitor, "%s: Failed to allocate memory for %d tags", __FUNCTION__, num_intervals);
+        free(tags);
+        free(boundaries);
+        return 1;
+    }
+
+    //boundaries are clamped to the time PoLiMEr measured, unfinished tags end with the application
+    double end_time = app_summary->end_time;
+    int i;
+    for (i = 0; i < num_intervals; i++)
+    {
+        struct poli_tag *tag = &tags[i];
+        tag->handle = poli_tag_register(intervals[i].name);
+        tag->tag_name = (tag->handle != -1) ? tag_registry.names[tag->handle] : intervals[i].name;
+        tag->monitor_id = monitor->color;
+        tag->monitor_rank = monitor->world_rank;
+        tag->prev_open = -1;
+        tag->closed = 1;
+
+        tag->start_time = intervals[i].start + tag_events_offset;
+        if (tag->start_time < system_info->initial_mpi_wtime)
+            tag->start_time = system_info->initial_mpi_wtime;
+        if (tag->start_time > end_time)
+            tag->start_time = end_time;
+        tag->end_time = intervals[i].end + tag_events_offset;
+        if (intervals[i].end == -1 || tag->end_time > end_time)
+        {
+            if (intervals[i].end == -1)
+                poli_log(WARNING, monitor, "Tag %s is not finished. It will be closed automatically.", tag->tag_name);
+            tag->end_time = end_time;
+        }
+
+        boundaries[2 * i].time = tag->start_time;
+        boundaries[2 * i].energy = &tag->start_energy;
+        boundaries[2 * i].timer_count = &tag->start_timer_count;
+        boundaries[2 * i + 1].time = tag->end_time;
+        boundaries[2 * i + 1].energy = &tag->end_energy;
+        boundaries[2 * i + 1].timer_count = &tag->end_timer_count;
+    }
+
+    qsort(boundaries, 2 * num_intervals, sizeof(struct tag_boundary), compare_tag_boundaries);
+    interpolate_tag_boundaries(boundaries, 2 * num_intervals);
+    free(boundaries);
+
+    int ret = 0;
+    for (i = 0; i < num_intervals; i++)
+    {
+        struct poli_tag *tag = &tags[i];
+        if (tag->handle != -1 && tag_registry.aggregated[tag->handle])
+        {
+            ret |= update_tag_summary(tag);
+            continue;
+        }
+
+        struct poli_tag *new_poli_tag = poli_arena_append(&system_info->poli_tags);
+        if (new_poli_tag == 0)
+            continue; //counted as dropped by the arena
+        *new_poli_tag = *tag;
+        new_poli_tag->id = system_info->num_poli_tags++;
+    }
+    free(tags);
+    return ret;
+}
+
+static int compare_tag_boundaries (const void *a, const void *b)
+{
+    const struct tag_boundary *ba = a;
+    const struct tag_boundary *bb = b;
+    return (ba->time > bb->time) - (ba->time < bb->time);
+}
+
+static void interpolate_tag_boundaries (struct tag_boundary *boundaries, int num_boundaries)
+{
+    struct sample_schema *schema = &system_info->sample_schema;
+    struct poli_ring *ring = &system_info->poll_ring;
+    struct poli_tag *app_summary = get_app_summary();
+
+    //the readings at init and at finalize bound the samples
+    struct poli_sample prev, next, interpolated;
+    prev.counter = -1;
+    prev.wtime = system_info->initial_mpi_wtime;
+    poli_sample_read_values(schema, &system_info->initial_energy, prev.values);
+
+    int b = 0;
+    poli_ring_rewind(ring);
+    while (b < num_boundaries)
+    {
+        int last = (poli_ring_read_next(ring, &next) != 0);
+        if (last)
+        {
+            next.counter = prev.counter + 1;
+            next.wtime = app_summary->end_time;
+            poli_sample_read_values(schema, &app_summary->end_energy, next.values);
+        }
+
+        for (; b < num_boundaries && (last || boundaries[b].time <= next.wtime); b++)
+        {
+            double span = next.wtime - prev.wtime;
+            double fraction = (span > 0) ? (boundaries[b].time - prev.wtime) / span : 1.0;
+            if (fraction < 0)
+                fraction = 0;
+            if (fraction > 1)
+                fraction = 1;
+
+            int column;
+            for (column = 0; column < schema->num_columns; column++)
+            {
+                double from = prev.values[column];
+                double to = next.values[column];
+                if (!schema->is_energy[column])
+                    interpolated.values[column] = -1.0;
+                else if (from < 0 || to < 0) //a counter that couldn't be read, use the other side
+                    interpolated.values[column] = (from >= 0) ? from : to;
+                else
+                    interpolated.values[column] = from + (to - from) * fraction;
+            }
+            poli_sample_get_energy(schema, &interpolated, boundaries[b].energy);
+            *boundaries[b].timer_count = next.counter;
+        }
+
+        if (last)
+            break;
+        prev = next;
+    }
+    poli_ring_rewind(ring);
+}
+
+#endif
+
 /******************************************************************************/
 /*                      MODIFIED                                              */
 /******************************************************************************/
@@ -114,6 +560,9 @@ static void copy_energy_reading(struct energy_reading *to, struct energy_reading
   to->rapl_energy.pp0 = from->rapl_energy.pp0;
   to->rapl_energy.pp1 = from->rapl_energy.pp1;
   to->rapl_energy.platform = from->rapl_energy.platform;
+  int socket;
+  for (socket = 0; socket < MAX_SOCKETS; socket++)
+    to->rapl_socket_energy[socket] = from->rapl_socket_energy[socket];
 }
 
 int poli_get_current_energy(struct energy_reading *current_energy)
@@ -129,34 +578,28 @@ int poli_get_current_energy(struct energy_reading *current_energy)
 int poli_get_current_power(struct energy_reading *current_power)
 {
   if (poller->timer_on && monitor->imonitor) {
-    if (poller->time_counter < MAX_POLL_SAMPLES) {
-      struct system_poll_info *info = &system_info->system_poll_list[poller->time_counter];
-      struct energy_reading last_energy;
-      struct energy_reading energy;
-      struct energy_reading power;
-      struct rapl_energy diff;
-      double time;
-
-      energy = read_current_energy(system_info); 
-
-      if (poller->time_counter > 0) {
-        last_energy = system_info->system_poll_list[poller->time_counter-1].current_energy;
-        //last_energy = system_info->system_poll_list[poller->time_counter].current_energy;
-        // may not correspond to a polling time
-        //time = ((double) POLL_INTERVAL);
-        // this should be more accurate
-        time = get_time() - system_info->system_poll_list[poller->time_counter-1].wtime;
-      } else {
-        init_energy_reading(&last_energy);
-        time = system_info->initial_mpi_wtime;
-      }
-
-      rapl_compute_total_energy(&(diff), &(energy.rapl_energy), &(last_energy.rapl_energy));
-      rapl_compute_total_power(&(power.rapl_energy), &(diff), time);
-      copy_energy_reading(current_power, &(power));
-
-      return 0;
+    struct poli_sample last_sample;
+    struct energy_reading last_energy;
+    struct energy_reading energy;
+    struct energy_reading power;
+    struct energy_reading diff;
+    double time;
+
+    energy = read_current_energy(system_info);
+
+    if (poli_ring_latest(&system_info->poll_ring, &last_sample) == 0) {
+      poli_sample_get_energy(&system_info->sample_schema, &last_sample, &last_energy);
+      // may not correspond to a polling time, so use the time elapsed since the last sample
+      time = get_time() - last_sample.wtime;
+    } else {
+      last_energy = system_info->initial_energy;
+      time = get_time() - system_info->initial_mpi_wtime;
     }
+
+    compute_rapl_totals(&(diff), &(power), &(energy), &(last_energy), time);
+    copy_energy_reading(current_power, &(power));
+
+    return 0;
   }
 
   return 1;
@@ -213,8 +656,11 @@ int poli_init (void)
     monitor->thread_id = 0;
 #endif
 
-    if (monitor->node_rank == 0 && monitor->thread_id == 0)
-        monitor->imonitor = 1;
+    monitor->imonitor = (monitor->node_rank == 0 && monitor->thread_id == 0);
+#ifndef _NOMPI
+    //the monitors write the job's output together
+    MPI_Comm_split(MPI_COMM_WORLD, monitor->imonitor ? 0 : MPI_UNDEFINED, monitor->world_rank, &monitor->monitors_comm);
+#endif
 /*
 #ifdef _COBALT
     monitor->jobid = getenv("COBALT_JOBID");
@@ -228,10 +674,47 @@ int poli_init (void)
     if (monitor->jobid == NULL)
         strcpy(monitor->jobid, "myjob");
 
+    //tags registered from now on are aggregated unless set otherwise with poli_tag_set_aggregated
+    char *aggregate_str = getenv("PoLi_TAG_AGGREGATE");
+    tag_registry.aggregate_default = (aggregate_str != NULL && atoi(aggregate_str) == 1);
+
+#ifndef _TIMER_OFF
+    //every rank logs the boundaries of first/last tags where the monitor can read them, without synchronizing
+    int max_tag_events = DEFAULT_TAG_EVENTS;
+    char *tag_events_str = getenv("PoLi_TAG_EVENTS");
+    if (tag_events_str != NULL && atoi(tag_events_str) > 0)
+        max_tag_events = atoi(tag_events_str);
+    poli_tag_events_init(&tag_events, monitor, max_tag_events);
+    tag_events_offset = get_time() - poli_tag_events_clock();
+#endif
+
+    tag_registry.sync_default = TAG_SYNC_BARRIER;
+    char *sync_str = getenv("PoLi_TAG_SYNC");
+    if (sync_str != NULL && strcmp(sync_str, "none") == 0)
+        tag_registry.sync_default = TAG_SYNC_NONE;
+    else if (sync_str != NULL && strcmp(sync_str, "first_last") == 0)
+    {
+        if (tag_events.segment != NULL)
+            tag_registry.sync_default = TAG_SYNC_FIRST_LAST;
+        else
+            poli_log(WARNING, monitor, "PoLi_TAG_SYNC=first_last needs polling and MPI-3, tags will synchronize all ranks");
+    }
+
+#ifndef _TIMER_OFF
+    int sample_store_error = 0;
+#endif
     if (monitor->imonitor)
     {
         poller = malloc(sizeof(struct poller_t));
         poller->time_counter = 0;
+#ifndef _TIMER_OFF
+        poller->timer_on = 0;
+        poller->interval = DEFAULT_POLL_INTERVAL;
+        poller->adaptive = 0;
+        poller->min_interval = DEFAULT_ADAPTIVE_MIN_INTERVAL;
+        poller->max_interval = DEFAULT_ADAPTIVE_MAX_INTERVAL;
+        poller->adaptive_threshold = DEFAULT_ADAPTIVE_THRESHOLD;
+#endif
 
         //initialize the main struct
         init_system_info();
@@ -246,16 +729,32 @@ int poli_init (void)
         if (get_system_power_caps() != 0)
             poli_log(ERROR, monitor, "Couldn't get power caps on init!");
 
-        start_poli_tag_no_sync("application_summary");
+        int summary_handle = poli_tag_register("application_summary");
+        if (summary_handle != -1)
+        {
+            tag_registry.aggregated[summary_handle] = 0;
+            tag_registry.sync[summary_handle] = TAG_SYNC_BARRIER;
+            start_poli_tag_no_sync(summary_handle);
+        }
         // record energy
         system_info->initial_energy = read_current_energy(system_info);
+        //only the fields this node can measure are stored with every sample
+        poli_sample_schema_init(&system_info->sample_schema, &system_info->initial_energy, get_num_sockets());
+
+#ifndef _TIMER_OFF
+        //the job power and the budget are set up even without a sampler, their setup is collective over the monitors
+        sample_store_error = init_sample_store();
+        init_job_power();
+        init_power_budget();
+#endif
+        start_wrap_guard();
     }
 
     poli_sync();
 
 #ifndef _TIMER_OFF
-    //setup and start timer
-    if (monitor->imonitor)
+    //setup and start timer, the sampler has nowhere to put its samples without the poll ring
+    if (monitor->imonitor && !sample_store_error)
         setup_timer();
 #endif
 
@@ -269,36 +768,46 @@ static void init_system_info (void)
     //allocate memory and set dummy values
     system_info = malloc(sizeof(struct system_info_t));
 
-    system_info->poli_tag_list = 0;
     system_info->pcap_tag_list = 0;
     system_info->current_pcap_list = 0;
-
-#ifndef _TIMER_OFF
-    system_info->system_poll_list = 0;
-#endif
+    system_info->pcap_events = 0;
+    system_info->num_pcap_events = 0;
+    system_info->max_pcap_events = 0;
 
     system_info->num_poli_tags = 0;
     system_info->num_open_tags = 0;
     system_info->num_closed_tags = 0;
 
-    system_info->poli_opentag_tracker = -1;
-    system_info->poli_closetag_tracker = -1;
+    system_info->open_tag_stack = 0;
+    system_info->open_tag_stack_size = 0;
+    system_info->open_tag_stack_capacity = 0;
+    system_info->active_poli_tag_ids = 0;
+    system_info->num_active_poli_tag_ids = 0;
+    system_info->max_active_poli_tag_ids = 0;
 
     system_info->num_pcap_tags = 0;
-
-    // allocate list of poli tags (power measurements)
-    system_info->poli_tag_list = calloc(MAX_TAGS, sizeof(struct poli_tag));
+    system_info->num_dropped_pcap_tags = 0;
+
+    pthread_mutex_init(&system_info->energy_lock, NULL);
+    pthread_mutex_init(&system_info->pcap_lock, NULL);
+    system_info->wrap_guard_on = 0;
+    system_info->wrap_guard_period = 0.0;
+    clock_gettime(CLOCK_MONOTONIC, &system_info->last_energy_read);
+
+    // allocate storage for poli tags (power measurements), it grows as tags are started
+    size_t tag_memory_limit = 0;
+    char *limit_str = getenv("PoLi_TAG_MEMORY_LIMIT");
+    if (limit_str != NULL && atof(limit_str) > 0)
+        tag_memory_limit = (size_t) (atof(limit_str) * 1024 * 1024);
+    if (poli_arena_init(&system_info->poli_tags, sizeof(struct poli_tag), TAG_CHUNK_RECORDS, tag_memory_limit) != 0)
+        poli_log(ERROR, monitor, "Failed to allocate memory for tags! Tags will only be recorded if memory can be allocated later.");
+    poli_thread_tags_init(tag_memory_limit);
 
     // allocate list of power cap tags (create a tag each time we specifically set a power cap)
     system_info->pcap_tag_list = calloc(MAX_TAGS, sizeof(struct pcap_tag));
 
     //
-    system_info->current_pcap_list = calloc(NUM_ZONES, sizeof(struct pcap_info));
-
-#ifndef _TIMER_OFF
-    //allocate list keeping the poll info
-    system_info->system_poll_list = calloc(MAX_POLL_SAMPLES, sizeof(struct system_poll_info));
-#endif
+    system_info->current_pcap_list = calloc(MAX_SOCKETS * NUM_ZONES, sizeof(struct pcap_info));
 
 #ifdef _BENCH
     system_info->system_poll_list_em = calloc(MAX_POLL_SAMPLES, sizeof(struct system_poll_info));
@@ -317,6 +826,195 @@ static void init_system_info (void)
 }
 
 
+#ifndef _TIMER_OFF
+static int init_sample_store (void)
+{
+    //allocate the ring keeping the most recent samples, older samples are spooled to disk
+    unsigned long ring_capacity = DEFAULT_RING_CAPACITY;
+    char *capacity_str = getenv("PoLi_POLL_BUFFER_SAMPLES");
+    if (capacity_str != NULL && atol(capacity_str) > 0)
+        ring_capacity = (unsigned long) atol(capacity_str);
+
+    char *spool_dir = getenv("PoLi_SPOOL_DIR");
+    if (spool_dir == NULL)
+        spool_dir = getenv("TMPDIR");
+    if (spool_dir == NULL)
+        spool_dir = "/tmp";
+    char spool_path[1000];
+    snprintf(spool_path, sizeof(spool_path), "%s/PoLiMEr_spool_%s_%s_%d.bin", spool_dir, monitor->my_host, monitor->jobid, (int) getpid());
+
+    if (poli_ring_init(&system_info->poll_ring, system_info->sample_schema.sample_size, ring_capacity, spool_path) != 0)
+    {
+        poli_log(ERROR, monitor, "Failed to set up the polling buffer. The sampler is not started, polling output will not be available.");
+        return 1;
+    }
+    return 0;
+
+}
+
+static void init_job_power (void)
+{
+    char *job_power_str = getenv("PoLi_JOB_POWER");
+    int requested = (job_power_str != NULL && atoi(job_power_str) == 1);
+
+    double interval = DEFAULT_JOB_POWER_INTERVAL;
+    char *interval_str = getenv("PoLi_JOB_POWER_INTERVAL");
+    if (interval_str != NULL && atof(interval_str) >= MIN_POLL_INTERVAL)
+        interval = atof(interval_str);
+    int max_points = DEFAULT_JOB_POWER_POINTS;
+    char *points_str = getenv("PoLi_JOB_POWER_POINTS");
+    if (points_str != NULL && atoi(points_str) > 0)
+        max_points = atoi(points_str);
+
+    if (poli_job_power_init(&job_power, monitor, requested, interval, max_points) != 0)
+        poli_log(ERROR, monitor, "Failed to set up the job power timeline");
+}
+
+static void init_power_budget (void)
+{
+    double watts = 0.0;
+    char *budget_str = getenv("PoLi_JOB_POWER_BUDGET");
+    if (budget_str != NULL)
+        watts = atof(budget_str);
+    int requested = (watts > 0);
+    if (requested && system_info->sysmsr->pcap_error_state)
+    {
+        poli_log(WARNING, monitor, "The job power budget needs RAPL power caps, this node can't take part");
+        requested = 0;
+    }
+
+    double interval = DEFAULT_POWER_BUDGET_INTERVAL;
+    char *interval_str = getenv("PoLi_JOB_POWER_BUDGET_INTERVAL");
+    if (interval_str != NULL && atof(interval_str) >= MIN_POLL_INTERVAL)
+        interval = atof(interval_str);
+
+    //the node's caps can move between the lowest and highest package power caps of all its packages
+    double min_cap = 0.0, max_cap = 0.0;
+    int socket;
+    for (socket = 0; requested && socket < get_num_sockets(); socket++)
+    {
+        double min, max, thermal_spec, max_time_window;
+        if (rapl_get_power_cap_info(zone_names[PACKAGE_INDEX], socket, &min, &max, &thermal_spec, &max_time_window, system_info) != 0)
+        {
+            poli_log(WARNING, monitor, "Couldn't get the power cap limits of package %d, this node can't take part in the job power budget", socket);
+            requested = 0;
+            break;
+        }
+        //rapl_set_power_cap only takes caps between MIN_WATTS and MAX_WATTS
+        if (min < MIN_WATTS)
+            min = MIN_WATTS;
+        if (max <= 0)
+            max = (thermal_spec > 0) ? thermal_spec : MAX_WATTS;
+        if (max > MAX_WATTS)
+            max = MAX_WATTS;
+        min_cap += min;
+        max_cap += (max > min) ? max : min;
+    }
+
+    if (poli_power_budget_init(&power_budget, monitor, requested, watts, interval, min_cap, max_cap) != 0)
+        poli_log(ERROR, monitor, "Failed to set up the job power budget");
+}
+
+static void update_power_budget (struct system_poll_info *info)
+{
+    if (!power_budget.enabled)
+        return;
+
+    int num_sockets = get_num_sockets();
+    double cap = 0.0;
+    int socket;
+    pthread_mutex_lock(&system_info->pcap_lock);
+    for (socket = 0; socket < num_sockets; socket++)
+        cap += get_current_pcap(socket, PACKAGE_INDEX)->watts_long;
+    pthread_mutex_unlock(&system_info->pcap_lock);
+    if (cap <= 0)
+        cap = power_budget.send.max;
+
+    double new_cap;
+    if (poli_power_budget_update(&power_budget, info->wtime - system_info->initial_mpi_wtime,
+        info->computed_power.rapl_energy.package, cap, &new_cap))
+    {
+        //the node's share is split evenly over its packages; once the budget stopped, poli_finalize may already have reset
+        //the power caps (it takes pcap_lock after stopping it), so a late cap is dropped
+        pthread_mutex_lock(&system_info->pcap_lock);
+        if (!power_budget.stopped && apply_power_cap(ALL_PACKAGES, zone_names[PACKAGE_INDEX], new_cap / num_sockets,
+            new_cap / num_sockets, DEFAULT_SECONDS_LONG, DEFAULT_SECONDS_SHORT, INTERNAL) != 0)
+            poli_log(ERROR, monitor, "Something went wrong with setting the power cap of the job power budget");
+        pthread_mutex_unlock(&system_info->pcap_lock);
+    }
+}
+
+#ifndef _NOMPI
+static int job_power_to_file (void)
+{
+    if (!job_power.enabled)
+        return 0;
+    int ret = poli_job_power_finish(&job_power);
+
+    int monitor_rank, num_monitors;
+    MPI_Comm_size(monitor->monitors_comm, &num_monitors);
+    MPI_Comm_rank(monitor->monitors_comm, &monitor_rank);
+    char *hosts = NULL;
+    if (monitor_rank == 0)
+        hosts = malloc((size_t) num_monitors * MPI_MAX_PROCESSOR_NAME);
+    MPI_Gather(monitor->my_host, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, hosts, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, 0, monitor->monitors_comm);
+    if (monitor_rank != 0)
+        return ret;
+
+    struct job_power_point *points = malloc(job_power.max_points * sizeof(struct job_power_point));
+    int num_points = 0;
+    if (hosts == NULL || points == NULL)
+    {
+        poli_log(ERROR, monitor, "%s: Failed to allocate memory for the job power timeline", __FUNCTION__);
+        free(hosts);
+        free(points);
+        return 1;
+    }
+    poli_job_power_get(&job_power, points, job_power.max_points, &num_points);
+    if (job_power.num_points > job_power.max_points)
+        poli_log(WARNING, monitor, "Only the last %d of %ld points of the job power timeline were kept", job_power.max_points, job_power.num_points);
+
+    char path[1000];
+    char *prefix = getenv("PoLi_PREFIX");
+    snprintf(path, sizeof(path), "%sPoLiMEr_job-power_%s.txt", (prefix != NULL) ? prefix : "", monitor->jobid);
+    struct text_writer out;
+    if (poli_text_open(&out, path) != 0)
+        ret = 1;
+    else
+    {
+#ifndef _HEADER_OFF
+        poli_text_puts(&out, "Time (s)\tNodes\tPower (W)\tMin (W)\tMin node\tMax (W)\tMax node\n");
+#endif
+        int point;
+        for (point = 0; point < num_points; point++)
+        {
+            struct node_stats *power = &points[point].power;
+            poli_text_field(&out, points[point].time);
+            poli_text_int(&out, (long) power->count);
+            poli_text_putc(&out, '\t');
+            if (power->count == 0)
+            {
+                poli_text_puts(&out, "\t\t\t\t\n");
+                continue;
+            }
+            poli_text_field(&out, power->total);
+            poli_text_field(&out, power->min);
+            poli_text_puts(&out, &hosts[(size_t) power->min_node * MPI_MAX_PROCESSOR_NAME]);
+            poli_text_putc(&out, '\t');
+            poli_text_field(&out, power->max);
+            poli_text_puts(&out, &hosts[(size_t) power->max_node * MPI_MAX_PROCESSOR_NAME]);
+            poli_text_putc(&out, '\n');
+        }
+        if (poli_text_close(&out) != 0)
+            ret = 1;
+    }
+    free(hosts);
+    free(points);
+    return ret;
+}
+#endif
+#endif
+
 static void init_power_interfaces (struct system_info_t * system_info)
 {
     //initialize the msr environment to read from/write to msrs
@@ -420,114 +1118,406 @@ static int get_comm_split_color_hostname (struct monitor_t * monitor)
 /*                      EMON TAGS                                             */
 /******************************************************************************/
 
-static struct poli_tag *find_poli_tag_for_name (char *tag_name)
+static unsigned int hash_tag_name (char *tag_name)
 {
-    int tag_num;
-    for (tag_num = 0; tag_num < system_info->num_poli_tags; tag_num++)
+    //FNV-1a
+    unsigned int hash = 2166136261u;
+    for (; *tag_name; tag_name++)
     {
-        struct poli_tag *this_poli_tag = &system_info->poli_tag_list[tag_num];
-        if (strcmp(this_poli_tag->tag_name, tag_name) == 0 && !this_poli_tag->closed) {
-            return this_poli_tag;
-        }
+        hash ^= (unsigned char) *tag_name;
+        hash *= 16777619u;
     }
-    return 0;
+    return hash;
 }
 
-static struct poli_tag *get_poli_tag_for_start_time_counter(int counter)
+static int find_tag_handle (char *tag_name, int *slot)
 {
-    if (monitor->imonitor)
+    if (tag_registry.table_size == 0)
     {
-        int i;
-        for (i = 0; i < system_info->num_poli_tags; i++)
-        {
-            struct poli_tag *this_poli_tag = &system_info->poli_tag_list[i];
-            if (this_poli_tag->start_timer_count == counter)
-                return this_poli_tag;
-        }
+        if (slot)
+            *slot = -1;
+        return -1;
     }
-    return 0;
+
+    int mask = tag_registry.table_size - 1;
+    int i = hash_tag_name(tag_name) & mask;
+    while (tag_registry.table[i] != -1 && strcmp(tag_registry.names[tag_registry.table[i]], tag_name) != 0)
+        i = (i + 1) & mask;
+
+    if (slot)
+        *slot = i;
+    return tag_registry.table[i];
 }
 
-static struct poli_tag *get_poli_tag_for_end_time_counter(int counter)
+static int grow_tag_registry (void)
 {
-    if (monitor->imonitor)
+    int max_names = (tag_registry.max_names > 0) ? 2 * tag_registry.max_names : 64;
+    char **names = realloc(tag_registry.names, max_names * sizeof(char *));
+    if (names == NULL)
+        return 1;
+    tag_registry.names = names;
+    int *last_open = realloc(tag_registry.last_open, max_names * sizeof(int));
+    if (last_open == NULL)
+        return 1;
+    tag_registry.last_open = last_open;
+    int *num_dropped_open = realloc(tag_registry.num_dropped_open, max_names * sizeof(int));
+    if (num_dropped_open == NULL)
+        return 1;
+    tag_registry.num_dropped_open = num_dropped_open;
+    int *aggregated = realloc(tag_registry.aggregated, max_names * sizeof(int));
+    if (aggregated == NULL)
+        return 1;
+    tag_registry.aggregated = aggregated;
+    struct tag_summary **summaries = realloc(tag_registry.summaries, max_names * sizeof(struct tag_summary *));
+    if (summaries == NULL)
+        return 1;
+    tag_registry.summaries = summaries;
+    poli_tag_sync_t *sync = realloc(tag_registry.sync, max_names * sizeof(poli_tag_sync_t));
+    if (sync == NULL)
+        return 1;
+    tag_registry.sync = sync;
+    int *event_name = realloc(tag_registry.event_name, max_names * sizeof(int));
+    if (event_name == NULL)
+        return 1;
+    tag_registry.event_name = event_name;
+
+    //rehash into a table twice the size of the name list so it never gets more than half full
+    int *table = malloc(2 * max_names * sizeof(int));
+    if (table == NULL)
+        return 1;
+    if (tag_registry.table)
+        free(tag_registry.table);
+    tag_registry.table = table;
+    tag_registry.table_size = 2 * max_names;
+    tag_registry.max_names = max_names;
+
+    int i, slot;
+    for (i = 0; i < tag_registry.table_size; i++)
+        tag_registry.table[i] = -1;
+    for (i = 0; i < tag_registry.num_names; i++)
     {
-        int i;
-        for (i = 0; i < system_info->num_poli_tags; i++)
-        {
-            struct poli_tag *this_poli_tag = &system_info->poli_tag_list[i];
-            if (this_poli_tag->end_timer_count == counter)
-                return this_poli_tag;
-        }
+        find_tag_handle(tag_registry.names[i], &slot);
+        tag_registry.table[slot] = i;
     }
     return 0;
 }
 
-int poli_start_tag (char *tag_name)
+static void free_tag_registry (void)
 {
-    poli_sync_node();
-    poli_log(TRACE, monitor,   "Entering %s %s\n", __FUNCTION__, tag_name);
-    int ret = start_poli_tag_no_sync(tag_name);
-    poli_log(TRACE, monitor,   "Finishing %s %s\n", __FUNCTION__, tag_name);
-    return ret;
+    int i;
+    for (i = 0; i < tag_registry.num_names; i++)
+    {
+        free(tag_registry.names[i]);
+        if (tag_registry.summaries[i])
+            free(tag_registry.summaries[i]);
+    }
+    if (tag_registry.names)
+        free(tag_registry.names);
+    if (tag_registry.last_open)
+        free(tag_registry.last_open);
+    if (tag_registry.num_dropped_open)
+        free(tag_registry.num_dropped_open);
+    if (tag_registry.aggregated)
+        free(tag_registry.aggregated);
+    if (tag_registry.summaries)
+        free(tag_registry.summaries);
+    if (tag_registry.sync)
+        free(tag_registry.sync);
+    if (tag_registry.event_name)
+        free(tag_registry.event_name);
+    if (tag_registry.open_aggregated)
+        free(tag_registry.open_aggregated);
+    if (tag_registry.table)
+        free(tag_registry.table);
+    memset(&tag_registry, 0, sizeof(struct tag_registry));
+    tag_registry.free_aggregated = -1;
 }
 
-static int start_poli_tag_no_sync (char *tag_name)
+int poli_tag_register (char *tag_name)
 {
-    if (monitor->imonitor)
+#ifndef _NOOMP
+    if (omp_in_parallel())
     {
-        int num_tags = system_info->num_poli_tags;
-        struct poli_tag *new_poli_tag = &system_info->poli_tag_list[num_tags];
-        new_poli_tag->id = num_tags;
-        system_info->poli_opentag_tracker = num_tags;
-        new_poli_tag->tag_name = tag_name;
-        new_poli_tag->monitor_id = monitor->color;
-        new_poli_tag->monitor_rank = monitor->world_rank;
-
-        new_poli_tag->start_energy = read_current_energy(system_info);
-
-        new_poli_tag->start_time = get_time();
-        gettimeofday(&(new_poli_tag->start_timestamp), NULL);
-        new_poli_tag->start_timer_count = poller->time_counter;
-
-        system_info->num_poli_tags++;
-        system_info->num_open_tags++;
+        int handle;
+#pragma omp critical (poli_tag_registry)
+        handle = register_tag(tag_name);
+        return handle;
     }
-    return 0;
+#endif
+    return register_tag(tag_name);
 }
 
-int poli_end_tag (char *tag_name)
+static int lookup_tag (char *tag_name)
 {
-    poli_sync_node();
-    poli_log(TRACE, monitor,   "Entering %s %s\n", __FUNCTION__, tag_name);
-    int ret = end_poli_tag_no_sync(tag_name);
-    poli_log(TRACE, monitor,   "Finishing %s %s\n", __FUNCTION__, tag_name);
-    return ret;
+#ifndef _NOOMP
+    if (omp_in_parallel())
+    {
+        int handle;
+#pragma omp critical (poli_tag_registry)
+        handle = find_tag_handle(tag_name, NULL);
+        return handle;
+    }
+#endif
+    return find_tag_handle(tag_name, NULL);
 }
 
-static int end_poli_tag_no_sync (char *tag_name)
+static int register_tag (char *tag_name)
 {
-    int ret = 0;
-    if (monitor->imonitor)
+    if (tag_name == NULL)
     {
-        struct poli_tag *this_poli_tag = &system_info->poli_tag_list[system_info->poli_opentag_tracker];
-        if (system_info->poli_opentag_tracker < 1) //1 because we don't want application_summary to be prematurely closed
-        {
-            if (strcmp(this_poli_tag->tag_name, tag_name) != 0)
-            {
-                poli_log(WARNING, monitor, "You attempted to close tag %s, but no tags were opened! This tag will be omitted", tag_name);
-                return -1;
-            }
-        }
+        poli_log(ERROR, monitor, "%s: Tag name is missing", __FUNCTION__);
+        return -1;
+    }
 
-        //if (strcmp(this_poli_tag->tag_name, tag_name) != 0) //this enables interleaving tags
-        //    this_poli_tag = find_poli_tag_for_name(tag_name);
-        if (this_poli_tag == 0)
-        {
-            poli_log(ERROR, monitor,   "%s: Failed to find poli tag to end: %s\n", __FUNCTION__, tag_name);
+    int slot;
+    int handle = find_tag_handle(tag_name, &slot);
+    if (handle != -1)
+        return handle;
+
+    if (tag_registry.num_names == tag_registry.max_names)
+    {
+        if (grow_tag_registry() != 0)
+        {
+            poli_log(ERROR, monitor, "%s: Failed to allocate memory for tag %s", __FUNCTION__, tag_name);
+            return -1;
+        }
+        find_tag_handle(tag_name, &slot);
+    }
+
+    size_t len = strlen(tag_name) + 1;
+    char *name = malloc(len);
+    if (name == NULL)
+    {
+        poli_log(ERROR, monitor, "%s: Failed to allocate memory for tag %s", __FUNCTION__, tag_name);
+        return -1;
+    }
+    memcpy(name, tag_name, len);
+
+    handle = tag_registry.num_names++;
+    tag_registry.names[handle] = name;
+    tag_registry.last_open[handle] = -1;
+    tag_registry.num_dropped_open[handle] = 0;
+    tag_registry.aggregated[handle] = tag_registry.aggregate_default;
+    tag_registry.summaries[handle] = 0;
+    tag_registry.sync[handle] = tag_registry.sync_default;
+    tag_registry.event_name[handle] = -1;
+    tag_registry.table[slot] = handle;
+    return handle;
+}
+
+static int valid_tag_handle (int handle)
+{
+    if (handle < 0 || handle >= tag_registry.num_names)
+    {
+        poli_log(ERROR, monitor, "Tag handle %d is invalid, tags must be registered with poli_tag_register", handle);
+        return 0;
+    }
+    return 1;
+}
+
+static int in_parallel_region (void)
+{
+#ifndef _NOOMP
+    return omp_in_parallel();
+#else
+    return 0;
+#endif
+}
+
+static int record_thread_tag (int handle, tag_event_kind_t kind)
+{
+    if (handle < 0)
+        return 1;
+    if (!monitor->imonitor)
+        return 0;
+#ifndef _TIMER_OFF
+    return poli_thread_tags_record(handle, kind);
+#else
+    static int warned = 0;
+    if (__atomic_fetch_add(&warned, 1, __ATOMIC_RELAXED) == 0)
+        poli_log(WARNING, monitor, "Tags inside parallel regions need polling, they won't be recorded");
+    return 1;
+#endif
+}
+
+int poli_start_tag (char *tag_name)
+{
+    poli_log(TRACE, monitor,   "Entering %s %s\n", __FUNCTION__, tag_name);
+    int handle = poli_tag_register(tag_name);
+    int ret = in_parallel_region() ? record_thread_tag(handle, TAG_EVENT_START) : start_tag(handle);
+    poli_log(TRACE, monitor,   "Finishing %s %s\n", __FUNCTION__, tag_name);
+    return ret;
+}
+
+int poli_start_tag_h (int handle)
+{
+    poli_log(TRACE, monitor,   "Entering %s %d\n", __FUNCTION__, handle);
+    int ret;
+    if (in_parallel_region()) //the handle is checked once the thread's tags are resolved
+        ret = record_thread_tag(handle, TAG_EVENT_START);
+    else
+        ret = start_tag(valid_tag_handle(handle) ? handle : -1);
+    poli_log(TRACE, monitor,   "Finishing %s %d\n", __FUNCTION__, handle);
+    return ret;
+}
+
+static int start_tag (int handle)
+{
+    if (handle == -1 || tag_registry.sync[handle] == TAG_SYNC_BARRIER)
+        poli_sync_node();
+    if (handle == -1)
+        return 1;
+    if (tag_registry.sync[handle] == TAG_SYNC_FIRST_LAST)
+        return poli_tag_events_record(&tag_events, &tag_registry.event_name[handle], tag_registry.names[handle], TAG_EVENT_START);
+    return start_poli_tag_no_sync(handle);
+}
+
+int poli_tag_set_aggregated (int handle, int aggregated)
+{
+    if (!valid_tag_handle(handle))
+        return 1;
+    if (tag_registry.last_open[handle] != -1 || tag_registry.num_dropped_open[handle] > 0)
+    {
+        poli_log(ERROR, monitor, "%s: Tag %s is open, it can only be changed while it isn't", __FUNCTION__, tag_registry.names[handle]);
+        return 1;
+    }
+    tag_registry.aggregated[handle] = (aggregated != 0);
+    return 0;
+}
+
+int poli_tag_set_sync (int handle, poli_tag_sync_t sync)
+{
+    if (!valid_tag_handle(handle))
+        return 1;
+    if (sync != TAG_SYNC_BARRIER && sync != TAG_SYNC_NONE && sync != TAG_SYNC_FIRST_LAST)
+    {
+        poli_log(ERROR, monitor, "%s: Unknown tag synchronization %d", __FUNCTION__, (int) sync);
+        return 1;
+    }
+    if (sync == TAG_SYNC_FIRST_LAST && tag_events.segment == NULL)
+    {
+        poli_log(ERROR, monitor, "%s: Tag %s can't span from the first to the last rank, this needs polling and MPI-3", __FUNCTION__, tag_registry.names[handle]);
+        return 1;
+    }
+    if (tag_registry.last_open[handle] != -1 || tag_registry.num_dropped_open[handle] > 0)
+    {
+        poli_log(ERROR, monitor, "%s: Tag %s is open, it can only be changed while it isn't", __FUNCTION__, tag_registry.names[handle]);
+        return 1;
+    }
+    tag_registry.sync[handle] = sync;
+    return 0;
+}
+
+static int start_poli_tag_no_sync (int handle)
+{
+    if (monitor->imonitor && tag_registry.aggregated[handle])
+        return start_aggregated_tag(handle);
+
+    if (monitor->imonitor)
+    {
+        char *tag_name = tag_registry.names[handle];
+        int num_tags = system_info->num_poli_tags;
+        if (append_tag_id(&system_info->open_tag_stack, &system_info->open_tag_stack_size, &system_info->open_tag_stack_capacity, num_tags) != 0)
+        {
+            poli_log(ERROR, monitor, "%s: Failed to open tag %s", __FUNCTION__, tag_name);
             return 1;
         }
-        ret = end_existing_poli_tag(this_poli_tag);
+        struct poli_tag *new_poli_tag = poli_arena_append(&system_info->poli_tags);
+        if (new_poli_tag == 0)
+        {
+            system_info->open_tag_stack_size--;
+            //the matching end is still accepted so that it doesn't close another instance of the tag
+            tag_registry.num_dropped_open[handle]++;
+            if (system_info->poli_tags.dropped == 1)
+                poli_log(WARNING, monitor, "Out of memory for tags (see PoLi_TAG_MEMORY_LIMIT), tag %s and any tag started after it won't be recorded", tag_name);
+            return 1;
+        }
+        new_poli_tag->id = num_tags;
+        new_poli_tag->tag_name = tag_name;
+        new_poli_tag->handle = handle;
+        new_poli_tag->prev_open = tag_registry.last_open[handle];
+        tag_registry.last_open[handle] = num_tags;
+        new_poli_tag->monitor_id = monitor->color;
+        new_poli_tag->monitor_rank = monitor->world_rank;
+
+        new_poli_tag->start_energy = read_current_energy(system_info);
+
+        new_poli_tag->start_time = get_time();
+        gettimeofday(&(new_poli_tag->start_timestamp), NULL);
+        new_poli_tag->start_timer_count = get_timer_count();
+
+        system_info->num_poli_tags++;
+        system_info->num_open_tags++;
+    }
+    return 0;
+}
+
+int poli_end_tag (char *tag_name)
+{
+    poli_log(TRACE, monitor,   "Entering %s %s\n", __FUNCTION__, tag_name);
+    int ret;
+    int handle = (tag_name != NULL) ? lookup_tag(tag_name) : -1;
+    if (handle == -1)
+    {
+        if (!in_parallel_region())
+            poli_sync_node();
+        poli_log(WARNING, monitor, "You attempted to close tag %s, but no tags were opened! This tag will be omitted", tag_name);
+        ret = -1;
+    }
+    else if (in_parallel_region())
+        ret = record_thread_tag(handle, TAG_EVENT_END);
+    else
+        ret = end_tag(handle);
+    poli_log(TRACE, monitor,   "Finishing %s %s\n", __FUNCTION__, tag_name);
+    return ret;
+}
+
+int poli_end_tag_h (int handle)
+{
+    poli_log(TRACE, monitor,   "Entering %s %d\n", __FUNCTION__, handle);
+    int ret;
+    if (in_parallel_region())
+        ret = record_thread_tag(handle, TAG_EVENT_END);
+    else
+        ret = end_tag(valid_tag_handle(handle) ? handle : -1);
+    poli_log(TRACE, monitor,   "Finishing %s %d\n", __FUNCTION__, handle);
+    return ret;
+}
+
+static int end_tag (int handle)
+{
+    if (handle == -1 || tag_registry.sync[handle] == TAG_SYNC_BARRIER)
+        poli_sync_node();
+    if (handle == -1)
+        return 1;
+    if (tag_registry.sync[handle] == TAG_SYNC_FIRST_LAST)
+        return poli_tag_events_record(&tag_events, &tag_registry.event_name[handle], tag_registry.names[handle], TAG_EVENT_END);
+    return end_poli_tag_no_sync(handle);
+}
+
+static int end_poli_tag_no_sync (int handle)
+{
+    int ret = 0;
+    if (monitor->imonitor)
+    {
+        //instances that weren't recorded are the most recent ones, since tags are only dropped once the memory is used up
+        if (tag_registry.num_dropped_open[handle] > 0)
+        {
+            tag_registry.num_dropped_open[handle]--;
+            return 0;
+        }
+
+        //the most recently opened instance of the tag is closed, whether or not it is the innermost open tag
+        int id = tag_registry.last_open[handle];
+        if (id < 0 || (id == 0 && !tag_registry.aggregated[handle])) //application_summary (id 0) is only closed by poli_finalize
+        {
+            poli_log(WARNING, monitor, "You attempted to close tag %s, but no tags were opened! This tag will be omitted", tag_registry.names[handle]);
+            return -1;
+        }
+        if (tag_registry.aggregated[handle])
+            ret = end_aggregated_tag(id);
+        else
+            ret = end_existing_poli_tag(get_poli_tag(id));
     }
     return ret;
 }
@@ -543,25 +1533,162 @@ static int end_existing_poli_tag (struct poli_tag *this_poli_tag)
 
         this_poli_tag->end_time = get_time();
         gettimeofday(&(this_poli_tag->end_timestamp), NULL);
-        this_poli_tag->end_timer_count = poller->time_counter;
+        this_poli_tag->end_timer_count = get_timer_count();
         this_poli_tag->closed = 1;
-        system_info->poli_closetag_tracker = system_info->poli_opentag_tracker;
         system_info->num_closed_tags--; //yes, decrement
-        system_info->poli_closetag_tracker = system_info->poli_opentag_tracker;
-        system_info->poli_opentag_tracker--;
+
+        //usually the innermost tag, but finalize can close tags in any order
+        int depth;
+        for (depth = system_info->open_tag_stack_size - 1; depth >= 0; depth--)
+        {
+            if (system_info->open_tag_stack[depth] == this_poli_tag->id)
+            {
+                memmove(&system_info->open_tag_stack[depth], &system_info->open_tag_stack[depth + 1],
+                    (system_info->open_tag_stack_size - depth - 1) * sizeof(int));
+                system_info->open_tag_stack_size--;
+                break;
+            }
+        }
+
+        //likewise unlink it from the open instances of its handle
+        int *next_open = &tag_registry.last_open[this_poli_tag->handle];
+        while (*next_open != -1 && *next_open != this_poli_tag->id)
+            next_open = &get_poli_tag(*next_open)->prev_open;
+        if (*next_open == this_poli_tag->id)
+            *next_open = this_poli_tag->prev_open;
 
         poli_log(TRACE, monitor, "Finishing %s", __FUNCTION__);
     }
     return 0;
 }
 
+static int start_aggregated_tag (int handle)
+{
+    int index = tag_registry.free_aggregated;
+    if (index == -1)
+    {
+        if (tag_registry.num_open_aggregated == tag_registry.max_open_aggregated)
+        {
+            int new_max = (tag_registry.max_open_aggregated > 0) ? 2 * tag_registry.max_open_aggregated : 16;
+            struct poli_tag *new_list = realloc(tag_registry.open_aggregated, new_max * sizeof(struct poli_tag));
+            if (new_list == NULL)
+            {
+                poli_log(ERROR, monitor, "%s: Failed to open tag %s", __FUNCTION__, tag_registry.names[handle]);
+                tag_registry.num_dropped_open[handle]++;
+                return 1;
+            }
+            tag_registry.open_aggregated = new_list;
+            tag_registry.max_open_aggregated = new_max;
+        }
+        index = tag_registry.num_open_aggregated++;
+    }
+    else
+        tag_registry.free_aggregated = tag_registry.open_aggregated[index].prev_open;
+
+    struct poli_tag *tag = &tag_registry.open_aggregated[index];
+    memset(tag, 0, sizeof(struct poli_tag));
+    tag->id = index;
+    tag->tag_name = tag_registry.names[handle];
+    tag->handle = handle;
+    tag->prev_open = tag_registry.last_open[handle];
+    tag_registry.last_open[handle] = index;
+
+    tag->start_energy = read_current_energy(system_info);
+    tag->start_time = get_time();
+
+    system_info->num_open_tags++;
+    return 0;
+}
+
+static int end_aggregated_tag (int index)
+{
+    struct poli_tag *tag = &tag_registry.open_aggregated[index];
+    tag->end_energy = read_current_energy(system_info);
+    tag->end_time = get_time();
+    tag->closed = 1;
+    system_info->num_closed_tags--;
+
+    int ret = update_tag_summary(tag);
+
+    //unlink it from the open instances of its handle, then recycle it
+    int *next_open = &tag_registry.last_open[tag->handle];
+    while (*next_open != -1 && *next_open != index)
+        next_open = &tag_registry.open_aggregated[*next_open].prev_open;
+    if (*next_open == index)
+        *next_open = tag->prev_open;
+
+    tag->prev_open = tag_registry.free_aggregated;
+    tag_registry.free_aggregated = index;
+    return ret;
+}
+
+static int update_tag_summary (struct poli_tag *tag)
+{
+    struct tag_summary *summary = tag_registry.summaries[tag->handle];
+    if (summary == NULL)
+    {
+        summary = calloc(1, sizeof(struct tag_summary));
+        if (summary == NULL)
+        {
+            poli_log(ERROR, monitor, "%s: Failed to allocate the summary of tag %s", __FUNCTION__, tag->tag_name);
+            return 1;
+        }
+        summary->first_start = tag->start_time;
+        summary->last_end = tag->end_time;
+        tag_registry.summaries[tag->handle] = summary;
+    }
+
+    double time = tag->end_time - tag->start_time;
+    if (tag->start_time < summary->first_start)
+        summary->first_start = tag->start_time;
+    if (tag->end_time > summary->last_end)
+        summary->last_end = tag->end_time;
+    poli_stats_update(&summary->time, time);
+
+    struct sample_schema *schema = &system_info->sample_schema;
+    double start[SAMPLE_NUM_FIELDS], end[SAMPLE_NUM_FIELDS];
+    poli_sample_read_values(schema, &tag->start_energy, start);
+    poli_sample_read_values(schema, &tag->end_energy, end);
+
+    int column;
+    for (column = 0; column < schema->num_columns; column++)
+    {
+        //counters that couldn't be read are left out
+        if (!schema->is_energy[column] || start[column] < 0 || end[column] < start[column])
+            continue;
+        double energy = end[column] - start[column];
+        poli_stats_update(&summary->energy[column], energy);
+        if (time > 0)
+            poli_stats_update(&summary->power[column], energy / time);
+    }
+    return 0;
+}
+
+static int append_tag_id (int **ids, int *num_ids, int *max_ids, int id)
+{
+    if (*num_ids == *max_ids)
+    {
+        int new_max = (*max_ids > 0) ? 2 * (*max_ids) : 16;
+        int *new_ids = realloc(*ids, new_max * sizeof(int));
+        if (new_ids == NULL)
+        {
+            poli_log(ERROR, monitor, "%s: Failed to allocate memory for %d tag ids", __FUNCTION__, new_max);
+            return 1;
+        }
+        *ids = new_ids;
+        *max_ids = new_max;
+    }
+    (*ids)[(*num_ids)++] = id;
+    return 0;
+}
+
 /*                      END OF EMON TAGS                                      */
 
 /******************************************************************************/
 /*                     POWER CAP TAGS                                         */
 /******************************************************************************/
 
-static int init_pcap_tag (char *zone, double watts_long, double watts_short, double seconds_long, double seconds_short, pcap_flag_t pcap_flag)
+static int init_pcap_tag (char *zone, int package, double watts_long, double watts_short, double seconds_long, double seconds_short, pcap_flag_t pcap_flag)
 {
     if (monitor->imonitor)
     {
@@ -575,6 +1702,14 @@ static int init_pcap_tag (char *zone, double watts_long, double watts_short, dou
             return 1;
         }
 
+        //the power cap is still applied and shows in the polling output, it only misses its row in the power cap tags file
+        if (system_info->num_pcap_tags >= MAX_TAGS)
+        {
+            if (system_info->num_dropped_pcap_tags++ == 0)
+                poli_log(WARNING, monitor, "Reached the maximum of %d power cap tags, further power caps won't be listed in the power cap tags file", MAX_TAGS);
+            return 0;
+        }
+
         struct pcap_tag *new_pcap_tag = &system_info->pcap_tag_list[system_info->num_pcap_tags];
 
         new_pcap_tag->id = system_info->num_pcap_tags;
@@ -592,24 +1727,23 @@ static int init_pcap_tag (char *zone, double watts_long, double watts_short, dou
         new_pcap_tag->wtime = get_time();
         gettimeofday(&(new_pcap_tag->timestamp), NULL);
 
-        new_pcap_tag->start_timer_count = poller->time_counter;
+        new_pcap_tag->start_timer_count = get_timer_count();
         new_pcap_tag->pcap_flag = pcap_flag;
-
-        int found_num = 0;
-        int tag_num;
-
-        for (tag_num = 0; tag_num < system_info->num_poli_tags; tag_num++)
+        new_pcap_tag->package_id = package;
+
+        //only the ids of the open tags are kept, in the order they were opened; internal power caps are set by
+        //the sampler thread while the application may be opening and closing tags, so they don't list them
+        new_pcap_tag->first_active_poli_tag = system_info->num_active_poli_tag_ids;
+        new_pcap_tag->num_active_poli_tags = 0;
+        int depth;
+        for (depth = 0; pcap_flag != INTERNAL && depth < system_info->open_tag_stack_size; depth++)
         {
-            struct poli_tag current_poli_tag = system_info->poli_tag_list[tag_num];
-            if (current_poli_tag.closed == 0)
-            {
-                new_pcap_tag->active_poli_tags[found_num] = current_poli_tag;
-                found_num++;
-            }
+            if (append_tag_id(&system_info->active_poli_tag_ids, &system_info->num_active_poli_tag_ids,
+                &system_info->max_active_poli_tag_ids, system_info->open_tag_stack[depth]) != 0)
+                break;
+            new_pcap_tag->num_active_poli_tags++;
         }
 
-        new_pcap_tag->num_active_poli_tags = found_num;
-
         system_info->num_pcap_tags++;
 
         poli_log(TRACE, monitor,   "Finishing %s", __FUNCTION__);
@@ -619,20 +1753,6 @@ static int init_pcap_tag (char *zone, double watts_long, double watts_short, dou
     return 0;
 }
 
-static struct pcap_tag *get_pcap_for_time_counter(int counter)
-{
-    poli_log(TRACE, monitor,   "Entering %s", __FUNCTION__);
-    int tag_num;
-
-    for (tag_num = 0; tag_num < system_info->num_pcap_tags; tag_num++)
-    {
-        struct pcap_tag *tag = &system_info->pcap_tag_list[tag_num];
-        if (tag->start_timer_count == counter)
-            return tag;
-    }
-    return 0;
-}
-
 /*                     END OF POWER CAP TAGS                                  */
 
 /******************************************************************************/
@@ -647,6 +1767,34 @@ int poli_set_power_cap (double watts)
 }
 
 int poli_set_power_cap_with_params(char *zone_name, double watts_long, double watts_short, double seconds_long, double seconds_short)
+{
+    return set_power_cap(ALL_PACKAGES, zone_name, watts_long, watts_short, seconds_long, seconds_short);
+}
+
+int poli_set_power_cap_for_package (int package, char *zone_name, double watts_long, double watts_short, double seconds_long, double seconds_short)
+{
+    if (monitor->imonitor && (package < 0 || package >= get_num_sockets()))
+    {
+        poli_log(ERROR, monitor, "%s: Invalid package %d. Power caps can be set on packages 0 to %d", __FUNCTION__, package, get_num_sockets() - 1);
+        return 1;
+    }
+    return set_power_cap(package, zone_name, watts_long, watts_short, seconds_long, seconds_short);
+}
+
+static int set_power_cap (int package, char *zone_name, double watts_long, double watts_short, double seconds_long, double seconds_short)
+{
+    int ret = 0;
+    if (monitor->imonitor)
+    {
+        pthread_mutex_lock(&system_info->pcap_lock);
+        ret = apply_power_cap(package, zone_name, watts_long, watts_short, seconds_long, seconds_short, USER_SET);
+        pthread_mutex_unlock(&system_info->pcap_lock);
+    }
+    return ret;
+}
+
+static int apply_power_cap (int package, char *zone_name, double watts_long, double watts_short, double seconds_long, double seconds_short,
+    pcap_flag_t pcap_flag)
 {
     if (monitor->imonitor)
     {
@@ -659,70 +1807,92 @@ int poli_set_power_cap_with_params(char *zone_name, double watts_long, double wa
             return 1;
         }
 
-        if (rapl_set_power_cap(zone_name, watts_long, watts_short, seconds_long, seconds_short, system_info, 1) != 0)
+        if (rapl_set_power_cap(zone_name, package, watts_long, watts_short, seconds_long, seconds_short, system_info, 1) != 0)
         {
             poli_log(ERROR, monitor,   "%s: Something went wrong with setting rapl power cap!", __FUNCTION__);
             return 1;
         }
 
-        if (init_pcap_tag(zone_name, watts_long, watts_short, seconds_long, seconds_short, USER_SET) != 0)
+        //the power cap is set from here on, so it is tracked even if its tag can't be recorded
+        int ret = 0;
+        if (init_pcap_tag(zone_name, package, watts_long, watts_short, seconds_long, seconds_short, pcap_flag) != 0)
         {
             poli_log(ERROR, monitor,   "%s: Something went wrong with initializing a new power cap tag!", __FUNCTION__);
-            return 1;
+            ret = 1;
         }
 
-        struct pcap_info *info = &system_info->current_pcap_list[i];
-
-        info->monitor_id = monitor->color;
-        info->monitor_rank = monitor->world_rank;
-        memset(info->zone, '\0', ZONE_NAME_LEN);
-        strncpy(info->zone, zone_name, zone_names_len[i]);
-        if (watts_long > 0)
-        {
-            info->enabled_long = 1;
-            info->clamped_long = 1;
-        }
-        else
-        {
-            info->enabled_long = 0;
-            info->clamped_long = 0;
-        }
-        if (watts_short > 0)
-        {
-            info->enabled_short = 1;
-            info->clamped_short = 1;
-        }
-        else
+        int socket = (package == ALL_PACKAGES) ? 0 : package;
+        int last_socket = (package == ALL_PACKAGES) ? get_num_sockets() - 1 : package;
+        for (; socket <= last_socket; socket++)
         {
-            info->enabled_short = 0;
-            info->clamped_short = 0;
+            struct pcap_info *info = get_current_pcap(socket, i);
+
+            info->monitor_id = monitor->color;
+            info->monitor_rank = monitor->world_rank;
+            memset(info->zone, '\0', ZONE_NAME_LEN);
+            strncpy(info->zone, zone_name, zone_names_len[i]);
+            if (watts_long > 0)
+            {
+                info->enabled_long = 1;
+                info->clamped_long = 1;
+            }
+            else
+            {
+                info->enabled_long = 0;
+                info->clamped_long = 0;
+            }
+            if (watts_short > 0)
+            {
+                info->enabled_short = 1;
+                info->clamped_short = 1;
+            }
+            else
+            {
+                info->enabled_short = 0;
+                info->clamped_short = 0;
+            }
+            info->watts_long = watts_long;
+            info->watts_short = watts_short;
+            info->seconds_long = seconds_long;
+            info->seconds_short = seconds_short;
+
+            record_pcap_event(socket, i);
         }
-        info->watts_long = watts_long;
-        info->watts_short = watts_short;
-        info->seconds_long = seconds_long;
-        info->seconds_short = seconds_short;
 
         poli_log(TRACE, monitor, "Finishing %s", __FUNCTION__);
+        return ret;
     }
     return 0;
 }
 
 int poli_reset_system (void)
+{
+    int ret = 0;
+    if (monitor->imonitor)
+    {
+        pthread_mutex_lock(&system_info->pcap_lock);
+        ret = reset_power_caps();
+        pthread_mutex_unlock(&system_info->pcap_lock);
+    }
+    return ret;
+}
+
+static int reset_power_caps (void)
 {
     if (monitor->imonitor)
     {
         poli_log(TRACE, monitor, "Entering %s", __FUNCTION__);
 
-        if (rapl_set_power_cap("PACKAGE", (double) DEFAULT_PKG_POW, (double) DEFAULT_SHORT, (double) DEFAULT_SECONDS_LONG, (double) DEFAULT_SECONDS_SHORT, system_info, 1) ||
-            rapl_set_power_cap("CORE", (double) DEFAULT_CORE_POW, 0, (double) DEFAULT_CORE_SECONDS, 0, system_info, 0))
+        if (rapl_set_power_cap("PACKAGE", ALL_PACKAGES, (double) DEFAULT_PKG_POW, (double) DEFAULT_SHORT, (double) DEFAULT_SECONDS_LONG, (double) DEFAULT_SECONDS_SHORT, system_info, 1) ||
+            rapl_set_power_cap("CORE", ALL_PACKAGES, (double) DEFAULT_CORE_POW, 0, (double) DEFAULT_CORE_SECONDS, 0, system_info, 0))
         {
             poli_log(ERROR, monitor,   "%s: Something went wrong with setting power caps. Returning...\n", __FUNCTION__);
             return 1;
         }
 
         /* Set up new pcap tags to indicate change in power caps */
-        if (init_pcap_tag("PACKAGE", (double) DEFAULT_PKG_POW, (double) DEFAULT_SHORT, (double) DEFAULT_SECONDS_LONG, (double) DEFAULT_SECONDS_SHORT, SYSTEM_RESET) != 0 ||
-            init_pcap_tag("CORE", (double) DEFAULT_CORE_POW, 0, (double) DEFAULT_SECONDS_LONG, 0, SYSTEM_RESET) != 0)
+        if (init_pcap_tag("PACKAGE", ALL_PACKAGES, (double) DEFAULT_PKG_POW, (double) DEFAULT_SHORT, (double) DEFAULT_SECONDS_LONG, (double) DEFAULT_SECONDS_SHORT, SYSTEM_RESET) != 0 ||
+            init_pcap_tag("CORE", ALL_PACKAGES, (double) DEFAULT_CORE_POW, 0, (double) DEFAULT_SECONDS_LONG, 0, SYSTEM_RESET) != 0)
         {
             poli_log(ERROR, monitor,   "%s: Something went wrong with initializing a new power cap tag!\n", __FUNCTION__);
             return 1;
@@ -744,14 +1914,27 @@ int poli_reset_system (void)
 
 int poli_get_power_cap_for_param (char *zone_name, char *param, double *result)
 {
-    if (monitor->imonitor)
+    return poli_get_power_cap_for_package(0, zone_name, param, result);
+}
+
+int poli_get_power_cap_for_package (int package, char *zone_name, char *param, double *result)
+{
+    int ret = 0;
+    if (monitor->imonitor && (package < 0 || package >= get_num_sockets()))
+    {
+        poli_log(ERROR, monitor, "%s: Invalid package %d. Power caps can be read on packages 0 to %d", __FUNCTION__, package, get_num_sockets() - 1);
+        if (result != NULL)
+            *result = 0.0;
+        ret = 1;
+    }
+    else if (monitor->imonitor)
     {
         poli_log(TRACE, monitor,   "Entering %s", __FUNCTION__);
 
         int found = 0;
         int pkg_exists = 0;
         /* check if the package power cap is there, in case zone_name is invalid*/
-        struct pcap_info *pkg_info = &system_info->current_pcap_list[PACKAGE_INDEX];
+        struct pcap_info *pkg_info = get_current_pcap(package, PACKAGE_INDEX);
         if (pkg_info != 0)
             pkg_exists = 1;
         /* look for power cap of zone requested */
@@ -773,7 +1956,7 @@ int poli_get_power_cap_for_param (char *zone_name, char *param, double *result)
         {
             if (result != NULL)
             {
-                struct pcap_info *info = &system_info->current_pcap_list[i];
+                struct pcap_info *info = get_current_pcap(package, i);
                 if (strcmp(param, "watts_long") == 0)
                     *result = info->watts_long;
                 else if (strcmp(param, "watts_short") == 0)
@@ -803,9 +1986,10 @@ int poli_get_power_cap_for_param (char *zone_name, char *param, double *result)
 
 #ifndef _NOMPI
     MPI_Bcast(result, 1, MPI_DOUBLE, 0, monitor->mynode_comm); //this is necessary for user to retrieve value
+    MPI_Bcast(&ret, 1, MPI_INT, 0, monitor->mynode_comm);
 #endif
 
-    return 0;
+    return ret;
 }
 
 int poli_get_power_cap (double *watts)
@@ -813,20 +1997,32 @@ int poli_get_power_cap (double *watts)
     return poli_get_power_cap_for_param(zone_names[PACKAGE_INDEX], "watts_long", watts);
 }
 
+int poli_get_num_packages (int *num_packages)
+{
+    if (monitor->imonitor)
+        *num_packages = get_num_sockets();
+
+#ifndef _NOMPI
+    MPI_Bcast(num_packages, 1, MPI_INT, 0, monitor->mynode_comm);
+#endif
+
+    return 0;
+}
+
 //TODO currently supporting only RAPL
-static int get_system_power_cap_for_zone (int zone_index)
+static int get_system_power_cap_for_zone (int socket, int zone_index)
 {
     if (monitor->imonitor)
     {
         struct msr_pcap pcap;
-        int pret = rapl_get_power_cap(&pcap, zone_names[zone_index], system_info);
+        int pret = rapl_get_power_cap(&pcap, zone_names[zone_index], socket, system_info);
         if (pret != 0)
         {
             poli_log(ERROR, monitor, "%s: Something went wrong with getting RAPL power cap", __FUNCTION__);
             return -1;
         }
 
-        struct pcap_info *info = &system_info->current_pcap_list[zone_index];
+        struct pcap_info *info = get_current_pcap(socket, zone_index);
 
         info->monitor_id = monitor->color;
         info->monitor_rank = monitor->world_rank;
@@ -841,6 +2037,8 @@ static int get_system_power_cap_for_zone (int zone_index)
         info->enabled_short = pcap.enabled_short;
         info->clamped_long = pcap.clamped_long;
         info->clamped_short = pcap.clamped_short;
+
+        record_pcap_event(socket, zone_index);
     }
 
     return 0;
@@ -853,9 +2051,10 @@ static int get_system_power_caps (void)
     {
         poli_log(TRACE, monitor,   "Entering %s", __FUNCTION__);
 
-        int i;
-        for (i = 0; i < system_info->sysmsr->num_zones; i++)
-            get_system_power_cap_for_zone(i);
+        int i, socket;
+        for (socket = 0; socket < get_num_sockets(); socket++)
+            for (i = 0; i < system_info->sysmsr->num_zones; i++)
+                get_system_power_cap_for_zone(socket, i);
 
         poli_log(TRACE, monitor,   "Finishing %s", __FUNCTION__);
     }
@@ -865,13 +2064,26 @@ static int get_system_power_caps (void)
 
 int poli_get_power_cap_limits (char* zone_name, double *min, double *max)
 {
-    if (monitor->imonitor)
+    return poli_get_power_cap_limits_for_package(0, zone_name, min, max);
+}
+
+int poli_get_power_cap_limits_for_package (int package, char *zone_name, double *min, double *max)
+{
+    int ret = 0;
+    if (monitor->imonitor && (package < 0 || package >= get_num_sockets()))
+    {
+        poli_log(ERROR, monitor, "%s: Invalid package %d. Power caps can be read on packages 0 to %d", __FUNCTION__, package, get_num_sockets() - 1);
+        *min = 0.0;
+        *max = 0.0;
+        ret = 1;
+    }
+    else if (monitor->imonitor)
     {
         int index = get_zone_index(zone_name);
-        struct pcap_info *current_pcap = &system_info->current_pcap_list[index];
+        struct pcap_info *current_pcap = get_current_pcap(package, index);
 
         if (!current_pcap->min || !current_pcap->max)
-            rapl_get_power_cap_info(zone_name, &current_pcap->min, &current_pcap->max,
+            rapl_get_power_cap_info(zone_name, package, &current_pcap->min, &current_pcap->max,
                 &current_pcap->thermal_spec, &current_pcap->max_time_window, system_info);
 
         *min = current_pcap->min;
@@ -881,9 +2093,10 @@ int poli_get_power_cap_limits (char* zone_name, double *min, double *max)
 #ifndef _NOMPI
     MPI_Bcast(min, 1, MPI_DOUBLE, 0, monitor->mynode_comm);
     MPI_Bcast(max, 1, MPI_DOUBLE, 0, monitor->mynode_comm);
+    MPI_Bcast(&ret, 1, MPI_INT, 0, monitor->mynode_comm);
 #endif
 
-    return 0;
+    return ret;
 }
 
 void poli_print_power_cap_info (void)
@@ -895,7 +2108,7 @@ void poli_print_power_cap_info (void)
         printf("                       RANK: %d NODE: %s                    \n", monitor->world_rank, monitor->my_host);
         printf("------------------------------------------------------------\n");
 
-        struct pcap_info *current_pcap = &system_info->current_pcap_list[PACKAGE_INDEX];
+        struct pcap_info *current_pcap = get_current_pcap(0, PACKAGE_INDEX);
         if (current_pcap != 0)
         {
             printf("\tzone: %s\n", current_pcap->zone);
@@ -928,33 +2141,38 @@ void poli_print_power_cap_info_verbose (void)
         printf("                POWER CAP INFO VERBOSE                      \n");
         printf("                RANK: %d NODE: %s                           \n", monitor->world_rank, monitor->my_host);
         printf("------------------------------------------------------------\n");
-        for (i = 0; i < system_info->sysmsr->num_zones; i++)
+        int socket;
+        for (socket = 0; socket < get_num_sockets(); socket++)
         {
-            struct pcap_info *current_pcap = &system_info->current_pcap_list[i];
-            if (current_pcap != 0)
+            for (i = 0; i < system_info->sysmsr->num_zones; i++)
             {
-                printf("\tzone: %s\n", current_pcap->zone);
-                printf("\twatts_long: %lf\n", current_pcap->watts_long);
-                printf("\tseconds_long: %lf\n", current_pcap->seconds_long);
-                printf("\tenabled_long: %d\n", current_pcap->enabled_long);
-                printf("\tclamped_long: %d\n", current_pcap->clamped_long);
-                int short_supported = 0;
-                if (current_pcap->zone_label == PACKAGE || current_pcap->zone_label == PLATFORM)
-                    short_supported = 1;
-                if (short_supported)
+                struct pcap_info *current_pcap = get_current_pcap(socket, i);
+                if (current_pcap != 0)
                 {
-                    printf("\twatts_short: %lf\n", current_pcap->watts_short);
-                    printf("\tseconds_short: %lf\n", current_pcap->seconds_short);
-                    printf("\tenabled_short: %d\n", current_pcap->enabled_short);
-                    printf("\tclamped_short: %d\n", current_pcap->clamped_short);
+                    printf("\tzone: %s\n", current_pcap->zone);
+                    printf("\tpackage: %d\n", socket);
+                    printf("\twatts_long: %lf\n", current_pcap->watts_long);
+                    printf("\tseconds_long: %lf\n", current_pcap->seconds_long);
+                    printf("\tenabled_long: %d\n", current_pcap->enabled_long);
+                    printf("\tclamped_long: %d\n", current_pcap->clamped_long);
+                    int short_supported = 0;
+                    if (current_pcap->zone_label == PACKAGE || current_pcap->zone_label == PLATFORM)
+                        short_supported = 1;
+                    if (short_supported)
+                    {
+                        printf("\twatts_short: %lf\n", current_pcap->watts_short);
+                        printf("\tseconds_short: %lf\n", current_pcap->seconds_short);
+                        printf("\tenabled_short: %d\n", current_pcap->enabled_short);
+                        printf("\tclamped_short: %d\n", current_pcap->clamped_short);
+                    }
+                    printf("\tthermal specification: %lf\n", current_pcap->thermal_spec);
+                    printf("\tmax power cap %lf\n", current_pcap->max);
+                    printf("\tmin power cap %lf\n", current_pcap->min);
+                    printf("\tmax time window %lf\n", current_pcap->max_time_window);
                 }
-                printf("\tthermal specification: %lf\n", current_pcap->thermal_spec);
-                printf("\tmax power cap %lf\n", current_pcap->max);
-                printf("\tmin power cap %lf\n", current_pcap->min);
-                printf("\tmax time window %lf\n", current_pcap->max_time_window);
+                else
+                    printf("Power cap for zone %s on rank %d has not yet been recorded.\n", zone_names[i], monitor->world_rank);
             }
-            else
-                printf("Power cap for zone %s on rank %d has not yet been recorded.\n", zone_names[i], monitor->world_rank);
         }
         printf("************************************************************\n");
     }
@@ -1048,25 +2266,14 @@ static int read_cpufreq (double *freq)
         int hz = 0;
         if (system_info->cur_freq_file > 0)
         {
-            if (poller->time_counter > 0)
-            {
-                if(lseek(system_info->cur_freq_file, 0, SEEK_SET) < 0)
-                {
-                    poli_log(ERROR, monitor,   "Attempt to set file descriptor to beginning of frequency file failed! %s", strerror(errno));
-                    return 1;
-                }
-            }
-            #ifdef _TIMER_OFF
-            if (lseek(system_info->cur_freq_file, 0, SEEK_SET) < 0) {
-                poli_log(ERROR, monitor,   "Attempt to set file descriptor to beginning of frequency file failed! %s", strerror(errno));
-                return 1;
-            }
-            #endif
-            if (read(system_info->cur_freq_file, buff, sizeof(buff)))
+            /* pread leaves the file offset alone, so the sampler thread and the application can both read */
+            if (pread(system_info->cur_freq_file, buff, sizeof(buff) - 1, 0) > 0)
             {
                 char *token;
-                token = strtok(buff, " \t\n");
-                hz = atoi(token);
+                char *saveptr;
+                token = strtok_r(buff, " \t\n", &saveptr);
+                if (token != NULL)
+                    hz = atoi(token);
             }
 
             (*freq) = (double) (hz / 1000.0);
@@ -1083,111 +2290,402 @@ static int read_cpufreq (double *freq)
 /*              TIMER                                                         */
 /******************************************************************************/
 
+int poli_set_poll_interval (double seconds)
+{
+#ifndef _TIMER_OFF
+    if (monitor == 0)
+    {
+        poli_log(ERROR, NULL, "%s: PoLiMEr has not been initialized", __FUNCTION__);
+        return 1;
+    }
+    if (monitor->imonitor)
+    {
+        if (seconds < MIN_POLL_INTERVAL)
+        {
+            poli_log(ERROR, monitor, "Invalid polling interval %lf s. It cannot be less than %lf s", seconds, MIN_POLL_INTERVAL);
+            return 1;
+        }
+        poller->interval = seconds;
+    }
+    return 0;
+#else
+    poli_log(WARNING, monitor, "%s: Polling is turned off (TIMER_OFF)", __FUNCTION__);
+    return 1;
+#endif
+}
+
+int poli_get_poll_interval (double *seconds)
+{
+#ifndef _TIMER_OFF
+    if (monitor == 0)
+    {
+        poli_log(ERROR, NULL, "%s: PoLiMEr has not been initialized", __FUNCTION__);
+        return 1;
+    }
+    if (monitor->imonitor)
+        (*seconds) = poller->interval;
+#ifndef _NOMPI
+    MPI_Bcast(seconds, 1, MPI_DOUBLE, 0, monitor->mynode_comm);
+#endif
+    return 0;
+#else
+    (*seconds) = 0.0;
+    return 1;
+#endif
+}
+
+int poli_enable_adaptive_polling (double min_interval, double max_interval, double threshold_watts)
+{
+#ifndef _TIMER_OFF
+    if (monitor == 0)
+    {
+        poli_log(ERROR, NULL, "%s: PoLiMEr has not been initialized", __FUNCTION__);
+        return 1;
+    }
+    if (monitor->imonitor)
+    {
+        if (!isfinite(min_interval) || !isfinite(max_interval) || min_interval < MIN_POLL_INTERVAL || max_interval < min_interval)
+        {
+            poli_log(ERROR, monitor, "Invalid adaptive polling bounds [%lf, %lf] s. They must be at least %lf s and in increasing order", min_interval, max_interval, MIN_POLL_INTERVAL);
+            return 1;
+        }
+        if (!isfinite(threshold_watts) || threshold_watts <= 0.0)
+        {
+            poli_log(ERROR, monitor, "Invalid adaptive polling threshold %lf W. It must be positive", threshold_watts);
+            return 1;
+        }
+        poller->min_interval = min_interval;
+        poller->max_interval = max_interval;
+        poller->adaptive_threshold = threshold_watts;
+        if (poller->interval < min_interval)
+            poller->interval = min_interval;
+        else if (poller->interval > max_interval)
+            poller->interval = max_interval;
+        poller->adaptive = 1;
+    }
+    return 0;
+#else
+    poli_log(WARNING, monitor, "%s: Polling is turned off (TIMER_OFF)", __FUNCTION__);
+    return 1;
+#endif
+}
+
+int poli_disable_adaptive_polling (void)
+{
+#ifndef _TIMER_OFF
+    if (monitor == 0)
+    {
+        poli_log(ERROR, NULL, "%s: PoLiMEr has not been initialized", __FUNCTION__);
+        return 1;
+    }
+    if (monitor->imonitor)
+        poller->adaptive = 0;
+    return 0;
+#else
+    poli_log(WARNING, monitor, "%s: Polling is turned off (TIMER_OFF)", __FUNCTION__);
+    return 1;
+#endif
+}
+
+int poli_set_job_power_budget (double watts)
+{
+#ifndef _TIMER_OFF
+    if (monitor == 0)
+    {
+        poli_log(ERROR, NULL, "%s: PoLiMEr has not been initialized", __FUNCTION__);
+        return 1;
+    }
+    if (!monitor->imonitor)
+        return 0;
+    if (!power_budget.enabled)
+    {
+        poli_log(ERROR, monitor, "%s: No job power budget was started, set PoLi_JOB_POWER_BUDGET", __FUNCTION__);
+        return 1;
+    }
+    power_budget.budget = (watts > 0) ? watts : 0.0;
+    return 0;
+#else
+    poli_log(WARNING, monitor, "%s: Polling is turned off (TIMER_OFF)", __FUNCTION__);
+    return 1;
+#endif
+}
+
+int poli_get_job_power (double *times, double *power, int max_points, int *num_points)
+{
+    *num_points = 0;
+#ifndef _TIMER_OFF
+    if (monitor == 0)
+    {
+        poli_log(ERROR, NULL, "%s: PoLiMEr has not been initialized", __FUNCTION__);
+        return 1;
+    }
+    if (job_power.points == NULL || max_points <= 0)
+        return 1;
+    struct job_power_point *points = malloc(max_points * sizeof(struct job_power_point));
+    if (points == NULL)
+    {
+        poli_log(ERROR, monitor, "%s: Failed to allocate memory for %d points", __FUNCTION__, max_points);
+        return 1;
+    }
+    poli_job_power_get(&job_power, points, max_points, num_points);
+    int point;
+    for (point = 0; point < *num_points; point++)
+    {
+        times[point] = points[point].time;
+        power[point] = points[point].power.total;
+    }
+    free(points);
+    return 0;
+#else
+    poli_log(WARNING, monitor, "%s: Polling is turned off (TIMER_OFF)", __FUNCTION__);
+    return 1;
+#endif
+}
+
 #ifndef _TIMER_OFF
 static int setup_timer (void)
 {
     if (monitor->imonitor)
     {
-        poller->timer_on = 1;
+        poller->cpu = -1;
+        poller->rt_priority = 0;
 
-        memset(&poller->sa, 0, sizeof(poller->sa));
-        poller->sa.sa_handler = &timer_handler;
+        double interval = poller->interval;
+        if (get_env_double("PoLi_POLL_INTERVAL", &interval, "s"))
+        {
+            if (interval < MIN_POLL_INTERVAL)
+                poli_log(WARNING, monitor, "Ignoring invalid PoLi_POLL_INTERVAL=%lf. It cannot be less than %lf s, using %lf s", interval, MIN_POLL_INTERVAL, poller->interval);
+            else
+                poller->interval = interval;
+        }
 
-        int status = sigaction(SIGALRM, &poller->sa, NULL);
-        if (0 != status)
+        char *adaptive_str = getenv("PoLi_POLL_ADAPTIVE");
+        if (adaptive_str != NULL && atoi(adaptive_str) != 0)
         {
-            poli_log(ERROR, monitor,   "Failed to set SIGACTION: %s", strerror(errno));
-            return 1;
+            double min_interval = poller->min_interval;
+            double max_interval = poller->max_interval;
+            double threshold = poller->adaptive_threshold;
+            get_env_double("PoLi_POLL_MIN_INTERVAL", &min_interval, "s");
+            get_env_double("PoLi_POLL_MAX_INTERVAL", &max_interval, "s");
+            get_env_double("PoLi_POLL_ADAPTIVE_THRESHOLD", &threshold, "W");
+            if (poli_enable_adaptive_polling(min_interval, max_interval, threshold) != 0)
+                poli_log(WARNING, monitor, "Adaptive polling is off, polling every %lf s", poller->interval);
+        }
+
+        char *cpu_str = getenv("PoLi_POLLER_CPU");
+        if (cpu_str != NULL)
+            poller->cpu = atoi(cpu_str);
+        char *prio_str = getenv("PoLi_POLLER_RT_PRIORITY");
+        if (prio_str != NULL)
+            poller->rt_priority = atoi(prio_str);
+
+        //the sampler is created pinned and with its priority, so that not even its first sample is taken without them
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        int status;
+        if (poller->cpu >= 0)
+        {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(poller->cpu, &cpuset);
+            status = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
+            if (0 != status)
+                poli_log(WARNING, monitor, "Failed to pin sampler thread to cpu %d: %s", poller->cpu, strerror(status));
         }
 
-        poller->timer.it_value.tv_sec = 0;
-        poller->timer.it_value.tv_usec = INITIAL_TIMER_DELAY;
+        if (poller->rt_priority > 0)
+        {
+            struct sched_param param;
+            memset(&param, 0, sizeof(param));
+            param.sched_priority = poller->rt_priority;
+            status = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+            if (0 == status)
+                status = pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+            if (0 == status)
+                status = pthread_attr_setschedparam(&attr, &param);
+            if (0 != status)
+                poli_log(WARNING, monitor, "Failed to set real-time priority %d for sampler thread: %s", poller->rt_priority, strerror(status));
+        }
 
-        poller->timer.it_interval.tv_sec = 0;
-        poller->timer.it_interval.tv_usec = POLL_INTERVAL * 1000000;
+        poller->timer_on = 1;
 
-        status = setitimer(ITIMER_REAL, &poller->timer, NULL);
+        status = pthread_create(&poller->thread, &attr, &poller_thread, NULL);
+        //without the permission for real-time scheduling or with a cpu that isn't available, it runs like any other thread
+        if (0 != status && (poller->cpu >= 0 || poller->rt_priority > 0))
+        {
+            poli_log(WARNING, monitor, "Failed to start sampler thread on cpu %d with real-time priority %d: %s. Starting it without them",
+                poller->cpu, poller->rt_priority, strerror(status));
+            status = pthread_create(&poller->thread, NULL, &poller_thread, NULL);
+        }
+        pthread_attr_destroy(&attr);
         if (0 != status)
         {
-            poli_log(ERROR, monitor,   "Failed to set timer: %s", strerror(errno));
+            poller->timer_on = 0;
+            poli_log(ERROR, monitor,   "Failed to start sampler thread: %s", strerror(status));
             return 1;
         }
     }
     return 0;
 }
 
+static int get_env_double (char *name, double *value, char *unit)
+{
+    char *str = getenv(name);
+    if (str == NULL)
+        return 0;
+
+    char *end;
+    double number = strtod(str, &end);
+    if (end == str || *end != '\0' || !isfinite(number))
+    {
+        poli_log(WARNING, monitor, "Ignoring invalid %s=%s. It must be a finite number, using %lf %s", name, str, *value, unit);
+        return 0;
+    }
+    *value = number;
+    return 1;
+}
+
 static int stop_timer (void)
 {
+    if (!poller->timer_on)
+        return 0;
+
     poller->timer_on = 0;
-    sigaction(SIGALRM, &poller->sa, NULL);
+    // the sampler thread can only be cancelled while it sleeps between two samples
+    pthread_cancel(poller->thread);
+    pthread_join(poller->thread, NULL);
+    return 0;
+}
+
+static void *poller_thread (void *arg)
+{
+    (void) arg;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
-    poller->timer.it_value.tv_sec = 0;
-    poller->timer.it_value.tv_usec = 0;
+    double initial_delay = INITIAL_TIMER_DELAY / 1000000.0;
+    if (poller->interval < initial_delay)
+        initial_delay = poller->interval;
 
-    poller->timer.it_interval.tv_sec = 0;
-    poller->timer.it_interval.tv_usec = 0;
+    clock_gettime(CLOCK_MONOTONIC, &poller->next_poll);
+    timespec_add_seconds(&poller->next_poll, initial_delay);
 
-    setitimer(ITIMER_REAL, &poller->timer, NULL);
-    return 0;
+    while (poller->timer_on)
+    {
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        int status = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &poller->next_poll, NULL);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (status == EINTR)
+            continue;
+        if (!poller->timer_on)
+            break;
+
+        timer_handler();
+
+        double interval = poller->interval;
+        timespec_add_seconds(&poller->next_poll, interval);
+
+        //if a sample took longer than the interval, skip the missed ticks instead of sampling in a burst
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > poller->next_poll.tv_sec ||
+            (now.tv_sec == poller->next_poll.tv_sec && now.tv_nsec > poller->next_poll.tv_nsec))
+        {
+            poller->next_poll = now;
+            timespec_add_seconds(&poller->next_poll, interval);
+        }
+    }
+    return NULL;
 }
 
-static void init_energy_reading (struct energy_reading *reading)
+static double get_sample_power (struct system_poll_info *info)
 {
-    struct rapl_energy rapl_energy = {0};
-    reading->rapl_energy = rapl_energy;
 #ifdef _CRAY
-    struct cray_measurement cray_meas = {0};
-    reading->cray_meas = cray_meas;
+    return info->computed_power.cray_meas.node_measured_power;
+#elif _BGQ
+    return info->current_energy.bgq_meas.card_power;
 #else
-#ifdef _BGQ
-    struct bgq_measurement bgq_meas = {0};
-    reading->bgq_meas = bgq_meas;
+    return info->computed_power.rapl_energy.package;
 #endif
-#endif
-    return;
 }
 
-static void timer_handler (int signum)
+/* picks the next interval from how much power changed since the previous sample */
+static void adapt_poll_interval (struct system_poll_info *info)
+{
+    double power = get_sample_power(info);
+    double last_power = poller->last_power;
+    poller->last_power = power;
+
+    if (!poller->adaptive || info->counter == 0)
+        return;
+
+    double interval = poller->interval;
+    if (fabs(power - last_power) > poller->adaptive_threshold)
+        interval /= ADAPTIVE_SPEEDUP;
+    else
+        interval *= ADAPTIVE_BACKOFF;
+
+    if (interval < poller->min_interval)
+        interval = poller->min_interval;
+    else if (interval > poller->max_interval)
+        interval = poller->max_interval;
+    poller->interval = interval;
+}
+
+static void timer_handler (void)
 {
     if (poller->timer_on && monitor->imonitor)
     {
-        if (poller->time_counter < MAX_POLL_SAMPLES)
+        double start_iter_time = get_time();
+
+        struct poli_sample *sample = poli_ring_reserve(&system_info->poll_ring);
+        if (sample == NULL)
         {
-            double start_iter_time = get_time();
-            double pcap;
+            //the writer is behind, drop this sample; the next one covers the whole period
+            poller->time_counter++;
+            return;
+        }
 
-            struct system_poll_info *info = &system_info->system_poll_list[poller->time_counter];
+        struct system_poll_info poll_info;
+        struct system_poll_info *info = &poll_info;
+        struct energy_reading last_energy;
+        double last_wtime;
 
-            struct energy_reading last_energy;
+        if (poller->time_counter > 0)
+        {
+            last_energy = poller->last_energy;
+            last_wtime = poller->last_wtime;
+        }
+        else
+        {
+            last_energy = system_info->initial_energy;
+            last_wtime = system_info->initial_mpi_wtime;
+        }
 
-            if (poller->time_counter > 0)
-                last_energy = system_info->system_poll_list[poller->time_counter-1].current_energy;
-            else
-                init_energy_reading(&last_energy);
+        info->counter = poller->time_counter;
 
-            int zone;
-            for (zone = 0; zone < system_info->sysmsr->num_zones; zone++)
-            {
-                info->pcap_info_list[zone] = system_info->current_pcap_list[zone];
-            }
+        get_current_frequency(info);
+        info->current_energy = read_current_energy(system_info);
+        info->last_energy = last_energy;
+        // the sample time is taken right after the counters are read so power uses the actual elapsed time
+        info->wtime = get_time();
 
-            info->counter = poller->time_counter;
+        info->interval = info->wtime - last_wtime;
+        compute_current_power(info, info->interval);
+        adapt_poll_interval(info);
+        poli_job_power_update(&job_power, info->wtime - system_info->initial_mpi_wtime, get_sample_power(info));
+        update_power_budget(info);
 
-            info->pkg_pcap = system_info->current_pcap_list[PACKAGE_INDEX].watts_long;
-            get_current_frequency(info);
-            info->current_energy = read_current_energy(system_info);
-            info->last_energy = last_energy;
+        info->poll_iter_time = get_time() - start_iter_time;
 
-            if (poller->time_counter == 0)
-                compute_current_power(info, system_info->initial_mpi_wtime, system_info);
-            else
-                compute_current_power(info, ((double) POLL_INTERVAL), system_info);
+        poller->last_energy = info->current_energy;
+        poller->last_wtime = info->wtime;
 
-            info->wtime = get_time();
-            info->poll_iter_time = info->wtime - start_iter_time;
+        //only the fields of the schema are stored, power is derived again from the energy when the samples are written out
+        poli_sample_pack(&system_info->sample_schema, sample, info);
+        //publishes the sample to every reader
+        poli_ring_commit(&system_info->poll_ring);
 
-            poller->time_counter++;
-        }
+        poller->time_counter++;
     }
     return;
 }
@@ -1220,23 +2718,16 @@ void timer_handler_em (void)
             #endif
             }
 
-            int zone;
-            for (zone = 0; zone < system_info->sysmsr->num_zones; zone++)
-            {
-                info->pcap_info_list[zone] = system_info->current_pcap_list[zone];
-            }
-
             info->counter = time_counter_em;
 
-            info->pkg_pcap = system_info->current_pcap_list[PACKAGE_INDEX].watts_long;
             get_current_frequency(info);
             info->current_energy = read_current_energy(system_info);
             info->last_energy = last_energy;
 
             if (time_counter == 0)
-                compute_current_power(info, system_info->initial_mpi_wtime, system_info);
+                compute_current_power(info, system_info->initial_mpi_wtime);
             else
-                compute_current_power(info, ((double) POLL_INTERVAL), system_info);
+                compute_current_power(info, poller->interval);
 
             info->current_energy.rapl_energy.package, info->current_energy.rapl_energy.dram, info->computed_power.rapl_energy.package, info->computed_power.rapl_energy.dram,
             info->current_energy.cray_meas.node_energy, info->current_energy.cray_meas.cpu_energy, info->current_energy.cray_meas.memory_energy,
@@ -1259,25 +2750,126 @@ void timer_handler_em (void)
 /*              HELPERS                                                       */
 /******************************************************************************/
 
+/* index of the next sample; the sampler publishes it through the ring so it can be read from any thread */
+static int get_timer_count (void)
+{
+#ifndef _TIMER_OFF
+    if (poller->timer_on)
+        return (int) poli_ring_offered(&system_info->poll_ring);
+#endif
+    return poller->time_counter;
+}
+
+static void timespec_add_seconds (struct timespec *ts, double seconds)
+{
+    double intpart;
+    double frac = modf(seconds, &intpart);
+    ts->tv_sec += (time_t) intpart;
+    ts->tv_nsec += (long) (frac * 1e9);
+    if (ts->tv_nsec >= 1000000000L)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static int start_wrap_guard (void)
+{
+    system_info->wrap_guard_on = 0;
+    system_info->wrap_guard_period = rapl_wrap_guard_period(system_info);
+
+    char *guard_str = getenv("PoLi_WRAP_GUARD");
+    if (guard_str != NULL && atoi(guard_str) == 0)
+    {
+        poli_log(DEBUG, monitor, "Wrap guard is disabled");
+        return 0;
+    }
+    if (system_info->wrap_guard_period <= 0.0)
+        return 0;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&system_info->wrap_guard_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&system_info->wrap_guard_lock, NULL);
+
+    system_info->wrap_guard_on = 1;
+    int status = pthread_create(&system_info->wrap_guard, NULL, &wrap_guard_thread, NULL);
+    if (0 != status)
+    {
+        system_info->wrap_guard_on = 0;
+        pthread_cond_destroy(&system_info->wrap_guard_cond);
+        pthread_mutex_destroy(&system_info->wrap_guard_lock);
+        poli_log(ERROR, monitor, "Failed to start wrap guard thread: %s. Energy of long tags may be wrong.", strerror(status));
+        return 1;
+    }
+
+    poli_log(DEBUG, monitor, "Wrap guard reads energy at least every %lf s", system_info->wrap_guard_period);
+    return 0;
+}
+
+static int stop_wrap_guard (void)
+{
+    if (!system_info->wrap_guard_on)
+        return 0;
+
+    pthread_mutex_lock(&system_info->wrap_guard_lock);
+    system_info->wrap_guard_on = 0;
+    pthread_cond_signal(&system_info->wrap_guard_cond);
+    pthread_mutex_unlock(&system_info->wrap_guard_lock);
+    pthread_join(system_info->wrap_guard, NULL);
+
+    pthread_cond_destroy(&system_info->wrap_guard_cond);
+    pthread_mutex_destroy(&system_info->wrap_guard_lock);
+    return 0;
+}
+
+/* sleeps until a wrap guard period has passed since the last energy read, by anyone, and only reads if nobody did in the meantime */
+static void *wrap_guard_thread (void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&system_info->wrap_guard_lock);
+    while (system_info->wrap_guard_on)
+    {
+        pthread_mutex_lock(&system_info->energy_lock);
+        struct timespec deadline = system_info->last_energy_read;
+        pthread_mutex_unlock(&system_info->energy_lock);
+        timespec_add_seconds(&deadline, system_info->wrap_guard_period);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+        {
+            //never read energy while holding the wrap guard lock, stop_wrap_guard must not wait for a read
+            pthread_mutex_unlock(&system_info->wrap_guard_lock);
+            read_current_energy(system_info);
+            pthread_mutex_lock(&system_info->wrap_guard_lock);
+            continue;
+        }
+
+        pthread_cond_timedwait(&system_info->wrap_guard_cond, &system_info->wrap_guard_lock, &deadline);
+    }
+    pthread_mutex_unlock(&system_info->wrap_guard_lock);
+
+    return NULL;
+}
+
 static double get_time (void)
 {
 #ifndef _NOMPI
     return MPI_Wtime();
 #else
-    return (double) time(NULL);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
 #endif
 }
 
-static int compute_current_power (struct system_poll_info * info, double time, struct system_info_t * system_info)
+static int compute_current_power (struct system_poll_info * info, double time)
 {
-    if (time == system_info->initial_mpi_wtime)
-        rapl_compute_total_power(&(info->computed_power.rapl_energy), &(info->current_energy.rapl_energy), time);
-    else
-    {
-        struct rapl_energy diff;
-        rapl_compute_total_energy(&(diff), &(info->current_energy.rapl_energy), &(info->last_energy.rapl_energy));
-        rapl_compute_total_power(&(info->computed_power.rapl_energy), &(diff), time);
-    }
+    struct energy_reading diff;
+    compute_rapl_totals(&(diff), &(info->computed_power), &(info->current_energy), &(info->last_energy), time);
 #ifdef _CRAY
     compute_cray_total_measurements(&(info->computed_power.cray_meas), &(info->current_energy.cray_meas), &(info->last_energy.cray_meas), time);
 #elif _BGQ
@@ -1289,13 +2881,17 @@ static int compute_current_power (struct system_poll_info * info, double time, s
 static struct energy_reading read_current_energy (struct system_info_t * system_info)
 {
     struct energy_reading current_energy;
-    rapl_read_energy(&(current_energy.rapl_energy), system_info);
+    /* energy counters track overflows, so reads from the sampler thread and the application must not interleave */
+    pthread_mutex_lock(&system_info->energy_lock);
+    rapl_read_energy(&(current_energy.rapl_energy), current_energy.rapl_socket_energy, system_info);
+    clock_gettime(CLOCK_MONOTONIC, &system_info->last_energy_read);
 #ifdef _CRAY
     get_cray_measurement(&(current_energy.cray_meas), system_info);
 #elif _BGQ
     init_bgq_measurement(&(current_energy.bgq_meas));
     get_bgq_measurement(&(current_energy.bgq_meas), system_info);
 #endif
+    pthread_mutex_unlock(&system_info->energy_lock);
     return current_energy;
 }
 
@@ -1322,56 +2918,33 @@ static void poli_sync_node (void)
 }
 
 
-static void get_timestamp(double time_from_start, char *time_str_buffer, size_t buff_len)
+static time_t get_timestamp (double time_from_start)
 {
     double frac, intpart;
     int64_t fracpart;
-    struct timeval cur_time;
-
-    char time_str[8192];
-    memset(time_str, '\0', 8192);
-    char *time_str_ptr;
+    time_t second;
 
     frac = modf(time_from_start, &intpart);
-    cur_time.tv_sec = system_info->initial_start_time.tv_sec + (int64_t) intpart;
+    second = system_info->initial_start_time.tv_sec + (int64_t) intpart;
     fracpart = (int32_t) (frac * 1000000.0);
 
-    if ((system_info->initial_start_time.tv_usec + fracpart) >= 1e6) {
-        cur_time.tv_usec = (system_info->initial_start_time.tv_usec + fracpart - 1e6);
-        cur_time.tv_sec++;
-    }
-    else {
-        cur_time.tv_usec = system_info->initial_start_time.tv_usec + fracpart;
-    }
-
-    time_t rawtime = (time_t)cur_time.tv_sec;
-    struct tm *timeinfo = localtime(&rawtime);
-
-    strftime (time_str_buffer, buff_len, "%Y-%m-%d %H:%M:%S", timeinfo);
+    if ((system_info->initial_start_time.tv_usec + fracpart) >= 1e6)
+        second++;
 
-    return;
+    return second;
+}
 
+static void get_output_path (char *filename, char *extension, char *path, size_t len)
+{
+    char *prefix = getenv("PoLi_PREFIX");
+    snprintf(path, len, "%s%s_%s_%s.%s", (prefix != NULL) ? prefix : "", filename, monitor->my_host, monitor->jobid, extension);
 }
 
-static FILE * open_file (char *filename)
+static int open_file (char *filename, struct text_writer *out)
 {
-    FILE * fp;
-    char *prefix;
-    prefix = getenv("PoLi_PREFIX");
     char file[1000];
-    if (prefix != NULL)
-        sprintf(file, "%s%s_%s_%s.txt", prefix, filename, monitor->my_host, monitor->jobid);
-    else
-        sprintf(file, "%s_%s_%s.txt", filename, monitor->my_host, monitor->jobid);
-
-    fp = fopen(file, "w");
-    if (!fp)
-    {
-        poli_log(ERROR, monitor,   "Failed to open file %s: %s", file, strerror(errno));
-        fclose(fp);
-        return NULL;
-    }
-    return fp;
+    get_output_path(filename, "txt", file, sizeof(file));
+    return poli_text_open(out, file);
 }
 
 int get_zone_index (char *zone_name)
@@ -1442,20 +3015,89 @@ int coordsToInt (int *coords, int dim)
     return res;
 }
 
-static int compute_power_from_tag(struct poli_tag *tag, double time)
+static struct pcap_info *get_current_pcap (int socket, int zone_index)
 {
-    rapl_compute_total_energy(&(tag->total_energy.rapl_energy), &(tag->end_energy.rapl_energy), &(tag->start_energy.rapl_energy));
-    rapl_compute_total_power(&(tag->total_power.rapl_energy), &(tag->total_energy.rapl_energy), time);
-#ifdef _CRAY
-    compute_cray_total_measurements(&(tag->total_energy.cray_meas), &(tag->end_energy.cray_meas), &(tag->start_energy.cray_meas), time);
-#elif _BGQ
-    compute_bgq_total_measurements(&(tag->total_energy.bgq_meas), &(tag->end_energy.bgq_meas), &(tag->start_energy.bgq_meas), time);
-#endif
-
-    return 0;
+    return &system_info->current_pcap_list[socket * NUM_ZONES + zone_index];
 }
 
-/*                  END OF HELPERS                                            */
+static int record_pcap_event (int socket, int zone_index)
+{
+    struct pcap_info *info = get_current_pcap(socket, zone_index);
+
+    //power caps start out as 0 until they are read
+    double last_long = 0.0, last_short = 0.0;
+    int event;
+    for (event = system_info->num_pcap_events - 1; event >= 0; event--)
+    {
+        struct pcap_event *e = &system_info->pcap_events[event];
+        if (e->socket == socket && e->zone_index == zone_index)
+        {
+            last_long = e->watts_long;
+            last_short = e->watts_short;
+            break;
+        }
+    }
+    if (info->watts_long == last_long && info->watts_short == last_short)
+        return 0;
+
+    if (system_info->num_pcap_events == system_info->max_pcap_events)
+    {
+        int max_events = system_info->max_pcap_events ? 2 * system_info->max_pcap_events : MAX_SOCKETS * NUM_ZONES;
+        struct pcap_event *events = realloc(system_info->pcap_events, max_events * sizeof(struct pcap_event));
+        if (events == NULL)
+        {
+            poli_log(ERROR, monitor, "%s: Failed to allocate power cap events. The polling file may show outdated power caps.", __FUNCTION__);
+            return 1;
+        }
+        system_info->pcap_events = events;
+        system_info->max_pcap_events = max_events;
+    }
+
+    struct pcap_event *e = &system_info->pcap_events[system_info->num_pcap_events++];
+    e->counter = get_timer_count();
+    e->socket = socket;
+    e->zone_index = zone_index;
+    e->watts_long = info->watts_long;
+    e->watts_short = info->watts_short;
+
+    return 0;
+}
+
+static int get_num_sockets (void)
+{
+    int num_sockets = system_info->sysmsr->total_packages;
+    if (num_sockets > MAX_SOCKETS)
+        num_sockets = MAX_SOCKETS;
+    return num_sockets;
+}
+
+static void compute_rapl_totals (struct energy_reading *total_energy, struct energy_reading *total_power,
+    struct energy_reading *end, struct energy_reading *start, double time)
+{
+    rapl_compute_total_energy(&(total_energy->rapl_energy), &(end->rapl_energy), &(start->rapl_energy));
+    rapl_compute_total_power(&(total_power->rapl_energy), &(total_energy->rapl_energy), time);
+
+    int socket;
+    for (socket = 0; socket < get_num_sockets(); socket++)
+    {
+        rapl_compute_total_energy(&(total_energy->rapl_socket_energy[socket]), &(end->rapl_socket_energy[socket]), &(start->rapl_socket_energy[socket]));
+        rapl_compute_total_power(&(total_power->rapl_socket_energy[socket]), &(total_energy->rapl_socket_energy[socket]), time);
+    }
+}
+
+static int compute_power_from_tag(struct poli_tag *tag, double time)
+{
+    compute_rapl_totals(&(tag->total_energy), &(tag->total_power), &(tag->end_energy), &(tag->start_energy), time);
+#ifdef _CRAY
+    compute_cray_total_measurements(&(tag->total_energy.cray_meas), &(tag->end_energy.cray_meas), &(tag->start_energy.cray_meas), time);
+#elif _BGQ
+    compute_bgq_total_measurements(&(tag->total_energy.bgq_meas), &(tag->end_energy.bgq_meas), &(tag->start_energy.bgq_meas), time);
+#endif
+
+    return 0;
+}
+
+/*                  END OF HELPERS                                            */
 
 /******************************************************************************/
 /*                  FINALIZING/CLEANUP                                        */
@@ -1466,6 +3108,44 @@ static int file_handler (void)
     int ret = 0;
     if (monitor->imonitor)
     {
+        //the binary file is written by default, the text files are an optional export
+        int binary = 1, text = 0, shared = 0;
+        char *output_str = getenv("PoLi_OUTPUT");
+        if (output_str != NULL && strcmp(output_str, "text") == 0)
+        {
+            binary = 0;
+            text = 1;
+        }
+        else if (output_str != NULL && strcmp(output_str, "both") == 0)
+            text = 1;
+        else if (output_str != NULL && strcmp(output_str, "shared") == 0)
+        {
+#ifndef _NOMPI
+            binary = 0;
+            shared = 1;
+#else
+            (void) shared;
+            poli_log(WARNING, monitor, "PoLi_OUTPUT=shared needs MPI, the binary file will be written instead");
+#endif
+        }
+        else if (output_str != NULL && strcmp(output_str, "binary") != 0)
+            poli_log(WARNING, monitor, "Unknown output format PoLi_OUTPUT=%s, only the binary file will be written", output_str);
+
+        if (binary && binary_output_to_file() != 0)
+        {
+            ret = 1;
+            poli_log(ERROR, monitor,   "Something went wrong with writing the binary output");
+        }
+#ifndef _NOMPI
+        if (shared && shared_output_to_file() != 0)
+        {
+            ret = 1;
+            poli_log(ERROR, monitor,   "Something went wrong with writing the job file");
+        }
+#endif
+        if (!text)
+            return ret;
+
         if (polling_info_to_file() != 0)
         {
             ret = 1;
@@ -1479,6 +3159,18 @@ static int file_handler (void)
                 poli_log(ERROR, monitor,   "Something went wrong with writing energy tags to file\n");
             }
         }
+        int handle;
+        for (handle = 0; handle < tag_registry.num_names; handle++)
+            if (tag_registry.summaries[handle])
+                break;
+        if (handle < tag_registry.num_names)
+        {
+            if (tag_stats_to_file() != 0)
+            {
+                ret = (ret || 1);
+                poli_log(ERROR, monitor,   "Something went wrong with writing tag statistics to file\n");
+            }
+        }
         if (system_info->num_pcap_tags > 0)
         {
             if (pcap_tags_to_file() != 0)
@@ -1491,107 +3183,232 @@ static int file_handler (void)
     return ret;
 }
 
+static void write_tag_row (struct text_writer *out, char *tag_name, double start_offset, double end_offset, double total_time,
+    struct energy_reading *energy, struct energy_reading *power)
+{
+    int socket;
+    int num_sockets = get_num_sockets();
+
+    poli_text_puts(out, tag_name);
+    poli_text_putc(out, '\t');
+    poli_text_date(out, get_timestamp(start_offset));
+    poli_text_putc(out, '\t');
+    double times[3] = {start_offset, end_offset, total_time};
+    poli_text_doubles(out, times, 3);
+    poli_text_putc(out, '\t');
+
+    if (!system_info->sysmsr->error_state)
+    {
+        struct rapl_energy total_energy = energy->rapl_energy;
+        struct rapl_energy total_power = power->rapl_energy;
+        double totals[10] = {total_energy.package, total_energy.pp0, total_energy.pp1, total_energy.platform, total_energy.dram,
+            total_power.package, total_power.pp0, total_power.pp1, total_power.platform, total_power.dram};
+        poli_text_doubles(out, totals, 10);
+        if (num_sockets > 1)
+        {
+            for (socket = 0; socket < num_sockets; socket++)
+            {
+                struct rapl_energy *socket_energy = &(energy->rapl_socket_energy[socket]);
+                struct rapl_energy *socket_power = &(power->rapl_socket_energy[socket]);
+                double socket_totals[8] = {socket_energy->package, socket_energy->pp0, socket_energy->pp1, socket_energy->dram,
+                    socket_power->package, socket_power->pp0, socket_power->pp1, socket_power->dram};
+                poli_text_putc(out, '\t');
+                poli_text_doubles(out, socket_totals, 8);
+            }
+        }
+    }
+#ifdef _CRAY
+    struct cray_measurement total_measurements = energy->cray_meas;
+    double cray_totals[9] = {total_measurements.node_energy, total_measurements.cpu_energy, total_measurements.memory_energy,
+        total_measurements.node_power, total_measurements.cpu_power, total_measurements.memory_power,
+        total_measurements.node_measured_power, total_measurements.cpu_measured_power, total_measurements.memory_measured_power};
+    poli_text_putc(out, '\t');
+    poli_text_doubles(out, cray_totals, 9);
+    poli_text_putc(out, '\n');
+#else
+#ifdef _BGQ
+    struct bgq_measurement bgq_meas = energy->bgq_meas;
+    write_bgq_output(out, &bgq_meas);
+#endif
+    poli_text_putc(out, '\n');
+#endif
+}
+
+static void get_summary_totals (struct tag_summary *summary, struct energy_reading *total_energy, struct energy_reading *total_power)
+{
+    struct sample_schema *schema = &system_info->sample_schema;
+    struct poli_sample energy, power;
+    int column;
+    for (column = 0; column < schema->num_columns; column++)
+    {
+        energy.values[column] = -1.0;
+        power.values[column] = -1.0;
+        if (summary->energy[column].count > 0)
+        {
+            energy.values[column] = summary->energy[column].total;
+            if (summary->time.total > 0)
+                power.values[column] = summary->energy[column].total / summary->time.total;
+        }
+    }
+    poli_sample_get_energy(schema, &energy, total_energy);
+    poli_sample_get_energy(schema, &power, total_power);
+#ifdef _CRAY
+    total_energy->cray_meas.node_measured_power = total_power->cray_meas.node_energy;
+    total_energy->cray_meas.cpu_measured_power = total_power->cray_meas.cpu_energy;
+    total_energy->cray_meas.memory_measured_power = total_power->cray_meas.memory_energy;
+#endif
+}
+
+static void get_tag_times (struct poli_tag *tag, double *start_offset, double *end_offset, double *total_time)
+{
+    *total_time = tag->end_time - tag->start_time;
+    *end_offset = 0.0;
+    if (strcmp(tag->tag_name, "application_summary") == 0 && *total_time < 0)
+    {
+        *total_time = get_time() - system_info->initial_mpi_wtime;
+        *end_offset = *total_time;
+    }
+
+    compute_power_from_tag(tag, *total_time);
+
+    if (strcmp(tag->tag_name, "application_summary") == 0)
+    {
+        *start_offset = 0.0;
+        if (*end_offset == 0.0)
+            *end_offset = tag->end_time - tag->start_time;
+    }
+    else
+    {
+        *start_offset = tag->start_time - system_info->initial_mpi_wtime;
+        *end_offset = tag->end_time - system_info->initial_mpi_wtime;
+    }
+}
+
 int poli_tags_to_file (void)
 {
     if (monitor->imonitor)
     {
-        FILE *fp = open_file("PoLiMEr_energy-tags");
-        if (fp == NULL)
+        struct text_writer out;
+        if (open_file("PoLiMEr_energy-tags", &out) != 0)
             return 1;
 
+        int socket;
+        int num_sockets = get_num_sockets();
 #ifndef _HEADER_OFF
-        fprintf(fp, "Tag Name\tTimestamp\tStart Time (s)\tEnd Time (s)\tTotal Time (s)\t");
+        poli_text_puts(&out, "Tag Name\tTimestamp\tStart Time (s)\tEnd Time (s)\tTotal Time (s)\t");
         if (!system_info->sysmsr->error_state)
         {
-            fprintf(fp, "Total RAPL pkg E (J)\tTotal RAPL PP0 E (J)\tTotal RAPL PP1 E (J)\tTotal RAPL platform E (J)\tTotal RAPL dram E (J)\t");
-            fprintf(fp, "Total RAPL pkg P (W)\tTotal RAPL PP0 P (W)\tTotal RAPL PP1 P (W)\tTotal RAPL platform P (W)\tTotal RAPL dram P (W)");
+            poli_text_puts(&out, "Total RAPL pkg E (J)\tTotal RAPL PP0 E (J)\tTotal RAPL PP1 E (J)\tTotal RAPL platform E (J)\tTotal RAPL dram E (J)\t");
+            poli_text_puts(&out, "Total RAPL pkg P (W)\tTotal RAPL PP0 P (W)\tTotal RAPL PP1 P (W)\tTotal RAPL platform P (W)\tTotal RAPL dram P (W)");
+            if (num_sockets > 1)
+            {
+                for (socket = 0; socket < num_sockets; socket++)
+                {
+                    poli_text_printf(&out, "\tTotal RAPL pkg%d E (J)\tTotal RAPL PP0 pkg%d E (J)\tTotal RAPL PP1 pkg%d E (J)\tTotal RAPL dram pkg%d E (J)", socket, socket, socket, socket);
+                    poli_text_printf(&out, "\tTotal RAPL pkg%d P (W)\tTotal RAPL PP0 pkg%d P (W)\tTotal RAPL PP1 pkg%d P (W)\tTotal RAPL dram pkg%d P (W)", socket, socket, socket, socket);
+                }
+            }
         }
 #ifdef _CRAY
-        fprintf(fp, "\tTotal Cray node E (J)\tTotal Cray cpu E (J)\tTotal Cray memory E (J)\t");
-        fprintf(fp, "Total Cray node P (W)\tTotal Cray cpu P (W)\tTotal Cray memory P (W)\t");
-        fprintf(fp, "Total Cray node calc P (W)\tTotal Cray cpu calc P (W)\tTotal Cray memory calc P (W)");
+        poli_text_puts(&out, "\tTotal Cray node E (J)\tTotal Cray cpu E (J)\tTotal Cray memory E (J)\t");
+        poli_text_puts(&out, "Total Cray node P (W)\tTotal Cray cpu P (W)\tTotal Cray memory P (W)\t");
+        poli_text_puts(&out, "Total Cray node calc P (W)\tTotal Cray cpu calc P (W)\tTotal Cray memory calc P (W)");
 #endif
 #ifdef _BGQ
-        write_bgq_header(&fp);
+        write_bgq_header(&out);
 #endif
-        fprintf(fp, "\n");
+        poli_text_putc(&out, '\n');
 #endif
         int tag_num;
         for (tag_num = 0; tag_num < system_info->num_poli_tags; tag_num++)
         {
-            struct poli_tag *tag = &system_info->poli_tag_list[tag_num];
-
-            double total_time = tag->end_time - tag->start_time;
-            double start_offset, end_offset = 0.0;
-            if (strcmp(tag->tag_name, "application_summary") == 0 && total_time < 0)
-            {
-                total_time = get_time() - system_info->initial_mpi_wtime;
-                end_offset = total_time;
-            }
+            struct poli_tag *tag = get_poli_tag(tag_num);
+            double start_offset, end_offset, total_time;
+            get_tag_times(tag, &start_offset, &end_offset, &total_time);
+            write_tag_row(&out, tag->tag_name, start_offset, end_offset, total_time, &tag->total_energy, &tag->total_power);
+        }
 
-            compute_power_from_tag(tag, total_time);
+        //one row per aggregated tag, with the totals over all its instances
+        int handle;
+        for (handle = 0; handle < tag_registry.num_names; handle++)
+        {
+            struct tag_summary *summary = tag_registry.summaries[handle];
+            if (summary == NULL)
+                continue;
+            struct energy_reading total_energy, total_power;
+            get_summary_totals(summary, &total_energy, &total_power);
+            write_tag_row(&out, tag_registry.names[handle], summary->first_start - system_info->initial_mpi_wtime,
+                summary->last_end - system_info->initial_mpi_wtime, summary->time.total, &total_energy, &total_power);
+        }
+        poli_text_close(&out);
+    }
 
-            if (strcmp(tag->tag_name, "application_summary") == 0)
-            {
-                start_offset = 0.0;
-                if (end_offset == 0.0)
-                    end_offset = tag->end_time - tag->start_time;
-            }
-            else
-            {
-                start_offset = tag->start_time - system_info->initial_mpi_wtime;
-                end_offset = tag->end_time - system_info->initial_mpi_wtime;
-            }
+    return 0;
+}
 
-            char time_str_buffer[20];
-            get_timestamp(start_offset, time_str_buffer, sizeof(time_str_buffer));
+static int tag_stats_to_file (void)
+{
+    if (monitor->imonitor)
+    {
+        struct text_writer out;
+        if (open_file("PoLiMEr_tag-stats", &out) != 0)
+            return 1;
 
-            fprintf(fp, "%s\t%s\t%lf\t%lf\t%lf\t", tag->tag_name, time_str_buffer, start_offset, end_offset, total_time);
+#ifndef _HEADER_OFF
+        poli_text_puts(&out, "Tag Name\tQuantity\tCount\tTotal\tMin\tMax\tMean\tVariance\n");
+#endif
+        struct sample_schema *schema = &system_info->sample_schema;
+        int handle, column;
+        for (handle = 0; handle < tag_registry.num_names; handle++)
+        {
+            struct tag_summary *summary = tag_registry.summaries[handle];
+            if (summary == NULL)
+                continue;
 
-            if (!system_info->sysmsr->error_state)
+            char *name = tag_registry.names[handle];
+            write_stats_row(&out, name, "Time (s)", &summary->time);
+            for (column = 0; column < schema->num_columns; column++)
             {
-                struct rapl_energy total_energy = tag->total_energy.rapl_energy;
-                struct rapl_energy total_power = tag->total_power.rapl_energy;
-                fprintf(fp, "%lf\t%lf\t%lf\t%lf\t%lf\t", total_energy.package, total_energy.pp0, total_energy.pp1, total_energy.platform, total_energy.dram);
-                fprintf(fp, "%lf\t%lf\t%lf\t%lf\t%lf", total_power.package, total_power.pp0, total_power.pp1, total_power.platform, total_power.dram);
+                if (!schema->is_energy[column])
+                    continue;
+                char field_name[32];
+                char quantity[48];
+                poli_sample_field_name(schema->field[column], field_name, sizeof(field_name));
+                snprintf(quantity, sizeof(quantity), "%s E (J)", field_name);
+                write_stats_row(&out, name, quantity, &summary->energy[column]);
+                snprintf(quantity, sizeof(quantity), "%s P (W)", field_name);
+                write_stats_row(&out, name, quantity, &summary->power[column]);
             }
-#ifdef _CRAY
-            struct cray_measurement total_measurements = tag->total_energy.cray_meas;
-            fprintf(fp, "\t%lf\t%lf\t%lf\t", total_measurements.node_energy, total_measurements.cpu_energy, total_measurements.memory_energy);
-            fprintf(fp, "%lf\t%lf\t%lf\t", total_measurements.node_power, total_measurements.cpu_power, total_measurements.memory_power);
-            fprintf(fp, "%lf\t%lf\t%lf\n", total_measurements.node_measured_power, total_measurements.cpu_measured_power, total_measurements.memory_measured_power);
-#else
-#ifdef _BGQ
-            struct bgq_measurement bgq_meas = tag->total_energy.bgq_meas;
-            printf("\t%lf\n", bgq_meas.card_power);
-            printf("%lf\n", bgq_meas.cpu);
-            printf("%lf\n", bgq_meas.dram);
-            printf("%lf\n", bgq_meas.optics);
-            printf("%lf\n", bgq_meas.pci);
-            printf("%lf\n", bgq_meas.network);
-            printf("%lf\n", bgq_meas.link_chip);
-            printf("%lf\n", bgq_meas.sram);
-            write_bgq_output(&fp, &bgq_meas);
-#endif
-            fprintf(fp, "\n");
-#endif
         }
-        fclose(fp);
+        poli_text_close(&out);
     }
 
     return 0;
 }
 
+static void write_stats_row (struct text_writer *out, char *tag_name, char *quantity, struct running_stats *stats)
+{
+    poli_text_puts(out, tag_name);
+    poli_text_putc(out, '\t');
+    poli_text_puts(out, quantity);
+    poli_text_putc(out, '\t');
+    poli_text_int(out, stats->count);
+    poli_text_putc(out, '\t');
+    double values[5] = {stats->total, stats->min, stats->max, stats->mean, poli_stats_variance(stats)};
+    poli_text_doubles(out, values, 5);
+    poli_text_putc(out, '\n');
+}
+
 int pcap_tags_to_file (void)
 {
     if (monitor->imonitor)
     {
-        FILE *fp = open_file("PoLiMEr_powercap-tags");
-        if (fp == NULL)
+        struct text_writer out;
+        if (open_file("PoLiMEr_powercap-tags", &out) != 0)
             return 1;
 
 #ifndef _HEADER_OFF
-        fprintf(fp, "Tag ID\tZone\tTimestamp\tPower Cap Long (W)\tPower Cap Short (W)\tTime Window Long (s)\tTime Window Short (s)\tTime since start (s)\tPCAP FLAG\tNumber of active poli tags\tEmon tag list\n");
+        poli_text_puts(&out, "Tag ID\tZone\tTimestamp\tPower Cap Long (W)\tPower Cap Short (W)\tTime Window Long (s)\tTime Window Short (s)\tTime since start (s)\tPCAP FLAG\tPackage\tNumber of active poli tags\tEmon tag list\n");
 #endif
 
         int tag_num;
@@ -1600,26 +3417,38 @@ int pcap_tags_to_file (void)
             struct pcap_tag *tag = &system_info->pcap_tag_list[tag_num];
             double start_offset = tag->wtime - system_info->initial_mpi_wtime;
 
-            char time_str_buffer[20];
-            get_timestamp(start_offset, time_str_buffer, sizeof(time_str_buffer));
-
-            fprintf(fp, "%d\t%s\t%s\t%lf\t%lf\t%lf\t%lf\t%lf\t%d\t%d\t", tag->id,
-                tag->zone, time_str_buffer, tag->watts_long, tag->watts_short,
-                tag->seconds_long, tag->seconds_short, start_offset,
-                tag->pcap_flag, tag->num_active_poli_tags);
+            poli_text_int(&out, tag->id);
+            poli_text_putc(&out, '\t');
+            poli_text_puts(&out, tag->zone);
+            poli_text_putc(&out, '\t');
+            poli_text_date(&out, get_timestamp(start_offset));
+            poli_text_putc(&out, '\t');
+            double values[5] = {tag->watts_long, tag->watts_short, tag->seconds_long, tag->seconds_short, start_offset};
+            poli_text_doubles(&out, values, 5);
+            poli_text_putc(&out, '\t');
+            poli_text_int(&out, tag->pcap_flag);
+            poli_text_putc(&out, '\t');
+            if (tag->package_id == ALL_PACKAGES)
+                poli_text_puts(&out, "all");
+            else
+                poli_text_int(&out, tag->package_id);
+            poli_text_putc(&out, '\t');
+            poli_text_int(&out, tag->num_active_poli_tags);
+            poli_text_putc(&out, '\t');
 
             int i;
             for (i = 0; i < tag->num_active_poli_tags; i++)
             {
-                struct poli_tag etag = tag->active_poli_tags[i];
+                int id = system_info->active_poli_tag_ids[tag->first_active_poli_tag + i];
+                struct poli_tag *etag = get_poli_tag(id);
                 if (i < tag->num_active_poli_tags - 1)
-                    fprintf(fp, "\"%s,", etag.tag_name);
-                else
-                    fprintf(fp, "%s\"", etag.tag_name);
+                    poli_text_putc(&out, '"');
+                poli_text_puts(&out, etag->tag_name);
+                poli_text_putc(&out, (i < tag->num_active_poli_tags - 1) ? ',' : '"');
             }
-            fprintf(fp, "\n");
+            poli_text_putc(&out, '\n');
         }
-        fclose(fp);
+        poli_text_close(&out);
     }
 
     return 0;
@@ -1634,118 +3463,969 @@ static int polling_info_to_file (void)
 
 #ifndef _TIMER_OFF
 
-        FILE *fp = open_file("PoLiMEr");
-        if (fp == NULL)
+        struct text_writer out;
+        if (open_file("PoLiMEr", &out) != 0)
             return 1;
 
-        int zone;
+        int zone, socket;
+        int num_sockets = get_num_sockets();
 #ifndef _HEADER_OFF
-        fprintf(fp, "Count\tTimestamp\tTime since start (s)\t");
+        poli_text_puts(&out, "Count\tTimestamp\tTime since start (s)\tInterval (s)\t");
         if (!system_info->sysmsr->error_state)
         {
-            fprintf(fp, "RAPL pkg E (J)\tRAPL pp0 E (J)\tRAPL pp1 E (J)\tRAPL platform E (J)\tRAPL dram E (J)\t");
-            fprintf(fp, "RAPL pkg E since start (J)\tRAPL pp0 E since start (J)\tRAPL pp1 E since start (J)\tRAPL platform E since start (J)\tRAPL dram E since start (J)\t");
-            fprintf(fp, "RAPL pkg P (W)\tRAPL pp0 P (W)\tRAPL pp1 P (W)\tRAPL platform P (W)\tRAPL dram P (W)");
+            poli_text_puts(&out, "RAPL pkg E (J)\tRAPL pp0 E (J)\tRAPL pp1 E (J)\tRAPL platform E (J)\tRAPL dram E (J)\t");
+            poli_text_puts(&out, "RAPL pkg E since start (J)\tRAPL pp0 E since start (J)\tRAPL pp1 E since start (J)\tRAPL platform E since start (J)\tRAPL dram E since start (J)\t");
+            poli_text_puts(&out, "RAPL pkg P (W)\tRAPL pp0 P (W)\tRAPL pp1 P (W)\tRAPL platform P (W)\tRAPL dram P (W)");
+            if (num_sockets > 1)
+            {
+                for (socket = 0; socket < num_sockets; socket++)
+                {
+                    poli_text_printf(&out, "\tRAPL pkg%d E (J)\tRAPL pp0 pkg%d E (J)\tRAPL pp1 pkg%d E (J)\tRAPL dram pkg%d E (J)", socket, socket, socket, socket);
+                    poli_text_printf(&out, "\tRAPL pkg%d P (W)\tRAPL pp0 pkg%d P (W)\tRAPL pp1 pkg%d P (W)\tRAPL dram pkg%d P (W)", socket, socket, socket, socket);
+                }
+            }
         }
 #ifdef _CRAY
-        fprintf(fp, "\tCray node E (J)\tCray cpu E (J)\tCray memory E (J)\t");
-        fprintf(fp, "Cray node E since start (J)\tCray cpu E since start (J)\tCray memory E since start (J)\t");
-        fprintf(fp, "Cray node P (W)\tCray cpu P (W)\tCray memory P (W)\t");
-        fprintf(fp, "Cray node P calc (W)\tCray cpu P calc (W)\tCray memory P calc (W)\t");
-        fprintf(fp, "Cpufreq frequency (MHz)\tCray frequency (MHz)\t");
+        poli_text_puts(&out, "\tCray node E (J)\tCray cpu E (J)\tCray memory E (J)\t");
+        poli_text_puts(&out, "Cray node E since start (J)\tCray cpu E since start (J)\tCray memory E since start (J)\t");
+        poli_text_puts(&out, "Cray node P (W)\tCray cpu P (W)\tCray memory P (W)\t");
+        poli_text_puts(&out, "Cray node P calc (W)\tCray cpu P calc (W)\tCray memory P calc (W)\t");
+        poli_text_puts(&out, "Cpufreq frequency (MHz)\tCray frequency (MHz)\t");
 #else
 #ifdef _BGQ
-        write_bgq_header(&fp);
-        write_bgq_ediff_header(&fp);
+        write_bgq_header(&out);
+        write_bgq_ediff_header(&out);
 #endif
-        fprintf(fp, "\tCpufreq frequency (MHz)\t");
+        poli_text_puts(&out, "\tCpufreq frequency (MHz)\t");
 #endif
-        if (!system_info->sysmsr->error_state)
+        if (!system_info->sysmsr->pcap_error_state)
         {
-            for (zone = 0; zone < system_info->sysmsr->num_zones - 1; zone++)
+            for (socket = 0; socket < num_sockets; socket++)
             {
-                fprintf(fp, "%s power cap long (W)\t", zone_names[zone]);
-                fprintf(fp, "%s power cap short (W)\t", zone_names[zone]);
+                char socket_str[16] = "";
+                if (num_sockets > 1)
+                    snprintf(socket_str, sizeof(socket_str), " pkg%d", socket);
+                for (zone = 0; zone < system_info->sysmsr->num_zones; zone++)
+                {
+                    poli_text_printf(&out, "%s%s power cap long (W)\t", zone_names[zone], socket_str);
+                    poli_text_printf(&out, "%s%s power cap short (W)", zone_names[zone], socket_str);
+                    if (socket < num_sockets - 1 || zone < system_info->sysmsr->num_zones - 1)
+                        poli_text_putc(&out, '\t');
+                }
             }
-            fprintf(fp, "%s power cap long (W)\t", zone_names[system_info->sysmsr->num_zones - 1]);
-            fprintf(fp, "%s power cap short (W)\n", zone_names[system_info->sysmsr->num_zones - 1]);
         }
+        poli_text_putc(&out, '\n');
 #endif
-        int counter;
-        for (counter = 0; counter < poller->time_counter; counter++)
+        struct sample_schema *schema = &system_info->sample_schema;
+        struct sample_block block;
+        poli_ring_rewind(&system_info->poll_ring);
+        if (poli_sample_block_init(&block, schema, &system_info->initial_energy) != 0)
         {
-            if (system_info->num_poli_tags > 0)
+            poli_text_close(&out);
+            return 1;
+        }
+
+        struct rapl_energy *initial_rapl = &(system_info->initial_energy.rapl_energy);
+        double initial_energy_j[SAMPLE_RAPL_DRAM + 1] = {initial_rapl->package, initial_rapl->pp0, initial_rapl->pp1, initial_rapl->platform, initial_rapl->dram};
+
+        //power caps aren't stored with the samples, they are replayed from their change events
+        double pcap_long[MAX_SOCKETS][NUM_ZONES];
+        double pcap_short[MAX_SOCKETS][NUM_ZONES];
+        memset(pcap_long, 0, sizeof(pcap_long));
+        memset(pcap_short, 0, sizeof(pcap_short));
+        int next_event = 0;
+
+        //tag and power cap boundaries are merged with the samples in one pass
+        int num_markers = 0;
+        int next_marker = 0;
+        struct poll_marker *markers = build_poll_markers(&num_markers);
+
+        int field, i;
+        //samples are read back from the spool in the order they were taken
+        while (poli_sample_block_read(&block, schema, &system_info->poll_ring) > 0)
+        {
+            for (i = 0; i < block.num_samples; i++)
             {
-                struct poli_tag *this_end_poli_tag = get_poli_tag_for_end_time_counter(counter);
-                if (this_end_poli_tag != 0)
-                    fprintf(fp, "--- EMON TAG END: %s\n", this_end_poli_tag->tag_name);
+                //markers belonging to dropped samples are reported before the next available one
+                for (; next_marker < num_markers && markers[next_marker].counter <= block.counter[i]; next_marker++)
+                    write_poll_marker(&out, &markers[next_marker]);
+
+                replay_pcap_events(block.counter[i], &next_event, pcap_long, pcap_short);
+
+                double time_from_start = block.wtime[i] - system_info->initial_mpi_wtime;
+
+                poli_text_int(&out, block.counter[i]);
+                poli_text_putc(&out, '\t');
+                poli_text_date(&out, get_timestamp(time_from_start));
+                poli_text_putc(&out, '\t');
+                poli_text_field(&out, time_from_start);
+                poli_text_field(&out, block.interval[i]);
+
+                if (!system_info->sysmsr->error_state)
+                {
+                    for (field = SAMPLE_RAPL_PKG; field <= SAMPLE_RAPL_DRAM; field++)
+                        poli_text_field(&out, poli_sample_value(&block, schema, field, i));
+                    for (field = SAMPLE_RAPL_PKG; field <= SAMPLE_RAPL_DRAM; field++)
+                        poli_text_field(&out, poli_sample_value(&block, schema, field, i) - initial_energy_j[field]);
+                    for (field = SAMPLE_RAPL_PKG; field <= SAMPLE_RAPL_DRAM; field++)
+                        poli_text_field(&out, poli_sample_power(&block, schema, field, i));
+                    if (num_sockets > 1)
+                    {
+                        for (socket = 0; socket < num_sockets; socket++)
+                        {
+                            int first = SAMPLE_RAPL_SOCKET + SAMPLE_SOCKET_DOMAINS * socket;
+                            for (field = first; field < first + SAMPLE_SOCKET_DOMAINS; field++)
+                                poli_text_field(&out, poli_sample_value(&block, schema, field, i));
+                            for (field = first; field < first + SAMPLE_SOCKET_DOMAINS; field++)
+                                poli_text_field(&out, poli_sample_power(&block, schema, field, i));
+                        }
+                    }
+                }
+#ifdef _CRAY
+                struct cray_measurement *initial_cray = &(system_info->initial_energy.cray_meas);
+                double node_energy = poli_sample_value(&block, schema, SAMPLE_CRAY_NODE_ENERGY, i);
+                double cpu_energy = poli_sample_value(&block, schema, SAMPLE_CRAY_CPU_ENERGY, i);
+                double memory_energy = poli_sample_value(&block, schema, SAMPLE_CRAY_MEMORY_ENERGY, i);
+
+                poli_text_field(&out, node_energy);
+                poli_text_field(&out, cpu_energy);
+                poli_text_field(&out, memory_energy);
+                poli_text_field(&out, node_energy - initial_cray->node_energy);
+                poli_text_field(&out, cpu_energy - initial_cray->cpu_energy);
+                poli_text_field(&out, memory_energy - initial_cray->memory_energy);
+                poli_text_field(&out, poli_sample_value(&block, schema, SAMPLE_CRAY_NODE_POWER, i));
+                poli_text_field(&out, poli_sample_value(&block, schema, SAMPLE_CRAY_CPU_POWER, i));
+                poli_text_field(&out, poli_sample_value(&block, schema, SAMPLE_CRAY_MEMORY_POWER, i));
+                poli_text_field(&out, poli_sample_power(&block, schema, SAMPLE_CRAY_NODE_ENERGY, i));
+                poli_text_field(&out, poli_sample_power(&block, schema, SAMPLE_CRAY_CPU_ENERGY, i));
+                poli_text_field(&out, poli_sample_power(&block, schema, SAMPLE_CRAY_MEMORY_ENERGY, i));
+                poli_text_field(&out, poli_sample_value(&block, schema, SAMPLE_FREQ, i));
+                poli_text_field(&out, poli_sample_value(&block, schema, SAMPLE_CRAY_FREQ, i));
+#else
+#ifdef _BGQ
+                struct bgq_measurement bgq_meas;
+                init_bgq_measurement(&bgq_meas);
+                bgq_meas.card_power = poli_sample_value(&block, schema, SAMPLE_BGQ_CARD_POWER, i);
+                bgq_meas.cpu = poli_sample_value(&block, schema, SAMPLE_BGQ_CPU, i);
+                bgq_meas.dram = poli_sample_value(&block, schema, SAMPLE_BGQ_DRAM, i);
+                bgq_meas.optics = poli_sample_value(&block, schema, SAMPLE_BGQ_OPTICS, i);
+                bgq_meas.pci = poli_sample_value(&block, schema, SAMPLE_BGQ_PCI, i);
+                bgq_meas.network = poli_sample_value(&block, schema, SAMPLE_BGQ_NETWORK, i);
+                bgq_meas.link_chip = poli_sample_value(&block, schema, SAMPLE_BGQ_LINK_CHIP, i);
+                bgq_meas.sram = poli_sample_value(&block, schema, SAMPLE_BGQ_SRAM, i);
+                write_bgq_output(&out, &bgq_meas);
+                write_bgq_ediff(&out, &bgq_meas, &(system_info->initial_energy.bgq_meas));
+#endif
+                poli_text_field(&out, poli_sample_value(&block, schema, SAMPLE_FREQ, i));
+#endif
+                if (!system_info->sysmsr->pcap_error_state)
+                {
+                    for (socket = 0; socket < num_sockets; socket++)
+                    {
+                        for (zone = 0; zone < system_info->sysmsr->num_zones; zone++)
+                        {
+                            poli_text_field(&out, pcap_long[socket][zone]);
+                            poli_text_double(&out, pcap_short[socket][zone]);
+                            if (socket < num_sockets - 1 || zone < system_info->sysmsr->num_zones - 1)
+                                poli_text_putc(&out, '\t');
+                        }
+                    }
+                }
+                poli_text_putc(&out, '\n');
             }
-            if (system_info->num_pcap_tags > 0)
+        }
+        poli_sample_block_destroy(&block);
+        if (markers)
+            free(markers);
+        poli_text_close(&out);
+#else //_TIMER_OFF is set
+        return 0;
+#endif
+    }
+
+    return 0;
+}
+
+static int binary_output_to_file (void)
+{
+    char path[1000];
+    get_output_path("PoLiMEr", "bin", path, sizeof(path));
+    struct bin_writer writer;
+    if (poli_bin_open(&writer, path) != 0)
+        return 1;
+    return write_binary_output(&writer);
+}
+
+#ifndef _NOMPI
+static int shared_output_to_file (void)
+{
+    int ret = 0;
+    struct bin_writer writer;
+    poli_bin_open_memory(&writer);
+    int complete = (write_binary_output(&writer) == 0);
+    uint64_t size = writer.image_size;
+
+    int num_monitors, monitor_rank;
+    MPI_Comm_size(monitor->monitors_comm, &num_monitors);
+    MPI_Comm_rank(monitor->monitors_comm, &monitor_rank);
+
+    //the files of the nodes follow the index in the order of their monitors' ranks
+    uint64_t padded_size = (size + 7) & ~(uint64_t) 7;
+    uint64_t offset = 0, total_size = 0;
+    MPI_Exscan(&padded_size, &offset, 1, MPI_UINT64_T, MPI_SUM, monitor->monitors_comm);
+    if (monitor_rank == 0)
+        offset = 0;
+    MPI_Allreduce(&padded_size, &total_size, 1, MPI_UINT64_T, MPI_SUM, monitor->monitors_comm);
+    uint64_t data_offset = BIN_JOB_HEADER_SIZE + (uint64_t) num_monitors * BIN_JOB_ENTRY_SIZE;
+    offset += data_offset;
+
+    char path[1000];
+    char *prefix = getenv("PoLi_PREFIX");
+    snprintf(path, sizeof(path), "%sPoLiMEr_%s.job", (prefix != NULL) ? prefix : "", monitor->jobid);
+
+    MPI_File fh;
+    if (MPI_File_open(monitor->monitors_comm, path, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+    {
+        poli_log(ERROR, monitor, "Failed to open file %s", path);
+        free(writer.image);
+        return 1;
+    }
+    //drops whatever an older job file left beyond the end of this one
+    MPI_File_set_size(fh, (MPI_Offset) (data_offset + total_size));
+
+    //a node's file is written in chunks whose size fits in an int, every monitor takes part in every write
+    int num_chunks = (int) ((size + SHARED_OUTPUT_CHUNK - 1) / SHARED_OUTPUT_CHUNK);
+    int max_chunks = 0;
+    MPI_Allreduce(&num_chunks, &max_chunks, 1, MPI_INT, MPI_MAX, monitor->monitors_comm);
+    int chunk;
+    for (chunk = 0; chunk < max_chunks; chunk++)
+    {
+        uint64_t start = (uint64_t) chunk * SHARED_OUTPUT_CHUNK;
+        int count = 0;
+        if (start < size)
+            count = (int) ((size - start < SHARED_OUTPUT_CHUNK) ? size - start : SHARED_OUTPUT_CHUNK);
+        if (MPI_File_write_at_all(fh, (MPI_Offset) (offset + start), (count > 0) ? writer.image + start : NULL, count, MPI_BYTE, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+            ret = 1;
+    }
+
+    char entry[BIN_JOB_ENTRY_SIZE];
+    poli_bin_job_entry(entry, monitor->my_host, offset, size, monitor->world_rank, complete);
+    if (MPI_File_write_at_all(fh, (MPI_Offset) (BIN_JOB_HEADER_SIZE + (uint64_t) monitor_rank * BIN_JOB_ENTRY_SIZE), entry, BIN_JOB_ENTRY_SIZE, MPI_BYTE, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+        ret = 1;
+    if (monitor_rank == 0)
+    {
+        char header[BIN_JOB_HEADER_SIZE];
+        poli_bin_job_header(header, num_monitors, monitor->jobid);
+        if (MPI_File_write_at(fh, 0, header, BIN_JOB_HEADER_SIZE, MPI_BYTE, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+            ret = 1;
+    }
+    if (MPI_File_close(&fh) != MPI_SUCCESS)
+        ret = 1;
+    if (ret)
+        poli_log(ERROR, monitor, "Failed to write this node's part of %s", path);
+
+    free(writer.image);
+    return (ret || !complete);
+}
+#endif
+
+#ifndef _NOMPI
+//quantities of every tag in the job summary: time, then the energy of every counter, then its power
+static char *job_summary_energies[JOB_SUMMARY_ENERGIES] = {"RAPL pkg", "RAPL pp0", "RAPL pp1", "RAPL platform", "RAPL dram"
+#ifdef _CRAY
+    , "Cray node", "Cray cpu", "Cray memory"
+#endif
+};
+
+static int job_summary_to_file (void)
+{
+    int monitor_rank, num_monitors, error = 0, any_error = 0;
+    MPI_Comm_size(monitor->monitors_comm, &num_monitors);
+    MPI_Comm_rank(monitor->monitors_comm, &monitor_rank);
+
+    int num_names = tag_registry.num_names;
+    double *time = malloc((num_names + 1) * sizeof(double));
+    double *energy = malloc((num_names + 1) * JOB_SUMMARY_ENERGIES * sizeof(double));
+    int *num_instances = malloc((num_names + 1) * sizeof(int));
+    size_t names_len = 0;
+    char *names = NULL;
+    if (time == NULL || energy == NULL || num_instances == NULL)
+        error = 1;
+    else
+    {
+        get_node_tag_totals(time, energy, num_instances);
+        int handle;
+        for (handle = 0; handle < num_names; handle++)
+            if (num_instances[handle] > 0)
+                names_len += strlen(tag_registry.names[handle]) + 1;
+        names = malloc(names_len + 1);
+        if (names == NULL)
+            error = 1;
+        else
+        {
+            char *p = names;
+            for (handle = 0; handle < num_names; handle++)
+                if (num_instances[handle] > 0)
+                    p = stpcpy(p, tag_registry.names[handle]) + 1;
+        }
+    }
+
+    //every step is collective, a monitor that fails stops all of them
+    char *job_names = NULL;
+    int num_job_names = 0;
+    MPI_Allreduce(&error, &any_error, 1, MPI_INT, MPI_MAX, monitor->monitors_comm);
+    if (!any_error)
+    {
+        error = get_job_tag_names(names, names_len, &job_names, &num_job_names);
+        MPI_Allreduce(&error, &any_error, 1, MPI_INT, MPI_MAX, monitor->monitors_comm);
+    }
+
+    struct node_stats *stats = NULL, *job_stats = NULL;
+    char *hosts = NULL;
+    if (!any_error && num_job_names > 0)
+    {
+        size_t num_stats = (size_t) num_job_names * JOB_SUMMARY_QUANTITIES;
+        stats = malloc(num_stats * sizeof(struct node_stats));
+        if (monitor_rank == 0)
+        {
+            job_stats = malloc(num_stats * sizeof(struct node_stats));
+            hosts = malloc((size_t) num_monitors * MPI_MAX_PROCESSOR_NAME);
+        }
+        error = (stats == NULL || (monitor_rank == 0 && (job_stats == NULL || hosts == NULL)));
+        MPI_Allreduce(&error, &any_error, 1, MPI_INT, MPI_MAX, monitor->monitors_comm);
+    }
+
+    if (!any_error && num_job_names > 0)
+    {
+        int i, e;
+        char *name = job_names;
+        for (i = 0; i < num_job_names; i++, name += strlen(name) + 1)
+        {
+            struct node_stats *tag_stats = &stats[i * JOB_SUMMARY_QUANTITIES];
+            for (e = 0; e < JOB_SUMMARY_QUANTITIES; e++)
+                poli_node_stats_init(&tag_stats[e]);
+            int handle = find_tag_handle(name, NULL);
+            if (handle == -1 || handle >= num_names || num_instances[handle] == 0)
+                continue;
+            poli_node_stats_set(&tag_stats[0], time[handle], monitor_rank);
+            for (e = 0; e < JOB_SUMMARY_ENERGIES; e++)
             {
-                struct pcap_tag *this_pcap = get_pcap_for_time_counter(counter);
-                if (this_pcap != 0)
-                    fprintf(fp, "*** SET POWER CAP TAG %d TO: %s, %lf\n",
-                        this_pcap->id, this_pcap->zone, this_pcap->watts_long);
+                double tag_energy = energy[handle * JOB_SUMMARY_ENERGIES + e];
+                if (tag_energy < 0)
+                    continue;
+                poli_node_stats_set(&tag_stats[1 + e], tag_energy, monitor_rank);
+                if (time[handle] > 0)
+                    poli_node_stats_set(&tag_stats[1 + JOB_SUMMARY_ENERGIES + e], tag_energy / time[handle], monitor_rank);
             }
-            if (system_info->num_poli_tags > 0)
+        }
+
+        //the statistics of all tags and quantities are merged in a single reduction
+        MPI_Datatype stats_type;
+        MPI_Op merge_op;
+        poli_node_stats_mpi_create(&stats_type, &merge_op);
+        MPI_Reduce(stats, job_stats, num_job_names * JOB_SUMMARY_QUANTITIES, stats_type, merge_op, 0, monitor->monitors_comm);
+        MPI_Op_free(&merge_op);
+        MPI_Type_free(&stats_type);
+
+        MPI_Gather(monitor->my_host, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, hosts, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, 0, monitor->monitors_comm);
+
+        if (monitor_rank == 0)
+        {
+            char path[1000];
+            char *prefix = getenv("PoLi_PREFIX");
+            snprintf(path, sizeof(path), "%sPoLiMEr_job-summary_%s.txt", (prefix != NULL) ? prefix : "", monitor->jobid);
+            struct text_writer out;
+            if (poli_text_open(&out, path) != 0)
+                error = 1;
+            else
             {
-                struct poli_tag *this_start_poli_tag = get_poli_tag_for_start_time_counter(counter);
-                if (this_start_poli_tag != 0)
-                    fprintf(fp, "--- EMON TAG START: %s\n", this_start_poli_tag->tag_name);
+#ifndef _HEADER_OFF
+                poli_text_puts(&out, "Tag Name\tQuantity\tNodes\tTotal\tMin\tMin node\tMax\tMax node\tMean\n");
+#endif
+                name = job_names;
+                for (i = 0; i < num_job_names; i++, name += strlen(name) + 1)
+                {
+                    for (e = 0; e < JOB_SUMMARY_QUANTITIES; e++)
+                    {
+                        struct node_stats *quantity = &job_stats[i * JOB_SUMMARY_QUANTITIES + e];
+                        if (quantity->count == 0)
+                            continue;
+                        poli_text_puts(&out, name);
+                        poli_text_putc(&out, '\t');
+                        if (e == 0)
+                            poli_text_puts(&out, "Time (s)");
+                        else
+                            poli_text_printf(&out, "%s %s", job_summary_energies[(e - 1) % JOB_SUMMARY_ENERGIES], (e <= JOB_SUMMARY_ENERGIES) ? "E (J)" : "P (W)");
+                        poli_text_putc(&out, '\t');
+                        poli_text_int(&out, (long) quantity->count);
+                        poli_text_putc(&out, '\t');
+                        poli_text_field(&out, quantity->total);
+                        poli_text_field(&out, quantity->min);
+                        poli_text_puts(&out, &hosts[(size_t) quantity->min_node * MPI_MAX_PROCESSOR_NAME]);
+                        poli_text_putc(&out, '\t');
+                        poli_text_field(&out, quantity->max);
+                        poli_text_puts(&out, &hosts[(size_t) quantity->max_node * MPI_MAX_PROCESSOR_NAME]);
+                        poli_text_putc(&out, '\t');
+                        poli_text_double(&out, quantity->total / quantity->count);
+                        poli_text_putc(&out, '\n');
+                    }
+                }
+                error = poli_text_close(&out);
             }
+        }
+    }
 
-            struct system_poll_info *info = &system_info->system_poll_list[counter];
+    free(time);
+    free(energy);
+    free(num_instances);
+    free(names);
+    free(job_names);
+    free(stats);
+    free(job_stats);
+    free(hosts);
+    return (error || any_error);
+}
 
-            double time_from_start = info->wtime - system_info->initial_mpi_wtime;
+static void get_node_tag_totals (double *time, double *energy, int *num_instances)
+{
+    double values[JOB_SUMMARY_ENERGIES];
+    int handle, e;
+    for (handle = 0; handle < tag_registry.num_names; handle++)
+    {
+        time[handle] = 0.0;
+        num_instances[handle] = 0;
+        for (e = 0; e < JOB_SUMMARY_ENERGIES; e++)
+            energy[handle * JOB_SUMMARY_ENERGIES + e] = 0.0;
+    }
 
-            char time_str_buffer[20];
-            get_timestamp(time_from_start, time_str_buffer, sizeof(time_str_buffer));
+    int tag_num;
+    for (tag_num = 0; tag_num < system_info->num_poli_tags; tag_num++)
+    {
+        struct poli_tag *tag = get_poli_tag(tag_num);
+        double start_offset, end_offset, total_time;
+        get_tag_times(tag, &start_offset, &end_offset, &total_time);
+        handle = tag->handle;
+        if (handle < 0)
+            continue;
+        time[handle] += total_time;
+        num_instances[handle]++;
+        get_job_energies(&tag->total_energy, values);
+        for (e = 0; e < JOB_SUMMARY_ENERGIES; e++)
+        {
+            double *total = &energy[handle * JOB_SUMMARY_ENERGIES + e];
+            *total = (*total < 0 || values[e] < 0) ? -1.0 : *total + values[e];
+        }
+    }
 
-            fprintf(fp, "%d\t%s\t%lf\t", info->counter, time_str_buffer, time_from_start);
+    for (handle = 0; handle < tag_registry.num_names; handle++)
+    {
+        struct tag_summary *summary = tag_registry.summaries[handle];
+        if (summary == NULL)
+            continue;
+        struct energy_reading total_energy, total_power;
+        get_summary_totals(summary, &total_energy, &total_power);
+        time[handle] += summary->time.total;
+        num_instances[handle] += summary->time.count;
+        get_job_energies(&total_energy, values);
+        for (e = 0; e < JOB_SUMMARY_ENERGIES; e++)
+        {
+            double *total = &energy[handle * JOB_SUMMARY_ENERGIES + e];
+            *total = (*total < 0 || values[e] < 0) ? -1.0 : *total + values[e];
+        }
+    }
+}
 
-            if (!system_info->sysmsr->error_state)
-            {
-                struct rapl_energy *energy_j = &(info->current_energy.rapl_energy);
-                struct rapl_energy *watts = &(info->computed_power.rapl_energy);
+static int get_job_tag_names (char *names, int names_len, char **job_names, int *num_job_names)
+{
+    int monitor_rank, num_monitors, i, error = 0;
+    MPI_Comm_size(monitor->monitors_comm, &num_monitors);
+    MPI_Comm_rank(monitor->monitors_comm, &monitor_rank);
+
+    int *lengths = NULL, *displs = NULL;
+    char *all_names = NULL;
+    int all_len = 0;
+    if (monitor_rank == 0)
+    {
+        lengths = malloc(num_monitors * sizeof(int));
+        displs = malloc(num_monitors * sizeof(int));
+    }
+    MPI_Gather(&names_len, 1, MPI_INT, lengths, 1, MPI_INT, 0, monitor->monitors_comm);
+    if (monitor_rank == 0 && lengths != NULL && displs != NULL)
+    {
+        for (i = 0; i < num_monitors; i++)
+        {
+            displs[i] = all_len;
+            all_len += lengths[i];
+        }
+        all_names = malloc(all_len + 1);
+    }
+    MPI_Gatherv(names, names_len, MPI_CHAR, all_names, lengths, displs, MPI_CHAR, 0, monitor->monitors_comm);
 
-                fprintf(fp, "%lf\t%lf\t%lf\t%lf\t%lf\t", energy_j->package, energy_j->pp0, energy_j->pp1, energy_j->platform, energy_j->dram);
-                fprintf(fp, "%lf\t%lf\t%lf\t%lf\t%lf\t", (energy_j->package - system_info->initial_energy.rapl_energy.package), (energy_j->pp0 - system_info->initial_energy.rapl_energy.pp0), (energy_j->pp1 - system_info->initial_energy.rapl_energy.pp1), (energy_j->platform - system_info->initial_energy.rapl_energy.platform), (energy_j->dram - system_info->initial_energy.rapl_energy.dram));
-                fprintf(fp, "%lf\t%lf\t%lf\t%lf\t%lf\t", watts->package, watts->pp0, watts->pp1, watts->platform, watts->dram);
+    //the first monitor keeps one copy of every name, sorted, and sends them back
+    int job_len = 0;
+    *num_job_names = 0;
+    *job_names = NULL;
+    if (monitor_rank == 0)
+    {
+        int num_all = 0;
+        char *p;
+        for (p = all_names; all_names != NULL && p < all_names + all_len; p += strlen(p) + 1)
+            num_all++;
+        char **sorted = malloc((num_all + 1) * sizeof(char *));
+        *job_names = malloc(all_len + 1);
+        if (all_names == NULL || sorted == NULL || *job_names == NULL)
+        {
+            poli_log(ERROR, monitor, "%s: Failed to allocate memory for the tag names of %d nodes", __FUNCTION__, num_monitors);
+            error = 1;
+            job_len = -1;
+        }
+        else
+        {
+            for (i = 0, p = all_names; i < num_all; i++, p += strlen(p) + 1)
+                sorted[i] = p;
+            qsort(sorted, num_all, sizeof(char *), compare_tag_names);
+            for (i = 0; i < num_all; i++)
+            {
+                if (i > 0 && strcmp(sorted[i], sorted[i - 1]) == 0)
+                    continue;
+                strcpy(*job_names + job_len, sorted[i]);
+                job_len += strlen(sorted[i]) + 1;
+                (*num_job_names)++;
             }
+        }
+        free(sorted);
+    }
+    free(lengths);
+    free(displs);
+    free(all_names);
+
+    int counts[2] = {job_len, *num_job_names};
+    MPI_Bcast(counts, 2, MPI_INT, 0, monitor->monitors_comm);
+    if (counts[0] < 0)
+        return 1;
+    if (monitor_rank != 0)
+    {
+        *num_job_names = counts[1];
+        *job_names = malloc(counts[0] + 1);
+        if (*job_names == NULL)
+        {
+            poli_log(ERROR, monitor, "%s: Failed to allocate memory for %d tag names", __FUNCTION__, counts[1]);
+            error = 1;
+        }
+    }
+    //a monitor that couldn't allocate still takes part, with a scratch buffer
+    char scratch;
+    MPI_Bcast((*job_names != NULL) ? *job_names : &scratch, (*job_names != NULL) ? counts[0] : 0, MPI_CHAR, 0, monitor->monitors_comm);
+    return error;
+}
+
+static void get_job_energies (struct energy_reading *reading, double *values)
+{
+    int rapl = !system_info->sysmsr->error_state;
+    values[0] = rapl ? reading->rapl_energy.package : -1.0;
+    values[1] = rapl ? reading->rapl_energy.pp0 : -1.0;
+    values[2] = rapl ? reading->rapl_energy.pp1 : -1.0;
+    values[3] = rapl ? reading->rapl_energy.platform : -1.0;
+    values[4] = rapl ? reading->rapl_energy.dram : -1.0;
 #ifdef _CRAY
-            struct cray_measurement *cmeasurement = &(info->current_energy.cray_meas);
-            struct cray_measurement *cpower = &(info->computed_power.cray_meas);
-
-            fprintf(fp, "%lf\t%lf\t%lf\t", cmeasurement->node_energy, cmeasurement->cpu_energy, cmeasurement->memory_energy);
-            fprintf(fp, "%lf\t%lf\t%lf\t", (cmeasurement->node_energy - system_info->initial_energy.cray_meas.node_energy), (cmeasurement->cpu_energy - system_info->initial_energy.cray_meas.cpu_energy), (cmeasurement->memory_energy - system_info->initial_energy.cray_meas.memory_energy));
-            fprintf(fp, "%lf\t%lf\t%lf\t", cmeasurement->node_power, cmeasurement->cpu_power, cmeasurement->memory_power);
-            fprintf(fp, "%lf\t%lf\t%lf\t", cpower->node_measured_power, cpower->cpu_measured_power, cpower->memory_measured_power);
-            fprintf(fp, "%lf\t%lf\t", info->freq.freq, info->freq.cray_freq);
-#else
-#ifdef _BGQ
-            struct bgq_measurement *bgq_meas = &(info->current_energy.bgq_meas);
-            write_bgq_output(&fp, bgq_meas);
-            write_bgq_ediff(&fp, bgq_meas, &(system_info->initial_energy.bgq_meas));
+    values[5] = reading->cray_meas.node_energy;
+    values[6] = reading->cray_meas.cpu_energy;
+    values[7] = reading->cray_meas.memory_energy;
 #endif
-            fprintf(fp, "%lf\t", info->freq.freq);
+}
+
+static int compare_tag_names (const void *a, const void *b)
+{
+    char *name_a = *(char **) a, *name_b = *(char **) b;
+    int summary_a = (strcmp(name_a, "application_summary") == 0);
+    int summary_b = (strcmp(name_b, "application_summary") == 0);
+    if (summary_a != summary_b)
+        return summary_b - summary_a;
+    return strcmp(name_a, name_b);
+}
 #endif
-            for (zone = 0; zone < system_info->sysmsr->num_zones - 1; zone++)
+
+static int write_binary_output (struct bin_writer *writer)
+{
+
+    struct sample_schema *schema = &system_info->sample_schema;
+    char name[BIN_NAME_LEN];
+    char field_name[32];
+    int column, i;
+    int num_energy_columns = 0;
+    for (column = 0; column < schema->num_columns; column++)
+        num_energy_columns += schema->is_energy[column];
+
+    //samples: every stored field, the power derived from the energy fields and the power caps in effect
+    unsigned long num_samples = 0;
+#ifndef _TIMER_OFF
+    int socket, zone;
+    int num_sockets = get_num_sockets();
+    int num_zones = system_info->sysmsr->pcap_error_state ? 0 : system_info->sysmsr->num_zones;
+    int count_column = -1, time_column = -1, interval_column = -1;
+    int value_column[SAMPLE_NUM_FIELDS], power_column[SAMPLE_NUM_FIELDS];
+    int pcap_long_column[MAX_SOCKETS][NUM_ZONES], pcap_short_column[MAX_SOCKETS][NUM_ZONES];
+    if (poller->time_counter > 0)
+    {
+        num_samples = poli_ring_num_records(&system_info->poll_ring);
+        count_column = poli_bin_add_column(writer, BIN_TABLE_SAMPLES, BIN_INT64, "Count");
+        time_column = poli_bin_add_column(writer, BIN_TABLE_SAMPLES, BIN_FLOAT64, "Time since start (s)");
+        interval_column = poli_bin_add_column(writer, BIN_TABLE_SAMPLES, BIN_FLOAT64, "Interval (s)");
+        for (column = 0; column < schema->num_columns; column++)
+        {
+            sample_field_t field = schema->field[column];
+            poli_sample_field_name(field, field_name, sizeof(field_name));
+            if (schema->is_energy[column])
+                snprintf(name, sizeof(name), "%s E (J)", field_name);
+            else if (field == SAMPLE_FREQ || field == SAMPLE_CRAY_FREQ)
+                snprintf(name, sizeof(name), "%s (MHz)", field_name);
+            else
+                snprintf(name, sizeof(name), "%s P (W)", field_name);
+            value_column[column] = poli_bin_add_column(writer, BIN_TABLE_SAMPLES, BIN_FLOAT64, name);
+        }
+        for (column = 0; column < schema->num_columns; column++)
+        {
+            power_column[column] = -1;
+            if (!schema->is_energy[column])
+                continue;
+            poli_sample_field_name(schema->field[column], field_name, sizeof(field_name));
+            //Cray nodes also measure power, the derived one is the calculated power
+            snprintf(name, sizeof(name), (schema->field[column] < SAMPLE_CRAY_NODE_ENERGY) ? "%s P (W)" : "%s P calc (W)", field_name);
+            power_column[column] = poli_bin_add_column(writer, BIN_TABLE_SAMPLES, BIN_FLOAT64, name);
+        }
+        for (socket = 0; socket < num_sockets; socket++)
+        {
+            for (zone = 0; zone < num_zones; zone++)
             {
-                fprintf(fp, "%lf\t", info->pcap_info_list[zone].watts_long);
-                fprintf(fp, "%lf\t", info->pcap_info_list[zone].watts_short);
+                char socket_str[16] = "";
+                if (num_sockets > 1)
+                    snprintf(socket_str, sizeof(socket_str), " pkg%d", socket);
+                snprintf(name, sizeof(name), "%s%s power cap long (W)", zone_names[zone], socket_str);
+                pcap_long_column[socket][zone] = poli_bin_add_column(writer, BIN_TABLE_SAMPLES, BIN_FLOAT64, name);
+                snprintf(name, sizeof(name), "%s%s power cap short (W)", zone_names[zone], socket_str);
+                pcap_short_column[socket][zone] = poli_bin_add_column(writer, BIN_TABLE_SAMPLES, BIN_FLOAT64, name);
             }
-            fprintf(fp, "%lf\t", info->pcap_info_list[system_info->sysmsr->num_zones - 1].watts_long);
-            fprintf(fp, "%lf\n", info->pcap_info_list[system_info->sysmsr->num_zones - 1].watts_short);
         }
-        fclose(fp);
-#else //_TIMER_OFF is set
-        return 0;
+    }
 #endif
+    poli_bin_set_rows(writer, BIN_TABLE_SAMPLES, num_samples);
+
+    //tags: one row per recorded tag and one per aggregated tag
+    unsigned long num_summaries = 0;
+    int handle;
+    for (handle = 0; handle < tag_registry.num_names; handle++)
+        num_summaries += (tag_registry.summaries[handle] != NULL);
+    int tag_name_column = poli_bin_add_column(writer, BIN_TABLE_TAGS, BIN_STRING, "Tag Name");
+    int tag_start_column = poli_bin_add_column(writer, BIN_TABLE_TAGS, BIN_FLOAT64, "Start Time (s)");
+    int tag_end_column = poli_bin_add_column(writer, BIN_TABLE_TAGS, BIN_FLOAT64, "End Time (s)");
+    int tag_time_column = poli_bin_add_column(writer, BIN_TABLE_TAGS, BIN_FLOAT64, "Total Time (s)");
+    int tag_count_column = poli_bin_add_column(writer, BIN_TABLE_TAGS, BIN_INT64, "Instances");
+    int tag_start_sample_column = poli_bin_add_column(writer, BIN_TABLE_TAGS, BIN_INT64, "Start sample");
+    int tag_end_sample_column = poli_bin_add_column(writer, BIN_TABLE_TAGS, BIN_INT64, "End sample");
+    int tag_energy_column[SAMPLE_NUM_FIELDS], tag_power_column[SAMPLE_NUM_FIELDS];
+    for (column = 0; column < schema->num_columns; column++)
+    {
+        if (!schema->is_energy[column])
+            continue;
+        poli_sample_field_name(schema->field[column], field_name, sizeof(field_name));
+        snprintf(name, sizeof(name), "Total %s E (J)", field_name);
+        tag_energy_column[column] = poli_bin_add_column(writer, BIN_TABLE_TAGS, BIN_FLOAT64, name);
+        snprintf(name, sizeof(name), "Avg %s P (W)", field_name);
+        tag_power_column[column] = poli_bin_add_column(writer, BIN_TABLE_TAGS, BIN_FLOAT64, name);
+    }
+    poli_bin_set_rows(writer, BIN_TABLE_TAGS, system_info->num_poli_tags + num_summaries);
+
+    //tag statistics: one row per aggregated tag and quantity
+    int stats_name_column = poli_bin_add_column(writer, BIN_TABLE_TAG_STATS, BIN_STRING, "Tag Name");
+    int stats_quantity_column = poli_bin_add_column(writer, BIN_TABLE_TAG_STATS, BIN_STRING, "Quantity");
+    int stats_count_column = poli_bin_add_column(writer, BIN_TABLE_TAG_STATS, BIN_INT64, "Count");
+    int stats_total_column = poli_bin_add_column(writer, BIN_TABLE_TAG_STATS, BIN_FLOAT64, "Total");
+    int stats_min_column = poli_bin_add_column(writer, BIN_TABLE_TAG_STATS, BIN_FLOAT64, "Min");
+    int stats_max_column = poli_bin_add_column(writer, BIN_TABLE_TAG_STATS, BIN_FLOAT64, "Max");
+    int stats_mean_column = poli_bin_add_column(writer, BIN_TABLE_TAG_STATS, BIN_FLOAT64, "Mean");
+    int stats_variance_column = poli_bin_add_column(writer, BIN_TABLE_TAG_STATS, BIN_FLOAT64, "Variance");
+    poli_bin_set_rows(writer, BIN_TABLE_TAG_STATS, num_summaries * (1 + 2 * num_energy_columns));
+
+    //power cap tags
+    int pcap_id_column = poli_bin_add_column(writer, BIN_TABLE_PCAP_TAGS, BIN_INT64, "Tag ID");
+    int pcap_zone_column = poli_bin_add_column(writer, BIN_TABLE_PCAP_TAGS, BIN_STRING, "Zone");
+    int pcap_watts_long_column = poli_bin_add_column(writer, BIN_TABLE_PCAP_TAGS, BIN_FLOAT64, "Power Cap Long (W)");
+    int pcap_watts_short_column = poli_bin_add_column(writer, BIN_TABLE_PCAP_TAGS, BIN_FLOAT64, "Power Cap Short (W)");
+    int pcap_seconds_long_column = poli_bin_add_column(writer, BIN_TABLE_PCAP_TAGS, BIN_FLOAT64, "Time Window Long (s)");
+    int pcap_seconds_short_column = poli_bin_add_column(writer, BIN_TABLE_PCAP_TAGS, BIN_FLOAT64, "Time Window Short (s)");
+    int pcap_time_column = poli_bin_add_column(writer, BIN_TABLE_PCAP_TAGS, BIN_FLOAT64, "Time since start (s)");
+    int pcap_flag_column = poli_bin_add_column(writer, BIN_TABLE_PCAP_TAGS, BIN_INT64, "PCAP FLAG");
+    int pcap_package_column = poli_bin_add_column(writer, BIN_TABLE_PCAP_TAGS, BIN_INT64, "Package");
+    int pcap_sample_column = poli_bin_add_column(writer, BIN_TABLE_PCAP_TAGS, BIN_INT64, "Start sample");
+    int pcap_tags_column = poli_bin_add_column(writer, BIN_TABLE_PCAP_TAGS, BIN_STRING, "Emon tag list");
+    poli_bin_set_rows(writer, BIN_TABLE_PCAP_TAGS, system_info->num_pcap_tags);
+
+    if (poli_bin_layout(writer) != 0)
+    {
+        poli_bin_close(writer, 0.0, monitor->my_host, monitor->jobid);
+        return 1;
     }
 
-    return 0;
+#ifndef _TIMER_OFF
+    if (num_samples > 0)
+    {
+        struct sample_block block;
+        poli_ring_rewind(&system_info->poll_ring);
+        if (poli_sample_block_init(&block, schema, &system_info->initial_energy) == 0)
+        {
+            double pcap_long[MAX_SOCKETS][NUM_ZONES];
+            double pcap_short[MAX_SOCKETS][NUM_ZONES];
+            memset(pcap_long, 0, sizeof(pcap_long));
+            memset(pcap_short, 0, sizeof(pcap_short));
+            int next_event = 0;
+
+            int64_t counter[SAMPLE_BLOCK];
+            double time_from_start[SAMPLE_BLOCK];
+            //the samples are already transposed into columns, which are appended as they are
+            while (poli_sample_block_read(&block, schema, &system_info->poll_ring) > 0)
+            {
+                for (i = 0; i < block.num_samples; i++)
+                {
+                    counter[i] = block.counter[i];
+                    time_from_start[i] = block.wtime[i] - system_info->initial_mpi_wtime;
+                    replay_pcap_events(block.counter[i], &next_event, pcap_long, pcap_short);
+                    for (socket = 0; socket < num_sockets; socket++)
+                    {
+                        for (zone = 0; zone < num_zones; zone++)
+                        {
+                            poli_bin_append_double(writer, pcap_long_column[socket][zone], pcap_long[socket][zone]);
+                            poli_bin_append_double(writer, pcap_short_column[socket][zone], pcap_short[socket][zone]);
+                        }
+                    }
+                }
+                poli_bin_append(writer, count_column, counter, block.num_samples);
+                poli_bin_append(writer, time_column, time_from_start, block.num_samples);
+                poli_bin_append(writer, interval_column, block.interval, block.num_samples);
+                for (column = 0; column < schema->num_columns; column++)
+                {
+                    poli_bin_append(writer, value_column[column], &block.values[column * SAMPLE_BLOCK], block.num_samples);
+                    if (power_column[column] != -1)
+                        poli_bin_append(writer, power_column[column], &block.power[column * SAMPLE_BLOCK], block.num_samples);
+                }
+            }
+            poli_sample_block_destroy(&block);
+        }
+    }
+#endif
+
+    //tag names are stored once
+    int64_t *name_offsets = malloc((tag_registry.num_names > 0 ? tag_registry.num_names : 1) * sizeof(int64_t));
+    if (name_offsets == NULL)
+    {
+        poli_log(ERROR, monitor, "%s: Failed to allocate memory for %d tag names", __FUNCTION__, tag_registry.num_names);
+        poli_bin_close(writer, 0.0, monitor->my_host, monitor->jobid);
+        return 1;
+    }
+    for (handle = 0; handle < tag_registry.num_names; handle++)
+        name_offsets[handle] = poli_bin_add_string(writer, tag_registry.names[handle]);
+
+    double energy[SAMPLE_NUM_FIELDS], power[SAMPLE_NUM_FIELDS];
+    int tag_num;
+    for (tag_num = 0; tag_num < system_info->num_poli_tags; tag_num++)
+    {
+        struct poli_tag *tag = get_poli_tag(tag_num);
+        double start_offset, end_offset, total_time;
+        get_tag_times(tag, &start_offset, &end_offset, &total_time);
+
+        poli_bin_append_int(writer, tag_name_column, (tag->handle != -1) ? name_offsets[tag->handle] : poli_bin_add_string(writer, tag->tag_name));
+        poli_bin_append_double(writer, tag_start_column, start_offset);
+        poli_bin_append_double(writer, tag_end_column, end_offset);
+        poli_bin_append_double(writer, tag_time_column, total_time);
+        poli_bin_append_int(writer, tag_count_column, 1);
+        poli_bin_append_int(writer, tag_start_sample_column, tag->start_timer_count);
+        poli_bin_append_int(writer, tag_end_sample_column, tag->closed ? tag->end_timer_count : -1);
+        poli_sample_read_values(schema, &tag->total_energy, energy);
+        poli_sample_read_values(schema, &tag->total_power, power);
+        for (column = 0; column < schema->num_columns; column++)
+        {
+            if (!schema->is_energy[column])
+                continue;
+            poli_bin_append_double(writer, tag_energy_column[column], energy[column]);
+            poli_bin_append_double(writer, tag_power_column[column], power[column]);
+        }
+    }
+
+    for (handle = 0; handle < tag_registry.num_names; handle++)
+    {
+        struct tag_summary *summary = tag_registry.summaries[handle];
+        if (summary == NULL)
+            continue;
+        struct energy_reading total_energy, total_power;
+        get_summary_totals(summary, &total_energy, &total_power);
+
+        poli_bin_append_int(writer, tag_name_column, name_offsets[handle]);
+        poli_bin_append_double(writer, tag_start_column, summary->first_start - system_info->initial_mpi_wtime);
+        poli_bin_append_double(writer, tag_end_column, summary->last_end - system_info->initial_mpi_wtime);
+        poli_bin_append_double(writer, tag_time_column, summary->time.total);
+        poli_bin_append_int(writer, tag_count_column, summary->time.count);
+        poli_bin_append_int(writer, tag_start_sample_column, -1);
+        poli_bin_append_int(writer, tag_end_sample_column, -1);
+        poli_sample_read_values(schema, &total_energy, energy);
+        poli_sample_read_values(schema, &total_power, power);
+        for (column = 0; column < schema->num_columns; column++)
+        {
+            if (!schema->is_energy[column])
+                continue;
+            poli_bin_append_double(writer, tag_energy_column[column], energy[column]);
+            poli_bin_append_double(writer, tag_power_column[column], power[column]);
+        }
+
+        //statistics in the same order as in the tag statistics file
+        for (column = -1; column < schema->num_columns; column++)
+        {
+            int quantity;
+            for (quantity = 0; quantity < 2; quantity++)
+            {
+                struct running_stats *stats;
+                if (column == -1)
+                {
+                    if (quantity == 1)
+                        continue;
+                    stats = &summary->time;
+                    snprintf(name, sizeof(name), "Time (s)");
+                }
+                else
+                {
+                    if (!schema->is_energy[column])
+                        break;
+                    poli_sample_field_name(schema->field[column], field_name, sizeof(field_name));
+                    stats = (quantity == 0) ? &summary->energy[column] : &summary->power[column];
+                    snprintf(name, sizeof(name), (quantity == 0) ? "%s E (J)" : "%s P (W)", field_name);
+                }
+                poli_bin_append_int(writer, stats_name_column, name_offsets[handle]);
+                poli_bin_append_int(writer, stats_quantity_column, poli_bin_add_string(writer, name));
+                poli_bin_append_int(writer, stats_count_column, stats->count);
+                poli_bin_append_double(writer, stats_total_column, stats->total);
+                poli_bin_append_double(writer, stats_min_column, stats->min);
+                poli_bin_append_double(writer, stats_max_column, stats->max);
+                poli_bin_append_double(writer, stats_mean_column, stats->mean);
+                poli_bin_append_double(writer, stats_variance_column, poli_stats_variance(stats));
+            }
+        }
+    }
+
+    for (tag_num = 0; tag_num < system_info->num_pcap_tags; tag_num++)
+    {
+        struct pcap_tag *tag = &system_info->pcap_tag_list[tag_num];
+        poli_bin_append_int(writer, pcap_id_column, tag->id);
+        poli_bin_append_int(writer, pcap_zone_column, poli_bin_add_string(writer, tag->zone));
+        poli_bin_append_double(writer, pcap_watts_long_column, tag->watts_long);
+        poli_bin_append_double(writer, pcap_watts_short_column, tag->watts_short);
+        poli_bin_append_double(writer, pcap_seconds_long_column, tag->seconds_long);
+        poli_bin_append_double(writer, pcap_seconds_short_column, tag->seconds_short);
+        poli_bin_append_double(writer, pcap_time_column, tag->wtime - system_info->initial_mpi_wtime);
+        poli_bin_append_int(writer, pcap_flag_column, tag->pcap_flag);
+        poli_bin_append_int(writer, pcap_package_column, (tag->package_id == ALL_PACKAGES) ? -1 : tag->package_id);
+        poli_bin_append_int(writer, pcap_sample_column, tag->start_timer_count);
+
+        //the names of the tags open when the power cap was set, separated by commas
+        size_t len = 1;
+        for (i = 0; i < tag->num_active_poli_tags; i++)
+            len += strlen(get_poli_tag(system_info->active_poli_tag_ids[tag->first_active_poli_tag + i])->tag_name) + 1;
+        char tag_list[len];
+        tag_list[0] = '\0';
+        for (i = 0; i < tag->num_active_poli_tags; i++)
+        {
+            if (i > 0)
+                strcat(tag_list, ",");
+            strcat(tag_list, get_poli_tag(system_info->active_poli_tag_ids[tag->first_active_poli_tag + i])->tag_name);
+        }
+        poli_bin_append_int(writer, pcap_tags_column, poli_bin_add_string(writer, tag_list));
+    }
+    free(name_offsets);
+
+    double start_time = system_info->initial_start_time.tv_sec + system_info->initial_start_time.tv_usec / 1e6;
+    return poli_bin_close(writer, start_time, monitor->my_host, monitor->jobid);
+}
+
+#ifndef _TIMER_OFF
+static struct poll_marker *build_poll_markers (int *num_markers)
+{
+    *num_markers = 0;
+    int max_markers = 2 * system_info->num_poli_tags + system_info->num_pcap_tags;
+    if (max_markers == 0)
+        return NULL;
+
+    struct poll_marker *markers = malloc(max_markers * sizeof(struct poll_marker));
+    if (markers == NULL)
+    {
+        poli_log(ERROR, monitor, "%s: Failed to allocate %d markers, tags won't be shown in the polling file", __FUNCTION__, max_markers);
+        return NULL;
+    }
+
+    int tag_num, n = 0;
+    for (tag_num = 0; tag_num < system_info->num_poli_tags; tag_num++)
+    {
+        struct poli_tag *tag = get_poli_tag(tag_num);
+        markers[n].counter = tag->start_timer_count;
+        markers[n].kind = MARKER_TAG_START;
+        markers[n++].id = tag_num;
+        if (tag->closed)
+        {
+            markers[n].counter = tag->end_timer_count;
+            markers[n].kind = MARKER_TAG_END;
+            markers[n++].id = tag_num;
+        }
+    }
+    for (tag_num = 0; tag_num < system_info->num_pcap_tags; tag_num++)
+    {
+        markers[n].counter = system_info->pcap_tag_list[tag_num].start_timer_count;
+        markers[n].kind = MARKER_PCAP;
+        markers[n++].id = tag_num;
+    }
+
+    qsort(markers, n, sizeof(struct poll_marker), compare_poll_markers);
+    *num_markers = n;
+    return markers;
 }
 
+static int compare_poll_markers (const void *a, const void *b)
+{
+    const struct poll_marker *ma = a;
+    const struct poll_marker *mb = b;
+    if (ma->counter != mb->counter)
+        return (ma->counter < mb->counter) ? -1 : 1;
+    if (ma->kind != mb->kind)
+        return (ma->kind < mb->kind) ? -1 : 1;
+    return (ma->id < mb->id) ? -1 : (ma->id > mb->id);
+}
+
+static void replay_pcap_events (int counter, int *next_event, double pcap_long[MAX_SOCKETS][NUM_ZONES], double pcap_short[MAX_SOCKETS][NUM_ZONES])
+{
+    for (; *next_event < system_info->num_pcap_events && system_info->pcap_events[*next_event].counter <= counter; (*next_event)++)
+    {
+        struct pcap_event *event = &system_info->pcap_events[*next_event];
+        pcap_long[event->socket][event->zone_index] = event->watts_long;
+        pcap_short[event->socket][event->zone_index] = event->watts_short;
+    }
+}
+
+static void write_poll_marker (struct text_writer *out, struct poll_marker *marker)
+{
+    if (marker->kind == MARKER_TAG_END || marker->kind == MARKER_TAG_START)
+    {
+        poli_text_puts(out, (marker->kind == MARKER_TAG_END) ? "--- EMON TAG END: " : "--- EMON TAG START: ");
+        poli_text_puts(out, get_poli_tag(marker->id)->tag_name);
+        poli_text_putc(out, '\n');
+    }
+    else
+    {
+        struct pcap_tag *this_pcap = &system_info->pcap_tag_list[marker->id];
+        if (this_pcap->package_id == ALL_PACKAGES)
+            poli_text_printf(out, "*** SET POWER CAP TAG %d TO: %s, %lf\n",
+                this_pcap->id, this_pcap->zone, this_pcap->watts_long);
+        else
+            poli_text_printf(out, "*** SET POWER CAP TAG %d TO: %s pkg%d, %lf\n",
+                this_pcap->id, this_pcap->zone, this_pcap->package_id, this_pcap->watts_long);
+    }
+}
+#endif
+
 static void finalize_power_interfaces (struct system_info_t * system_info)
 {
     finalize_msrs(system_info);
@@ -1766,7 +4446,7 @@ static int finalize_tags (void)
 
     for (tag_num = 0; tag_num < system_info->num_poli_tags; tag_num++)
     {
-        struct poli_tag *this_poli_tag = &system_info->poli_tag_list[tag_num];
+        struct poli_tag *this_poli_tag = get_poli_tag(tag_num);
         if ( this_poli_tag->closed == 0)
         {
             poli_log(WARNING, monitor, "Tag %s is not finished. It will be closed automatically.", this_poli_tag->tag_name);
@@ -1774,11 +4454,22 @@ static int finalize_tags (void)
         }
     }
 
+    for (tag_num = 0; tag_num < tag_registry.num_open_aggregated; tag_num++)
+    {
+        struct poli_tag *this_poli_tag = &tag_registry.open_aggregated[tag_num];
+        if (this_poli_tag->closed == 0)
+        {
+            poli_log(WARNING, monitor, "Tag %s is not finished. It will be closed automatically.", this_poli_tag->tag_name);
+            end_aggregated_tag(tag_num);
+        }
+    }
+
     return 0;
 }
 
 int poli_finalize(void)
 {
+    poli_tag_events_flush(&tag_events);
     poli_sync();
 
     poli_log(TRACE, monitor, "Entering %s", __FUNCTION__);
@@ -1789,37 +4480,73 @@ int poli_finalize(void)
 
         poli_log(TRACE, monitor, "Checking if any poli tags are unfinished");
 
-        struct poli_tag *app_summary = &system_info->poli_tag_list[0]; //need to close application summary tag which is the first one
-        end_existing_poli_tag(app_summary);
+        //need to close application summary tag, unless the memory for tags ran out before it was recorded
+        struct poli_tag *app_summary = get_app_summary();
+        if (app_summary != NULL)
+            end_existing_poli_tag(app_summary);
         /* Check if any poli tags are unfinished */
         finalize_tags();
+        if (system_info->poli_tags.dropped > 0)
+            poli_log(WARNING, monitor, "%lu tags weren't recorded because the memory for tags ran out", system_info->poli_tags.dropped);
+        if (system_info->num_dropped_pcap_tags > 0)
+            poli_log(WARNING, monitor, "%d power caps aren't listed in the power cap tags file, it holds at most %d", system_info->num_dropped_pcap_tags, MAX_TAGS);
 
         poli_log(TRACE, monitor, "Resetting the system");
 
+#ifndef _TIMER_OFF
+        //no power cap of the budget may come after the reset
+        poli_power_budget_finish(&power_budget);
+#endif
         /* Reset system power caps */
         if (poli_reset_system() != 0)
-            if (!system_info->sysmsr->error_state)
+            if (!system_info->sysmsr->pcap_error_state)
                 poli_log(ERROR, monitor, "Couldn't reset system!");
 
+        poli_log(TRACE, monitor, "Stopping wrap guard");
+        stop_wrap_guard();
 #ifndef _TIMER_OFF
         poli_log(TRACE, monitor, "Stopping timer");
         stop_timer();
+        poli_log(TRACE, monitor, "Spooling remaining samples");
+        poli_ring_stop(&system_info->poll_ring);
+        poli_log(TRACE, monitor, "Resolving tags logged by the ranks");
+        resolve_tag_events();
+        poli_log(TRACE, monitor, "Resolving tags logged by threads");
+        resolve_thread_tags();
+        poli_thread_tags_destroy();
 #endif
         poli_log(TRACE, monitor, "Pushing results to file");
         file_handler();
+#ifndef _NOMPI
+        //every monitor must read the same PoLi_JOB_SUMMARY, the summary is collective
+        char *job_summary_str = getenv("PoLi_JOB_SUMMARY");
+        if (job_summary_str == NULL || atoi(job_summary_str) != 0)
+        {
+            poli_log(TRACE, monitor, "Writing the job summary");
+            if (job_summary_to_file() != 0)
+                poli_log(ERROR, monitor, "Something went wrong with writing the job summary");
+        }
+#ifndef _TIMER_OFF
+        if (job_power_to_file() != 0)
+            poli_log(ERROR, monitor, "Something went wrong with writing the job power timeline");
+#endif
+#endif
+#ifndef _TIMER_OFF
+        poli_job_power_destroy(&job_power);
+        poli_power_budget_destroy(&power_budget);
+#endif
 
         poli_log(TRACE, monitor,   "Closing frequency file");
         if (system_info->cur_freq_file)
             close(system_info->cur_freq_file);
 
+        pthread_mutex_destroy(&system_info->energy_lock);
+        pthread_mutex_destroy(&system_info->pcap_lock);
+
         poli_log(TRACE, monitor,   "Cleaning up structures");
 
         /* Cleanup */
-        if (system_info->poli_tag_list)
-        {
-            free(system_info->poli_tag_list);
-            system_info->poli_tag_list = 0;
-        }
+        poli_arena_destroy(&system_info->poli_tags);
         if (system_info->pcap_tag_list)
         {
             free(system_info->pcap_tag_list);
@@ -1830,12 +4557,23 @@ int poli_finalize(void)
             free(system_info->current_pcap_list);
             system_info->current_pcap_list = 0;
         }
-#ifndef _TIMER_OFF
-        if (system_info->system_poll_list)
+        if (system_info->pcap_events)
+        {
+            free(system_info->pcap_events);
+            system_info->pcap_events = 0;
+        }
+        if (system_info->open_tag_stack)
+        {
+            free(system_info->open_tag_stack);
+            system_info->open_tag_stack = 0;
+        }
+        if (system_info->active_poli_tag_ids)
         {
-            free(system_info->system_poll_list);
-            system_info->system_poll_list = 0;
+            free(system_info->active_poli_tag_ids);
+            system_info->active_poli_tag_ids = 0;
         }
+#ifndef _TIMER_OFF
+        poli_ring_destroy(&system_info->poll_ring);
 #endif
 #ifdef _BENCH
         if (system_info->system_poll_list_em)
@@ -1859,9 +4597,18 @@ int poli_finalize(void)
     int finalized;
     MPI_Finalized(&finalized);
     if (!finalized)
+    {
+        poli_tag_events_destroy(&tag_events);
         MPI_Comm_free(&monitor->mynode_comm);
+        if (monitor->monitors_comm != MPI_COMM_NULL)
+            MPI_Comm_free(&monitor->monitors_comm);
+    }
+#else
+    poli_tag_events_destroy(&tag_events);
 #endif
 
+    free_tag_registry();
+
     if (monitor)
         free(monitor);
 
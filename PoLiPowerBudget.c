@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PoLiMEr.h"
+#include "PoLiLog.h"
+#include "PoLiPowerBudget.h"
+
+/* fill_to_level - raises the power caps of the nodes to a common level, each between its floor and its ceiling,
+   so that they add up to watts (or all reach their ceiling)
+   input: watts to hand out, floors, ceilings, power caps, number of nodes*/
+static void fill_to_level (double watts, double *floor, double *ceiling, double *caps, int num_nodes);
+static double sum_at_level (double level, double *floor, double *ceiling, int num_nodes);
+
+#if !defined(_NOMPI) && MPI_VERSION >= 3
+/* complete_round - completes the redistribution in flight
+   input: the budget, 1 to wait for it, 0 to only check
+   returns: 1 if it completed, 0 otherwise*/
+static int complete_round (struct power_budget *budget, int wait);
+#endif
+
+int poli_power_budget_init (struct power_budget *budget, struct monitor_t *monitor, int requested, double watts, double interval,
+    double min_cap, double max_cap)
+{
+    memset(budget, 0, sizeof(struct power_budget));
+    budget->interval = interval;
+    budget->budget = watts;
+    budget->send.min = min_cap;
+    budget->send.max = max_cap;
+#if !defined(_NOMPI) && MPI_VERSION >= 3
+    budget->comm = MPI_COMM_NULL;
+    int provided;
+    MPI_Query_thread(&provided);
+    int usable = (provided == MPI_THREAD_MULTIPLE);
+    if (requested && !usable)
+        poli_log(WARNING, monitor, "The job power budget needs MPI_THREAD_MULTIPLE, it is disabled");
+
+    //either all monitors take part or none of them
+    int enabled = (requested && usable);
+    MPI_Allreduce(MPI_IN_PLACE, &enabled, 1, MPI_INT, MPI_MIN, monitor->monitors_comm);
+    if (!enabled)
+        return 0;
+
+    MPI_Comm_rank(monitor->monitors_comm, &budget->monitor_rank);
+    MPI_Comm_size(monitor->monitors_comm, &budget->num_monitors);
+    budget->nodes = malloc(budget->num_monitors * sizeof(struct budget_node));
+    budget->caps = malloc(budget->num_monitors * sizeof(double));
+    int error = (budget->nodes == NULL || budget->caps == NULL);
+    if (error)
+        poli_log(ERROR, monitor, "%s: Failed to allocate memory for %d nodes", __FUNCTION__, budget->num_monitors);
+    MPI_Allreduce(MPI_IN_PLACE, &error, 1, MPI_INT, MPI_MAX, monitor->monitors_comm);
+    if (error)
+    {
+        poli_power_budget_destroy(budget);
+        return 1;
+    }
+
+    //a communicator of its own keeps the budget's exchanges apart from any other collective of the monitors
+    MPI_Comm_dup(monitor->monitors_comm, &budget->comm);
+    budget->monitors_comm = monitor->monitors_comm;
+    pthread_mutex_init(&budget->lock, NULL);
+    budget->enabled = 1;
+    return 0;
+#else
+    if (requested)
+        poli_log(WARNING, monitor, "The job power budget needs MPI-3, it is disabled");
+    return 0;
+#endif
+}
+
+int poli_power_budget_update (struct power_budget *budget, double time, double power, double cap, double *new_cap)
+{
+    int changed = 0;
+#if !defined(_NOMPI) && MPI_VERSION >= 3
+    if (!budget->enabled)
+        return 0;
+    pthread_mutex_lock(&budget->lock);
+    if (budget->stopped)
+    {
+        pthread_mutex_unlock(&budget->lock);
+        return 0;
+    }
+
+    if (budget->in_flight && complete_round(budget, 0))
+    {
+        //every monitor gets the same data and computes the same caps, the first monitor's budget decides
+        double watts = budget->nodes[0].budget;
+        if (watts > 0)
+        {
+            if (poli_power_budget_allocate(watts, budget->nodes, budget->num_monitors, budget->caps) != 0 &&
+                budget->monitor_rank == 0 && watts != budget->too_low)
+            {
+                poli_log(WARNING, NULL, "The job power budget of %lf W is below the lowest power caps of the nodes", watts);
+                budget->too_low = watts;
+            }
+            *new_cap = budget->caps[budget->monitor_rank];
+            double change = *new_cap - cap;
+            changed = (change >= POWER_BUDGET_MIN_CHANGE || change <= -POWER_BUDGET_MIN_CHANGE);
+        }
+    }
+
+    //a redistribution that is late starts right away, the ones missed in the meantime are skipped
+    if (!budget->in_flight && budget->next_round * budget->interval <= time)
+    {
+        budget->send.power = power;
+        budget->send.cap = cap;
+        budget->send.budget = budget->budget;
+        MPI_Iallgather(&budget->send, BUDGET_NODE_DOUBLES, MPI_DOUBLE, budget->nodes, BUDGET_NODE_DOUBLES, MPI_DOUBLE,
+            budget->comm, &budget->request);
+        budget->in_flight = 1;
+        budget->num_rounds++;
+        budget->next_round = (long) (time / budget->interval) + 1;
+    }
+    pthread_mutex_unlock(&budget->lock);
+#else
+    (void) budget;
+    (void) time;
+    (void) power;
+    (void) cap;
+    (void) new_cap;
+#endif
+    return changed;
+}
+
+int poli_power_budget_finish (struct power_budget *budget)
+{
+#if !defined(_NOMPI) && MPI_VERSION >= 3
+    if (!budget->enabled)
+        return 0;
+    //the sampler thread doesn't start any exchange from now on
+    pthread_mutex_lock(&budget->lock);
+    budget->stopped = 1;
+    pthread_mutex_unlock(&budget->lock);
+
+    //the monitors stopped after different numbers of exchanges, so they agree on the last one outside of the exchanges'
+    //communicator, before waiting for any exchange
+    long max_rounds = budget->num_rounds;
+    MPI_Allreduce(&budget->num_rounds, &max_rounds, 1, MPI_LONG, MPI_MAX, budget->monitors_comm);
+
+    //a monitor waits for an exchange only once every monitor that has not started it yet is about to
+    if (budget->in_flight)
+        complete_round(budget, 1);
+    for (; budget->num_rounds < max_rounds; budget->num_rounds++)
+    {
+        MPI_Iallgather(&budget->send, BUDGET_NODE_DOUBLES, MPI_DOUBLE, budget->nodes, BUDGET_NODE_DOUBLES, MPI_DOUBLE,
+            budget->comm, &budget->request);
+        budget->in_flight = 1;
+        complete_round(budget, 1);
+    }
+    budget->enabled = 0;
+#else
+    (void) budget;
+#endif
+    return 0;
+}
+
+int poli_power_budget_allocate (double watts, struct budget_node *nodes, int num_nodes, double *caps)
+{
+    double *floor = malloc(2 * num_nodes * sizeof(double));
+    if (floor == NULL)
+        return 1;
+    double *ceiling = floor + num_nodes;
+
+    //idle nodes only ask for what they use, nodes held back by their cap ask for as much as they can get
+    double min_total = 0.0;
+    int node;
+    for (node = 0; node < num_nodes; node++)
+    {
+        floor[node] = nodes[node].min;
+        ceiling[node] = nodes[node].max;
+        if (nodes[node].power < POWER_BUDGET_IDLE_FRACTION * nodes[node].cap)
+        {
+            double demand = nodes[node].power * (1.0 + POWER_BUDGET_MARGIN);
+            if (demand < ceiling[node])
+                ceiling[node] = (demand > floor[node]) ? demand : floor[node];
+        }
+        caps[node] = floor[node];
+        min_total += floor[node];
+    }
+    if (watts <= min_total)
+    {
+        free(floor);
+        return (watts < min_total);
+    }
+
+    fill_to_level(watts, floor, ceiling, caps, num_nodes);
+
+    //what is left once every node got what it asked for goes to all nodes, idle ones included
+    double total = 0.0;
+    for (node = 0; node < num_nodes; node++)
+        total += caps[node];
+    if (total < watts)
+    {
+        for (node = 0; node < num_nodes; node++)
+        {
+            floor[node] = caps[node];
+            ceiling[node] = nodes[node].max;
+        }
+        fill_to_level(watts, floor, ceiling, caps, num_nodes);
+    }
+    free(floor);
+    return 0;
+}
+
+void poli_power_budget_destroy (struct power_budget *budget)
+{
+#if !defined(_NOMPI) && MPI_VERSION >= 3
+    if (budget->comm != MPI_COMM_NULL)
+    {
+        pthread_mutex_destroy(&budget->lock);
+        MPI_Comm_free(&budget->comm);
+    }
+#endif
+    free(budget->nodes);
+    free(budget->caps);
+    budget->nodes = 0;
+    budget->caps = 0;
+    budget->enabled = 0;
+}
+
+static void fill_to_level (double watts, double *floor, double *ceiling, double *caps, int num_nodes)
+{
+    double low = floor[0], high = ceiling[0];
+    int node;
+    for (node = 1; node < num_nodes; node++)
+    {
+        if (floor[node] < low)
+            low = floor[node];
+        if (ceiling[node] > high)
+            high = ceiling[node];
+    }
+    if (sum_at_level(high, floor, ceiling, num_nodes) <= watts)
+        low = high;
+
+    //the same steps on every monitor give the same caps
+    int step;
+    for (step = 0; step < 64 && low < high; step++)
+    {
+        double level = (low + high) / 2.0;
+        if (sum_at_level(level, floor, ceiling, num_nodes) <= watts)
+            low = level;
+        else
+            high = level;
+    }
+    for (node = 0; node < num_nodes; node++)
+        caps[node] = (low < floor[node]) ? floor[node] : (low > ceiling[node]) ? ceiling[node] : low;
+}
+
+static double sum_at_level (double level, double *floor, double *ceiling, int num_nodes)
+{
+    double total = 0.0;
+    int node;
+    for (node = 0; node < num_nodes; node++)
+        total += (level < floor[node]) ? floor[node] : (level > ceiling[node]) ? ceiling[node] : level;
+    return total;
+}
+
+#if !defined(_NOMPI) && MPI_VERSION >= 3
+static int complete_round (struct power_budget *budget, int wait)
+{
+    int done = 1;
+    if (wait)
+        MPI_Wait(&budget->request, MPI_STATUS_IGNORE);
+    else
+        MPI_Test(&budget->request, &done, MPI_STATUS_IGNORE);
+    if (done)
+        budget->in_flight = 0;
+    return done;
+}
+#endif
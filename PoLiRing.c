@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "PoLiLog.h"
+#include "PoLiRing.h"
+
+// Number of records read from the spool at once
+#define RING_READ_BATCH 256
+// Number of records written to the spool at once
+#define RING_WRITE_BATCH 256
+
+static void *ring_writer (void *arg);
+static int ring_drain (struct poli_ring *ring);
+static int write_all (int fd, const char *buf, size_t len);
+
+static inline char *ring_slot (struct poli_ring *ring, unsigned long index)
+{
+    return ring->slots + (index & ring->mask) * ring->slot_size;
+}
+
+static inline unsigned long *slot_seq (char *slot)
+{
+    return (unsigned long *) slot;
+}
+
+int poli_ring_init (struct poli_ring *ring, size_t record_size, unsigned long capacity, char *spool_path)
+{
+    poli_log(TRACE, NULL, "Entering %s", __FUNCTION__);
+
+    memset(ring, 0, sizeof(struct poli_ring));
+    ring->spool_fd = -1;
+
+    unsigned long cap = 1;
+    while (cap < capacity)
+        cap <<= 1;
+
+    ring->record_size = record_size;
+    ring->slot_size = (RING_SLOT_HEADER + record_size + RING_CACHE_LINE - 1) & ~((size_t) RING_CACHE_LINE - 1);
+
+    //capacity stays 0 until the ring is usable, so a ring that failed to initialize drops every record
+    void *slots = NULL;
+    if (posix_memalign(&slots, RING_CACHE_LINE, cap * ring->slot_size) != 0)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to allocate %lu records of %lu bytes", __FUNCTION__, cap, (unsigned long) record_size);
+        return 1;
+    }
+    memset(slots, 0, cap * ring->slot_size);
+    ring->slots = slots;
+
+    ring->write_buffer = malloc(RING_WRITE_BATCH * record_size);
+    if (ring->write_buffer == NULL)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to allocate write buffer", __FUNCTION__);
+        free(ring->slots);
+        ring->slots = 0;
+        return 1;
+    }
+
+    ring->spool_fd = open(spool_path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (ring->spool_fd < 0)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to open spool file %s: %s", __FUNCTION__, spool_path, strerror(errno));
+        free(ring->slots);
+        ring->slots = 0;
+        free(ring->write_buffer);
+        ring->write_buffer = 0;
+        return 1;
+    }
+    //the spool is only needed while the ring exists
+    unlink(spool_path);
+
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+
+    ring->capacity = cap;
+    ring->mask = cap - 1;
+    ring->running = 1;
+    int status = pthread_create(&ring->writer, NULL, &ring_writer, ring);
+    if (status != 0)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to start writer thread: %s", __FUNCTION__, strerror(status));
+        ring->running = 0;
+        ring->capacity = 0;
+        ring->mask = 0;
+        close(ring->spool_fd);
+        ring->spool_fd = -1;
+        free(ring->slots);
+        ring->slots = 0;
+        free(ring->write_buffer);
+        ring->write_buffer = 0;
+        return 1;
+    }
+
+    poli_log(TRACE, NULL, "Finishing %s", __FUNCTION__);
+
+    return 0;
+}
+
+void *poli_ring_reserve (struct poli_ring *ring)
+{
+    if (ring->slots == NULL)
+        return NULL;
+
+    unsigned long head = ring->head;
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail >= ring->capacity)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&ring->offered, ring->offered + 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    char *slot = ring_slot(ring, head);
+    //mark the slot as being written before touching the record
+    __atomic_store_n(slot_seq(slot), 2 * head + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    return slot + RING_SLOT_HEADER;
+}
+
+void poli_ring_commit (struct poli_ring *ring)
+{
+    unsigned long head = ring->head;
+    char *slot = ring_slot(ring, head);
+
+    __atomic_store_n(slot_seq(slot), 2 * head + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->offered, ring->offered + 1, __ATOMIC_RELEASE);
+
+    //wake the writer early if the ring is filling up, but never wait for it:
+    //if the lock is busy the next commit tries again
+    if (head + 1 - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) >= ring->capacity / 2
+        && pthread_mutex_trylock(&ring->lock) == 0)
+    {
+        pthread_cond_signal(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+unsigned long poli_ring_offered (struct poli_ring *ring)
+{
+    return __atomic_load_n(&ring->offered, __ATOMIC_ACQUIRE);
+}
+
+int poli_ring_latest (struct poli_ring *ring, void *record)
+{
+    for (;;)
+    {
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head == 0)
+            return 1;
+
+        char *slot = ring_slot(ring, head - 1);
+        unsigned long seq = __atomic_load_n(slot_seq(slot), __ATOMIC_ACQUIRE);
+        //the slot has already been reused for a newer record, start over
+        if (seq != 2 * (head - 1) + 2)
+            continue;
+
+        memcpy(record, slot + RING_SLOT_HEADER, ring->record_size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(slot_seq(slot), __ATOMIC_RELAXED) == seq)
+            return 0;
+    }
+}
+
+int poli_ring_stop (struct poli_ring *ring)
+{
+    poli_log(TRACE, NULL, "Entering %s", __FUNCTION__);
+
+    if (ring->running)
+    {
+        pthread_mutex_lock(&ring->lock);
+        ring->running = 0;
+        pthread_cond_signal(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+        pthread_join(ring->writer, NULL);
+    }
+
+    //spool whatever the writer didn't get to
+    ring_drain(ring);
+
+    if (ring->dropped > 0)
+        poli_log(WARNING, NULL, "%lu records were dropped because the writer couldn't keep up", ring->dropped);
+
+    poli_log(TRACE, NULL, "Finishing %s", __FUNCTION__);
+
+    return ring->write_error;
+}
+
+unsigned long poli_ring_num_records (struct poli_ring *ring)
+{
+    return ring->num_spooled;
+}
+
+int poli_ring_read_next (struct poli_ring *ring, void *record)
+{
+    if (ring->read_next >= ring->num_spooled)
+        return 1;
+
+    if (ring->read_buffer == NULL)
+    {
+        ring->read_buffer = malloc(RING_READ_BATCH * ring->record_size);
+        if (ring->read_buffer == NULL)
+            return 1;
+        ring->read_buffer_records = RING_READ_BATCH;
+        ring->read_buffer_start = 0;
+        ring->read_buffer_count = 0;
+    }
+
+    if (ring->read_next >= ring->read_buffer_start + ring->read_buffer_count)
+    {
+        unsigned long count = ring->num_spooled - ring->read_next;
+        if (count > ring->read_buffer_records)
+            count = ring->read_buffer_records;
+
+        size_t len = count * ring->record_size;
+        off_t offset = (off_t) ring->read_next * ring->record_size;
+        size_t done = 0;
+        while (done < len)
+        {
+            ssize_t r = pread(ring->spool_fd, ring->read_buffer + done, len - done, offset + done);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+            {
+                poli_log(ERROR, NULL, "%s: Failed to read from spool: %s", __FUNCTION__, r < 0 ? strerror(errno) : "unexpected end of file");
+                return 1;
+            }
+            done += r;
+        }
+        ring->read_buffer_start = ring->read_next;
+        ring->read_buffer_count = count;
+    }
+
+    memcpy(record, ring->read_buffer + (ring->read_next - ring->read_buffer_start) * ring->record_size, ring->record_size);
+    ring->read_next++;
+
+    return 0;
+}
+
+void poli_ring_rewind (struct poli_ring *ring)
+{
+    ring->read_next = 0;
+    ring->read_buffer_start = 0;
+    ring->read_buffer_count = 0;
+}
+
+void poli_ring_destroy (struct poli_ring *ring)
+{
+    if (ring->running)
+        poli_ring_stop(ring);
+
+    if (ring->spool_fd >= 0)
+        close(ring->spool_fd);
+    ring->spool_fd = -1;
+
+    if (ring->slots)
+        free(ring->slots);
+    ring->slots = 0;
+
+    if (ring->write_buffer)
+        free(ring->write_buffer);
+    ring->write_buffer = 0;
+
+    if (ring->read_buffer)
+        free(ring->read_buffer);
+    ring->read_buffer = 0;
+
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->cond);
+}
+
+static void *ring_writer (void *arg)
+{
+    struct poli_ring *ring = (struct poli_ring *) arg;
+
+    pthread_mutex_lock(&ring->lock);
+    while (ring->running)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t) RING_WRITER_PERIOD;
+        deadline.tv_nsec += (long) ((RING_WRITER_PERIOD - (time_t) RING_WRITER_PERIOD) * 1e9);
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_cond_timedwait(&ring->cond, &ring->lock, &deadline);
+        if (!ring->running)
+            break;
+
+        pthread_mutex_unlock(&ring->lock);
+        ring_drain(ring);
+        pthread_mutex_lock(&ring->lock);
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    return NULL;
+}
+
+/* writes records [tail, head) to the spool; only one thread drains at a time */
+static int ring_drain (struct poli_ring *ring)
+{
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long tail = ring->tail;
+
+    while (tail < head)
+    {
+        unsigned long count = head - tail;
+        if (count > RING_WRITE_BATCH)
+            count = RING_WRITE_BATCH;
+
+        unsigned long i;
+        for (i = 0; i < count; i++)
+            memcpy(ring->write_buffer + i * ring->record_size, ring_slot(ring, tail + i) + RING_SLOT_HEADER, ring->record_size);
+
+        //the slots can be reused as soon as they are copied out
+        tail += count;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        if (!ring->write_error)
+        {
+            if (write_all(ring->spool_fd, ring->write_buffer, count * ring->record_size) != 0)
+            {
+                poli_log(ERROR, NULL, "%s: Failed to write to spool: %s. Further records will be lost.", __FUNCTION__, strerror(errno));
+                ring->write_error = 1;
+            }
+            else
+                ring->num_spooled += count;
+        }
+    }
+
+    return ring->write_error;
+}
+
+static int write_all (int fd, const char *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t w = write(fd, buf + done, len - done);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return 1;
+        done += w;
+    }
+    return 0;
+}
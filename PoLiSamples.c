@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "PoLiMEr.h"
+#include "PoLiLog.h"
+#include "PoLiSamples.h"
+
+static double *field_in_reading (struct energy_reading *reading, struct frequency *freq, sample_field_t field);
+static void add_field (struct sample_schema *schema, sample_field_t field, int is_energy, double missing_power);
+
+void poli_sample_schema_init (struct sample_schema *schema, struct energy_reading *reading, int num_sockets)
+{
+    memset(schema, 0, sizeof(struct sample_schema));
+    int field;
+    for (field = 0; field < SAMPLE_NUM_FIELDS; field++)
+        schema->column[field] = -1;
+
+    //RAPL domains the node can't read stay at -1 and are never stored
+    for (field = SAMPLE_RAPL_PKG; field <= SAMPLE_RAPL_DRAM; field++)
+        if (*field_in_reading(reading, NULL, field) != -1.0)
+            add_field(schema, field, 1, -1.0);
+
+    //per package values are only reported on multi-socket nodes
+    if (num_sockets > 1)
+    {
+        for (field = SAMPLE_RAPL_SOCKET; field < SAMPLE_RAPL_SOCKET + SAMPLE_SOCKET_DOMAINS * num_sockets; field++)
+            if (*field_in_reading(reading, NULL, field) != -1.0)
+                add_field(schema, field, 1, -1.0);
+    }
+
+#ifdef _CRAY
+    add_field(schema, SAMPLE_CRAY_NODE_ENERGY, 1, 0.0);
+    add_field(schema, SAMPLE_CRAY_NODE_POWER, 0, 0.0);
+    add_field(schema, SAMPLE_CRAY_CPU_ENERGY, 1, 0.0);
+    add_field(schema, SAMPLE_CRAY_CPU_POWER, 0, 0.0);
+    add_field(schema, SAMPLE_CRAY_MEMORY_ENERGY, 1, 0.0);
+    add_field(schema, SAMPLE_CRAY_MEMORY_POWER, 0, 0.0);
+    add_field(schema, SAMPLE_CRAY_FREQ, 0, 0.0);
+#elif _BGQ
+    for (field = SAMPLE_BGQ_CARD_POWER; field <= SAMPLE_BGQ_SRAM; field++)
+        add_field(schema, field, 0, 0.0);
+#endif
+    add_field(schema, SAMPLE_FREQ, 0, 0.0);
+
+    schema->sample_size = offsetof(struct poli_sample, values) + schema->num_columns * sizeof(double);
+
+    poli_log(DEBUG, NULL, "Storing %d values per sample (%lu bytes)", schema->num_columns, (unsigned long) schema->sample_size);
+}
+
+static void add_field (struct sample_schema *schema, sample_field_t field, int is_energy, double missing_power)
+{
+    int column = schema->num_columns++;
+    schema->column[field] = column;
+    schema->field[column] = field;
+    schema->is_energy[column] = is_energy;
+    schema->missing_power[column] = missing_power;
+}
+
+/* returns where a field lives in an energy reading (or the frequency), NULL if it doesn't exist in this build */
+static double *field_in_reading (struct energy_reading *reading, struct frequency *freq, sample_field_t field)
+{
+    if (field >= SAMPLE_RAPL_SOCKET && field < SAMPLE_CRAY_NODE_ENERGY)
+    {
+        struct rapl_energy *re = &reading->rapl_socket_energy[(field - SAMPLE_RAPL_SOCKET) / SAMPLE_SOCKET_DOMAINS];
+        switch ((field - SAMPLE_RAPL_SOCKET) % SAMPLE_SOCKET_DOMAINS)
+        {
+            case 0: return &re->package;
+            case 1: return &re->pp0;
+            case 2: return &re->pp1;
+            default: return &re->dram;
+        }
+    }
+
+    switch (field)
+    {
+        case SAMPLE_RAPL_PKG: return &reading->rapl_energy.package;
+        case SAMPLE_RAPL_PP0: return &reading->rapl_energy.pp0;
+        case SAMPLE_RAPL_PP1: return &reading->rapl_energy.pp1;
+        case SAMPLE_RAPL_PLATFORM: return &reading->rapl_energy.platform;
+        case SAMPLE_RAPL_DRAM: return &reading->rapl_energy.dram;
+#ifdef _CRAY
+        case SAMPLE_CRAY_NODE_ENERGY: return &reading->cray_meas.node_energy;
+        case SAMPLE_CRAY_NODE_POWER: return &reading->cray_meas.node_power;
+        case SAMPLE_CRAY_CPU_ENERGY: return &reading->cray_meas.cpu_energy;
+        case SAMPLE_CRAY_CPU_POWER: return &reading->cray_meas.cpu_power;
+        case SAMPLE_CRAY_MEMORY_ENERGY: return &reading->cray_meas.memory_energy;
+        case SAMPLE_CRAY_MEMORY_POWER: return &reading->cray_meas.memory_power;
+        case SAMPLE_CRAY_FREQ: return freq ? &freq->cray_freq : NULL;
+#elif _BGQ
+        case SAMPLE_BGQ_CARD_POWER: return &reading->bgq_meas.card_power;
+        case SAMPLE_BGQ_CPU: return &reading->bgq_meas.cpu;
+        case SAMPLE_BGQ_DRAM: return &reading->bgq_meas.dram;
+        case SAMPLE_BGQ_OPTICS: return &reading->bgq_meas.optics;
+        case SAMPLE_BGQ_PCI: return &reading->bgq_meas.pci;
+        case SAMPLE_BGQ_NETWORK: return &reading->bgq_meas.network;
+        case SAMPLE_BGQ_LINK_CHIP: return &reading->bgq_meas.link_chip;
+        case SAMPLE_BGQ_SRAM: return &reading->bgq_meas.sram;
+#endif
+        case SAMPLE_FREQ: return freq ? &freq->freq : NULL;
+        default: return NULL;
+    }
+}
+
+void poli_sample_pack (struct sample_schema *schema, struct poli_sample *sample, struct system_poll_info *info)
+{
+    sample->counter = info->counter;
+    sample->wtime = info->wtime;
+    sample->interval = info->interval;
+    sample->poll_iter_time = info->poll_iter_time;
+
+    int column;
+    for (column = 0; column < schema->num_columns; column++)
+        sample->values[column] = *field_in_reading(&info->current_energy, &info->freq, schema->field[column]);
+}
+
+void poli_sample_read_values (struct sample_schema *schema, struct energy_reading *reading, double *values)
+{
+    int column;
+    for (column = 0; column < schema->num_columns; column++)
+    {
+        double *value = field_in_reading(reading, NULL, schema->field[column]);
+        values[column] = (value != NULL) ? *value : -1.0;
+    }
+}
+
+void poli_sample_field_name (sample_field_t field, char *name, size_t len)
+{
+    static char *rapl_names[] = {"RAPL pkg", "RAPL PP0", "RAPL PP1", "RAPL platform", "RAPL dram"};
+    static char *socket_names[] = {"RAPL pkg%d", "RAPL PP0 pkg%d", "RAPL PP1 pkg%d", "RAPL dram pkg%d"};
+    static char *other_names[] = {"Cray node", "Cray node", "Cray cpu", "Cray cpu", "Cray memory", "Cray memory", "Cray freq",
+        "BGQ card", "BGQ cpu", "BGQ dram", "BGQ optics", "BGQ pci", "BGQ network", "BGQ link chip", "BGQ sram", "freq"};
+
+    if (field < SAMPLE_RAPL_SOCKET)
+        snprintf(name, len, "%s", rapl_names[field]);
+    else if (field < SAMPLE_CRAY_NODE_ENERGY)
+        snprintf(name, len, socket_names[(field - SAMPLE_RAPL_SOCKET) % SAMPLE_SOCKET_DOMAINS], (field - SAMPLE_RAPL_SOCKET) / SAMPLE_SOCKET_DOMAINS);
+    else if (field < SAMPLE_NUM_FIELDS)
+        snprintf(name, len, "%s", other_names[field - SAMPLE_CRAY_NODE_ENERGY]);
+    else
+        snprintf(name, len, "unknown");
+}
+
+void poli_sample_get_energy (struct sample_schema *schema, struct poli_sample *sample, struct energy_reading *reading)
+{
+    int field;
+    for (field = SAMPLE_RAPL_PKG; field < SAMPLE_CRAY_NODE_ENERGY; field++)
+        *field_in_reading(reading, NULL, field) = -1.0;
+#ifdef _CRAY
+    for (field = SAMPLE_CRAY_NODE_ENERGY; field <= SAMPLE_CRAY_MEMORY_POWER; field++)
+        *field_in_reading(reading, NULL, field) = -1.0;
+    reading->cray_meas.node_measured_power = -1.0;
+    reading->cray_meas.cpu_measured_power = -1.0;
+    reading->cray_meas.memory_measured_power = -1.0;
+#elif _BGQ
+    init_bgq_measurement(&reading->bgq_meas);
+#endif
+
+    int column;
+    for (column = 0; column < schema->num_columns; column++)
+    {
+        double *value = field_in_reading(reading, NULL, schema->field[column]);
+        if (value != NULL)
+            *value = sample->values[column];
+    }
+}
+
+int poli_sample_block_init (struct sample_block *block, struct sample_schema *schema, struct energy_reading *initial)
+{
+    memset(block, 0, sizeof(struct sample_block));
+
+    size_t columns_size = (size_t) schema->num_columns * SAMPLE_BLOCK * sizeof(double);
+    block->values = malloc(columns_size);
+    block->power = malloc(columns_size);
+    block->last = malloc(schema->num_columns * sizeof(double));
+    if (block->values == NULL || block->power == NULL || block->last == NULL)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to allocate %d columns of %d samples", __FUNCTION__, schema->num_columns, SAMPLE_BLOCK);
+        poli_sample_block_destroy(block);
+        return 1;
+    }
+
+    int column;
+    for (column = 0; column < schema->num_columns; column++)
+    {
+        double *value = field_in_reading(initial, NULL, schema->field[column]);
+        block->last[column] = (value != NULL) ? *value : 0.0;
+    }
+
+    return 0;
+}
+
+int poli_sample_block_read (struct sample_block *block, struct sample_schema *schema, struct poli_ring *ring)
+{
+    struct poli_sample sample;
+    int i, column;
+
+    //transpose the spooled rows into columns
+    for (i = 0; i < SAMPLE_BLOCK; i++)
+    {
+        if (poli_ring_read_next(ring, &sample) != 0)
+            break;
+        block->counter[i] = sample.counter;
+        block->wtime[i] = sample.wtime;
+        block->interval[i] = sample.interval;
+        for (column = 0; column < schema->num_columns; column++)
+            block->values[column * SAMPLE_BLOCK + i] = sample.values[column];
+    }
+    block->num_samples = i;
+
+    //power of an energy counter over each sample's interval; counters that weren't read or went backwards have none
+    for (column = 0; column < schema->num_columns; column++)
+    {
+        if (!schema->is_energy[column])
+            continue;
+
+        double *energy = &block->values[column * SAMPLE_BLOCK];
+        double *power = &block->power[column * SAMPLE_BLOCK];
+        double last = block->last[column];
+        double missing = schema->missing_power[column];
+        for (i = 0; i < block->num_samples; i++)
+        {
+            if (energy[i] > -1 && last > -1 && energy[i] >= last)
+                power[i] = (energy[i] - last) / block->interval[i];
+            else
+                power[i] = missing;
+            last = energy[i];
+        }
+        block->last[column] = last;
+    }
+
+    return block->num_samples;
+}
+
+double poli_sample_value (struct sample_block *block, struct sample_schema *schema, sample_field_t field, int i)
+{
+    int column = schema->column[field];
+    if (column < 0)
+        return -1.0;
+    return block->values[column * SAMPLE_BLOCK + i];
+}
+
+double poli_sample_power (struct sample_block *block, struct sample_schema *schema, sample_field_t field, int i)
+{
+    int column = schema->column[field];
+    if (column < 0 || !schema->is_energy[column])
+        return -1.0;
+    return block->power[column * SAMPLE_BLOCK + i];
+}
+
+void poli_sample_block_destroy (struct sample_block *block)
+{
+    if (block->values)
+        free(block->values);
+    block->values = 0;
+
+    if (block->power)
+        free(block->power);
+    block->power = 0;
+
+    if (block->last)
+        free(block->last);
+    block->last = 0;
+}
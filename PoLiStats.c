@@ -0,0 +1,91 @@
+#include <string.h>
+
+#include "PoLiStats.h"
+
+#ifndef _NOMPI
+static void merge_node_stats (void *in, void *inout, int *len, MPI_Datatype *type);
+#endif
+
+void poli_stats_init (struct running_stats *stats)
+{
+    memset(stats, 0, sizeof(struct running_stats));
+}
+
+void poli_stats_update (struct running_stats *stats, double value)
+{
+    stats->count++;
+    stats->total += value;
+    if (stats->count == 1 || value < stats->min)
+        stats->min = value;
+    if (stats->count == 1 || value > stats->max)
+        stats->max = value;
+
+    double delta = value - stats->mean;
+    stats->mean += delta / stats->count;
+    stats->m2 += delta * (value - stats->mean);
+}
+
+double poli_stats_variance (struct running_stats *stats)
+{
+    if (stats->count == 0)
+        return 0.0;
+    return stats->m2 / stats->count;
+}
+
+void poli_node_stats_init (struct node_stats *stats)
+{
+    memset(stats, 0, sizeof(struct node_stats));
+    stats->min_node = -1;
+    stats->max_node = -1;
+}
+
+void poli_node_stats_set (struct node_stats *stats, double value, int node)
+{
+    stats->count = 1;
+    stats->total = value;
+    stats->min = value;
+    stats->max = value;
+    stats->min_node = node;
+    stats->max_node = node;
+}
+
+void poli_node_stats_merge (struct node_stats *into, const struct node_stats *from)
+{
+    if (from->count == 0)
+        return;
+    if (into->count == 0)
+    {
+        *into = *from;
+        return;
+    }
+    into->count += from->count;
+    into->total += from->total;
+    if (from->min < into->min || (from->min == into->min && from->min_node < into->min_node))
+    {
+        into->min = from->min;
+        into->min_node = from->min_node;
+    }
+    if (from->max > into->max || (from->max == into->max && from->max_node < into->max_node))
+    {
+        into->max = from->max;
+        into->max_node = from->max_node;
+    }
+}
+
+#ifndef _NOMPI
+void poli_node_stats_mpi_create (MPI_Datatype *type, MPI_Op *op)
+{
+    MPI_Type_contiguous(sizeof(struct node_stats) / sizeof(double), MPI_DOUBLE, type);
+    MPI_Type_commit(type);
+    MPI_Op_create(merge_node_stats, 1, op);
+}
+
+static void merge_node_stats (void *in, void *inout, int *len, MPI_Datatype *type)
+{
+    struct node_stats *from = in, *into = inout;
+    (void) type;
+    int i;
+    for (i = 0; i < *len; i++)
+        poli_node_stats_merge(&into[i], &from[i]);
+}
+#endif
@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "PoLiMEr.h"
+#include "PoLiLog.h"
+#include "PoLiTagEvents.h"
+
+/* an instance of a tag on one rank, the k-th time the rank started it */
+struct rank_interval {
+    char *name;
+    int instance;
+    double start;
+    double end;
+};
+
+static struct tag_event_segment *get_segment (struct tag_event_log *log, int rank);
+static int match_rank_events (struct tag_event_segment *segment, struct rank_interval *intervals, int *num_intervals);
+static int compare_rank_intervals (const void *a, const void *b);
+static int compare_tag_intervals (const void *a, const void *b);
+
+int poli_tag_events_init (struct tag_event_log *log, struct monitor_t *monitor, int max_events)
+{
+    memset(log, 0, sizeof(struct tag_event_log));
+    size_t size = sizeof(struct tag_event_segment) + (size_t) max_events * sizeof(struct tag_event);
+
+#ifdef _NOMPI
+    log->segment = calloc(1, size);
+    if (log->segment == NULL)
+    {
+        poli_log(ERROR, monitor, "%s: Failed to allocate the tag event log", __FUNCTION__);
+        return 1;
+    }
+    log->num_ranks = 1;
+#elif MPI_VERSION >= 3
+    struct tag_event_segment *segment;
+    if (MPI_Win_allocate_shared(size, 1, MPI_INFO_NULL, monitor->mynode_comm, &segment, &log->win) != MPI_SUCCESS)
+    {
+        poli_log(ERROR, monitor, "%s: Failed to allocate the tag event log", __FUNCTION__);
+        return 1;
+    }
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, log->win);
+    memset(segment, 0, size);
+    log->segment = segment;
+    log->num_ranks = monitor->node_size;
+#else
+    poli_log(WARNING, monitor, "Tag boundaries can't be shared between ranks without MPI-3");
+    return 1;
+#endif
+
+    log->segment->max_events = max_events;
+    return 0;
+}
+
+double poli_tag_events_clock (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+int poli_tag_events_record (struct tag_event_log *log, int *name_index, char *name, tag_event_kind_t kind)
+{
+    struct tag_event_segment *segment = log->segment;
+    if (segment == NULL)
+        return 1;
+
+    if (*name_index == -1)
+    {
+        if (segment->num_names == TAG_EVENT_MAX_NAMES)
+        {
+            if (segment->dropped_names++ == 0)
+                poli_log(WARNING, NULL, "A rank can log at most %d tag names, first/last tag %s and any other new one won't be recorded", TAG_EVENT_MAX_NAMES, name);
+            return 1;
+        }
+        strncpy(segment->names[segment->num_names], name, TAG_EVENT_NAME_LEN - 1);
+        *name_index = segment->num_names++;
+    }
+
+    if (segment->num_events == segment->max_events)
+    {
+        segment->dropped++;
+        return 1;
+    }
+
+    struct tag_event *event = &segment->events[segment->num_events];
+    event->name = *name_index;
+    event->kind = kind;
+    event->time = poli_tag_events_clock();
+    segment->num_events++;
+    return 0;
+}
+
+void poli_tag_events_flush (struct tag_event_log *log)
+{
+#if !defined(_NOMPI) && MPI_VERSION >= 3
+    if (log->segment)
+        MPI_Win_sync(log->win);
+#else
+    (void) log;
+#endif
+}
+
+static struct tag_event_segment *get_segment (struct tag_event_log *log, int rank)
+{
+#if !defined(_NOMPI) && MPI_VERSION >= 3
+    MPI_Aint size;
+    int disp_unit;
+    struct tag_event_segment *segment;
+    if (MPI_Win_shared_query(log->win, rank, &size, &disp_unit, &segment) != MPI_SUCCESS)
+        return NULL;
+    return segment;
+#else
+    (void) rank;
+    return log->segment;
+#endif
+}
+
+int poli_tag_events_collect (struct tag_event_log *log, struct tag_interval **intervals, int *num_intervals)
+{
+    *intervals = 0;
+    *num_intervals = 0;
+    if (log->segment == NULL)
+        return 1;
+
+    poli_tag_events_flush(log);
+
+    int rank, num_events = 0, dropped = 0, dropped_names = 0;
+    for (rank = 0; rank < log->num_ranks; rank++)
+    {
+        struct tag_event_segment *segment = get_segment(log, rank);
+        if (segment == NULL)
+            return 1;
+        num_events += segment->num_events;
+        dropped += segment->dropped;
+        dropped_names += segment->dropped_names;
+    }
+    if (dropped > 0)
+        poli_log(WARNING, NULL, "%d tag boundaries didn't fit in the tag event log (see PoLi_TAG_EVENTS), their tags are incomplete", dropped);
+    if (dropped_names > 0)
+        poli_log(WARNING, NULL, "%d tag boundaries weren't logged because their rank logged %d tag names already", dropped_names, TAG_EVENT_MAX_NAMES);
+    if (num_events == 0)
+        return 0;
+
+    struct rank_interval *rank_intervals = malloc(num_events * sizeof(struct rank_interval));
+    if (rank_intervals == NULL)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to allocate memory for %d tag events", __FUNCTION__, num_events);
+        return 1;
+    }
+    int num_rank_intervals = 0;
+    for (rank = 0; rank < log->num_ranks; rank++)
+    {
+        if (match_rank_events(get_segment(log, rank), rank_intervals, &num_rank_intervals) != 0)
+        {
+            free(rank_intervals);
+            return 1;
+        }
+    }
+
+    //the n-th instance of a tag on every rank becomes one interval
+    qsort(rank_intervals, num_rank_intervals, sizeof(struct rank_interval), compare_rank_intervals);
+    struct tag_interval *result = malloc(num_rank_intervals * sizeof(struct tag_interval));
+    if (result == NULL && num_rank_intervals > 0)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to allocate memory for %d tag intervals", __FUNCTION__, num_rank_intervals);
+        free(rank_intervals);
+        return 1;
+    }
+    int i, n = 0;
+    for (i = 0; i < num_rank_intervals; i++)
+    {
+        struct rank_interval *ri = &rank_intervals[i];
+        if (n > 0 && i > 0 && compare_rank_intervals(ri, &rank_intervals[i - 1]) == 0)
+        {
+            struct tag_interval *ti = &result[n - 1];
+            if (ri->start < ti->start)
+                ti->start = ri->start;
+            if (ti->end != -1 && (ri->end == -1 || ri->end > ti->end))
+                ti->end = ri->end;
+        }
+        else
+        {
+            result[n].name = ri->name;
+            result[n].start = ri->start;
+            result[n].end = ri->end;
+            n++;
+        }
+    }
+    free(rank_intervals);
+
+    qsort(result, n, sizeof(struct tag_interval), compare_tag_intervals);
+    *intervals = result;
+    *num_intervals = n;
+    return 0;
+}
+
+/* match_rank_events - pairs every start of a rank with its end, the most recent open instance of a name is ended first
+   input: the rank's segment, where to append the intervals, their number
+   returns: 0 if no errors, 1 otherwise*/
+static int match_rank_events (struct tag_event_segment *segment, struct rank_interval *intervals, int *num_intervals)
+{
+    if (segment->num_events == 0)
+        return 0;
+
+    int *open = malloc(segment->num_names * sizeof(int)); //by name: most recent open instance, -1 if none
+    int *num_started = calloc(segment->num_names, sizeof(int));
+    int *prev_open = malloc(segment->num_events * sizeof(int)); //by interval: the instance open before it
+    if (open == NULL || num_started == NULL || prev_open == NULL)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to allocate memory for %d tag events", __FUNCTION__, segment->num_events);
+        free(open);
+        free(num_started);
+        free(prev_open);
+        return 1;
+    }
+
+    int i;
+    for (i = 0; i < segment->num_names; i++)
+        open[i] = -1;
+
+    int first = *num_intervals;
+    for (i = 0; i < segment->num_events; i++)
+    {
+        struct tag_event *event = &segment->events[i];
+        if (event->kind == TAG_EVENT_START)
+        {
+            struct rank_interval *ri = &intervals[*num_intervals];
+            ri->name = segment->names[event->name];
+            ri->instance = num_started[event->name]++;
+            ri->start = event->time;
+            ri->end = -1;
+            prev_open[*num_intervals - first] = open[event->name];
+            open[event->name] = *num_intervals - first;
+            (*num_intervals)++;
+        }
+        else if (open[event->name] != -1) //ends without a start (dropped) are ignored
+        {
+            intervals[first + open[event->name]].end = event->time;
+            open[event->name] = prev_open[open[event->name]];
+        }
+    }
+
+    free(open);
+    free(num_started);
+    free(prev_open);
+    return 0;
+}
+
+static int compare_rank_intervals (const void *a, const void *b)
+{
+    const struct rank_interval *ra = a, *rb = b;
+    int cmp = strcmp(ra->name, rb->name);
+    if (cmp != 0)
+        return cmp;
+    return (ra->instance > rb->instance) - (ra->instance < rb->instance);
+}
+
+static int compare_tag_intervals (const void *a, const void *b)
+{
+    const struct tag_interval *ta = a, *tb = b;
+    return (ta->start > tb->start) - (ta->start < tb->start);
+}
+
+void poli_tag_events_destroy (struct tag_event_log *log)
+{
+    if (log->segment == NULL)
+        return;
+#ifdef _NOMPI
+    free(log->segment);
+#elif MPI_VERSION >= 3
+    MPI_Win_unlock_all(log->win);
+    MPI_Win_free(&log->win);
+#endif
+    log->segment = 0;
+}
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "PoLiLog.h"
+#include "PoLiText.h"
+
+// Largest magnitude formatted without snprintf, its value in millionths still fits exactly in a double
+#define FAST_DOUBLE_LIMIT 1e9
+
+static char *reserve (struct text_writer *writer, size_t len);
+static int flush_buffer (struct text_writer *writer);
+static char *format_unsigned (char *end, uint64_t value);
+
+int poli_text_open (struct text_writer *writer, char *path)
+{
+    memset(writer, 0, sizeof(struct text_writer));
+    writer->date_second = (time_t) -1;
+    writer->buf = malloc(TEXT_BUFFER_SIZE);
+    if (writer->buf == NULL)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to allocate memory for the output of %s", __FUNCTION__, path);
+        return 1;
+    }
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd < 0)
+    {
+        poli_log(ERROR, NULL, "Failed to open file %s: %s", path, strerror(errno));
+        free(writer->buf);
+        return 1;
+    }
+    return 0;
+}
+
+void poli_text_puts (struct text_writer *writer, const char *string)
+{
+    size_t len = strlen(string);
+    while (len > 0)
+    {
+        size_t n = (len < TEXT_BUFFER_SIZE) ? len : TEXT_BUFFER_SIZE;
+        char *p = reserve(writer, n);
+        if (p == NULL)
+            return;
+        memcpy(p, string, n);
+        writer->len += n;
+        string += n;
+        len -= n;
+    }
+}
+
+void poli_text_putc (struct text_writer *writer, char c)
+{
+    char *p = reserve(writer, 1);
+    if (p == NULL)
+        return;
+    *p = c;
+    writer->len++;
+}
+
+void poli_text_printf (struct text_writer *writer, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    char *p = reserve(writer, TEXT_NUMBER_LEN);
+    int n = (p != NULL) ? vsnprintf(p, TEXT_BUFFER_SIZE - writer->len, format, args) : -1;
+    va_end(args);
+    if (n < 0)
+        return;
+    if ((size_t) n < TEXT_BUFFER_SIZE - writer->len)
+    {
+        writer->len += n;
+        return;
+    }
+
+    //didn't fit in what is left of the buffer
+    char *line = malloc(n + 1);
+    if (line == NULL)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to allocate memory for %d characters of output", __FUNCTION__, n);
+        writer->error = 1;
+        return;
+    }
+    va_start(args, format);
+    vsnprintf(line, n + 1, format, args);
+    va_end(args);
+    poli_text_puts(writer, line);
+    free(line);
+}
+
+void poli_text_double (struct text_writer *writer, double value)
+{
+    double scaled = fabs(value) * 1e6;
+    double whole = floor(scaled);
+    double frac = scaled - whole;
+    /* scaled is within half an ulp of the exact value in millionths, so unless it is that close to a tie
+       it rounds the same way printf rounds the exact value */
+    if (!isfinite(value) || fabs(value) >= FAST_DOUBLE_LIMIT || fabs(frac - 0.5) <= scaled * DBL_EPSILON)
+    {
+        char number[DBL_MAX_10_EXP + TEXT_NUMBER_LEN];
+        snprintf(number, sizeof(number), "%lf", value);
+        poli_text_puts(writer, number);
+        return;
+    }
+
+    char *p = reserve(writer, TEXT_NUMBER_LEN);
+    if (p == NULL)
+        return;
+
+    uint64_t units = (uint64_t) whole + (frac > 0.5);
+    char digits[TEXT_NUMBER_LEN];
+    char *end = digits + sizeof(digits);
+    char *start = format_unsigned(end - 7, units / 1000000);
+    uint64_t fraction = units % 1000000;
+    int i;
+    end[-7] = '.';
+    for (i = 1; i <= 6; i++)
+    {
+        end[-i] = '0' + (char) (fraction % 10);
+        fraction /= 10;
+    }
+    if (signbit(value))
+        *--start = '-';
+    memcpy(p, start, end - start);
+    writer->len += end - start;
+}
+
+void poli_text_field (struct text_writer *writer, double value)
+{
+    poli_text_double(writer, value);
+    poli_text_putc(writer, '\t');
+}
+
+void poli_text_doubles (struct text_writer *writer, const double *values, int count)
+{
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        if (i > 0)
+            poli_text_putc(writer, '\t');
+        poli_text_double(writer, values[i]);
+    }
+}
+
+void poli_text_int (struct text_writer *writer, long value)
+{
+    char *p = reserve(writer, TEXT_NUMBER_LEN);
+    if (p == NULL)
+        return;
+
+    char digits[TEXT_NUMBER_LEN];
+    char *end = digits + sizeof(digits);
+    char *start = format_unsigned(end, (value < 0) ? -(uint64_t) value : (uint64_t) value);
+    if (value < 0)
+        *--start = '-';
+    memcpy(p, start, end - start);
+    writer->len += end - start;
+}
+
+void poli_text_date (struct text_writer *writer, time_t second)
+{
+    if (second != writer->date_second)
+    {
+        struct tm timeinfo;
+        if (localtime_r(&second, &timeinfo) == NULL || strftime(writer->date, sizeof(writer->date), "%Y-%m-%d %H:%M:%S", &timeinfo) == 0)
+            writer->date[0] = '\0';
+        writer->date_second = second;
+    }
+    poli_text_puts(writer, writer->date);
+}
+
+int poli_text_close (struct text_writer *writer)
+{
+    flush_buffer(writer);
+    if (close(writer->fd) != 0)
+        writer->error = 1;
+    free(writer->buf);
+    writer->buf = NULL;
+    return writer->error;
+}
+
+/* reserve - makes room for len characters at the end of the buffer, writing it out if needed
+   returns: where to put them, NULL on error*/
+static char *reserve (struct text_writer *writer, size_t len)
+{
+    if (writer->buf == NULL)
+        return NULL;
+    if (writer->len + len > TEXT_BUFFER_SIZE && flush_buffer(writer) != 0)
+        return NULL;
+    return writer->buf + writer->len;
+}
+
+static int flush_buffer (struct text_writer *writer)
+{
+    const char *p = writer->buf;
+    size_t len = writer->len;
+    writer->len = 0;
+    while (len > 0)
+    {
+        ssize_t n = write(writer->fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (!writer->error)
+                poli_log(ERROR, NULL, "%s: Failed to write the text output: %s", __FUNCTION__, strerror(errno));
+            writer->error = 1;
+            return 1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* format_unsigned - writes the decimal digits of a value backwards
+   input: the end of the digits, the value
+   returns: the first digit*/
+static char *format_unsigned (char *end, uint64_t value)
+{
+    do
+    {
+        *--end = '0' + (char) (value % 10);
+        value /= 10;
+    } while (value > 0);
+    return end;
+}
@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _NOOMP
+#include <omp.h>
+#endif
+
+#include "PoLiLog.h"
+#include "PoLiThreadTags.h"
+
+/* an instance of a tag on one thread, the k-th time the thread started it */
+struct instance_interval {
+    struct thread_tag_interval interval;
+    int instance;
+};
+
+//all logs allocated since the last poli_thread_tags_destroy, newest first
+static struct thread_tag_log *thread_logs = NULL;
+//logs of an older generation were freed
+static unsigned long thread_tags_generation = 1;
+static size_t thread_tags_memory_limit = 0;
+
+static __thread struct thread_tag_log *thread_log = NULL;
+
+static struct thread_tag_log *new_thread_log (void);
+static int match_thread_events (struct thread_tag_log *log, struct instance_interval *intervals, int *num_intervals);
+static int compare_instances (const void *a, const void *b);
+static int compare_thread_intervals (const void *a, const void *b);
+
+void poli_thread_tags_init (size_t memory_limit)
+{
+    thread_tags_memory_limit = memory_limit;
+}
+
+int poli_thread_tags_record (int handle, tag_event_kind_t kind)
+{
+    double time = poli_tag_events_clock();
+
+    struct thread_tag_log *log = thread_log;
+    if (log == NULL || log->generation != __atomic_load_n(&thread_tags_generation, __ATOMIC_RELAXED))
+    {
+        log = new_thread_log();
+        if (log == NULL)
+            return 1;
+    }
+
+    struct thread_tag_event *event = poli_arena_append(&log->events);
+    if (event == NULL)
+        return 1;
+    event->handle = handle;
+    event->kind = kind;
+    event->time = time;
+    return 0;
+}
+
+static struct thread_tag_log *new_thread_log (void)
+{
+    struct thread_tag_log *log = malloc(sizeof(struct thread_tag_log));
+    if (log == NULL)
+        return NULL;
+    if (poli_arena_init(&log->events, sizeof(struct thread_tag_event), THREAD_TAG_CHUNK_EVENTS, thread_tags_memory_limit) != 0)
+    {
+        free(log);
+        return NULL;
+    }
+#ifndef _NOOMP
+    log->thread_num = omp_get_thread_num();
+#else
+    log->thread_num = 0;
+#endif
+    log->generation = __atomic_load_n(&thread_tags_generation, __ATOMIC_RELAXED);
+
+    //the only time threads contend: pushing the new log to the list
+    log->next = __atomic_load_n(&thread_logs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&thread_logs, &log->next, log, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    thread_log = log;
+    return log;
+}
+
+int poli_thread_tags_collect (struct thread_tag_interval **intervals, int *num_intervals)
+{
+    *intervals = 0;
+    *num_intervals = 0;
+
+    struct thread_tag_log *log;
+    unsigned long num_events = 0, dropped = 0;
+    for (log = __atomic_load_n(&thread_logs, __ATOMIC_ACQUIRE); log != NULL; log = log->next)
+    {
+        num_events += log->events.num_records;
+        dropped += log->events.dropped;
+    }
+    if (dropped > 0)
+        poli_log(WARNING, NULL, "%lu tag boundaries logged by threads were dropped because the memory for tags ran out, their tags are incomplete", dropped);
+    if (num_events == 0)
+        return 0;
+
+    struct instance_interval *instances = malloc(num_events * sizeof(struct instance_interval));
+    if (instances == NULL)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to allocate memory for %lu tag events", __FUNCTION__, num_events);
+        return 1;
+    }
+    int num_instances = 0;
+    for (log = thread_logs; log != NULL; log = log->next)
+    {
+        if (match_thread_events(log, instances, &num_instances) != 0)
+        {
+            free(instances);
+            return 1;
+        }
+    }
+
+    //every instance on a thread, plus at most one union per instance
+    struct thread_tag_interval *result = malloc(2 * num_instances * sizeof(struct thread_tag_interval));
+    if (result == NULL && num_instances > 0)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to allocate memory for %d tag intervals", __FUNCTION__, num_instances);
+        free(instances);
+        return 1;
+    }
+    qsort(instances, num_instances, sizeof(struct instance_interval), compare_instances);
+    int i, n = 0;
+    for (i = 0; i < num_instances; i++)
+    {
+        struct thread_tag_interval *ti = &instances[i].interval;
+        result[n++] = *ti;
+        //the n-th instances of a tag on all threads are consecutive, their union follows the last of them
+        if (i > 0 && compare_instances(&instances[i], &instances[i - 1]) == 0)
+        {
+            struct thread_tag_interval *all = &result[n - 2];
+            struct thread_tag_interval merged = *all;
+            if (ti->start < merged.start)
+                merged.start = ti->start;
+            if (merged.end != -1 && (ti->end == -1 || ti->end > merged.end))
+                merged.end = ti->end;
+            *all = *ti;
+            result[n - 1] = merged;
+        }
+        else
+        {
+            result[n] = *ti;
+            result[n].thread_num = -1;
+            n++;
+        }
+    }
+    free(instances);
+
+    qsort(result, n, sizeof(struct thread_tag_interval), compare_thread_intervals);
+    *intervals = result;
+    *num_intervals = n;
+    return 0;
+}
+
+/* match_thread_events - pairs every start of a thread with its end, the most recent open instance of a tag is ended first
+   input: the thread's log, where to append the intervals, their number
+   returns: 0 if no errors, 1 otherwise*/
+static int match_thread_events (struct thread_tag_log *log, struct instance_interval *intervals, int *num_intervals)
+{
+    unsigned long num_events = log->events.num_records;
+    if (num_events == 0)
+        return 0;
+
+    unsigned long i;
+    int num_handles = 0;
+    for (i = 0; i < num_events; i++)
+    {
+        struct thread_tag_event *event = poli_arena_get(&log->events, i);
+        if (event->handle >= num_handles)
+            num_handles = event->handle + 1;
+    }
+
+    int *open = malloc(num_handles * sizeof(int)); //by handle: most recent open instance, -1 if none
+    int *num_started = calloc(num_handles, sizeof(int));
+    int *prev_open = malloc(num_events * sizeof(int)); //by interval: the instance open before it
+    if (open == NULL || num_started == NULL || prev_open == NULL)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to allocate memory for %lu tag events", __FUNCTION__, num_events);
+        free(open);
+        free(num_started);
+        free(prev_open);
+        return 1;
+    }
+
+    int h;
+    for (h = 0; h < num_handles; h++)
+        open[h] = -1;
+
+    int first = *num_intervals;
+    for (i = 0; i < num_events; i++)
+    {
+        struct thread_tag_event *event = poli_arena_get(&log->events, i);
+        if (event->kind == TAG_EVENT_START)
+        {
+            struct instance_interval *ii = &intervals[*num_intervals];
+            ii->interval.handle = event->handle;
+            ii->interval.thread_num = log->thread_num;
+            ii->interval.start = event->time;
+            ii->interval.end = -1;
+            ii->instance = num_started[event->handle]++;
+            prev_open[*num_intervals - first] = open[event->handle];
+            open[event->handle] = *num_intervals - first;
+            (*num_intervals)++;
+        }
+        else if (open[event->handle] != -1) //ends without a start on this thread are ignored
+        {
+            intervals[first + open[event->handle]].interval.end = event->time;
+            open[event->handle] = prev_open[open[event->handle]];
+        }
+    }
+
+    free(open);
+    free(num_started);
+    free(prev_open);
+    return 0;
+}
+
+static int compare_instances (const void *a, const void *b)
+{
+    const struct instance_interval *ia = a, *ib = b;
+    if (ia->interval.handle != ib->interval.handle)
+        return (ia->interval.handle > ib->interval.handle) - (ia->interval.handle < ib->interval.handle);
+    return (ia->instance > ib->instance) - (ia->instance < ib->instance);
+}
+
+static int compare_thread_intervals (const void *a, const void *b)
+{
+    const struct thread_tag_interval *ta = a, *tb = b;
+    return (ta->start > tb->start) - (ta->start < tb->start);
+}
+
+void poli_thread_tags_destroy (void)
+{
+    struct thread_tag_log *log = thread_logs;
+    while (log != NULL)
+    {
+        struct thread_tag_log *next = log->next;
+        poli_arena_destroy(&log->events);
+        free(log);
+        log = next;
+    }
+    thread_logs = NULL;
+    __atomic_store_n(&thread_tags_generation, thread_tags_generation + 1, __ATOMIC_RELAXED);
+    thread_log = NULL;
+}
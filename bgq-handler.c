@@ -21,6 +21,7 @@
 #include "PoLiMEr.h"
 #include "PoLiLog.h"
 #include "bgq-handler.h"
+#include "PoLiText.h"
 
 
 // Info about the co-ordinates of the process
@@ -189,34 +190,41 @@ static double evaluate_boundaries(double end, double start)
 }
 
 
-void write_bgq_header(FILE **fp)
+void write_bgq_header(struct text_writer *out)
 {
-    fprintf(*fp, "Row\tCol\tMidplane\tNodeboard\t");
-    fprintf(*fp, "BGQ Node Card E (J)\tBGQ cpu E (J)\tBGQ dram E (J)\tBGQ optics E (J)\tBGQ pci E (J)\tBGQ network E (J)\tBGQ link chip E (J)\tBGQ sram E (J)\t");
-    fprintf(*fp, "BGQ Node Card P (W)\tBGQ cpu P (W)\tBGQ dram P (W)\tBGQ optics P (W)\tBGQ pci P (W)\tBGQ network P (W)\tBGQ link chip P (W)\tBGQ sram P (W)\t");
+    poli_text_puts(out, "Row\tCol\tMidplane\tNodeboard\t");
+    poli_text_puts(out, "BGQ Node Card E (J)\tBGQ cpu E (J)\tBGQ dram E (J)\tBGQ optics E (J)\tBGQ pci E (J)\tBGQ network E (J)\tBGQ link chip E (J)\tBGQ sram E (J)\t");
+    poli_text_puts(out, "BGQ Node Card P (W)\tBGQ cpu P (W)\tBGQ dram P (W)\tBGQ optics P (W)\tBGQ pci P (W)\tBGQ network P (W)\tBGQ link chip P (W)\tBGQ sram P (W)\t");
 }
 
-void write_bgq_output(FILE **fp, struct bgq_measurement *bm)
+void write_bgq_output(struct text_writer *out, struct bgq_measurement *bm)
 {
-    fprintf(*fp, "%X\t%X\t%d\t%02d\t", row, col, midplane, nodeboard);
+    poli_text_printf(out, "%X\t%X\t%d\t%02d\t", row, col, midplane, nodeboard);
 
-    fprintf(*fp, "%lf\t%lf\t%lf\t%lf\t%lf\t%lf\t%lf\t%lf\t", bm->card_en, bm->cpu_en,
-        bm->dram_en, bm->optics_en, bm->pci_en, bm->network_en, bm->link_chip_en, bm->sram_en);
-
-    fprintf(*fp, "%lf\t%lf\t%lf\t%lf\t%lf\t%lf\t%lf\t%lf\t", bm->card_power, bm->cpu,
-        bm->dram, bm->optics, bm->pci, bm->network, bm->link_chip, bm->sram);
+    double values[16] = {bm->card_en, bm->cpu_en, bm->dram_en, bm->optics_en, bm->pci_en, bm->network_en, bm->link_chip_en, bm->sram_en,
+        bm->card_power, bm->cpu, bm->dram, bm->optics, bm->pci, bm->network, bm->link_chip, bm->sram};
+    int i;
+    for (i = 0; i < 16; i++)
+    {
+        poli_text_double(out, values[i]);
+        poli_text_putc(out, '\t');
+    }
 
 }
 
-void write_bgq_ediff_header(FILE **fp)
+void write_bgq_ediff_header(struct text_writer *out)
 {
-    fprintf(*fp, "BGQ Node Card E since start (J)\tBGQ cpu E since start (J)\tBGQ dram E since start (J)\tBGQ optics E since start (J)\tBGQ pci E since start (J)\tBGQ network E since start (J)\tBGQ link chip E since start (J)\tBGQ sram E since start (J)\t");
+    poli_text_puts(out, "BGQ Node Card E since start (J)\tBGQ cpu E since start (J)\tBGQ dram E since start (J)\tBGQ optics E since start (J)\tBGQ pci E since start (J)\tBGQ network E since start (J)\tBGQ link chip E since start (J)\tBGQ sram E since start (J)\t");
 }
 
-void write_bgq_ediff(FILE **fp, struct bgq_measurement *end, struct bgq_measurement *start)
+void write_bgq_ediff(struct text_writer *out, struct bgq_measurement *end, struct bgq_measurement *start)
 {
-    fprintf(*fp, "%lf\t%lf\t%lf\t%lf\t%lf\t%lf\t%lf\t%lf\t", end->card_power - start->card_power,
-        end->cpu - start->cpu, end->dram - start->dram, end->optics - start->optics, end->pci - start->pci,
-        end->network - start->network, end->link_chip - start->link_chip, end->sram - start->sram);
+    double values[8] = {end->card_power - start->card_power, end->cpu - start->cpu, end->dram - start->dram, end->optics - start->optics,
+        end->pci - start->pci, end->network - start->network, end->link_chip - start->link_chip, end->sram - start->sram};
+    int i;
+    for (i = 0; i < 8; i++)
+    {
+        poli_text_double(out, values[i]);
+        poli_text_putc(out, '\t');
+    }
 }
-
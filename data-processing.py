@@ -54,6 +54,22 @@ def collect_files(path):
                 
                 if "CLEAN" in file:
                     continue
+                if "job-summary" in file or "job-power" in file:
+                    continue
+                if file.endswith(".job"):
+                    try:
+                        jobid, index = load_job_index(file)
+                        nodes_per_job.setdefault(jobid, {})
+                        jobfiles.setdefault(jobid, {})
+                        for node, offset, size, complete in index:
+                            if not complete:
+                                print("The file of node", node, "in", file, "is incomplete")
+                            nodes_per_job[jobid][node] = list(load_binary_file(file, offset))
+                            jobfiles[jobid][node] = [file, file, file]
+                    except Exception as e:
+                        print("File", file, "couldn't be loaded")
+                        print("ERROR", str(e))
+                    continue
                 prefix = ""
                 filenamecomponents = file.split('_')
                 jobid = filenamecomponents[jobid_index].split('.')[0].strip()
@@ -98,7 +114,14 @@ def collect_files(path):
                     files_per_node[node] = [-1,-1,-1]
                     nodefiles[node] = [-1, -1, -1]
                     
-                if "energy-tags" in file:
+                if file.endswith(".bin"):
+                    try:
+                        files_per_node[node] = list(load_binary_file(file))
+                        nodefiles[node] = [file, file, file]
+                    except Exception as e:
+                        print("File", file, "couldn't be loaded")
+                        print("ERROR", str(e))
+                elif "energy-tags" in file:
                     try:
                         files_per_node[node][1] = load_etag_file(file)
                         nodefiles[node][1] = file
@@ -200,6 +223,86 @@ def load_pcaptag_file (file):
     path = os.path.join(args.prefix_path, file)
     return pd.read_csv(path, sep='\t', header=0, dtype={'Emon tag list': np.str}, parse_dates=[2], index_col = 0, na_values=[-1,'-1.000000'])
 
+# Layout of the binary output, see include/PoLiBinary.h
+BIN_HEADER = np.dtype([('magic', 'S8'), ('version', '<u4'), ('num_columns', '<u4'), ('columns_offset', '<u8'),
+    ('strings_offset', '<u8'), ('strings_size', '<u8'), ('num_rows', '<u8', (4,)), ('start_time', '<f8'),
+    ('num_tables', '<u4'), ('reserved', '<u4'), ('node', 'S64'), ('jobid', 'S64'), ('padding', 'V40')])
+BIN_COLUMN = np.dtype([('name', 'S56'), ('dtype', 'S8'), ('table', '<u4'), ('is_string', '<u4'), ('offset', '<u8')])
+BIN_TABLE_SAMPLES, BIN_TABLE_TAGS, BIN_TABLE_TAG_STATS, BIN_TABLE_PCAP_TAGS = range(4)
+# job file written with PoLi_OUTPUT=shared, layout in include/PoLiBinary.h
+BIN_JOB_HEADER = np.dtype([('magic', 'S8'), ('version', '<u4'), ('num_nodes', '<u4'), ('index_offset', '<u8'),
+    ('data_offset', '<u8'), ('jobid', 'S64'), ('padding', 'V32')])
+BIN_JOB_ENTRY = np.dtype([('node', 'S64'), ('offset', '<u8'), ('size', '<u8'), ('rank', '<u4'), ('complete', '<u4'), ('reserved', '<u8')])
+
+def load_job_index (file):
+    ''' Returns the job id and the index of a job file: node, offset and size of its binary file, and whether it is complete '''
+    path = os.path.join(args.prefix_path, file)
+    header = np.fromfile(path, dtype=BIN_JOB_HEADER, count=1)[0]
+    if header['magic'] != b'PoLiJob':
+        raise ValueError(file + " is not a " + MONITOR + " job file")
+    index = np.fromfile(path, dtype=BIN_JOB_ENTRY, count=header['num_nodes'], offset=int(header['index_offset']))
+    return header['jobid'].decode(), [(e['node'].decode(), int(e['offset']), int(e['size']), bool(e['complete'])) for e in index]
+
+def extract_node_file (file, node, out_file):
+    ''' Copies the binary file of one node out of a job file '''
+    jobid, index = load_job_index(file)
+    for name, offset, size, complete in index:
+        if name == node:
+            with open(os.path.join(args.prefix_path, file), 'rb') as job, open(out_file, 'wb') as out:
+                job.seek(offset)
+                out.write(job.read(size))
+            return
+    raise ValueError("Node " + node + " is not in " + file)
+
+def load_binary_tables (file, base=0):
+    ''' Returns the columns of every table of a binary output file, memory-mapped, and the start time.
+        base is the offset of the binary file, for the files of the nodes in a job file '''
+    path = os.path.join(args.prefix_path, file)
+    header = np.fromfile(path, dtype=BIN_HEADER, count=1, offset=base)[0]
+    if header['magic'] != b'PoLiMEr':
+        raise ValueError(file + " is not a " + MONITOR + " binary file")
+    columns = np.fromfile(path, dtype=BIN_COLUMN, count=header['num_columns'], offset=base + int(header['columns_offset']))
+    strings = b''
+    if header['strings_size'] > 0:
+        strings = np.memmap(path, dtype='S1', mode='r', offset=base + int(header['strings_offset']), shape=(int(header['strings_size']),)).tobytes()
+    tables = [{} for t in range(header['num_tables'])]
+    for column in columns:
+        table = int(column['table'])
+        num_rows = int(header['num_rows'][table])
+        dtype = column['dtype'].decode()
+        values = np.memmap(path, dtype=dtype, mode='r', offset=base + int(column['offset']), shape=(num_rows,)) if num_rows > 0 else np.empty(0, dtype=dtype)
+        if column['is_string']:
+            values = [strings[v:strings.index(b'\0', v)].decode() for v in values]
+        tables[table][column['name'].decode()] = values
+    return tables, header['start_time']
+
+def load_binary_file (file, base=0):
+    ''' Returns the polling, energy tags and power cap tags data frames of a binary output file,
+        with the same columns as the text files '''
+    tables, start_time = load_binary_tables(file, base)
+    def timestamps(offsets):
+        utc = pd.to_datetime(start_time + offsets, unit='s').dt.tz_localize('UTC')
+        return utc.dt.tz_convert(datetime.datetime.now().astimezone().tzinfo).dt.tz_localize(None)
+
+    poll = pd.DataFrame(tables[BIN_TABLE_SAMPLES]).replace(-1, np.nan)
+    if len(poll.columns) > 0:
+        poll = poll.set_index('Count')
+        poll.insert(0, 'Timestamp', timestamps(poll['Time since start (s)']))
+        for column in list(poll.columns):
+            for power in [column.replace(' E (J)', ' P (W)'), column.replace(' E (J)', ' P calc (W)')]:
+                if column.endswith(' E (J)') and power in poll.columns:
+                    poll[column.replace(' E (J)', ' E since start (J)')] = (poll[power] * poll['Interval (s)']).cumsum()
+                    break
+
+    etags = pd.DataFrame(tables[BIN_TABLE_TAGS])
+    etags.insert(1, 'Timestamp', timestamps(etags['Start Time (s)']))
+    etags = etags.set_index('Tag Name').replace(-1, np.nan)
+
+    pcaptags = pd.DataFrame(tables[BIN_TABLE_PCAP_TAGS])
+    pcaptags.insert(2, 'Timestamp', timestamps(pcaptags['Time since start (s)']))
+    pcaptags = pcaptags.set_index('Tag ID')
+    return poll, etags, pcaptags
+
 def get_pcap_markers(df):
     tcol = 'Time since start (s)'
     flag = 'PCAP FLAG'
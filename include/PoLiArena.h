@@ -0,0 +1,50 @@
+#ifndef __POLIARENA_H
+#define __POLIARENA_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+
+/* Records of a fixed size stored in chunks that are allocated as the arena
+   grows. Records are never moved once appended, so pointers to them stay
+   valid until the arena is destroyed. An optional memory limit caps the
+   chunks allocated after the first one; records that don't fit anymore are
+   dropped and counted. */
+struct poli_arena {
+    size_t record_size;
+    unsigned long chunk_records; //records per chunk
+    char **chunks;
+    unsigned long num_chunks;
+    unsigned long max_chunks;
+    unsigned long num_records;
+    size_t memory_limit; //bytes, 0 if unlimited
+    unsigned long dropped;
+};
+
+/* poli_arena_init - sets up the arena and allocates its first chunk
+   input: the arena, size of one record in bytes, number of records per chunk,
+          limit in bytes for the memory held by chunks (0 for no limit, the first chunk is always allocated)
+   returns: 0 if no errors, 1 otherwise*/
+int poli_arena_init (struct poli_arena *arena, size_t record_size, unsigned long chunk_records, size_t memory_limit);
+
+/* poli_arena_append - appends a zeroed record, allocating a new chunk if needed
+   returns: the record, or NULL if it was dropped because of the memory limit or a failed allocation*/
+void *poli_arena_append (struct poli_arena *arena);
+
+/* poli_arena_get - returns record index, which must be lower than the number of records appended*/
+static inline void *poli_arena_get (struct poli_arena *arena, unsigned long index)
+{
+    return arena->chunks[index / arena->chunk_records] + (index % arena->chunk_records) * arena->record_size;
+}
+
+/* poli_arena_destroy - frees all chunks*/
+void poli_arena_destroy (struct poli_arena *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
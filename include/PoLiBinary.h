@@ -0,0 +1,156 @@
+#ifndef __POLIBINARY_H
+#define __POLIBINARY_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BIN_MAGIC "PoLiMEr"
+#define BIN_VERSION 1
+// Size of the file header in bytes
+#define BIN_HEADER_SIZE 256
+// Size of a column descriptor in bytes
+#define BIN_COLUMN_SIZE 80
+// Longest column name, including the terminating null character
+#define BIN_NAME_LEN 56
+// Values buffered per column before they are written
+#define BIN_BUFFER_ROWS 256
+
+#define BIN_JOB_MAGIC "PoLiJob"
+#define BIN_JOB_VERSION 1
+// Size of the job file header in bytes
+#define BIN_JOB_HEADER_SIZE 128
+// Size of an entry of the job file index in bytes
+#define BIN_JOB_ENTRY_SIZE 96
+
+/* A binary file holding tables as contiguous columns, meant to be read with
+   numpy.memmap without any parsing. Everything is little-endian:
+
+   header (BIN_HEADER_SIZE bytes)
+       0   char[8]  magic "PoLiMEr"
+       8   uint32   version
+       12  uint32   number of columns
+       16  uint64   offset of the column descriptors
+       24  uint64   offset of the string table
+       32  uint64   size of the string table
+       40  uint64   number of rows of each table [BIN_NUM_TABLES]
+       72  float64  start of the measurements (seconds since the epoch)
+       80  uint32   number of tables
+       84  uint32   reserved
+       88  char[64] node
+       152 char[64] job id
+   column descriptors (BIN_COLUMN_SIZE bytes each)
+       0   char[56] name
+       56  char[8]  numpy dtype ("<f8" or "<i8")
+       64  uint32   table
+       68  uint32   1 if the values are offsets of null-terminated strings in the string table
+       72  uint64   offset of the column, holding one value per row of its table
+   column blocks, 8-byte aligned
+   string table */
+
+/* A job file holds the binary files of all nodes of a job, written together by their monitors:
+
+   header (BIN_JOB_HEADER_SIZE bytes)
+       0   char[8]  magic "PoLiJob"
+       8   uint32   version
+       12  uint32   number of nodes
+       16  uint64   offset of the index
+       24  uint64   offset of the first node's file
+       32  char[64] job id
+   index, one entry (BIN_JOB_ENTRY_SIZE bytes) per node
+       0   char[64] node
+       64  uint64   offset of the node's binary file
+       72  uint64   its size
+       80  uint32   rank of the node's monitor in MPI_COMM_WORLD
+       84  uint32   1 if the node's file is complete
+       88  uint64   reserved
+   the binary file of every node, 8-byte aligned, with offsets relative to its start,
+   so copying its bytes out gives the file the node would have written on its own */
+
+typedef enum bin_tables { BIN_TABLE_SAMPLES, BIN_TABLE_TAGS, BIN_TABLE_TAG_STATS, BIN_TABLE_PCAP_TAGS, BIN_NUM_TABLES } bin_table_t;
+
+typedef enum bin_types { BIN_FLOAT64, BIN_INT64, BIN_STRING } bin_type_t;
+
+struct bin_column {
+    char name[BIN_NAME_LEN];
+    bin_type_t type;
+    bin_table_t table;
+    uint64_t offset;
+    uint64_t num_written; //rows written to the file so far
+    int num_buffered;
+};
+
+/* Columns are declared first, along with the number of rows of every table,
+   then filled in any order, each one from its first row to its last. */
+struct bin_writer {
+    int fd;
+    int num_columns;
+    int max_columns;
+    struct bin_column *columns;
+    uint64_t num_rows[BIN_NUM_TABLES];
+    uint64_t data_end;
+    int laid_out;
+    uint64_t *buffers; //BIN_BUFFER_ROWS values per column, already little-endian
+    char *strings;
+    size_t strings_size;
+    size_t max_strings;
+    char *image; //the whole file, if it is built in memory (fd is -1)
+    uint64_t image_size;
+    size_t image_capacity;
+    int error;
+};
+
+/* poli_bin_open - creates the file
+   returns: 0 if no errors, 1 otherwise*/
+int poli_bin_open (struct bin_writer *writer, char *path);
+
+/* poli_bin_open_memory - builds the file in memory instead, after poli_bin_close it is in writer->image
+   (writer->image_size bytes, to be freed by the caller)
+   returns: 0 if no errors, 1 otherwise*/
+int poli_bin_open_memory (struct bin_writer *writer);
+
+/* poli_bin_add_column - declares a column, only before the columns are laid out
+   input: the writer, its table, type of its values, its name (truncated to BIN_NAME_LEN - 1 characters)
+   returns: the index of the column, -1 on error*/
+int poli_bin_add_column (struct bin_writer *writer, bin_table_t table, bin_type_t type, char *name);
+
+/* poli_bin_set_rows - sets the number of rows of a table, only before the columns are laid out*/
+void poli_bin_set_rows (struct bin_writer *writer, bin_table_t table, uint64_t num_rows);
+
+/* poli_bin_layout - places every column in the file, values can be appended from now on
+   returns: 0 if no errors, 1 otherwise*/
+int poli_bin_layout (struct bin_writer *writer);
+
+/* poli_bin_append - appends values to a column, rows beyond the number of rows of its table are dropped
+   input: the writer, the column, count values (double for BIN_FLOAT64, int64_t otherwise)
+   returns: 0 if no errors, 1 otherwise*/
+int poli_bin_append (struct bin_writer *writer, int column, const void *values, size_t count);
+int poli_bin_append_double (struct bin_writer *writer, int column, double value);
+int poli_bin_append_int (struct bin_writer *writer, int column, int64_t value);
+
+/* poli_bin_add_string - copies a string into the string table
+   returns: its offset, to be appended to a BIN_STRING column, -1 on error*/
+int64_t poli_bin_add_string (struct bin_writer *writer, char *string);
+
+/* poli_bin_close - writes the remaining values, the descriptors, the string table and the header, and closes the file
+   input: the writer, start of the measurements in seconds since the epoch, node and job id
+   returns: 0 if the file is complete, 1 otherwise*/
+int poli_bin_close (struct bin_writer *writer, double start_time, char *node, char *jobid);
+
+/* poli_bin_job_header - fills the header of a job file
+   input: BIN_JOB_HEADER_SIZE bytes, number of nodes, job id*/
+void poli_bin_job_header (char *buf, uint32_t num_nodes, char *jobid);
+
+/* poli_bin_job_entry - fills the index entry of a node in a job file
+   input: BIN_JOB_ENTRY_SIZE bytes, node, offset and size of its binary file, rank of its monitor, 1 if the file is complete*/
+void poli_bin_job_entry (char *buf, char *node, uint64_t offset, uint64_t size, uint32_t rank, int complete);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
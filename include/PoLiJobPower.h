@@ -0,0 +1,95 @@
+#ifndef __POLIJOBPOWER_H
+#define __POLIJOBPOWER_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <pthread.h>
+
+#ifndef _NOMPI
+#include <mpi.h>
+#endif
+
+#include "PoLiStats.h"
+
+// Rounds of the job power timeline a monitor can have in flight at once
+#define JOB_POWER_WINDOW 16
+// Points of the job power timeline kept by the first monitor, can be changed with PoLi_JOB_POWER_POINTS
+#define DEFAULT_JOB_POWER_POINTS 4096
+// Seconds between two points of the job power timeline, can be changed with PoLi_JOB_POWER_INTERVAL
+#define DEFAULT_JOB_POWER_INTERVAL 1.0
+
+/* power of the whole job at one point of the timeline: sum, extremes and nodes (monitor ranks) of the node powers */
+struct job_power_point {
+    double time; //seconds since the start of the application
+    struct node_stats power;
+};
+
+#ifndef _NOMPI
+/* one reduction of node powers, the n-th round of every monitor is reduced with the n-th round of all others */
+struct job_power_round {
+    long point; //index of the point in the timeline
+    struct node_stats send;
+    struct node_stats recv;
+    MPI_Request request;
+};
+#endif
+
+/* A job power timeline built while the application runs: at every point, all
+   monitors contribute the latest power of their node to a non-blocking
+   reduction to the first monitor, which keeps the most recent points in a ring.
+   Only the sampler threads take part, the application's ranks never wait for it. */
+struct job_power_timeline {
+    int enabled;
+    double interval;
+    int monitor_rank;
+#ifndef _NOMPI
+    MPI_Comm comm; //duplicate of the monitors' communicator, only used by the timeline's rounds
+    MPI_Comm monitors_comm; //the monitors agree on the number of rounds on it, it carries none of the rounds
+    MPI_Datatype type;
+    MPI_Op op;
+    struct job_power_round rounds[JOB_POWER_WINDOW]; //in flight, oldest first from first_round
+    int first_round;
+    int num_rounds;
+#endif
+    long next_point; //index of the next point to contribute to
+
+    /* first monitor only */
+    pthread_mutex_t lock;
+    struct job_power_point *points; //ring of the latest max_points points
+    int max_points;
+    long num_points; //points completed so far, the ring holds the last max_points of them
+};
+
+struct monitor_t;
+
+/* poli_job_power_init - sets up the timeline, collective over the monitors; it stays disabled unless every monitor
+   asks for it and MPI provides MPI_THREAD_MULTIPLE (the sampler threads make MPI calls)
+   input: the timeline, the monitor, 1 if this monitor asks for it, seconds between points, points kept by the first monitor
+   returns: 0 if no errors (also if it stays disabled), 1 otherwise*/
+int poli_job_power_init (struct job_power_timeline *timeline, struct monitor_t *monitor, int requested, double interval, int max_points);
+
+/* poli_job_power_update - contributes the node's power to every point due, and stores the points whose reduction completed,
+   called by the sampler thread after every sample
+   input: the timeline, seconds since the start of the application, latest power of the node (W)*/
+void poli_job_power_update (struct job_power_timeline *timeline, double time, double power);
+
+/* poli_job_power_finish - completes the timeline once the sampler stopped, collective over the monitors:
+   monitors that contributed to fewer points than others take part in the remaining reductions without a value
+   returns: 0 if no errors, 1 otherwise*/
+int poli_job_power_finish (struct job_power_timeline *timeline);
+
+/* poli_job_power_get - copies the latest points of the timeline, only on the first monitor
+   input: the timeline, array of points, its length, pointer to the number of points copied (oldest first)
+   returns: 0 if no errors, 1 otherwise*/
+int poli_job_power_get (struct job_power_timeline *timeline, struct job_power_point *points, int max_points, int *num_points);
+
+void poli_job_power_destroy (struct job_power_timeline *timeline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -11,12 +11,17 @@ extern "C"
 #include <stdint.h>
 #include <signal.h>
 #include <time.h>
+#include <pthread.h>
 
 #ifndef _NOMPI
 #include "mpi.h"
 #endif
 
 #include "msr-handler.h"
+#include "PoLiRing.h"
+#include "PoLiSamples.h"
+#include "PoLiArena.h"
+#include "PoLiStats.h"
 
 #ifdef _CRAY
 #include "cray_pm-handler.h"
@@ -27,12 +32,34 @@ extern "C"
 #endif
 
 
-// Maximum number of user-specified tags
+// Maximum number of power cap tags
 #define MAX_TAGS     10000
-// Maximum number of polling records
+// Number of poli tags allocated at once, the tag memory can be limited with PoLi_TAG_MEMORY_LIMIT (MB)
+#define TAG_CHUNK_RECORDS 1024
+// Maximum number of polling records (only used for _BENCH)
 #define MAX_POLL_SAMPLES 500000
-#define POLL_INTERVAL 0.5
+// Polling interval in seconds, can be changed with PoLi_POLL_INTERVAL or poli_set_poll_interval()
+#define DEFAULT_POLL_INTERVAL 0.5
+// Shortest polling interval accepted (1 ms)
+#define MIN_POLL_INTERVAL 0.001
+// Delay of the first sample in microseconds
 #define INITIAL_TIMER_DELAY 100000
+// Adaptive polling: default bounds of the interval (seconds) and power change (W) between two samples that is considered a burst
+#define DEFAULT_ADAPTIVE_MIN_INTERVAL 0.05
+#define DEFAULT_ADAPTIVE_MAX_INTERVAL 2.0
+#define DEFAULT_ADAPTIVE_THRESHOLD 5.0
+// Adaptive polling: the interval is divided by this on a burst and grows by ADAPTIVE_BACKOFF while power is flat
+#define ADAPTIVE_SPEEDUP 2.0
+#define ADAPTIVE_BACKOFF 1.25
+// Largest write of a node's file into the job file (PoLi_OUTPUT=shared), in bytes
+#define SHARED_OUTPUT_CHUNK (1 << 30)
+// Energy counters in the job summary, each reported as energy and power next to the time of a tag
+#ifdef _CRAY
+#define JOB_SUMMARY_ENERGIES 8
+#else
+#define JOB_SUMMARY_ENERGIES 5
+#endif
+#define JOB_SUMMARY_QUANTITIES (1 + 2 * JOB_SUMMARY_ENERGIES)
 
 struct monitor_t {
     int imonitor;
@@ -46,27 +73,17 @@ struct monitor_t {
     char *jobid;
 #ifndef _NOMPI
     MPI_Comm mynode_comm;
+    MPI_Comm monitors_comm; //one rank per node, MPI_COMM_NULL on the other ranks
     char my_host[MPI_MAX_PROCESSOR_NAME];
 #else
     char *my_host;
 #endif
 };
 
-struct poller_t {
-    int time_counter;
-#ifdef _BENCH
-    int time_counter_em;
-#endif
-#ifndef _TIMER_OFF
-    struct sigaction sa;
-    struct itimerval timer;
-    volatile int timer_on;
-#endif
-};
-
 
 struct energy_reading {
-  struct rapl_energy rapl_energy;
+  struct rapl_energy rapl_energy; //node totals
+  struct rapl_energy rapl_socket_energy[MAX_SOCKETS]; //per package, only the first num_sockets are valid
 #ifdef _CRAY
   struct cray_measurement cray_meas;
 #elif _BGQ
@@ -74,9 +91,33 @@ struct energy_reading {
 #endif
 };
 
+struct poller_t {
+    int time_counter; //only written by the sampler thread; other threads read it through the poll ring
+#ifdef _BENCH
+    int time_counter_em;
+#endif
+#ifndef _TIMER_OFF
+    pthread_t thread;
+    struct timespec next_poll; //absolute CLOCK_MONOTONIC time of the next sample
+    int cpu; //cpu the sampler thread is pinned to, -1 if not pinned
+    int rt_priority; //SCHED_FIFO priority of the sampler thread, 0 if default scheduling
+    volatile double interval; //polling interval in seconds
+    volatile int timer_on;
+    volatile int adaptive; //if set, the sampler adjusts interval between min_interval and max_interval
+    volatile double min_interval;
+    volatile double max_interval;
+    volatile double adaptive_threshold; //power change (W) between two samples above which the sampler speeds up
+    struct energy_reading last_energy; //counters of the previous sample
+    double last_wtime; //time of the previous sample
+    double last_power; //power of the previous sample, used by adaptive polling
+#endif
+};
+
 struct poli_tag {
     int id;
-    char *tag_name;
+    char *tag_name; //interned, owned by the tag registry
+    int handle;
+    int prev_open; //id of the tag with the same handle that was open when this one was opened, -1 if none
     int monitor_id;
     int monitor_rank;
 
@@ -94,6 +135,45 @@ struct poli_tag {
     int closed;
 };
 
+/* how the ranks of a node agree on the boundaries of a tag:
+   TAG_SYNC_BARRIER: all ranks synchronize at every boundary, the monitor measures (the default)
+   TAG_SYNC_NONE: no synchronization, the monitor measures between its own start and end, other ranks don't take part
+   TAG_SYNC_FIRST_LAST: no synchronization, every rank logs its boundaries and the tag spans from
+                        the first rank starting it to the last rank ending it (needs polling) */
+typedef enum poli_tag_syncs { TAG_SYNC_BARRIER, TAG_SYNC_NONE, TAG_SYNC_FIRST_LAST } poli_tag_sync_t;
+
+/* statistics over the closed instances of an aggregated tag */
+struct tag_summary {
+    double first_start; //earliest start time of an instance
+    double last_end; //latest end time of an instance
+    struct running_stats time;
+    struct running_stats energy[SAMPLE_NUM_FIELDS]; //by sample schema column, only for energy columns
+    struct running_stats power[SAMPLE_NUM_FIELDS];
+};
+
+/* interned tag names, the handle of a name is its index in names */
+struct tag_registry {
+    char **names;
+    int *last_open; //by handle: id of the most recently opened tag that is still open (index in open_aggregated for aggregated tags), -1 if none
+    int *num_dropped_open; //by handle: open instances that were started after the tag memory ran out
+    int *aggregated; //by handle: 1 if instances are only summarized instead of recorded
+    poli_tag_sync_t *sync; //by handle
+    int *event_name; //by handle: index of the name in this rank's tag event log, -1 until it is logged
+    struct tag_summary **summaries; //by handle: summary of an aggregated tag, NULL until an instance is closed
+    int num_names;
+    int max_names;
+    int *table; //open addressing hash table of handles, -1 marks an empty slot
+    int table_size; //power of two, kept at most half full
+    int aggregate_default; //aggregated for names registered from now on, PoLi_TAG_AGGREGATE
+    poli_tag_sync_t sync_default; //sync of names registered from now on, PoLi_TAG_SYNC
+
+    /* open instances of aggregated tags, recycled once they are closed */
+    struct poli_tag *open_aggregated;
+    int num_open_aggregated; //entries used so far, open or free
+    int max_open_aggregated;
+    int free_aggregated; //first free entry, free entries are chained by prev_open, -1 if none
+};
+
 typedef enum pcap_flags { DEFAULT, USER_SET, SYSTEM_RESET, INTERNAL, INITIAL } pcap_flag_t;
 
 struct pcap_tag {
@@ -109,7 +189,8 @@ struct pcap_tag {
     double wtime;
     struct timeval timestamp;
     pcap_flag_t pcap_flag; //to have some idea if system reset, user set or controlled by library
-    struct poli_tag active_poli_tags[MAX_TAGS]; //stores all active tags
+    int package_id; //ALL_PACKAGES if the power cap was set on every package
+    int first_active_poli_tag; //index in active_poli_tag_ids of the first poli tag open when the power cap was set
     int num_active_poli_tags;
     int start_timer_count;
 };
@@ -141,16 +222,42 @@ struct frequency {
 #endif
 };
 
+/* a change of the power cap of one zone on one socket; power caps are recorded as changes instead of with every sample */
+struct pcap_event {
+    int counter; //first sample the power cap applies to
+    int socket;
+    int zone_index;
+    double watts_long;
+    double watts_short;
+};
+
+/* tag and power cap boundaries are reported in the polling file before the sample they happened at,
+   in this order when several fall on the same sample */
+typedef enum poll_marker_kinds { MARKER_TAG_END, MARKER_PCAP, MARKER_TAG_START } poll_marker_kind_t;
+
+struct poll_marker {
+    int counter; //sample the boundary is reported at
+    poll_marker_kind_t kind;
+    int id; //id of the poli tag or power cap tag
+};
+
+/* a boundary of a tag that was logged by the ranks and whose energy is interpolated from the samples */
+struct tag_boundary {
+    double time;
+    struct energy_reading *energy; //where the interpolated energy is stored
+    int *timer_count; //where the sample following the boundary is stored
+};
+
+/* one reading of the sampler; only the fields of the sample schema are kept in the poll ring */
 struct system_poll_info {
     int counter;
-    double pkg_pcap;
-    struct pcap_info pcap_info_list[NUM_ZONES];
     struct energy_reading last_energy;
     struct energy_reading current_energy;
     struct energy_reading computed_power;
     struct frequency freq;
 
     double wtime;
+    double interval; //time elapsed since the previous sample, which computed_power is averaged over
     double poll_iter_time;
 };
 
@@ -164,14 +271,23 @@ struct system_info_t {
     struct energy_reading initial_energy;
     struct energy_reading final_energy;
 
-    struct poli_tag *poli_tag_list;
-    int poli_opentag_tracker;
-    int poli_closetag_tracker;
+    struct poli_arena poli_tags; //every poli tag started, indexed by tag id
+    int *open_tag_stack; //ids of the open poli tags, the innermost one last
+    int open_tag_stack_size;
+    int open_tag_stack_capacity;
     struct pcap_tag *pcap_tag_list;
-    struct pcap_info *current_pcap_list; //stores PACKAGE, CORE, DRAM in that order
+    int *active_poli_tag_ids; //ids of the poli tags open at each power cap tag, see pcap_tag.first_active_poli_tag
+    int num_active_poli_tag_ids;
+    int max_active_poli_tag_ids;
+    struct pcap_info *current_pcap_list; //stores PACKAGE, CORE, DRAM in that order, NUM_ZONES entries per socket
+
+    struct pcap_event *pcap_events; //every change of current_pcap_list, in the order they happened
+    int num_pcap_events;
+    int max_pcap_events;
 
+    struct sample_schema sample_schema; //fields stored with every sample and summarized by aggregated tags
 #ifndef _TIMER_OFF
-    struct system_poll_info *system_poll_list;
+    struct poli_ring poll_ring; //the only channel out of the sampler: holds the most recent struct poli_sample samples until they are spooled
 #endif
 #ifdef _BENCH
     struct system_poll_info *system_poll_list_em;
@@ -181,9 +297,24 @@ struct system_info_t {
     int num_open_tags;
     int num_closed_tags;
     int num_pcap_tags;
+    int num_dropped_pcap_tags; //power caps that were set, but didn't fit in pcap_tag_list
 
     int cur_freq_file;
 
+    /* serializes energy counter reads between the sampler thread and the application */
+    pthread_mutex_t energy_lock;
+    struct timespec last_energy_read; //CLOCK_MONOTONIC time of the last energy read, written under energy_lock
+
+    /* serializes setting power caps, the job power budget sets them from the sampler thread */
+    pthread_mutex_t pcap_lock;
+
+    /* reads energy if nobody else did for wrap_guard_period seconds, so RAPL counters never wrap twice between two reads */
+    pthread_t wrap_guard;
+    pthread_mutex_t wrap_guard_lock;
+    pthread_cond_t wrap_guard_cond;
+    int wrap_guard_on;
+    double wrap_guard_period;
+
     /* add all system-dependent structs here*/
     struct system_msr_info *sysmsr;
 #ifdef _CRAY
@@ -220,16 +351,45 @@ int poli_init(void);
 /*                      EMON TAGS                                             */
 /******************************************************************************/
 
-/* start_poli_tag - starts an poli tag
+/* start_poli_tag - starts an poli tag. Inside an OpenMP parallel region, each thread starts its own tag
+   without synchronizing (see poli_start_tag_h to avoid the name lookup)
    input: tag name
    returns: 0 if no errors, 1 otherwise*/
 int poli_start_tag(char *tag_name);
 
-/* end_poli_tag - ends an poli tag
+/* end_poli_tag - ends the most recently started open poli tag with this name
    input: name of tag to end
    returns: 0 if no errors, 1 otherwises*/
 int poli_end_tag(char *tag_name);
 
+/* poli_tag_register - interns a tag name, registering the same name again returns the same handle
+   input: tag name, which is copied
+   returns: the handle of the tag, -1 on error*/
+int poli_tag_register(char *tag_name);
+
+/* poli_start_tag_h - starts a poli tag by handle, without looking up its name. Inside an OpenMP parallel region,
+   each thread logs the tag without taking a lock
+   input: handle returned by poli_tag_register
+   returns: 0 if no errors, 1 otherwise*/
+int poli_start_tag_h(int handle);
+
+/* poli_end_tag_h - ends the most recently started open poli tag of a handle
+   input: handle returned by poli_tag_register
+   returns: 0 if no errors, 1 otherwise*/
+int poli_end_tag_h(int handle);
+
+/* poli_tag_set_aggregated - selects whether every instance of a tag is recorded (the default, unless PoLi_TAG_AGGREGATE=1)
+   or only running statistics over all instances are kept, reported as one row per tag. Can't be changed while the tag is open.
+   input: handle returned by poli_tag_register, 1 to aggregate the tag, 0 to record every instance
+   returns: 0 if no errors, 1 otherwise*/
+int poli_tag_set_aggregated(int handle, int aggregated);
+
+/* poli_tag_set_sync - selects how the ranks of a node agree on the boundaries of a tag (see poli_tag_sync_t),
+   the default is TAG_SYNC_BARRIER unless set with PoLi_TAG_SYNC. Can't be changed while the tag is open.
+   input: handle returned by poli_tag_register, the synchronization
+   returns: 0 if no errors, 1 otherwise*/
+int poli_tag_set_sync(int handle, poli_tag_sync_t sync);
+
 
 /*                      END OF EMON TAGS                                      */
 
@@ -238,17 +398,29 @@ int poli_end_tag(char *tag_name);
 /*                     SETTING POWER CAPS                                     */
 /******************************************************************************/
 
-/* poli_set_power_cap - sets a general power cap (uses PACKAGE zone as default)
-   input: desired power in watts
+/* poli_set_power_cap - sets a general power cap (uses PACKAGE zone as default) on every package of the node
+   input: desired power in watts per package
    returns: 0 if no errors, 1 otherwise*/
 int poli_set_power_cap (double watts);
 
+/* poli_set_power_cap_with_params - sets the same power cap on every package of the node */
 int poli_set_power_cap_with_params(char *zone_name, double watts_long, double watts_short, double seconds_long, double seconds_short);
 
+/* poli_set_power_cap_for_package - sets a power cap on a single package, so sockets can run with different budgets
+   input: package index (0 to number of packages - 1), zone name, power cap parameters
+   returns: 0 if no errors, 1 otherwise*/
+int poli_set_power_cap_for_package (int package, char *zone_name, double watts_long, double watts_short, double seconds_long, double seconds_short);
+
 /* poli_reset_system - resets the system power caps to default values, which also creates a pcap tag
    returns: 0 if no errors, 1 otherwise*/
 int poli_reset_system(void);
 
+/* poli_set_job_power_budget - changes the job power budget started with PoLi_JOB_POWER_BUDGET, from the next
+   redistribution on; the budget of rank 0 is used, so it is enough to call it there
+   input: package power of the whole job in watts, 0 to keep the power caps as they are
+   returns: 0 if no errors, 1 otherwise (e.g. if no budget was started)*/
+int poli_set_job_power_budget (double watts);
+
 /*                    END OF SETTING POWER CAPS                               */
 
 /******************************************************************************/
@@ -265,7 +437,18 @@ int poli_get_power_cap (double *watts);
    returns: 0 if successful, -1 otherwise*/
 int poli_get_power_cap_for_param (char *zone_name, char *param, double *result);
 
+/* poli_get_power_cap_for_package - same as poli_get_power_cap_for_param for a single package
+   (poli_get_power_cap_for_param returns the values of package 0)
+   returns: 0 if successful, 1 if the package doesn't exist*/
+int poli_get_power_cap_for_package (int package, char *zone_name, char *param, double *result);
+
 int poli_get_power_cap_limits (char *zone_name, double *min, double *max);
+int poli_get_power_cap_limits_for_package (int package, char *zone_name, double *min, double *max);
+
+/* poli_get_num_packages - returns the number of packages whose power caps can be set individually
+   input: pointer to int holding the result
+   returns: 0*/
+int poli_get_num_packages (int *num_packages);
 
 void poli_print_power_cap_info (void);
 /* print_power_cap_info - prints all information related to currently recorded power caps*/
@@ -283,6 +466,38 @@ int poli_print_frequency_info (void);
 
 /*               END OF FREQUENNCY                                            */
 
+/******************************************************************************/
+/*              POLLING                                                       */
+/******************************************************************************/
+
+/* poli_set_poll_interval - changes the polling interval, takes effect after the next sample
+   input: the interval in seconds, must be at least MIN_POLL_INTERVAL
+   returns: 0 if no errors, 1 otherwise*/
+int poli_set_poll_interval (double seconds);
+
+/* poli_get_poll_interval - returns the current polling interval
+   input: pointer to double holding the interval in seconds
+   returns: 0 if no errors, 1 otherwise*/
+int poli_get_poll_interval (double *seconds);
+
+/* poli_enable_adaptive_polling - lets the sampler adjust the polling interval to how much power changes:
+   it polls faster when power changes by more than threshold_watts between two samples and backs off when power is flat
+   input: shortest and longest interval in seconds, power change in watts
+   returns: 0 if no errors, 1 otherwise*/
+int poli_enable_adaptive_polling (double min_interval, double max_interval, double threshold_watts);
+
+/* poli_disable_adaptive_polling - goes back to polling at a fixed interval, keeping the current one
+   returns: 0 if no errors, 1 otherwise*/
+int poli_disable_adaptive_polling (void);
+
+/* poli_get_job_power - returns the latest points of the job power timeline (PoLi_JOB_POWER=1), only on rank 0:
+   the time since the start of the application and the power summed over all nodes at every point, oldest first
+   input: arrays of times (s) and powers (W), their length, pointer to the number of points returned
+   returns: 0 if no errors, 1 otherwise (e.g. on other ranks or if the timeline is disabled)*/
+int poli_get_job_power (double *times, double *power, int max_points, int *num_points);
+
+/*               END OF POLLING                                               */
+
 /******************************************************************************/
 /*              HELPERS                                                       */
 /******************************************************************************/
@@ -0,0 +1,94 @@
+#ifndef __POLIPOWERBUDGET_H
+#define __POLIPOWERBUDGET_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <pthread.h>
+
+#ifndef _NOMPI
+#include <mpi.h>
+#endif
+
+// Seconds between two redistributions of the job power budget, can be changed with PoLi_JOB_POWER_BUDGET_INTERVAL
+#define DEFAULT_POWER_BUDGET_INTERVAL 1.0
+// A node using less than this fraction of its power cap is idle and gives the rest to the nodes still computing
+#define POWER_BUDGET_IDLE_FRACTION 0.9
+// Power an idle node keeps above what it uses, as a fraction of its power, so that it can pick up work again
+#define POWER_BUDGET_MARGIN 0.2
+// Smallest change of a node's power cap (W) that is applied
+#define POWER_BUDGET_MIN_CHANGE 1.0
+
+/* what a node reports at every redistribution, all doubles so that it can be sent as MPI_DOUBLE */
+struct budget_node {
+    double power; //package power of the node (W)
+    double cap; //package power cap of the node, summed over its packages
+    double min; //lowest and highest power cap the node accepts, summed over its packages
+    double max;
+    double budget; //job budget seen by the node, only the first monitor's is used
+};
+
+#define BUDGET_NODE_DOUBLES (sizeof(struct budget_node) / sizeof(double))
+
+/* A job power budget shared by the nodes: at every redistribution, all monitors
+   exchange what their nodes use with a non-blocking allgather started by their
+   sampler threads, and every monitor computes the same power caps for all nodes
+   from the same data. Only its own cap is applied. */
+struct power_budget {
+    int enabled;
+    double interval;
+    int monitor_rank;
+    int num_monitors;
+    volatile double budget; //W, 0 to keep the power caps as they are
+#ifndef _NOMPI
+    MPI_Comm comm; //duplicate of the monitors' communicator, only used by the budget's exchanges
+    MPI_Comm monitors_comm; //the monitors agree on the number of exchanges on it, it carries none of the exchanges
+    MPI_Request request;
+#endif
+    int in_flight; //1 while a redistribution is being exchanged
+    long next_round; //index of the next redistribution, redistributions are interval apart
+    long num_rounds; //exchanges started so far
+    struct budget_node send; //min and max are set once, the rest at every redistribution
+    struct budget_node *nodes; //by monitor rank
+    double *caps;
+    double too_low; //last budget reported to be below the lowest power caps
+    pthread_mutex_t lock; //held by the sampler thread while it takes part, stopped is set under it
+    int stopped;
+};
+
+struct monitor_t;
+
+/* poli_power_budget_init - sets up the budget, collective over the monitors; it stays disabled unless every monitor
+   asks for it and MPI provides MPI_THREAD_MULTIPLE (the sampler threads make MPI calls)
+   input: the budget, the monitor, 1 if this monitor asks for it, budget in watts, seconds between redistributions,
+          lowest and highest package power cap of the node
+   returns: 0 if no errors (also if it stays disabled), 1 otherwise*/
+int poli_power_budget_init (struct power_budget *budget, struct monitor_t *monitor, int requested, double watts, double interval,
+    double min_cap, double max_cap);
+
+/* poli_power_budget_update - takes part in the redistributions that are due, called by the sampler thread after every sample
+   input: the budget, seconds since the start of the application, latest package power and power cap of the node,
+          pointer to its new power cap
+   returns: 1 if a redistribution completed and the node's power cap should change to *new_cap, 0 otherwise*/
+int poli_power_budget_update (struct power_budget *budget, double time, double power, double cap, double *new_cap);
+
+/* poli_power_budget_finish - stops the redistributions, collective over the monitors: monitors that started fewer
+   than others take part in the remaining exchanges, whose power caps are not applied
+   returns: 0 if no errors, 1 otherwise*/
+int poli_power_budget_finish (struct power_budget *budget);
+
+/* poli_power_budget_allocate - splits a budget into power caps: idle nodes keep what they use plus a margin, nodes
+   running at their cap share the rest equally, and what nobody can use is shared by all; no cap goes below a node's minimum
+   input: budget in watts, the nodes, their number, their power caps
+   returns: 0 if the budget could be met, 1 if it is lower than the minimum power caps of the nodes*/
+int poli_power_budget_allocate (double watts, struct budget_node *nodes, int num_nodes, double *caps);
+
+void poli_power_budget_destroy (struct power_budget *budget);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
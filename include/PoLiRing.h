@@ -0,0 +1,110 @@
+#ifndef __POLIRING_H
+#define __POLIRING_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <pthread.h>
+
+// Default number of records kept in memory by a ring
+#define DEFAULT_RING_CAPACITY 4096
+// How often the writer drains the ring if it isn't woken up earlier (seconds)
+#define RING_WRITER_PERIOD 1.0
+// Size of a cache line; slots and the producer/consumer counters never share one
+#define RING_CACHE_LINE 64
+// Bytes in front of every record holding the slot's sequence number
+#define RING_SLOT_HEADER 16
+
+/* A fixed-size ring of records which a background writer thread drains
+   into an (unlinked) spool file. There is a single producer and any number
+   of readers, and none of them take a lock:
+   - every slot carries a sequence number which is odd while the producer
+     writes record n into it (2n+1) and even once it is complete (2n+2), so
+     readers can copy a record and detect if it changed underneath them
+   - the producer never blocks: if the writer can't keep up, new records
+     are dropped and counted
+   Once the ring is stopped, the spooled records can be read back in order. */
+struct poli_ring {
+    char *slots;
+    size_t record_size;
+    size_t slot_size; //record plus header, rounded up to a cache line
+    unsigned long capacity; //always a power of two
+    unsigned long mask;
+    char pad0[RING_CACHE_LINE];
+
+    /* written by the producer only */
+    unsigned long head; //number of records committed
+    unsigned long offered; //number of records committed or dropped
+    unsigned long dropped;
+    char pad1[RING_CACHE_LINE];
+
+    /* written by the writer only */
+    unsigned long tail; //number of records written to the spool
+    char pad2[RING_CACHE_LINE];
+
+    /* only used to let the writer sleep; the producer never waits on it */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t writer;
+    int running;
+
+    int spool_fd;
+    unsigned long num_spooled;
+    int write_error;
+    char *write_buffer;
+
+    /* state for reading the spool back */
+    char *read_buffer;
+    unsigned long read_buffer_records;
+    unsigned long read_next;
+    unsigned long read_buffer_start;
+    unsigned long read_buffer_count;
+};
+
+/* poli_ring_init - allocates the ring, creates the spool file and starts the writer thread
+   input: the ring, size of one record in bytes, number of records kept in memory (rounded up to a power of two),
+          path of the spool file (it is unlinked right away and only lives as long as the ring)
+   returns: 0 if no errors, 1 otherwise*/
+int poli_ring_init (struct poli_ring *ring, size_t record_size, unsigned long capacity, char *spool_path);
+
+/* poli_ring_reserve - returns the slot for the next record, or NULL if the ring is full (the record is dropped)*/
+void *poli_ring_reserve (struct poli_ring *ring);
+
+/* poli_ring_commit - publishes the record obtained with poli_ring_reserve*/
+void poli_ring_commit (struct poli_ring *ring);
+
+/* poli_ring_offered - returns the number of records the producer has committed or dropped so far,
+   i.e. the index the next record will get. Safe to call from any thread.*/
+unsigned long poli_ring_offered (struct poli_ring *ring);
+
+/* poli_ring_latest - copies the most recently committed record without blocking the producer.
+   Safe to call from any thread.
+   returns: 0 if a record was copied, 1 if the ring is empty*/
+int poli_ring_latest (struct poli_ring *ring, void *record);
+
+/* poli_ring_stop - stops the writer thread and spools every remaining record
+   returns: 0 if all records were spooled, 1 otherwise*/
+int poli_ring_stop (struct poli_ring *ring);
+
+/* poli_ring_num_records - returns the number of records that can be read back after poli_ring_stop*/
+unsigned long poli_ring_num_records (struct poli_ring *ring);
+
+/* poli_ring_read_next - reads the spooled records back in order
+   input: the ring, pointer to the memory holding one record
+   returns: 0 if a record was read, 1 at the end of the spool or on error*/
+int poli_ring_read_next (struct poli_ring *ring, void *record);
+
+/* poli_ring_rewind - makes poli_ring_read_next start over from the first spooled record*/
+void poli_ring_rewind (struct poli_ring *ring);
+
+/* poli_ring_destroy - closes the spool and frees the ring's memory*/
+void poli_ring_destroy (struct poli_ring *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef __POLISAMPLES_H
+#define __POLISAMPLES_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "msr-handler.h"
+#include "PoLiRing.h"
+
+// Number of samples transposed into columns at once when reading them back
+#define SAMPLE_BLOCK 256
+// RAPL domains stored for each package: pkg, pp0, pp1, dram
+#define SAMPLE_SOCKET_DOMAINS 4
+
+/* Everything the sampler can measure. A schema picks the fields the platform
+   actually supports, and only those are stored with every sample. */
+typedef enum sample_fields {
+    SAMPLE_RAPL_PKG, SAMPLE_RAPL_PP0, SAMPLE_RAPL_PP1, SAMPLE_RAPL_PLATFORM, SAMPLE_RAPL_DRAM,
+    SAMPLE_RAPL_SOCKET, //per package: SAMPLE_RAPL_SOCKET + SAMPLE_SOCKET_DOMAINS * package + pkg/pp0/pp1/dram
+    SAMPLE_CRAY_NODE_ENERGY = SAMPLE_RAPL_SOCKET + SAMPLE_SOCKET_DOMAINS * MAX_SOCKETS,
+    SAMPLE_CRAY_NODE_POWER, SAMPLE_CRAY_CPU_ENERGY, SAMPLE_CRAY_CPU_POWER,
+    SAMPLE_CRAY_MEMORY_ENERGY, SAMPLE_CRAY_MEMORY_POWER, SAMPLE_CRAY_FREQ,
+    SAMPLE_BGQ_CARD_POWER, SAMPLE_BGQ_CPU, SAMPLE_BGQ_DRAM, SAMPLE_BGQ_OPTICS,
+    SAMPLE_BGQ_PCI, SAMPLE_BGQ_NETWORK, SAMPLE_BGQ_LINK_CHIP, SAMPLE_BGQ_SRAM,
+    SAMPLE_FREQ,
+    SAMPLE_NUM_FIELDS
+} sample_field_t;
+
+struct sample_schema {
+    int num_columns;
+    int column[SAMPLE_NUM_FIELDS]; //column of each field, -1 if the field isn't recorded
+    sample_field_t field[SAMPLE_NUM_FIELDS]; //field of each column
+    int is_energy[SAMPLE_NUM_FIELDS]; //by column: energy counter whose power is derived from consecutive samples
+    double missing_power[SAMPLE_NUM_FIELDS]; //by column: power reported when it can't be derived
+    size_t sample_size; //bytes of one stored sample
+};
+
+/* one sample as stored in the poll ring; only the first num_columns values are stored */
+struct poli_sample {
+    int counter;
+    double wtime;
+    double interval; //time elapsed since the previous sample
+    double poll_iter_time;
+    double values[SAMPLE_NUM_FIELDS];
+};
+
+/* up to SAMPLE_BLOCK consecutive samples read back from the ring, one contiguous array per column */
+struct sample_block {
+    int num_samples;
+    int counter[SAMPLE_BLOCK];
+    double wtime[SAMPLE_BLOCK];
+    double interval[SAMPLE_BLOCK];
+    double *values; //column c of sample i is values[c * SAMPLE_BLOCK + i]
+    double *power; //power of the energy columns over each sample's interval, same layout
+    double *last; //value of each column in the sample before the block
+};
+
+struct energy_reading;
+struct system_poll_info;
+
+/* poli_sample_schema_init - decides which fields are stored, from a reading taken at init
+   (RAPL domains that couldn't be read are left out)
+   input: the schema, the reading, number of packages reported separately*/
+void poli_sample_schema_init (struct sample_schema *schema, struct energy_reading *reading, int num_sockets);
+
+/* poli_sample_pack - stores the energy and frequency of a sampler reading in a sample*/
+void poli_sample_pack (struct sample_schema *schema, struct poli_sample *sample, struct system_poll_info *info);
+
+/* poli_sample_get_energy - fills an energy reading from a stored sample, fields that aren't stored are set to -1*/
+void poli_sample_get_energy (struct sample_schema *schema, struct poli_sample *sample, struct energy_reading *reading);
+
+/* poli_sample_read_values - copies the value of every column from an energy reading, -1 for values that aren't part of a reading
+   input: the schema, the reading, array of at least num_columns values*/
+void poli_sample_read_values (struct sample_schema *schema, struct energy_reading *reading, double *values);
+
+/* poli_sample_field_name - writes a short name of the field (e.g. "RAPL pkg1") into name*/
+void poli_sample_field_name (sample_field_t field, char *name, size_t len);
+
+/* poli_sample_block_init - allocates the columns of a block
+   input: the block, the schema, the reading the power of the first sample is computed from
+   returns: 0 if no errors, 1 otherwise*/
+int poli_sample_block_init (struct sample_block *block, struct sample_schema *schema, struct energy_reading *initial);
+
+/* poli_sample_block_read - reads the next samples spooled by the ring into the block and derives their power
+   returns: the number of samples read, 0 at the end of the spool*/
+int poli_sample_block_read (struct sample_block *block, struct sample_schema *schema, struct poli_ring *ring);
+
+/* poli_sample_value, poli_sample_power - value or derived power of a field for sample i of a block,
+   -1 if the field isn't recorded*/
+double poli_sample_value (struct sample_block *block, struct sample_schema *schema, sample_field_t field, int i);
+double poli_sample_power (struct sample_block *block, struct sample_schema *schema, sample_field_t field, int i);
+
+void poli_sample_block_destroy (struct sample_block *block);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
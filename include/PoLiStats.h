@@ -0,0 +1,62 @@
+#ifndef __POLISTATS_H
+#define __POLISTATS_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#ifndef _NOMPI
+#include <mpi.h>
+#endif
+
+/* count, total, extremes, mean and variance of a series of values,
+   updated one value at a time in constant memory (Welford's algorithm) */
+struct running_stats {
+    long count;
+    double total;
+    double min;
+    double max;
+    double mean;
+    double m2; //sum of squared differences from the mean
+};
+
+void poli_stats_init (struct running_stats *stats);
+
+/* poli_stats_update - adds a value to the statistics*/
+void poli_stats_update (struct running_stats *stats, double value);
+
+/* poli_stats_variance - returns the (population) variance of the values added so far, 0 if there are none*/
+double poli_stats_variance (struct running_stats *stats);
+
+/* sum, extremes and the nodes they come from of one value per node, all doubles
+   so that arrays of them can be sent and reduced across nodes as MPI_DOUBLE */
+struct node_stats {
+    double count; //nodes that have a value
+    double total;
+    double min;
+    double max;
+    double min_node; //node with the smallest value (the lowest if several), -1 if none
+    double max_node; //node with the largest value (the lowest if several), -1 if none
+};
+
+void poli_node_stats_init (struct node_stats *stats);
+
+/* poli_node_stats_set - sets the statistics to the value of a single node*/
+void poli_node_stats_set (struct node_stats *stats, double value, int node);
+
+/* poli_node_stats_merge - adds the nodes of from to into, the result doesn't depend on the order of the merges*/
+void poli_node_stats_merge (struct node_stats *into, const struct node_stats *from);
+
+#ifndef _NOMPI
+/* poli_node_stats_mpi_create - creates the datatype of one struct node_stats and the operation merging them,
+   to be freed with MPI_Type_free and MPI_Op_free
+   input: pointers to the datatype and the operation*/
+void poli_node_stats_mpi_create (MPI_Datatype *type, MPI_Op *op);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
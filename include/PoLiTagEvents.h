@@ -0,0 +1,89 @@
+#ifndef __POLITAGEVENTS_H
+#define __POLITAGEVENTS_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#ifndef _NOMPI
+#include <mpi.h>
+#endif
+
+// Longest tag name kept in the tag event log (longer names are truncated)
+#define TAG_EVENT_NAME_LEN 64
+// Number of distinct tag names each rank can log, boundaries of tags with other names are dropped
+#define TAG_EVENT_MAX_NAMES 128
+// Number of tag boundaries each rank can log, can be changed with PoLi_TAG_EVENTS
+#define DEFAULT_TAG_EVENTS 4096
+
+typedef enum tag_event_kinds { TAG_EVENT_START, TAG_EVENT_END } tag_event_kind_t;
+
+struct tag_event {
+    int name; //index in the names of the segment
+    int kind;
+    double time; //CLOCK_MONOTONIC, the same clock for all ranks of a node
+};
+
+/* the part of the log written by one rank */
+struct tag_event_segment {
+    int num_names;
+    int num_events;
+    int max_events;
+    int dropped; //events that didn't fit
+    int dropped_names; //events whose tag name didn't fit
+    char names[TAG_EVENT_MAX_NAMES][TAG_EVENT_NAME_LEN];
+    struct tag_event events[];
+};
+
+/* A log of tag boundaries shared by the ranks of a node, in an MPI-3 shared
+   memory window. Every rank appends to its own segment without taking a lock
+   or synchronizing with the others; the monitor reads all segments once every
+   rank is done logging. */
+struct tag_event_log {
+    struct tag_event_segment *segment; //segment of this rank, NULL if the log couldn't be set up
+    int num_ranks;
+#ifndef _NOMPI
+    MPI_Win win;
+#endif
+};
+
+/* one instance of a tag on the node, from the first rank starting it to the last rank ending it */
+struct tag_interval {
+    char *name; //points into the log
+    double start;
+    double end; //-1 if a rank never ended it
+};
+
+struct monitor_t;
+
+/* poli_tag_events_init - allocates a segment for every rank of the node, collective over the node
+   input: the log, the monitor, number of events each rank can log
+   returns: 0 if no errors, 1 otherwise (e.g. without MPI-3)*/
+int poli_tag_events_init (struct tag_event_log *log, struct monitor_t *monitor, int max_events);
+
+/* poli_tag_events_clock - returns the time events are logged with, in seconds*/
+double poli_tag_events_clock (void);
+
+/* poli_tag_events_record - logs a tag boundary of this rank
+   input: the log, index of the name in this rank's segment (-1 the first time, it is then set), name of the tag, start or end
+   returns: 0 if no errors, 1 if the event was dropped*/
+int poli_tag_events_record (struct tag_event_log *log, int *name_index, char *name, tag_event_kind_t kind);
+
+/* poli_tag_events_flush - makes this rank's events visible to the monitor, must be called before the ranks synchronize*/
+void poli_tag_events_flush (struct tag_event_log *log);
+
+/* poli_tag_events_collect - matches the starts and ends of every rank and combines the n-th instance of a tag
+   on all ranks into one interval, must be called by the monitor after all ranks flushed their events
+   input: the log, pointer to the intervals (allocated, sorted by start), pointer to their number
+   returns: 0 if no errors, 1 otherwise*/
+int poli_tag_events_collect (struct tag_event_log *log, struct tag_interval **intervals, int *num_intervals);
+
+/* poli_tag_events_destroy - frees the log, collective over the node*/
+void poli_tag_events_destroy (struct tag_event_log *log);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
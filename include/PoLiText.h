@@ -0,0 +1,68 @@
+#ifndef __POLITEXT_H
+#define __POLITEXT_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <time.h>
+
+// Size of the buffer of a text file, written out with one write() when full
+#define TEXT_BUFFER_SIZE (1 << 20)
+// Room reserved for a single number, longer output goes through snprintf
+#define TEXT_NUMBER_LEN 64
+// Length of a date, "YYYY-MM-DD HH:MM:SS", including the terminating null character
+#define TEXT_DATE_LEN 20
+
+/* A tab-separated text file written through a large buffer. Numbers are
+   formatted without going through printf, and dates are only formatted
+   again when their second changes. */
+struct text_writer {
+    int fd;
+    char *buf;
+    size_t len;
+    time_t date_second; //second of the cached date, -1 if none
+    char date[TEXT_DATE_LEN];
+    int error;
+};
+
+/* poli_text_open - creates the file
+   returns: 0 if no errors, 1 otherwise*/
+int poli_text_open (struct text_writer *writer, char *path);
+
+/* poli_text_puts - appends a string*/
+void poli_text_puts (struct text_writer *writer, const char *string);
+
+/* poli_text_putc - appends a character*/
+void poli_text_putc (struct text_writer *writer, char c);
+
+/* poli_text_printf - appends formatted output, for headers and other rare lines*/
+void poli_text_printf (struct text_writer *writer, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+
+/* poli_text_double - appends a double exactly as printf("%lf") would*/
+void poli_text_double (struct text_writer *writer, double value);
+
+/* poli_text_field - appends a double followed by a tab*/
+void poli_text_field (struct text_writer *writer, double value);
+
+/* poli_text_doubles - appends doubles separated by tabs, without a tab before the first or after the last*/
+void poli_text_doubles (struct text_writer *writer, const double *values, int count);
+
+/* poli_text_int - appends an integer exactly as printf("%ld") would*/
+void poli_text_int (struct text_writer *writer, long value);
+
+/* poli_text_date - appends the local date and time of a second as "YYYY-MM-DD HH:MM:SS"
+   input: the writer, seconds since the epoch*/
+void poli_text_date (struct text_writer *writer, time_t second);
+
+/* poli_text_close - writes what is left in the buffer and closes the file
+   returns: 0 if the file is complete, 1 otherwise*/
+int poli_text_close (struct text_writer *writer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef __POLITHREADTAGS_H
+#define __POLITHREADTAGS_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+
+#include "PoLiArena.h"
+#include "PoLiTagEvents.h"
+
+// Tag boundaries per chunk of a thread's log
+#define THREAD_TAG_CHUNK_EVENTS 1024
+
+struct thread_tag_event {
+    int handle; //handle of the tag in the tag registry
+    int kind;
+    double time; //poli_tag_events_clock()
+};
+
+/* The tag boundaries logged by one thread. A thread allocates its log the
+   first time it logs a boundary and is the only one appending to it, so
+   logging never takes a lock; the log is linked into the list of all logs
+   once, when it is allocated. */
+struct thread_tag_log {
+    int thread_num; //omp_get_thread_num() when the log was allocated
+    unsigned long generation;
+    struct poli_arena events;
+    struct thread_tag_log *next;
+};
+
+/* one instance of a tag on one thread, or on all threads that logged it */
+struct thread_tag_interval {
+    int handle;
+    int thread_num; //-1 for the union of all threads
+    double start;
+    double end; //-1 if a thread never ended it
+};
+
+/* poli_thread_tags_init - sets the memory limit of every thread's log, must be called outside parallel regions
+   input: limit in bytes (0 for no limit)*/
+void poli_thread_tags_init (size_t memory_limit);
+
+/* poli_thread_tags_record - logs a tag boundary of the calling thread, allocating its log the first time
+   input: handle of the tag, start or end
+   returns: 0 if no errors, 1 if the boundary was dropped*/
+int poli_thread_tags_record (int handle, tag_event_kind_t kind);
+
+/* poli_thread_tags_collect - matches the starts and ends of every thread, must be called outside parallel regions.
+   The n-th instance of a tag on a thread gives one interval, and the n-th instances on all threads
+   are combined into one more interval, from the first thread starting it to the last thread ending it
+   input: pointer to the intervals (allocated, sorted by start), pointer to their number
+   returns: 0 if no errors, 1 otherwise*/
+int poli_thread_tags_collect (struct thread_tag_interval **intervals, int *num_intervals);
+
+/* poli_thread_tags_destroy - frees the logs of all threads, must be called outside parallel regions*/
+void poli_thread_tags_destroy (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
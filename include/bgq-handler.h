@@ -10,6 +10,7 @@
 
 struct system_info_t;
 struct monitor_t;
+struct text_writer;
 
 
 struct bgq_measurement
@@ -46,10 +47,10 @@ int compute_bgq_total_measurements (struct bgq_measurement *bm, struct bgq_measu
 
 
 
-void write_bgq_header(FILE **fp);
-void write_bgq_output(FILE **fp, struct bgq_measurement *bm);
-void write_bgq_ediff_header(FILE **fp);
-void write_bgq_ediff(FILE **fp, struct bgq_measurement *end, struct bgq_measurement *start);
+void write_bgq_header(struct text_writer *out);
+void write_bgq_output(struct text_writer *out, struct bgq_measurement *bm);
+void write_bgq_ediff_header(struct text_writer *out);
+void write_bgq_ediff(struct text_writer *out, struct bgq_measurement *end, struct bgq_measurement *start);
 
 #ifdef __cplusplus
 //}
@@ -19,6 +19,7 @@ extern "C"
 #include <string.h>
 
 #include <sys/syscall.h>
+#include <sys/ioctl.h>
 #include <linux/perf_event.h>
 
 #define MSR_RAPL_POWER_UNIT     0x606
@@ -57,6 +58,7 @@ extern "C"
 #define MSR_PLATFORM_POWER_LIMIT 0x65C
 
 #define IA32_THERM_STATUS 0x19C
+#define IA32_PACKAGE_THERM_STATUS 0x1B1
 #define IA32_MPERF 0xE7
 #define IA32_APERF 0xE8
 
@@ -87,6 +89,8 @@ extern "C"
 
 #define MAX_CPUS    1024
 #define MAX_PACKAGES    16
+#define MAX_SOCKETS     4 //packages whose energy is also reported separately, all of them count towards the node totals
+#define ALL_PACKAGES    -1 //package argument of the power cap functions that applies to the whole node
 #define MAX_MSRS 25
 
 #define DEFAULT_PKG_POW 215.0
@@ -97,7 +101,9 @@ extern "C"
 #define DEFAULT_CORE_SECONDS 0.000976562500 //when disabled
 #define MAX_WATTS 300.0
 #define MIN_WATTS 50.0
+#define WRAP_GUARD_SAFETY 0.5 //fraction of the time to a counter wrap at maximum power after which energy is read again
 #define NUM_ZONES 5 //PACKAGE, CORE, UNCORE, PLATFORM, DRAM (system/architecture dependent)
+#define NUM_PCAP_ZONES 3 //zones whose power caps are read and set: PACKAGE, CORE, DRAM (zone_names in PoLiMEr.c)
 #define ZONE_NAME_LEN 10
 
 #define PACKAGE_INDEX 0 //defining this because package is most commonly used zone
@@ -120,7 +126,32 @@ extern "C"
 
 #define BUFSIZE 500
 
+/* msr-safe batch interface, see https://github.com/LLNL/msr-safe (msr_batch.h) */
+#define MSR_BATCH_DEVICE "/dev/cpu/msr_batch"
+#ifndef X86_IOC_MSR_BATCH
+struct msr_batch_op {
+    uint16_t cpu;     /* In: CPU to execute {rd/wr}msr instruction */
+    uint16_t isrdmsr; /* In: 0=wrmsr, non-zero=rdmsr */
+    int32_t err;      /* Out: set if error occurred with this operation */
+    uint32_t msr;     /* In: MSR Address to perform operation */
+    uint64_t msrdata; /* In/Out: Input/Result to/from operation */
+    uint64_t wmask;   /* Out: Write mask applied to wrmsr */
+};
+
+struct msr_batch_array {
+    uint32_t numops;             /* In: # of operations in operations array */
+    struct msr_batch_op *ops;    /* In: Array[numops] of operations */
+};
+
+#define X86_IOC_MSR_BATCH _IOWR('c', 0xA2, struct msr_batch_array)
+#endif
+
 struct system_info_t;
+struct perf_rapl_info;
+struct powercap_info;
+
+/* how RAPL is accessed, chosen with PoLi_RAPL_BACKEND=msr|perf|powercap|auto */
+typedef enum rapl_backends { RAPL_BACKEND_NONE, RAPL_BACKEND_MSR, RAPL_BACKEND_PERF, RAPL_BACKEND_POWERCAP } rapl_backend_t;
 
 struct msr_info {
     int msr;
@@ -136,9 +167,9 @@ struct msr_energy {
     int msr;
     int package_id;
     int cpu_id;
-    double last_energy;
+    uint64_t last_raw; //last 32-bit counter value
+    uint64_t accumulated; //counter increments since the first read, never wraps
     double total_energy;
-    int num_overflows;
     double cpu_energy_units;
     double dram_energy_units;
 };
@@ -183,7 +214,12 @@ struct rapl_energy {
 };
 
 struct system_msr_info {
-    int error_state;
+    int error_state; //set if RAPL energy can't be read through any backend
+    int pcap_error_state; //set if power caps can't be read or set through any backend
+    rapl_backend_t backend; //used to read energy
+    rapl_backend_t pcap_backend; //used to read and set power caps (msr or powercap)
+    struct perf_rapl_info *perf; //only set if perf events are used
+    struct powercap_info *powercap; //only set if powercap is used
     /* general info */
     int cpu_model;
     int total_cores;
@@ -210,18 +246,37 @@ struct system_msr_info {
     struct msr_policy *policy_msrs;
 
     int num_zones;
+
+    /* msr-safe batch: one ioctl reads the energy, perf status and thermal msrs of all packages */
+    int batch_fd; //-1 if the batch interface is not used
+    int num_batch_ops;
+    struct msr_batch_op *batch_ops;
+    void **batch_targets; //msr_energy, msr_perf or thermal_status entry each op is read into
+    uint64_t thermal_status[MAX_PACKAGES]; //last IA32_PACKAGE_THERM_STATUS of each package (batch only)
 };
 
 void init_msrs (struct system_info_t *system_info);
 int finalize_msrs (struct system_info_t * system_info);
-int rapl_set_power_cap (char *zone_name, double watts_long, double watts_short, double seconds_long, double seconds_short, struct system_info_t * system_info, int enable);
-
-int rapl_read_energy (struct rapl_energy * re, struct system_info_t * system_info);
+/* rapl_set_power_cap - sets a power cap on one package, or the same power cap on every package in one pass
+   input: zone name, package index or ALL_PACKAGES, power cap parameters, system info, whether the cap is enabled
+   returns: 0 if no errors, 1 otherwise*/
+int rapl_set_power_cap (char *zone_name, int package, double watts_long, double watts_short, double seconds_long, double seconds_short, struct system_info_t * system_info, int enable);
+
+/* rapl_read_energy - reads the RAPL energy of all packages in one pass
+   input: node totals (platform energy is counted once), array of MAX_SOCKETS per package readings or NULL
+   returns: 0*/
+int rapl_read_energy (struct rapl_energy * re, struct rapl_energy * socket_re, struct system_info_t * system_info);
 int rapl_compute_total_power (struct rapl_energy *re, struct rapl_energy *energy, double time);
 int rapl_compute_total_energy (struct rapl_energy *re, struct rapl_energy *end, struct rapl_energy *start);
 
-int rapl_get_power_cap (struct msr_pcap *pcap, char *zone_name, struct system_info_t * system_info);
-int rapl_get_power_cap_info(char *zone_name, double *min, double *max,
+/* rapl_wrap_guard_period - the longest time energy readings can be apart without a counter wrapping
+   more than once, with a safety margin. Computed from the energy units (or the counter ranges with powercap)
+   and the maximum power of all packages.
+   returns: period in seconds, 0 if the counters can't wrap or energy can't be read*/
+double rapl_wrap_guard_period (struct system_info_t *system_info);
+
+int rapl_get_power_cap (struct msr_pcap *pcap, char *zone_name, int package, struct system_info_t * system_info);
+int rapl_get_power_cap_info(char *zone_name, int package, double *min, double *max,
     double *thermal_spec, double *max_time_window, struct system_info_t * system_info);
 
 #ifdef __cplusplus
@@ -0,0 +1,55 @@
+#ifndef __PERF_EVENT_HANDLER_H
+#define __PERF_EVENT_HANDLER_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+
+#include "msr-handler.h"
+
+#define PERF_RAPL_PMU_PATH "/sys/bus/event_source/devices/power/"
+#define PERF_RAPL_NUM_DOMAINS 5
+
+typedef enum perf_rapl_domains { PERF_RAPL_PKG, PERF_RAPL_CORES, PERF_RAPL_GPU, PERF_RAPL_RAM, PERF_RAPL_PSYS } perf_rapl_domain_t;
+
+struct system_info_t;
+
+struct perf_rapl_domain {
+    const char *event_name;
+    int available;
+    uint64_t config;
+    double scale; //joules per count
+};
+
+/* RAPL energy counters exposed by the kernel's "power" PMU. They are 64 bits wide and
+   don't wrap, and one group read per package returns all of its domains at once. */
+struct perf_rapl_info {
+    int pmu_type;
+    struct perf_rapl_domain domains[PERF_RAPL_NUM_DOMAINS];
+
+    int num_packages;
+    int group_fd[MAX_PACKAGES]; //group leader of each package, -1 if none could be opened
+    int num_events[MAX_PACKAGES];
+    int event_fd[MAX_PACKAGES][PERF_RAPL_NUM_DOMAINS];
+    int event_domain[MAX_PACKAGES][PERF_RAPL_NUM_DOMAINS]; //domain of each value in a group read, in read order
+};
+
+/* init_perf_rapl - opens the RAPL energy events of every package
+   returns: 0 if at least the first package can be read, 1 otherwise*/
+int init_perf_rapl (struct system_info_t *system_info);
+
+int finalize_perf_rapl (struct system_info_t *system_info);
+
+/* perf_rapl_read_energy - reads all domains of a package with a single read
+   input: struct to fill (domains that aren't available are left untouched), package index
+   returns: 0 if no errors, 1 otherwise*/
+int perf_rapl_read_energy (struct rapl_energy *re, struct system_info_t *system_info, int package);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
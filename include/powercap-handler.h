@@ -0,0 +1,81 @@
+#ifndef __POWERCAP_HANDLER_H
+#define __POWERCAP_HANDLER_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+
+#include "msr-handler.h"
+
+#ifndef POWERCAP_PATH
+#define POWERCAP_PATH "/sys/class/powercap/"
+#endif
+#define POWERCAP_PREFIX "intel-rapl:"
+#define POWERCAP_MAX_ZONES (MAX_PACKAGES * 4 + 1) //package, core, uncore, dram for each package and psys
+#define POWERCAP_NUM_CONSTRAINTS 2 //long_term, short_term
+#define POWERCAP_BUFSIZE 32
+
+struct system_info_t;
+
+/* one zone of the powercap tree, e.g. intel-rapl:0 (package-0) or intel-rapl:0:0 (core) */
+struct powercap_zone {
+    char name[BUFSIZE];
+    int package_id;
+    zone_label_t zone_label;
+
+    int energy_fd;
+    uint64_t max_energy_range_uj;
+    uint64_t last_energy_uj;
+    uint64_t wrapped_uj; //energy accumulated by the counter wrapping around
+
+    int enabled_fd;
+    int num_constraints;
+    int power_limit_fd[POWERCAP_NUM_CONSTRAINTS];
+    int time_window_fd[POWERCAP_NUM_CONSTRAINTS];
+    uint64_t max_power_uw[POWERCAP_NUM_CONSTRAINTS];
+};
+
+/* All zones are enumerated once and their files stay open, so reading energy
+   or a power limit is a single pread. */
+struct powercap_info {
+    int num_zones;
+    struct powercap_zone zones[POWERCAP_MAX_ZONES];
+    char energy_buf[POWERCAP_BUFSIZE]; //reused by every energy read (reads are serialized by the caller)
+};
+
+/* init_powercap - enumerates the RAPL zones under /sys/class/powercap and opens their files
+   returns: 0 if at least one zone's energy can be read, 1 otherwise*/
+int init_powercap (struct system_info_t *system_info);
+int finalize_powercap (struct system_info_t *system_info);
+
+/* powercap_read_energy - reads the energy of all zones of a package
+   input: struct to fill (zones that don't exist are left untouched), package index
+   returns: 0 if no errors, 1 otherwise*/
+int powercap_read_energy (struct rapl_energy *re, struct system_info_t *system_info, int package);
+
+/* powercap_set_power_cap - writes the limits of pcap to its zone (selected by zone_label) on a package
+   returns: 0 if no errors, 1 otherwise*/
+int powercap_set_power_cap (struct msr_pcap *pcap, struct system_info_t *system_info, int package);
+
+/* powercap_get_power_cap - reads the current limits of a zone (selected by pcap->zone_label) on a package
+   returns: 0 if no errors, 1 otherwise*/
+int powercap_get_power_cap (struct msr_pcap *pcap, struct system_info_t *system_info, int package);
+
+/* powercap_get_power_cap_info - powercap only exposes the maximum power of each constraint, which is
+   returned as max and thermal_spec; min and max_time_window are set to -1
+   returns: 0 if no errors, 1 otherwise*/
+int powercap_get_power_cap_info (zone_label_t zone_label, double *min, double *max,
+    double *thermal_spec, double *max_time_window, struct system_info_t *system_info, int package);
+
+/* powercap_min_energy_range - the smallest energy range of all zones, i.e. the energy after which the first counter wraps
+   returns: energy in Joules, 0 if no zone reports its range*/
+double powercap_min_energy_range (struct system_info_t *system_info);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
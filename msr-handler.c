@@ -19,14 +19,18 @@
 #include "PoLiMEr.h"
 #include "PoLiLog.h"
 #include "msr-handler.h"
+#include "perf_event-handler.h"
+#include "powercap-handler.h"
 
 static int short_term_supported (int msr);
 static int verify_power_limits(double watts, int enable);
 static int get_msr_for_zone_name(char *zone_name, int get_pcap);
+static int get_zone_label_for_name(char *zone_name, zone_label_t *zone_label);
 
 static int detect_cpu(void);
 static int verify_model(int model);
 static int detect_packages (struct system_info_t *system_info);
+static int init_msr_backend (struct system_info_t *system_info);
 
 static void get_msr_units(struct system_info_t *system_info, int package);
 
@@ -38,8 +42,21 @@ static int read_msr_pcap (struct msr_pcap *msr_pcap, struct system_info_t *syste
 static int read_msr_perf (struct msr_perf *msr_perf, struct system_info_t *system_info, int package_id);
 static int read_msr_policy (struct msr_policy *msr_policy, struct system_info_t *system_info, int package_id);
 static int read_msr_energy (struct msr_energy *msr_energy, struct system_info_t * system_info, int package_id);
+static void read_package_energy (struct rapl_energy *re, struct system_info_t *system_info, int package_id, int batched);
+static void init_rapl_energy (struct rapl_energy *re);
+static void add_rapl_energy (struct rapl_energy *total, struct rapl_energy *re);
+static void update_msr_energy (struct msr_energy *msr_energy, uint64_t data);
+
+static int is_energy_msr (int msr);
+static int is_perf_msr (int msr);
+static void init_msr_batch (struct system_info_t *system_info);
+static int add_msr_batch_op (struct system_msr_info *sysmsr, int cpu, int msr, void *target);
+static int read_msr_batch (struct system_info_t *system_info);
+static void finalize_msr_batch (struct system_msr_info *sysmsr);
 
 static int set_msr_pcap(struct msr_pcap *pcap, struct system_info_t * system_info, int package_id);
+static int set_msr_pcap_all_packages (struct msr_pcap *pcap, struct system_info_t *system_info);
+static uint64_t pcap_to_msrval (struct msr_pcap *pcap, uint64_t msrval, struct system_msr_info *sysmsr);
 static uint64_t to_msr_power(double watts, double power_units);
 static int write_msr(int fd, int msr_address, uint64_t data);
 static uint64_t replace_bits(uint64_t msrval, uint64_t data, uint8_t first, uint8_t last);
@@ -158,6 +175,11 @@ void init_msrs (struct system_info_t * system_info)
     system_info->sysmsr = malloc(sizeof(struct system_msr_info));
 
     system_info->sysmsr->error_state = 1;
+    system_info->sysmsr->pcap_error_state = 1;
+    system_info->sysmsr->backend = RAPL_BACKEND_NONE;
+    system_info->sysmsr->pcap_backend = RAPL_BACKEND_NONE;
+    system_info->sysmsr->perf = 0;
+    system_info->sysmsr->powercap = 0;
 
     system_info->sysmsr->info_msrs = 0;
     system_info->sysmsr->energy_msrs = 0;
@@ -165,18 +187,80 @@ void init_msrs (struct system_info_t * system_info)
     system_info->sysmsr->perf_msrs = 0;
     system_info->sysmsr->policy_msrs = 0;
     system_info->sysmsr->num_zones = 0;
+    system_info->sysmsr->batch_fd = -1;
+    memset(system_info->sysmsr->package_fd, 0, sizeof(system_info->sysmsr->package_fd));
+    system_info->sysmsr->num_batch_ops = 0;
+    system_info->sysmsr->batch_ops = 0;
+    system_info->sysmsr->batch_targets = 0;
 
-    system_info->sysmsr->cpu_model = detect_cpu();
+    detect_packages(system_info);
 
-    if (system_info->sysmsr->cpu_model < 0)
+    char *backend_str = getenv("PoLi_RAPL_BACKEND");
+    int want_msr = (backend_str != NULL && strcmp(backend_str, "msr") == 0);
+    int want_perf = (backend_str != NULL && strcmp(backend_str, "perf") == 0);
+    int want_powercap = (backend_str != NULL && strcmp(backend_str, "powercap") == 0);
+    if (backend_str != NULL && !want_msr && !want_perf && !want_powercap && strcmp(backend_str, "auto") != 0)
+        poli_log(WARNING, NULL, "Unknown PoLi_RAPL_BACKEND=%s (expected msr, perf, powercap or auto). Using auto.", backend_str);
+
+    //the msrs are tried first in any case since power capping is most precise through them
+    int msr_ok = (init_msr_backend(system_info) == 0);
+    int powercap_ok = 0;
+    if (want_powercap || (!msr_ok && !want_msr))
+        powercap_ok = (init_powercap(system_info) == 0);
+
+    struct system_msr_info *sysmsr = system_info->sysmsr;
+    if (want_msr && msr_ok)
+        sysmsr->backend = RAPL_BACKEND_MSR;
+    else if (want_powercap && powercap_ok)
+        sysmsr->backend = RAPL_BACKEND_POWERCAP;
+    else if (want_perf && init_perf_rapl(system_info) == 0)
+        sysmsr->backend = RAPL_BACKEND_PERF;
+    else
     {
-        poli_log(ERROR, NULL, "Something went wrong with determining CPU. Will not use RAPL interface.");
-        return;
+        if (want_msr || want_perf || want_powercap)
+            poli_log(WARNING, NULL, "Couldn't read RAPL energy through %s, trying the other interfaces.", backend_str);
+        if (msr_ok)
+            sysmsr->backend = RAPL_BACKEND_MSR;
+        else if (powercap_ok)
+            sysmsr->backend = RAPL_BACKEND_POWERCAP;
+        else if (!want_perf && init_perf_rapl(system_info) == 0)
+            sysmsr->backend = RAPL_BACKEND_PERF;
+    }
+
+    if (powercap_ok && (want_powercap || !msr_ok))
+    {
+        sysmsr->pcap_backend = RAPL_BACKEND_POWERCAP;
+        sysmsr->num_zones = NUM_PCAP_ZONES;
     }
+    else if (msr_ok)
+        sysmsr->pcap_backend = RAPL_BACKEND_MSR;
+
+    sysmsr->error_state = (sysmsr->backend == RAPL_BACKEND_NONE);
+    sysmsr->pcap_error_state = (sysmsr->pcap_backend == RAPL_BACKEND_NONE);
+    if (sysmsr->error_state)
+        poli_log(ERROR, NULL, "Neither the msrs, powercap nor perf events can be read. There won't be any measurements using RAPL.");
     else
-        system_info->sysmsr->error_state = 0;
+        poli_log(DEBUG, NULL, "Reading RAPL energy through %s", sysmsr->backend == RAPL_BACKEND_MSR ? "msrs" :
+            (sysmsr->backend == RAPL_BACKEND_POWERCAP ? "powercap" : "perf events"));
+    if (sysmsr->pcap_error_state)
+        poli_log(WARNING, NULL, "Neither the msrs nor powercap can be accessed. Power caps can't be read or set.");
 
-    detect_packages(system_info);
+    poli_log(TRACE, NULL, "Finishing %s", __FUNCTION__);
+}
+
+/* sets up the msr lists of the detected cpu model and opens the msr file of each package
+   returns: 0 if the msrs can be used, 1 otherwise*/
+static int init_msr_backend (struct system_info_t *system_info)
+{
+    poli_log(TRACE, NULL, "Entering %s", __FUNCTION__);
+
+    system_info->sysmsr->cpu_model = detect_cpu();
+
+    if (system_info->sysmsr->cpu_model < 0)
+    {
+        poli_log(ERROR, NULL, "Something went wrong with determining CPU. Will not use the RAPL msrs.");
+        return 1;
+    }
 
     int i, j;
     for (i = 0; i < 5; i++)
@@ -187,8 +271,7 @@ void init_msrs (struct system_info_t * system_info)
 
 
 
-    //TODO
-    system_info->sysmsr->num_zones = 3;
+    system_info->sysmsr->num_zones = NUM_PCAP_ZONES;
 
     switch (system_info->sysmsr->cpu_model)
     {
@@ -411,12 +494,10 @@ void init_msrs (struct system_info_t * system_info)
         int fd = open_msr(cpu_id);
         if (fd < 0)
         {
-            poli_log(ERROR, NULL, "Failed to open any MSR file. There won't be any measurements using RAPL.");
-            system_info->sysmsr->error_state = 1;
-            return;
+            poli_log(ERROR, NULL, "Failed to open any MSR file. Will not use the RAPL msrs.");
+            system_info->sysmsr->num_zones = 0;
+            return 1;
         }
-        else
-            system_info->sysmsr->error_state = 0;
 
         system_info->sysmsr->package_fd[package] = fd;
         get_msr_units(system_info, package);
@@ -428,8 +509,8 @@ void init_msrs (struct system_info_t * system_info)
             emsr->msr = system_info->sysmsr->msrs[0][msr];
             emsr->package_id = package;
             emsr->cpu_id = cpu_id;
-            emsr->last_energy = 0.0;
-            emsr->num_overflows = 0;
+            emsr->last_raw = 0;
+            emsr->accumulated = 0;
             emsr->cpu_energy_units = system_info->sysmsr->cpu_energy_units[package];
             emsr->dram_energy_units = system_info->sysmsr->dram_energy_units[package];
         }
@@ -481,20 +562,26 @@ void init_msrs (struct system_info_t * system_info)
         }
     }
 
+    init_msr_batch(system_info);
+
     poli_log(TRACE, NULL, "Finishing %s", __FUNCTION__);
+
+    return 0;
 }
 
 int finalize_msrs (struct system_info_t * system_info)
 {
     poli_log(TRACE, NULL, "Entering %s", __FUNCTION__);
 
-    if (!system_info->sysmsr->error_state)
-    {
-        int package;
-        for (package = 0; package < system_info->sysmsr->total_packages; package++)
-            if (system_info->sysmsr->package_fd[package])
-                close(system_info->sysmsr->package_fd[package]);
-    }
+    //the msr files may be open even if another backend is used
+    int package;
+    for (package = 0; package < system_info->sysmsr->total_packages; package++)
+        if (system_info->sysmsr->package_fd[package] > 0)
+            close(system_info->sysmsr->package_fd[package]);
+
+    finalize_msr_batch(system_info->sysmsr);
+    finalize_perf_rapl(system_info);
+    finalize_powercap(system_info);
 
     if(system_info->sysmsr)
         free(system_info->sysmsr);
@@ -504,13 +591,13 @@ int finalize_msrs (struct system_info_t * system_info)
     return 0;
 }
 
-int rapl_read_energy(struct rapl_energy *re, struct system_info_t * system_info)
+int rapl_read_energy(struct rapl_energy *re, struct rapl_energy *socket_re, struct system_info_t * system_info)
 {
-    re->package = -1.0;
-    re->pp0 = -1.0;
-    re->pp1 = -1.0;
-    re->dram = -1.0;
-    re->platform = -1.0;
+    init_rapl_energy(re);
+    int package;
+    if (socket_re)
+        for (package = 0; package < MAX_SOCKETS; package++)
+            init_rapl_energy(&socket_re[package]);
 
     if (system_info->sysmsr->error_state)
     {
@@ -518,14 +605,66 @@ int rapl_read_energy(struct rapl_energy *re, struct system_info_t * system_info)
         return 0;
     }
 
-    //TODO
-    int i, package_id = 0; //fixing package to be 0, this needs to be changed for other platforms
+    //a single ioctl updates the energy msrs of all packages, otherwise read them one by one
+    int batched = (system_info->sysmsr->backend == RAPL_BACKEND_MSR && read_msr_batch(system_info) == 0);
+
+    for (package = 0; package < system_info->sysmsr->total_packages; package++)
+    {
+        struct rapl_energy package_re;
+        init_rapl_energy(&package_re);
+
+        if (system_info->sysmsr->backend == RAPL_BACKEND_PERF)
+            perf_rapl_read_energy(&package_re, system_info, package);
+        else if (system_info->sysmsr->backend == RAPL_BACKEND_POWERCAP)
+            powercap_read_energy(&package_re, system_info, package);
+        else
+            read_package_energy(&package_re, system_info, package, batched);
+
+        add_rapl_energy(re, &package_re);
+        if (socket_re && package < MAX_SOCKETS)
+            socket_re[package] = package_re;
+    }
+
+    if (re->package == -1.0 && re->pp0 == -1.0 && re->pp1 == -1.0 && re->dram == -1.0 && re->platform == -1.0)
+        poli_log(ERROR, NULL, "%s: wasn't able to get any energy measurments!", __FUNCTION__);
+
+    return 0;
+}
+
+static void init_rapl_energy (struct rapl_energy *re)
+{
+    re->package = -1.0;
+    re->pp0 = -1.0;
+    re->pp1 = -1.0;
+    re->dram = -1.0;
+    re->platform = -1.0;
+}
+
+/* adds the energy of one package to the node totals; the platform counter covers the whole node so it is only taken once */
+static void add_rapl_energy (struct rapl_energy *total, struct rapl_energy *re)
+{
+    if (re->package > -1)
+        total->package = (total->package > -1 ? total->package : 0.0) + re->package;
+    if (re->pp0 > -1)
+        total->pp0 = (total->pp0 > -1 ? total->pp0 : 0.0) + re->pp0;
+    if (re->pp1 > -1)
+        total->pp1 = (total->pp1 > -1 ? total->pp1 : 0.0) + re->pp1;
+    if (re->dram > -1)
+        total->dram = (total->dram > -1 ? total->dram : 0.0) + re->dram;
+    if (re->platform > -1 && total->platform == -1.0)
+        total->platform = re->platform;
+}
+
+static void read_package_energy (struct rapl_energy *re, struct system_info_t *system_info, int package_id, int batched)
+{
+    int i;
     int num_energy_msrs = system_info->sysmsr->msr_nums[0];
 
     for (i = 0; i < num_energy_msrs; i++)
     {
         struct msr_energy *emsr = &system_info->sysmsr->energy_msrs[package_id * num_energy_msrs + i];
-        read_msr_energy(emsr, system_info, 0);
+        if (!batched)
+            read_msr_energy(emsr, system_info, package_id);
         if (emsr->msr == MSR_PKG_ENERGY_STATUS)
             re->package = emsr->total_energy;
         else if (emsr->msr == MSR_PP0_ENERGY_STATUS)
@@ -539,11 +678,6 @@ int rapl_read_energy(struct rapl_energy *re, struct system_info_t * system_info)
         else
             poli_log(ERROR, NULL, "%s: Unrecognized energy MSR %#010X", __FUNCTION__, emsr->msr);
     }
-
-    if (re->package == -1.0 && re->pp0 == -1.0 && re->pp1 == -1.0 && re->dram == -1.0 && re->platform == -1.0)
-        poli_log(ERROR, NULL, "%s: wasn't able to get any energy measurments!", __FUNCTION__);
-
-    return 0;
 }
 
 static int verify_power_limits(double watts, int enable)
@@ -642,6 +776,26 @@ static int get_msr_for_zone_name(char *zone_name, int get_pcap)
     return msr_address;
 }
 
+static int get_zone_label_for_name(char *zone_name, zone_label_t *zone_label)
+{
+    if (!strcmp(zone_name, "PACKAGE"))
+        *zone_label = PACKAGE;
+    else if (!strcmp(zone_name, "CORE"))
+        *zone_label = CORE;
+    else if (!strcmp(zone_name, "UNCORE"))
+        *zone_label = UNCORE;
+    else if (!strcmp(zone_name, "DRAM"))
+        *zone_label = DRAM;
+    else if (!strcmp(zone_name, "PLATFORM"))
+        *zone_label = PLATFORM;
+    else
+    {
+        poli_log(ERROR, NULL, "%s: Unsupported zone for power capping: %s", __FUNCTION__, zone_name);
+        return 1;
+    }
+    return 0;
+}
+
 static int rapl_init_power_cap(struct msr_pcap *pcap, char *zone_name, double watts_long, double watts_short, double seconds_long, double seconds_short, int enable)
 {
     poli_log(TRACE, NULL, "Entering %s", __FUNCTION__);
@@ -653,6 +807,7 @@ static int rapl_init_power_cap(struct msr_pcap *pcap, char *zone_name, double wa
     else
     {
         pcap->msr = msr_address;
+        get_zone_label_for_name(zone_name, &pcap->zone_label);
         if (pcap->msr != MSR_PKG_POWER_LIMIT && pcap->msr != MSR_PP0_POWER_LIMIT &&
         pcap->msr != MSR_PP1_POWER_LIMIT && pcap->msr != MSR_DRAM_POWER_LIMIT &&
         pcap->msr != MSR_PLATFORM_POWER_LIMIT)
@@ -686,18 +841,24 @@ static int rapl_init_power_cap(struct msr_pcap *pcap, char *zone_name, double wa
     return 0;
 }
 
-int rapl_set_power_cap(char *zone_name, double watts_long, double watts_short, double seconds_long, double seconds_short, struct system_info_t * system_info, int enable)
+int rapl_set_power_cap(char *zone_name, int package, double watts_long, double watts_short, double seconds_long, double seconds_short, struct system_info_t * system_info, int enable)
 {
     poli_log(TRACE, NULL, "Entering %s", __FUNCTION__);
 
     int ret = 1;
 
-    if (system_info->sysmsr->error_state)
+    if (system_info->sysmsr->pcap_error_state)
     {
         poli_log(WARNING, NULL, "RAPL Interface couldn't be set up. Setting power cap is not possible.");
         return ret;
     }
 
+    if (package != ALL_PACKAGES && (package < 0 || package >= system_info->sysmsr->total_packages))
+    {
+        poli_log(ERROR, NULL, "%s: Invalid package %d, this node has %d packages", __FUNCTION__, package, system_info->sysmsr->total_packages);
+        return ret;
+    }
+
     if (!verify_power_limits(watts_long, enable) || !verify_power_limits(watts_short, enable))
     {
         poli_log(WARNING, NULL, "%s: The requested power cap is invalid. Will reset system to default values...", __FUNCTION__);
@@ -726,9 +887,26 @@ int rapl_set_power_cap(char *zone_name, double watts_long, double watts_short, d
 
     if (rapl_init_power_cap(&pcap, zone_name, watts_long, watts_short, seconds_long, seconds_short, enable) == 0)
     {
-        int package = 0; //TODO figure out what to do with multiple packages
-        pcap.package_id = package;
-        ret = set_msr_pcap(&pcap, system_info, package);
+        if (package == ALL_PACKAGES && system_info->sysmsr->pcap_backend == RAPL_BACKEND_POWERCAP)
+        {
+            ret = 0;
+            for (package = 0; package < system_info->sysmsr->total_packages; package++)
+            {
+                pcap.package_id = package;
+                if (powercap_set_power_cap(&pcap, system_info, package) != 0)
+                    ret = 1;
+            }
+        }
+        else if (package == ALL_PACKAGES)
+            ret = set_msr_pcap_all_packages(&pcap, system_info);
+        else
+        {
+            pcap.package_id = package;
+            if (system_info->sysmsr->pcap_backend == RAPL_BACKEND_POWERCAP)
+                ret = powercap_set_power_cap(&pcap, system_info, package);
+            else
+                ret = set_msr_pcap(&pcap, system_info, package);
+        }
         if (ret != 0)
             poli_log(ERROR, NULL, "Something went wrong with setting a power cap!");
     }
@@ -755,15 +933,29 @@ static int short_term_supported (int msr)
 }
 
 
-int rapl_get_power_cap_info(char *zone_name, double *min, double *max,
+int rapl_get_power_cap_info(char *zone_name, int package, double *min, double *max,
     double *thermal_spec, double *max_time_window, struct system_info_t * system_info)
 {
-    if (system_info->sysmsr->error_state)
+    if (system_info->sysmsr->pcap_error_state)
     {
         poli_log(WARNING, NULL, "RAPL Interface couldn't be set up. Getting power cap info is not possible.");
         return 1;
     }
 
+    if (package < 0 || package >= system_info->sysmsr->total_packages)
+    {
+        poli_log(ERROR, NULL, "%s: Invalid package %d, this node has %d packages", __FUNCTION__, package, system_info->sysmsr->total_packages);
+        return 1;
+    }
+
+    if (system_info->sysmsr->pcap_backend == RAPL_BACKEND_POWERCAP)
+    {
+        zone_label_t zone_label;
+        if (get_zone_label_for_name(zone_name, &zone_label) != 0)
+            return 1;
+        return powercap_get_power_cap_info(zone_label, min, max, thermal_spec, max_time_window, system_info, package);
+    }
+
     int msr_address = get_msr_for_zone_name(zone_name, 0);
     int ret = 0;
     if (msr_address != MSR_PKG_POWER_INFO && msr_address != MSR_DRAM_POWER_INFO)
@@ -773,8 +965,6 @@ int rapl_get_power_cap_info(char *zone_name, double *min, double *max,
     }
     else if (msr_address != -1)
     {
-        int package = 0; //TODO
-
         uint64_t data;
         if (pread(system_info->sysmsr->package_fd[package], &data, sizeof(uint64_t), msr_address) != sizeof(uint64_t))
         {
@@ -801,20 +991,81 @@ int rapl_get_power_cap_info(char *zone_name, double *min, double *max,
     return ret;
 }
 
-int rapl_get_power_cap(struct msr_pcap *pcap, char *zone_name, struct system_info_t * system_info)
+double rapl_wrap_guard_period (struct system_info_t *system_info)
 {
-    if (system_info->sysmsr->error_state)
+    struct system_msr_info *sysmsr = system_info->sysmsr;
+
+    //perf counters are 64 bits wide
+    if (sysmsr->error_state || sysmsr->backend == RAPL_BACKEND_PERF)
+        return 0.0;
+
+    double wrap_energy = 0.0;
+    int package;
+    if (sysmsr->backend == RAPL_BACKEND_POWERCAP)
+        wrap_energy = powercap_min_energy_range(system_info);
+    else
+    {
+        for (package = 0; package < sysmsr->total_packages; package++)
+        {
+            double units = sysmsr->cpu_energy_units[package];
+            if (sysmsr->dram_energy_units[package] > 0.0 && sysmsr->dram_energy_units[package] < units)
+                units = sysmsr->dram_energy_units[package];
+            double energy = units * (double) ((uint64_t) 1 << 32);
+            if (energy > 0.0 && (wrap_energy == 0.0 || energy < wrap_energy))
+                wrap_energy = energy;
+        }
+    }
+    if (wrap_energy <= 0.0)
+        return 0.0;
+
+    //every package could draw its maximum power at the same time
+    double max_power = 0.0;
+    for (package = 0; package < sysmsr->total_packages; package++)
+    {
+        double min = -1, max = -1, thermal_spec = -1, max_time_window = -1;
+        if (!sysmsr->pcap_error_state)
+            rapl_get_power_cap_info("PACKAGE", package, &min, &max, &thermal_spec, &max_time_window, system_info);
+
+        if (max > 0.0)
+            max_power += max;
+        else if (thermal_spec > 0.0)
+            max_power += 2 * thermal_spec;
+        else
+            max_power += MAX_WATTS;
+    }
+
+    return WRAP_GUARD_SAFETY * wrap_energy / max_power;
+}
+
+int rapl_get_power_cap(struct msr_pcap *pcap, char *zone_name, int package, struct system_info_t * system_info)
+{
+    if (system_info->sysmsr->pcap_error_state)
     {
         poli_log(WARNING, NULL, "RAPL Interface couldn't be set up. Setting power cap is not possible.");
         return 1;
     }
 
+    if (package < 0 || package >= system_info->sysmsr->total_packages)
+    {
+        poli_log(ERROR, NULL, "%s: Invalid package %d, this node has %d packages", __FUNCTION__, package, system_info->sysmsr->total_packages);
+        return 1;
+    }
+
+    if (system_info->sysmsr->pcap_backend == RAPL_BACKEND_POWERCAP)
+    {
+        pcap->msr = get_msr_for_zone_name(zone_name, 1);
+        pcap->package_id = package;
+        if (get_zone_label_for_name(zone_name, &pcap->zone_label) != 0)
+            return 1;
+        return powercap_get_power_cap(pcap, system_info, pcap->package_id);
+    }
+
     int msr_address = get_msr_for_zone_name(zone_name, 1);
     int ret = 0;
     if (msr_address != -1)
     {
         pcap->msr = msr_address;
-        int package = 0; //TODO
+        pcap->package_id = package;
 
         uint64_t data;
         if (pread(system_info->sysmsr->package_fd[package], &data, sizeof(uint64_t), pcap->msr) != sizeof(uint64_t))
@@ -923,7 +1174,7 @@ static int open_msr(int core)
     poli_log(TRACE, NULL, "Finishing %s", __FUNCTION__);
     if (!ret)
         return fd;
-    return ret;
+    return -ret;
 }
 
 static void get_msr_units(struct system_info_t *system_info, int package)
@@ -981,21 +1232,93 @@ static int set_msr_pcap(struct msr_pcap *pcap, struct system_info_t * system_inf
     if (write_msr(system_info->sysmsr->package_fd[package_id], pcap->msr, msrval))
         poli_log(ERROR, NULL, "%s: Something went wrong with enabling the MSR", __FUNCTION__);
 
-    msrval = replace_bits(msrval, to_msr_power(pcap->watts_long, system_info->sysmsr->power_units), WATTS_LONG_START_BITS, WATTS_LONG_END_BITS);
+    msrval = pcap_to_msrval(pcap, msrval, system_info->sysmsr);
+
+    poli_log(TRACE, NULL, "Finishing %s", __FUNCTION__);
+
+    return write_msr(system_info->sysmsr->package_fd[package_id], pcap->msr, msrval);
+}
+
+/* writes the same power limit to every package. With msr-safe the limit msrs of all packages are read
+   with one ioctl and written with another, otherwise they are set one package at a time */
+static int set_msr_pcap_all_packages (struct msr_pcap *pcap, struct system_info_t *system_info)
+{
+    poli_log(TRACE, NULL, "Entering %s", __FUNCTION__);
+
+    struct system_msr_info *sysmsr = system_info->sysmsr;
+    int package;
+
+    if (sysmsr->batch_fd >= 0)
+    {
+        struct msr_batch_op ops[MAX_PACKAGES];
+        struct msr_batch_array batch = {.numops = sysmsr->total_packages, .ops = ops};
+        memset(ops, 0, sizeof(ops));
+        for (package = 0; package < sysmsr->total_packages; package++)
+        {
+            ops[package].cpu = (uint16_t) sysmsr->package_map[package];
+            ops[package].isrdmsr = 1;
+            ops[package].msr = (uint32_t) pcap->msr;
+        }
+
+        int failed = (ioctl(sysmsr->batch_fd, X86_IOC_MSR_BATCH, &batch) < 0);
+        for (package = 0; package < sysmsr->total_packages && !failed; package++)
+        {
+            failed = (ops[package].err != 0);
+            ops[package].msrdata = pcap_to_msrval(pcap, ops[package].msrdata, sysmsr);
+            ops[package].isrdmsr = 0;
+            ops[package].err = 0;
+        }
+
+        if (!failed)
+            failed = (ioctl(sysmsr->batch_fd, X86_IOC_MSR_BATCH, &batch) < 0);
+        for (package = 0; package < sysmsr->total_packages && !failed; package++)
+            failed = (ops[package].err != 0);
+
+        if (!failed)
+        {
+            poli_log(TRACE, NULL, "Finishing %s", __FUNCTION__);
+            return 0;
+        }
+        poli_log(DEBUG, NULL, "Couldn't set power limit msr %#010X in a batch, setting it one package at a time", pcap->msr);
+    }
+
+    int ret = 0;
+    for (package = 0; package < sysmsr->total_packages; package++)
+    {
+        pcap->package_id = package;
+        if (set_msr_pcap(pcap, system_info, package) != 0)
+            ret = 1;
+    }
+
+    poli_log(TRACE, NULL, "Finishing %s", __FUNCTION__);
+
+    return ret;
+}
+
+/* applies the enable bits, limits and time windows of pcap to the current value of a power limit msr */
+static uint64_t pcap_to_msrval (struct msr_pcap *pcap, uint64_t msrval, struct system_msr_info *sysmsr)
+{
+    const uint64_t enabled_long_bits = (pcap->enabled_long) ? 0x3 : 0x0;
+    const uint64_t enabled_short_bits = (pcap->enabled_short) ? 0x3 : 0x0;
+
+    msrval = replace_bits(msrval, enabled_long_bits, ENABLED_LONG_START_BITS, ENABLED_LONG_END_BITS);
+
+    if (pcap->enabled_short)
+        msrval = replace_bits(msrval, enabled_short_bits, ENABLED_SHORT_START_BITS, ENABLED_SHORT_END_BITS);
+
+    msrval = replace_bits(msrval, to_msr_power(pcap->watts_long, sysmsr->power_units), WATTS_LONG_START_BITS, WATTS_LONG_END_BITS);
 
     if (pcap->seconds_long > 0)
-        msrval = replace_bits(msrval, to_msr_time(pcap->seconds_long, system_info->sysmsr->time_units), SECONDS_LONG_START_BITS, SECONDS_LONG_END_BITS);
+        msrval = replace_bits(msrval, to_msr_time(pcap->seconds_long, sysmsr->time_units), SECONDS_LONG_START_BITS, SECONDS_LONG_END_BITS);
 
     if (pcap->enabled_short && pcap->clamped_short)
     {
-        msrval = replace_bits(msrval, to_msr_power(pcap->watts_short, system_info->sysmsr->power_units), WATTS_SHORT_START_BITS, WATTS_SHORT_END_BITS);
+        msrval = replace_bits(msrval, to_msr_power(pcap->watts_short, sysmsr->power_units), WATTS_SHORT_START_BITS, WATTS_SHORT_END_BITS);
         if (pcap->seconds_short > 0)
-            msrval = replace_bits(msrval, to_msr_time(pcap->seconds_short, system_info->sysmsr->time_units), SECONDS_SHORT_START_BITS, SECONDS_SHORT_END_BITS);
+            msrval = replace_bits(msrval, to_msr_time(pcap->seconds_short, sysmsr->time_units), SECONDS_SHORT_START_BITS, SECONDS_SHORT_END_BITS);
     }
 
-    poli_log(TRACE, NULL, "Finishing %s", __FUNCTION__);
-
-    return write_msr(system_info->sysmsr->package_fd[package_id], pcap->msr, msrval);
+    return msrval;
 }
 
 //from raplcap-msr.c
@@ -1215,20 +1538,207 @@ static int read_msr_energy (struct msr_energy *msr_energy, struct system_info_t
         return 0;
     }
 
+    update_msr_energy(msr_energy, data);
+
+    return 0;
+}
+
+static void update_msr_energy (struct msr_energy *msr_energy, uint64_t data)
+{
     data &= 0xFFFFFFFF;
 
-    if (data < msr_energy->last_energy)
-        msr_energy->num_overflows++;
+    //the unsigned 32-bit difference is correct across one wrap, the wrap guard makes sure there is never more than one
+    msr_energy->accumulated += (data - msr_energy->last_raw) & 0xFFFFFFFF;
+    msr_energy->last_raw = data;
 
-    msr_energy->last_energy = (double) data;
     if (msr_energy->msr == MSR_DRAM_ENERGY_STATUS)
-        msr_energy->total_energy = (double) ((data + msr_energy->num_overflows * (uint64_t) UINT32_MAX) * msr_energy->dram_energy_units);
+        msr_energy->total_energy = (double) msr_energy->accumulated * msr_energy->dram_energy_units;
     else
-        msr_energy->total_energy = (double) ((data + msr_energy->num_overflows * (uint64_t) UINT32_MAX) * msr_energy->cpu_energy_units);
+        msr_energy->total_energy = (double) msr_energy->accumulated * msr_energy->cpu_energy_units;
+}
+
+static int is_energy_msr (int msr)
+{
+    return (msr == MSR_PKG_ENERGY_STATUS) || (msr == MSR_PP0_ENERGY_STATUS) || (msr == MSR_PP1_ENERGY_STATUS) ||
+        (msr == MSR_DRAM_ENERGY_STATUS) || (msr == MSR_PLATFORM_ENERGY_COUNTER);
+}
 
+static int is_perf_msr (int msr)
+{
+    return (msr == MSR_PKG_PERF_STATUS) || (msr == MSR_DRAM_PERF_STATUS) || (msr == MSR_PP0_PERF_STATUS);
+}
+
+/* sets up a single msr-safe batch reading the energy, perf status and thermal msrs of all packages.
+   Msrs the batch can't read are left out; if any energy msr can't be read the batch isn't used at all. */
+static void init_msr_batch (struct system_info_t *system_info)
+{
+    poli_log(TRACE, NULL, "Entering %s", __FUNCTION__);
+
+    struct system_msr_info *sysmsr = system_info->sysmsr;
+
+    char *batch_str = getenv("PoLi_MSR_BATCH");
+    if (batch_str != NULL && atoi(batch_str) == 0)
+    {
+        poli_log(DEBUG, NULL, "MSR batch reads turned off by PoLi_MSR_BATCH");
+        return;
+    }
+
+    int fd = open(MSR_BATCH_DEVICE, O_RDWR);
+    if (fd < 0)
+    {
+        poli_log(DEBUG, NULL, "%s not available (%s), reading MSRs one at a time", MSR_BATCH_DEVICE, strerror(errno));
+        return;
+    }
+
+    int max_ops = sysmsr->total_packages * (sysmsr->msr_nums[0] + sysmsr->msr_nums[3] + 1);
+    sysmsr->batch_ops = calloc(max_ops, sizeof(struct msr_batch_op));
+    sysmsr->batch_targets = calloc(max_ops, sizeof(void *));
+    if (sysmsr->batch_ops == NULL || sysmsr->batch_targets == NULL)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to allocate MSR batch", __FUNCTION__);
+        close(fd);
+        finalize_msr_batch(sysmsr);
+        return;
+    }
+
+    int package, msr;
+    for (package = 0; package < sysmsr->total_packages; package++)
+    {
+        int cpu_id = sysmsr->package_map[package];
+        for (msr = 0; msr < sysmsr->msr_nums[0]; msr++)
+        {
+            struct msr_energy *emsr = &sysmsr->energy_msrs[msr + package * sysmsr->msr_nums[0]];
+            add_msr_batch_op(sysmsr, cpu_id, emsr->msr, emsr);
+        }
+        for (msr = 0; msr < sysmsr->msr_nums[3]; msr++)
+        {
+            struct msr_perf *perfmsr = &sysmsr->perf_msrs[msr + package * sysmsr->msr_nums[3]];
+            if (is_perf_msr(perfmsr->msr))
+                add_msr_batch_op(sysmsr, cpu_id, perfmsr->msr, perfmsr);
+        }
+        add_msr_batch_op(sysmsr, cpu_id, IA32_PACKAGE_THERM_STATUS, &sysmsr->thermal_status[package]);
+    }
+
+    //try it out once; per-op errors tell which msrs the allowlist doesn't permit
+    struct msr_batch_array batch = {.numops = sysmsr->num_batch_ops, .ops = sysmsr->batch_ops};
+    int status = ioctl(fd, X86_IOC_MSR_BATCH, &batch);
+    int batch_errno = errno;
+    int total = sysmsr->num_batch_ops;
+    int i, kept = 0, failed = 0;
+    for (i = 0; i < sysmsr->num_batch_ops; i++)
+    {
+        struct msr_batch_op *op = &sysmsr->batch_ops[i];
+        if (op->err != 0)
+        {
+            poli_log(DEBUG, NULL, "MSR %#010X on cpu %d can't be read in a batch: %s", op->msr, op->cpu, strerror(-op->err));
+            if (is_energy_msr(op->msr))
+                failed = 1;
+            continue;
+        }
+        sysmsr->batch_ops[kept] = *op;
+        sysmsr->batch_targets[kept] = sysmsr->batch_targets[i];
+        kept++;
+    }
+    sysmsr->num_batch_ops = kept;
+
+    //the ioctl failing without any per-op error means the batch interface itself doesn't work
+    if (failed || kept == 0 || (status < 0 && kept == total))
+    {
+        poli_log(WARNING, NULL, "Failed to read energy MSRs through %s (%s). Reading MSRs one at a time", MSR_BATCH_DEVICE, strerror(batch_errno));
+        close(fd);
+        finalize_msr_batch(sysmsr);
+        return;
+    }
+
+    sysmsr->batch_fd = fd;
+    poli_log(DEBUG, NULL, "Reading %d MSRs in a single batch", sysmsr->num_batch_ops);
+
+    poli_log(TRACE, NULL, "Finishing %s", __FUNCTION__);
+}
+
+static int add_msr_batch_op (struct system_msr_info *sysmsr, int cpu, int msr, void *target)
+{
+    struct msr_batch_op *op = &sysmsr->batch_ops[sysmsr->num_batch_ops];
+    op->cpu = (uint16_t) cpu;
+    op->isrdmsr = 1;
+    op->err = 0;
+    op->msr = (uint32_t) msr;
+    op->msrdata = 0;
+    op->wmask = 0;
+    sysmsr->batch_targets[sysmsr->num_batch_ops] = target;
+    sysmsr->num_batch_ops++;
     return 0;
 }
 
+/* reads all msrs of the batch with one ioctl and updates the energy, perf and thermal entries
+   returns: 0 if the batch was read, 1 if the msrs have to be read one at a time*/
+static int read_msr_batch (struct system_info_t *system_info)
+{
+    struct system_msr_info *sysmsr = system_info->sysmsr;
+    if (sysmsr->batch_fd < 0)
+        return 1;
+
+    int i;
+    for (i = 0; i < sysmsr->num_batch_ops; i++)
+        sysmsr->batch_ops[i].err = 0;
+
+    //the ioctl fails if any op failed, the other ops are still read
+    struct msr_batch_array batch = {.numops = sysmsr->num_batch_ops, .ops = sysmsr->batch_ops};
+    if (ioctl(sysmsr->batch_fd, X86_IOC_MSR_BATCH, &batch) < 0)
+    {
+        int batch_errno = errno;
+        for (i = 0; i < sysmsr->num_batch_ops; i++)
+            if (sysmsr->batch_ops[i].err != 0)
+                break;
+        if (i == sysmsr->num_batch_ops)
+        {
+            poli_log(ERROR, NULL, "%s: MSR batch read failed: %s", __FUNCTION__, strerror(batch_errno));
+            return 1;
+        }
+    }
+
+    //every energy msr has to be read at every sample, if one wasn't, all msrs are read one at a time instead
+    for (i = 0; i < sysmsr->num_batch_ops; i++)
+    {
+        struct msr_batch_op *op = &sysmsr->batch_ops[i];
+        if (op->err != 0 && is_energy_msr(op->msr))
+        {
+            poli_log(ERROR, NULL, "%s: MSR %#010X on cpu %d couldn't be read in the batch: %s", __FUNCTION__, op->msr, op->cpu, strerror(-op->err));
+            return 1;
+        }
+    }
+
+    for (i = 0; i < sysmsr->num_batch_ops; i++)
+    {
+        struct msr_batch_op *op = &sysmsr->batch_ops[i];
+        //the other msrs keep their last value
+        if (op->err != 0)
+            continue;
+        if (is_energy_msr(op->msr))
+            update_msr_energy((struct msr_energy *) sysmsr->batch_targets[i], op->msrdata);
+        else if (is_perf_msr(op->msr))
+            ((struct msr_perf *) sysmsr->batch_targets[i])->throttled_time = ((double) op->msrdata) * sysmsr->time_units;
+        else
+            *((uint64_t *) sysmsr->batch_targets[i]) = op->msrdata;
+    }
+
+    return 0;
+}
+
+static void finalize_msr_batch (struct system_msr_info *sysmsr)
+{
+    if (sysmsr->batch_fd >= 0)
+        close(sysmsr->batch_fd);
+    sysmsr->batch_fd = -1;
+    if (sysmsr->batch_ops)
+        free(sysmsr->batch_ops);
+    sysmsr->batch_ops = 0;
+    if (sysmsr->batch_targets)
+        free(sysmsr->batch_targets);
+    sysmsr->batch_targets = 0;
+    sysmsr->num_batch_ops = 0;
+}
+
 static int detect_cpu(void)
 {
 
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "PoLiMEr.h"
+#include "PoLiLog.h"
+#include "perf_event-handler.h"
+
+/* indexed by perf_rapl_domain_t */
+static const char *perf_rapl_event_names[PERF_RAPL_NUM_DOMAINS] = {"energy-pkg", "energy-cores", "energy-gpu", "energy-ram", "energy-psys"};
+
+static int read_pmu_file (const char *name, char *buf, size_t len);
+static int open_perf_event (struct perf_event_attr *attr, int cpu, int group_fd);
+static void set_domain_energy (struct rapl_energy *re, perf_rapl_domain_t domain, double joules);
+
+int init_perf_rapl (struct system_info_t *system_info)
+{
+    poli_log(TRACE, NULL, "Entering %s", __FUNCTION__);
+
+    struct system_msr_info *sysmsr = system_info->sysmsr;
+    char buf[BUFSIZE];
+
+    if (read_pmu_file("type", buf, sizeof(buf)) != 0)
+    {
+        poli_log(ERROR, NULL, "%s: The RAPL perf PMU is not available (%s)", __FUNCTION__, PERF_RAPL_PMU_PATH);
+        return 1;
+    }
+
+    struct perf_rapl_info *perf = calloc(1, sizeof(struct perf_rapl_info));
+    if (perf == NULL)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to allocate memory", __FUNCTION__);
+        return 1;
+    }
+    perf->pmu_type = atoi(buf);
+
+    int domain, package;
+    for (domain = 0; domain < PERF_RAPL_NUM_DOMAINS; domain++)
+    {
+        struct perf_rapl_domain *d = &perf->domains[domain];
+        d->event_name = perf_rapl_event_names[domain];
+        d->available = 0;
+
+        char name[BUFSIZE];
+        snprintf(name, sizeof(name), "events/%s", d->event_name);
+        if (read_pmu_file(name, buf, sizeof(buf)) != 0)
+            continue;
+        unsigned long long config;
+        if (sscanf(buf, "event=%llx", &config) != 1)
+        {
+            poli_log(WARNING, NULL, "%s: Couldn't parse perf event %s: %s", __FUNCTION__, d->event_name, buf);
+            continue;
+        }
+        d->config = (uint64_t) config;
+
+        snprintf(name, sizeof(name), "events/%s.scale", d->event_name);
+        if (read_pmu_file(name, buf, sizeof(buf)) != 0)
+            continue;
+        d->scale = strtod(buf, NULL);
+        d->available = 1;
+    }
+
+    perf->num_packages = sysmsr->total_packages;
+    for (package = 0; package < MAX_PACKAGES; package++)
+    {
+        perf->group_fd[package] = -1;
+        perf->num_events[package] = 0;
+    }
+
+    for (package = 0; package < perf->num_packages; package++)
+    {
+        int cpu = sysmsr->package_map[package];
+        for (domain = 0; domain < PERF_RAPL_NUM_DOMAINS; domain++)
+        {
+            if (!perf->domains[domain].available)
+                continue;
+
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.type = perf->pmu_type;
+            attr.size = sizeof(attr);
+            attr.config = perf->domains[domain].config;
+            attr.read_format = PERF_FORMAT_GROUP;
+
+            int fd = open_perf_event(&attr, cpu, perf->group_fd[package]);
+            if (fd < 0)
+            {
+                poli_log(DEBUG, NULL, "Couldn't open perf event %s on cpu %d: %s", perf->domains[domain].event_name, cpu, strerror(errno));
+                continue;
+            }
+            if (perf->group_fd[package] < 0)
+                perf->group_fd[package] = fd;
+            perf->event_fd[package][perf->num_events[package]] = fd;
+            perf->event_domain[package][perf->num_events[package]] = domain;
+            perf->num_events[package]++;
+        }
+    }
+
+    sysmsr->perf = perf;
+
+    if (perf->num_packages < 1 || perf->group_fd[0] < 0)
+    {
+        poli_log(ERROR, NULL, "%s: Couldn't open any RAPL perf event (check /proc/sys/kernel/perf_event_paranoid)", __FUNCTION__);
+        finalize_perf_rapl(system_info);
+        return 1;
+    }
+
+    poli_log(TRACE, NULL, "Finishing %s", __FUNCTION__);
+
+    return 0;
+}
+
+int finalize_perf_rapl (struct system_info_t *system_info)
+{
+    struct perf_rapl_info *perf = system_info->sysmsr->perf;
+    if (perf == NULL)
+        return 0;
+
+    int package, event;
+    for (package = 0; package < perf->num_packages; package++)
+        for (event = 0; event < perf->num_events[package]; event++)
+            close(perf->event_fd[package][event]);
+
+    free(perf);
+    system_info->sysmsr->perf = 0;
+
+    return 0;
+}
+
+int perf_rapl_read_energy (struct rapl_energy *re, struct system_info_t *system_info, int package)
+{
+    struct perf_rapl_info *perf = system_info->sysmsr->perf;
+    if (perf->group_fd[package] < 0)
+        return 1;
+
+    //PERF_FORMAT_GROUP: number of events followed by one value per event
+    uint64_t values[1 + PERF_RAPL_NUM_DOMAINS];
+    ssize_t expected = (1 + perf->num_events[package]) * sizeof(uint64_t);
+    if (read(perf->group_fd[package], values, sizeof(values)) < expected)
+    {
+        poli_log(ERROR, NULL, "%s: Couldn't read RAPL perf events of package %d: %s", __FUNCTION__, package, strerror(errno));
+        return 1;
+    }
+
+    int event;
+    for (event = 0; event < perf->num_events[package]; event++)
+    {
+        int domain = perf->event_domain[package][event];
+        set_domain_energy(re, domain, (double) values[1 + event] * perf->domains[domain].scale);
+    }
+
+    return 0;
+}
+
+static void set_domain_energy (struct rapl_energy *re, perf_rapl_domain_t domain, double joules)
+{
+    switch (domain)
+    {
+        case PERF_RAPL_PKG:
+            re->package = joules;
+            break;
+        case PERF_RAPL_CORES:
+            re->pp0 = joules;
+            break;
+        case PERF_RAPL_GPU:
+            re->pp1 = joules;
+            break;
+        case PERF_RAPL_RAM:
+            re->dram = joules;
+            break;
+        case PERF_RAPL_PSYS:
+            re->platform = joules;
+            break;
+        default:
+            break;
+    }
+}
+
+static int read_pmu_file (const char *name, char *buf, size_t len)
+{
+    char filename[BUFSIZE];
+    snprintf(filename, sizeof(filename), "%s%s", PERF_RAPL_PMU_PATH, name);
+
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL)
+        return 1;
+    char *res = fgets(buf, len, fp);
+    fclose(fp);
+    if (res == NULL)
+        return 1;
+
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+static int open_perf_event (struct perf_event_attr *attr, int cpu, int group_fd)
+{
+    return (int) syscall(__NR_perf_event_open, attr, -1, cpu, group_fd, 0);
+}
@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "PoLiMEr.h"
+#include "PoLiLog.h"
+#include "powercap-handler.h"
+
+static int add_zone (struct powercap_info *powercap, const char *dir_name);
+static int open_zone_file (const char *dir_name, const char *file, int flags);
+static int read_zone_u64 (const char *dir_name, const char *file, uint64_t *value);
+static int read_u64 (int fd, char *buf, size_t len, uint64_t *value);
+static int parse_u64 (const char *buf, ssize_t len, uint64_t *value);
+static int write_u64 (int fd, uint64_t value);
+static struct powercap_zone *find_zone (struct powercap_info *powercap, zone_label_t zone_label, int package);
+static void set_zone_energy (struct rapl_energy *re, zone_label_t zone_label, double joules);
+
+int init_powercap (struct system_info_t *system_info)
+{
+    poli_log(TRACE, NULL, "Entering %s", __FUNCTION__);
+
+    DIR *dir = opendir(POWERCAP_PATH);
+    if (dir == NULL)
+    {
+        poli_log(ERROR, NULL, "%s: Couldn't open %s: %s", __FUNCTION__, POWERCAP_PATH, strerror(errno));
+        return 1;
+    }
+
+    struct powercap_info *powercap = calloc(1, sizeof(struct powercap_info));
+    if (powercap == NULL)
+    {
+        poli_log(ERROR, NULL, "%s: Failed to allocate memory", __FUNCTION__);
+        closedir(dir);
+        return 1;
+    }
+    system_info->sysmsr->powercap = powercap;
+
+    //zones (intel-rapl:N) and their subzones (intel-rapl:N:M); other control types such as intel-rapl-mmio are skipped
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, POWERCAP_PREFIX, strlen(POWERCAP_PREFIX)) == 0)
+            add_zone(powercap, entry->d_name);
+    }
+    closedir(dir);
+
+    int zone, readable = 0;
+    for (zone = 0; zone < powercap->num_zones; zone++)
+        if (powercap->zones[zone].energy_fd >= 0)
+            readable++;
+
+    if (readable == 0)
+    {
+        poli_log(ERROR, NULL, "%s: No readable RAPL zones under %s", __FUNCTION__, POWERCAP_PATH);
+        finalize_powercap(system_info);
+        return 1;
+    }
+
+    poli_log(DEBUG, NULL, "Found %d powercap zones", powercap->num_zones);
+    poli_log(TRACE, NULL, "Finishing %s", __FUNCTION__);
+
+    return 0;
+}
+
+int finalize_powercap (struct system_info_t *system_info)
+{
+    struct powercap_info *powercap = system_info->sysmsr->powercap;
+    if (powercap == NULL)
+        return 0;
+
+    int zone, c;
+    for (zone = 0; zone < powercap->num_zones; zone++)
+    {
+        struct powercap_zone *z = &powercap->zones[zone];
+        if (z->energy_fd >= 0)
+            close(z->energy_fd);
+        if (z->enabled_fd >= 0)
+            close(z->enabled_fd);
+        for (c = 0; c < z->num_constraints; c++)
+        {
+            if (z->power_limit_fd[c] >= 0)
+                close(z->power_limit_fd[c]);
+            if (z->time_window_fd[c] >= 0)
+                close(z->time_window_fd[c]);
+        }
+    }
+
+    free(powercap);
+    system_info->sysmsr->powercap = 0;
+
+    return 0;
+}
+
+int powercap_read_energy (struct rapl_energy *re, struct system_info_t *system_info, int package)
+{
+    struct powercap_info *powercap = system_info->sysmsr->powercap;
+    int zone, ret = 0;
+
+    for (zone = 0; zone < powercap->num_zones; zone++)
+    {
+        struct powercap_zone *z = &powercap->zones[zone];
+        if (z->package_id != package || z->energy_fd < 0)
+            continue;
+
+        uint64_t energy_uj;
+        if (read_u64(z->energy_fd, powercap->energy_buf, sizeof(powercap->energy_buf), &energy_uj) != 0)
+        {
+            poli_log(ERROR, NULL, "%s: Couldn't read energy of zone %s", __FUNCTION__, z->name);
+            ret = 1;
+            continue;
+        }
+
+        if (energy_uj < z->last_energy_uj)
+            z->wrapped_uj += z->max_energy_range_uj + 1;
+        z->last_energy_uj = energy_uj;
+
+        set_zone_energy(re, z->zone_label, (double) (z->wrapped_uj + energy_uj) * 1e-6);
+    }
+
+    return ret;
+}
+
+int powercap_set_power_cap (struct msr_pcap *pcap, struct system_info_t *system_info, int package)
+{
+    struct powercap_zone *z = find_zone(system_info->sysmsr->powercap, pcap->zone_label, package);
+    if (z == NULL)
+    {
+        poli_log(ERROR, NULL, "%s: This system has no powercap zone for the requested power cap", __FUNCTION__);
+        return 1;
+    }
+
+    double watts[POWERCAP_NUM_CONSTRAINTS] = {pcap->watts_long, pcap->watts_short};
+    double seconds[POWERCAP_NUM_CONSTRAINTS] = {pcap->seconds_long, pcap->seconds_short};
+    int enabled[POWERCAP_NUM_CONSTRAINTS] = {pcap->enabled_long, pcap->enabled_short};
+
+    int c, ret = 0;
+    for (c = 0; c < z->num_constraints; c++)
+    {
+        //a constraint that isn't enabled keeps its current limits
+        if (!enabled[c])
+            continue;
+        if (z->power_limit_fd[c] < 0 || write_u64(z->power_limit_fd[c], (uint64_t) (watts[c] * 1e6)) != 0)
+        {
+            poli_log(ERROR, NULL, "%s: Couldn't write power limit %d of zone %s: %s", __FUNCTION__, c, z->name, strerror(errno));
+            ret = 1;
+        }
+        if (z->time_window_fd[c] >= 0 && seconds[c] > 0.0 && write_u64(z->time_window_fd[c], (uint64_t) (seconds[c] * 1e6)) != 0)
+        {
+            poli_log(ERROR, NULL, "%s: Couldn't write time window %d of zone %s: %s", __FUNCTION__, c, z->name, strerror(errno));
+            ret = 1;
+        }
+    }
+
+    if (z->enabled_fd >= 0 && write_u64(z->enabled_fd, pcap->enabled_long ? 1 : 0) != 0)
+    {
+        poli_log(ERROR, NULL, "%s: Couldn't enable zone %s: %s", __FUNCTION__, z->name, strerror(errno));
+        ret = 1;
+    }
+
+    return ret;
+}
+
+int powercap_get_power_cap (struct msr_pcap *pcap, struct system_info_t *system_info, int package)
+{
+    struct powercap_zone *z = find_zone(system_info->sysmsr->powercap, pcap->zone_label, package);
+    if (z == NULL)
+    {
+        poli_log(ERROR, NULL, "%s: This system has no powercap zone for the requested power cap", __FUNCTION__);
+        return 1;
+    }
+
+    char buf[POWERCAP_BUFSIZE];
+    uint64_t value;
+
+    pcap->enabled_long = 0;
+    if (z->enabled_fd >= 0 && read_u64(z->enabled_fd, buf, sizeof(buf), &value) == 0)
+        pcap->enabled_long = (value != 0);
+    pcap->clamped_long = pcap->enabled_long;
+
+    double watts[POWERCAP_NUM_CONSTRAINTS] = {0.0, 0.0};
+    double seconds[POWERCAP_NUM_CONSTRAINTS] = {0.0, 0.0};
+    int c;
+    for (c = 0; c < z->num_constraints; c++)
+    {
+        if (z->power_limit_fd[c] >= 0 && read_u64(z->power_limit_fd[c], buf, sizeof(buf), &value) == 0)
+            watts[c] = (double) value * 1e-6;
+        if (z->time_window_fd[c] >= 0 && read_u64(z->time_window_fd[c], buf, sizeof(buf), &value) == 0)
+            seconds[c] = (double) value * 1e-6;
+    }
+
+    pcap->watts_long = watts[0];
+    pcap->seconds_long = seconds[0];
+    pcap->watts_short = watts[1];
+    pcap->seconds_short = seconds[1];
+    pcap->enabled_short = (z->num_constraints > 1) ? pcap->enabled_long : 0;
+    pcap->clamped_short = pcap->enabled_short;
+
+    return 0;
+}
+
+int powercap_get_power_cap_info (zone_label_t zone_label, double *min, double *max,
+    double *thermal_spec, double *max_time_window, struct system_info_t *system_info, int package)
+{
+    *min = -1;
+    *max = -1;
+    *thermal_spec = -1;
+    *max_time_window = -1;
+
+    struct powercap_zone *z = find_zone(system_info->sysmsr->powercap, zone_label, package);
+    if (z == NULL || z->num_constraints < 1)
+    {
+        poli_log(ERROR, NULL, "%s: This system has no powercap zone for the requested power cap", __FUNCTION__);
+        return 1;
+    }
+
+    *thermal_spec = (double) z->max_power_uw[0] * 1e-6;
+    *max = (z->num_constraints > 1 && z->max_power_uw[1] > 0) ? (double) z->max_power_uw[1] * 1e-6 : *thermal_spec;
+
+    return 0;
+}
+
+double powercap_min_energy_range (struct system_info_t *system_info)
+{
+    struct powercap_info *powercap = system_info->sysmsr->powercap;
+    uint64_t range_uj = 0;
+    int zone;
+
+    for (zone = 0; zone < powercap->num_zones; zone++)
+    {
+        struct powercap_zone *z = &powercap->zones[zone];
+        if (z->energy_fd >= 0 && z->max_energy_range_uj > 0 && (range_uj == 0 || z->max_energy_range_uj < range_uj))
+            range_uj = z->max_energy_range_uj;
+    }
+
+    return (double) range_uj * 1e-6;
+}
+
+static int add_zone (struct powercap_info *powercap, const char *dir_name)
+{
+    if (powercap->num_zones >= POWERCAP_MAX_ZONES)
+    {
+        poli_log(WARNING, NULL, "%s: Ignoring powercap zone %s, too many zones", __FUNCTION__, dir_name);
+        return 1;
+    }
+
+    struct powercap_zone *z = &powercap->zones[powercap->num_zones];
+    memset(z, 0, sizeof(struct powercap_zone));
+
+    char path[BUFSIZE];
+    snprintf(path, sizeof(path), "%s%s/name", POWERCAP_PATH, dir_name);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL || fgets(z->name, sizeof(z->name), fp) == NULL)
+    {
+        if (fp)
+            fclose(fp);
+        poli_log(WARNING, NULL, "%s: Couldn't read the name of powercap zone %s", __FUNCTION__, dir_name);
+        return 1;
+    }
+    fclose(fp);
+    z->name[strcspn(z->name, "\n")] = '\0';
+
+    //subzones belong to the package of their parent zone (the directory name up to the last ':')
+    z->package_id = 0;
+    if (strncmp(z->name, "package-", 8) == 0)
+    {
+        z->zone_label = PACKAGE;
+        z->package_id = atoi(z->name + 8);
+    }
+    else if (strcmp(z->name, "core") == 0)
+        z->zone_label = CORE;
+    else if (strcmp(z->name, "uncore") == 0)
+        z->zone_label = UNCORE;
+    else if (strcmp(z->name, "dram") == 0)
+        z->zone_label = DRAM;
+    else if (strcmp(z->name, "psys") == 0)
+        z->zone_label = PLATFORM;
+    else
+    {
+        poli_log(DEBUG, NULL, "%s: Ignoring unknown powercap zone %s (%s)", __FUNCTION__, dir_name, z->name);
+        return 1;
+    }
+
+    if (z->zone_label != PACKAGE && z->zone_label != PLATFORM)
+    {
+        size_t parent_len = strrchr(dir_name, ':') - dir_name;
+        char parent_name[BUFSIZE];
+        snprintf(path, sizeof(path), "%s%.*s/name", POWERCAP_PATH, (int) parent_len, dir_name);
+        fp = fopen(path, "r");
+        if (fp != NULL && fgets(parent_name, sizeof(parent_name), fp) != NULL && strncmp(parent_name, "package-", 8) == 0)
+            z->package_id = atoi(parent_name + 8);
+        if (fp)
+            fclose(fp);
+    }
+
+    if (z->package_id < 0 || z->package_id >= MAX_PACKAGES)
+    {
+        poli_log(WARNING, NULL, "%s: Ignoring powercap zone %s of package %d", __FUNCTION__, dir_name, z->package_id);
+        return 1;
+    }
+
+    z->energy_fd = open_zone_file(dir_name, "energy_uj", O_RDONLY);
+    if (read_zone_u64(dir_name, "max_energy_range_uj", &z->max_energy_range_uj) != 0)
+        z->max_energy_range_uj = 0;
+    if (z->energy_fd >= 0)
+    {
+        char buf[POWERCAP_BUFSIZE];
+        read_u64(z->energy_fd, buf, sizeof(buf), &z->last_energy_uj);
+    }
+
+    //limits can only be written by privileged users, but they can still be read
+    z->enabled_fd = open_zone_file(dir_name, "enabled", O_RDWR);
+    if (z->enabled_fd < 0)
+        z->enabled_fd = open_zone_file(dir_name, "enabled", O_RDONLY);
+
+    int c;
+    z->num_constraints = 0;
+    for (c = 0; c < POWERCAP_NUM_CONSTRAINTS; c++)
+    {
+        char file[BUFSIZE];
+        snprintf(file, sizeof(file), "constraint_%d_power_limit_uw", c);
+        int limit_fd = open_zone_file(dir_name, file, O_RDWR);
+        if (limit_fd < 0)
+            limit_fd = open_zone_file(dir_name, file, O_RDONLY);
+        if (limit_fd < 0)
+            break;
+
+        z->power_limit_fd[c] = limit_fd;
+        snprintf(file, sizeof(file), "constraint_%d_time_window_us", c);
+        z->time_window_fd[c] = open_zone_file(dir_name, file, O_RDWR);
+        if (z->time_window_fd[c] < 0)
+            z->time_window_fd[c] = open_zone_file(dir_name, file, O_RDONLY);
+        snprintf(file, sizeof(file), "constraint_%d_max_power_uw", c);
+        if (read_zone_u64(dir_name, file, &z->max_power_uw[c]) != 0)
+            z->max_power_uw[c] = 0;
+        z->num_constraints++;
+    }
+
+    powercap->num_zones++;
+
+    return 0;
+}
+
+static struct powercap_zone *find_zone (struct powercap_info *powercap, zone_label_t zone_label, int package)
+{
+    int zone;
+    for (zone = 0; zone < powercap->num_zones; zone++)
+    {
+        struct powercap_zone *z = &powercap->zones[zone];
+        if (z->zone_label == zone_label && (z->package_id == package || zone_label == PLATFORM))
+            return z;
+    }
+    return NULL;
+}
+
+static void set_zone_energy (struct rapl_energy *re, zone_label_t zone_label, double joules)
+{
+    switch (zone_label)
+    {
+        case PACKAGE:
+            re->package = joules;
+            break;
+        case CORE:
+            re->pp0 = joules;
+            break;
+        case UNCORE:
+            re->pp1 = joules;
+            break;
+        case DRAM:
+            re->dram = joules;
+            break;
+        case PLATFORM:
+            re->platform = joules;
+            break;
+        default:
+            break;
+    }
+}
+
+static int open_zone_file (const char *dir_name, const char *file, int flags)
+{
+    //the zone directory and the file name each fit in BUFSIZE
+    char path[sizeof(POWERCAP_PATH) + 2 * BUFSIZE];
+    int len = snprintf(path, sizeof(path), "%s%s/%s", POWERCAP_PATH, dir_name, file);
+    if (len < 0 || len >= (int) sizeof(path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return open(path, flags);
+}
+
+static int read_zone_u64 (const char *dir_name, const char *file, uint64_t *value)
+{
+    int fd = open_zone_file(dir_name, file, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    char buf[POWERCAP_BUFSIZE];
+    int ret = read_u64(fd, buf, sizeof(buf), value);
+    close(fd);
+    return ret;
+}
+
+static int read_u64 (int fd, char *buf, size_t len, uint64_t *value)
+{
+    ssize_t n = pread(fd, buf, len, 0);
+    if (n <= 0)
+        return 1;
+    return parse_u64(buf, n, value);
+}
+
+/* sysfs values are plain decimal numbers followed by a newline */
+static int parse_u64 (const char *buf, ssize_t len, uint64_t *value)
+{
+    uint64_t result = 0;
+    ssize_t i;
+    for (i = 0; i < len && buf[i] >= '0' && buf[i] <= '9'; i++)
+        result = result * 10 + (uint64_t) (buf[i] - '0');
+    if (i == 0)
+        return 1;
+    *value = result;
+    return 0;
+}
+
+static int write_u64 (int fd, uint64_t value)
+{
+    char buf[POWERCAP_BUFSIZE];
+    int n = snprintf(buf, sizeof(buf), "%llu", (unsigned long long) value);
+    return (pwrite(fd, buf, n, 0) == n) ? 0 : 1;
+}